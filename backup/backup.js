@@ -1,9 +1,16 @@
 'use strict'
 
+const child_process = require('child_process')
 const fs = require('fs')
+const os = require('os')
+const path = require('path')
 const process = require('process')
+const catalog = require('./src/catalog')
 const s3 = require('./src/s3')
 
+// How long the catalog is trusted before the whole vault is listed again, by default
+const CATALOG_MAX_AGE = 7 * 24 * 60 * 60 * 1000
+
 const BackupSystem = function(siteID, vaultName, options) {
     if(options === undefined) { options = {} }
     if(options.awsOptions === undefined) { options.awsOptions = {} }
@@ -17,6 +24,63 @@ const BackupSystem = function(siteID, vaultName, options) {
 
     this.storage = new s3.S3(creationOptions)
     this.vaultName = vaultName
+
+    // With a password, archives are encrypted by wuffcrypt on their way up
+    this.password = options.password
+    this.wuffcrypt = options.wuffcrypt || 'wuffcrypt'
+    this.transferOptions = {'partSize': options.partSize, 'queueSize': options.concurrency}
+
+    // Known archives are kept locally, so that each run only has to ask S3 what is new
+    const catalogPath = options.catalog || path.join(os.homedir(), '.backup-tools', vaultName + '.catalog')
+    this.catalog = new catalog.Catalog(catalogPath)
+    this.refreshCatalog = options.refreshCatalog
+    this.catalogMaxAge = (options.catalogMaxAge === undefined) ? CATALOG_MAX_AGE : options.catalogMaxAge
+}
+
+// wuffcrypt's files are a header followed by blocks of this size, so downloads cut on block
+// boundaries hand it whole blocks as they arrive
+const WUFFCRYPT_HEADER_SIZE = 31
+const WUFFCRYPT_BLOCK_SIZE = 1024 * 1024 + 16
+
+// Run wuffcrypt with the given arguments and stdio, returning the child and a promise of its
+// success.  A failure is reported through the transfer, which waits on the promise.  The password
+// goes through a pipe on descriptor 3 rather than the command line, where any user could see it.
+BackupSystem.prototype.runWuffcrypt = function(args, stdio, failure) {
+    const child = child_process.spawn(this.wuffcrypt, ['--password-fd', '3'].concat(args), {'stdio': stdio.concat(['pipe'])})
+
+    // wuffcrypt drops one trailing newline, so one is added to keep any the password ends with.
+    // If it exits before reading, the write fails, and its exit reports why.
+    const passwordPipe = child.stdio[3]
+    passwordPipe.on('error', () => {})
+    passwordPipe.end(this.password + '\n')
+
+    const finished = new Promise((resolve, reject) => {
+        child.on('error', reject)
+        child.on('exit', (code, signal) => {
+            if(code === 0) { return resolve() }
+
+            return reject(new Error(failure))
+        })
+    })
+
+    finished.catch(() => {})
+    return {'child': child, 'finished': finished, 'kill': () => child.kill()}
+}
+
+// Encrypt path with wuffcrypt, returning its output stream and a promise of its success
+BackupSystem.prototype.encrypt = function(path) {
+    const run = this.runWuffcrypt(['-e', path, '-'], ['ignore', 'pipe', 'inherit'],
+                                  'wuffcrypt failed to encrypt ' + path)
+    run.stream = run.child.stdout
+    return run
+}
+
+// Decrypt into path with wuffcrypt, returning its input stream and a promise of its success
+BackupSystem.prototype.decrypt = function(path) {
+    const run = this.runWuffcrypt(['-d', '-', path], ['pipe', 'inherit', 'inherit'],
+                                  'wuffcrypt failed to decrypt ' + path)
+    run.stream = run.child.stdin
+    return run
 }
 
 BackupSystem.prototype.backup = function(path, expiry) {
@@ -28,23 +92,91 @@ BackupSystem.prototype.backup = function(path, expiry) {
     }
 
     const description = this.siteID + ' ' + now.toISOString() + ' ' + expiry.toISOString()
-    return this.storage.uploadArchive(this.vaultName, path, description, {'Expires': expiry})
+    const uploaded = (archiveID) => {
+        this.catalog.add([archiveID])
+        return archiveID
+    }
+
+    if(!this.password) {
+        return this.storage.uploadArchive(this.vaultName, path, description, this.transferOptions).then(uploaded)
+    }
+
+    // Parts go up while the rest is still being encrypted, and the upload is only completed
+    // once wuffcrypt has finished cleanly
+    const encrypter = this.encrypt(path)
+    const options = {'beforeComplete': () => encrypter.finished}
+    for(let key in this.transferOptions) {
+        options[key] = this.transferOptions[key]
+    }
+
+    return this.storage.uploadStream(this.vaultName, encrypter.stream, description, options).then(uploaded, (err) => {
+        encrypter.kill()
+        throw err
+    })
+}
+
+// The keys of every archive in the vault.  The first run, any run with refreshCatalog, and any
+// run once the catalog is older than catalogMaxAge lists the whole vault, split by site and then
+// by year so that the pages can be fetched at once.  Other runs start from the catalog: a listing
+// of just the vault's top level says which sites there are, and each is listed only from the
+// newest of its archives in the catalog on.  A site that has gone from the vault takes its
+// archives with it, but archives that other hosts or lifecycle rules delete from a site that
+// remains are only seen by the next full listing.
+BackupSystem.prototype.inventory = function() {
+    const listing = {'concurrency': this.transferOptions.queueSize}
+    const keys = (archives) => archives.map((archive) => archive.id)
+
+    const stale = this.catalog.load() ? this.catalog.age() > this.catalogMaxAge : true
+    if(this.refreshCatalog || stale) {
+        listing.delimiters = [' ', '-']
+        return this.storage.getInventory(this.vaultName, listing).then((archives) => {
+            this.catalog.replace(keys(archives))
+            return Array.from(this.catalog.keys)
+        })
+    }
+
+    return this.storage.getPrefixes(this.vaultName, ' ').then((top) => {
+        // Keys of one site sort by date, so anything new comes after the newest we know of.  A
+        // site the catalog has not seen is listed from the start.
+        const sites = new Map()
+        for(let prefix of top.prefixes) { sites.set(prefix, undefined) }
+
+        const gone = []
+        const present = new Set(top.keys)
+        for(let key of this.catalog.keys) {
+            const space = key.indexOf(' ')
+            const prefix = key.slice(0, space + 1)
+            if(space < 0 ? !present.has(key) : !sites.has(prefix)) {
+                gone.push(key)
+            }
+            else if(space >= 0 && !(sites.get(prefix) >= key)) {
+                sites.set(prefix, key)
+            }
+        }
+        this.catalog.remove(gone)
+
+        listing.ranges = Array.from(sites, (site) => ({'prefix': site[0], 'marker': site[1]}))
+        return this.storage.getInventory(this.vaultName, listing).then((archives) => {
+            this.catalog.add(keys(archives).concat(top.keys))
+            return Array.from(this.catalog.keys)
+        })
+    })
 }
 
 BackupSystem.prototype.list = function() {
-    // Get the S3 vault inventory
-    return this.storage.getInventory(this.vaultName).then((inventory) => {
-        // Using the inventory, remove any expired archives
+    return this.inventory().then((inventory) => {
+        inventory.sort()
+
         const results = []
-        for(let archive of inventory) {
-            const descriptionSegments = archive.description.split(' ')
+        for(let id of inventory) {
+            const descriptionSegments = id.split(' ')
             const expiryDate = new Date(Date.parse(descriptionSegments[descriptionSegments.length - 1]))
             const archiveDate = new Date(Date.parse(descriptionSegments[descriptionSegments.length - 2]))
 
             // XXX Should we deal with invalid dates here, or pass the buck (status quo)
             results.push({
-                'id': archive.id,
-                'description': archive.description,
+                'id': id,
+                'description': id,
                 'expiry': expiryDate,
                 'date': archiveDate
             })
@@ -60,24 +192,66 @@ BackupSystem.prototype.prune = function() {
             return isNaN(archive.date) || isNaN(archive.expiry) || (archive.expiry < (new Date()))
         }).map((archive) => archive.id)
 
-        return this.storage.removeArchives(this.vaultName, toPrune)
+        // Each batch leaves the catalog as soon as it is gone, so an interrupted prune loses nothing
+        const options = {
+            'concurrency': this.transferOptions.queueSize,
+            'onDeleted': (keys) => this.catalog.remove(keys)
+        }
+
+        return this.storage.removeArchives(this.vaultName, toPrune, options).then((result) => {
+            if(result.errors.length > 0) {
+                const error = result.errors[0]
+                throw new Error('Failed to delete ' + result.errors.length + ' archives, such as ' + error.Key + ': ' + error.Message)
+            }
+
+            return result.deleted.length
+        })
     })
 }
 
+// Download an archive into a file of the same name, several ranges at once.  With a password,
+// the ranges are cut on wuffcrypt's block boundaries and piped straight into it, so blocks are
+// decrypted on every core while the rest is still downloading, and the encrypted archive never
+// touches the disk.
 BackupSystem.prototype.restore = function(archiveID) {
-    const outStream = fs.createWriteStream(archiveID)
-    outStream.on('error', (err) => {
-        console.error('Error writing file ' + archiveID)
-    })
+    const partSize = this.transferOptions.partSize || 16 * 1024 * 1024
+    const options = {'queueSize': this.transferOptions.queueSize, 'rangeSize': partSize}
+    const finished = (archive) => {
+        console.log('Finished restoring ' + archive.key)
+    }
 
-    return this.storage.getArchive(this.vaultName, archiveID, outStream).then((archive) => {
-        return new Promise((resolve, reject) => {
-            console.log('Finished restoring ' + archive.key)
-            return resolve()
-        })
+    if(!this.password) {
+        const outStream = fs.createWriteStream(archiveID)
+        return this.storage.getArchive(this.vaultName, archiveID, outStream, options).then(finished)
+    }
+
+    options.rangeOffset = WUFFCRYPT_HEADER_SIZE
+    options.rangeSize = Math.max(1, Math.round(partSize / WUFFCRYPT_BLOCK_SIZE)) * WUFFCRYPT_BLOCK_SIZE
+
+    const decrypter = this.decrypt(archiveID)
+    return this.storage.getArchive(this.vaultName, archiveID, decrypter.stream, options).then((archive) => {
+        return decrypter.finished.then(() => finished(archive))
+    }).catch((err) => {
+        decrypter.kill()
+        throw err
     })
 }
 
+// The password from --passwordFile, BACKUP_PASSWORD or --password, in that order.  The first two
+// keep it out of the process list.  One trailing newline is dropped from the file.
+function readPassword(argv) {
+    const fromEnvironment = process.env.BACKUP_PASSWORD
+
+    // wuffcrypt has no need to inherit it
+    delete process.env.BACKUP_PASSWORD
+
+    if(argv.passwordFile) {
+        return fs.readFileSync(argv.passwordFile, 'utf8').replace(/\r?\n$/, '')
+    }
+
+    return fromEnvironment || argv.password
+}
+
 function main(argv) {
     const options = {}
     options.awsOptions = {}
@@ -85,11 +259,26 @@ function main(argv) {
     options.awsOptions.secretAccessKey = argv.awsSecretKey
     options.awsOptions.region = argv.awsRegion
 
+    // An S3-compatible service, such as a local MinIO, is addressed by path rather than by
+    // bucket subdomain
+    if(argv.awsEndpoint) {
+        options.awsOptions.endpoint = argv.awsEndpoint
+        options.awsOptions.s3ForcePathStyle = true
+    }
+
+    options.password = readPassword(argv)
+    options.wuffcrypt = argv.wuffcrypt
+    options.partSize = argv.partSize * 1024 * 1024
+    options.concurrency = argv.concurrency
+    options.catalog = argv.catalog
+    options.refreshCatalog = argv.refreshCatalog
+    options.catalogMaxAge = argv.catalogMaxAge * 24 * 60 * 60 * 1000
+
     const backupSystem = new BackupSystem(argv.name, argv.vault, options)
 
-    new Promise((resolve, reject) => {
+    Promise.resolve().then(() => {
         // Backup
-        if(!argv.backup) { return resolve() }
+        if(!argv.backup) { return }
 
         // Expire in either a year or a week
         const expiry = new Date()
@@ -107,7 +296,9 @@ function main(argv) {
         // Prune
         if(!argv.prune) { return }
 
-        return backupSystem.prune()
+        return backupSystem.prune().then((pruned) => {
+            console.log('Pruned ' + pruned + ' archives')
+        })
     }).then(() => {
         // List backups
         if(!argv.list) { return }
@@ -141,12 +332,31 @@ main(require('yargs')
     .describe('longTermBackup', 'Keep the backup for a year instead of a week.')
     .describe('awsRegion', 'The AWS region to use.')
     .default('awsRegion', 'us-east-1')
+    .describe('awsEndpoint', 'Use another S3-compatible service, such as http://localhost:9000 for a local MinIO.')
+    .describe('password', 'Encrypt backups with wuffcrypt as they are uploaded, and decrypt them as they are restored, using this password.  Other users can see it in the process list; prefer --passwordFile or BACKUP_PASSWORD.')
+    .describe('passwordFile', 'Read the password from this file instead.  BACKUP_PASSWORD in the environment also works.')
+    .describe('wuffcrypt', 'The wuffcrypt executable.')
+    .default('wuffcrypt', 'wuffcrypt')
+    .describe('partSize', 'Upload in parts, and download in ranges, of this many MiB, at least 5.')
+    .default('partSize', 16)
+    .describe('concurrency', 'How many parts to upload, ranges to download, listing pages or batches of deletes to send at once.')
+    .default('concurrency', 4)
+    .describe('catalog', 'Where to keep the local catalog of archives.  Defaults to ~/.backup-tools/VAULT.catalog.')
+    .boolean('refreshCatalog')
+    .default('refreshCatalog', false)
+    .describe('refreshCatalog', 'List the whole vault again, to pick up archives deleted by other hosts or lifecycle rules.')
+    .default('catalogMaxAge', 7)
+    .describe('catalogMaxAge', 'List the whole vault again once the catalog was last refreshed this many days ago.')
     .boolean('prune')
     .describe('prune', 'Prune old backups.  May take several hours to complete.')
     .boolean('list')
     .describe('list', 'List all backups currently in the inventory.')
     .describe('restore', 'Restore a given backup ID.')
     .check(function(args) {
+        if(!(args.partSize >= 5)) { throw '--partSize must be at least 5.' }
+        if(!(args.concurrency >= 1)) { throw '--concurrency must be at least 1.' }
+        if(!(args.catalogMaxAge >= 0)) { throw '--catalogMaxAge must not be negative.' }
+
         if(args.list) { return true }
         if(args.hasOwnProperty('restore')) { return true }
         if(args.hasOwnProperty('backup')) { return true }
@@ -0,0 +1,113 @@
+'use strict'
+
+const fs = require('fs')
+const path = require('path')
+
+// A local record of the keys in a bucket, so that listing and pruning need not fetch every key
+// from S3 on each run.  It is a log of "+" and "-" lines, each followed by a key as a JSON
+// string, appended to as archives are uploaded and deleted, and rewritten with only the keys
+// that remain once it has grown to twice their number.  An "=" line records, as a JSON date,
+// when the whole bucket was last listed.
+const Catalog = function(catalogPath) {
+    this.path = catalogPath
+    this.keys = new Set()
+    this.refreshed = null
+    this.logLength = 0
+}
+
+// Read the catalog, returning false if there is none yet
+Catalog.prototype.load = function() {
+    let text = null
+    try {
+        text = fs.readFileSync(this.path, 'utf8')
+    }
+    catch(err) {
+        if(err.code === 'ENOENT') { return false }
+        throw err
+    }
+
+    // A line cut short by a crash is ignored; the next refresh brings back what it said
+    const lines = text.split('\n')
+    lines.pop()
+
+    this.keys = new Set()
+    this.refreshed = null
+    for(let line of lines) {
+        let key = null
+        try {
+            key = JSON.parse(line.slice(1))
+        }
+        catch(err) {
+            continue
+        }
+
+        if(line[0] === '+') { this.keys.add(key) }
+        else if(line[0] === '-') { this.keys.delete(key) }
+        else if(line[0] === '=') { this.refreshed = new Date(key) }
+    }
+
+    this.logLength = lines.length
+    if(this.logLength > 2 * this.keys.size + 1000) { this.rewrite() }
+    return true
+}
+
+// Start over with exactly these keys, as just listed
+Catalog.prototype.replace = function(keys) {
+    this.keys = new Set(keys)
+    this.refreshed = new Date()
+    this.rewrite()
+}
+
+// How many milliseconds since the whole bucket was last listed, or Infinity if it never was
+Catalog.prototype.age = function() {
+    if(this.refreshed === null || isNaN(this.refreshed)) { return Infinity }
+    return Date.now() - this.refreshed.getTime()
+}
+
+Catalog.prototype.add = function(keys) {
+    this.append('+', keys.filter((key) => !this.keys.has(key)))
+}
+
+Catalog.prototype.remove = function(keys) {
+    this.append('-', keys.filter((key) => this.keys.has(key)))
+}
+
+Catalog.prototype.append = function(op, keys) {
+    if(keys.length === 0) { return }
+
+    for(let key of keys) {
+        if(op === '+') { this.keys.add(key) }
+        else { this.keys.delete(key) }
+    }
+
+    // Without a catalog, the next run lists the whole bucket anyway; a partial one would hide
+    // everything it did not mention
+    if(!fs.existsSync(this.path)) { return }
+
+    fs.appendFileSync(this.path, keys.map((key) => op + JSON.stringify(key) + '\n').join(''))
+    this.logLength += keys.length
+}
+
+// Write the keys to a new file and move it into place, so that a crash leaves one or the other
+Catalog.prototype.rewrite = function() {
+    const lines = []
+    if(this.refreshed !== null) { lines.push('=' + JSON.stringify(this.refreshed) + '\n') }
+    for(let key of this.keys) {
+        lines.push('+' + JSON.stringify(key) + '\n')
+    }
+
+    mkdirs(path.dirname(this.path))
+    const newPath = this.path + '.new'
+    fs.writeFileSync(newPath, lines.join(''))
+    fs.renameSync(newPath, this.path)
+    this.logLength = lines.length
+}
+
+const mkdirs = function(dir) {
+    if(fs.existsSync(dir)) { return }
+
+    mkdirs(path.dirname(dir))
+    fs.mkdirSync(dir)
+}
+
+exports.Catalog = Catalog
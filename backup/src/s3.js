@@ -7,66 +7,425 @@ const S3 = function(options) {
     this.s3 = new aws.S3(options)
 }
 
+// Parts start at this size, and double every PARTS_PER_STEP parts, so that a stream of unknown
+// length can run to several terabytes without going over S3's limit of 10000 parts
+const PART_SIZE = 16 * 1024 * 1024
+const PARTS_PER_STEP = 1000
+
+// How many parts are uploaded, or ranges downloaded, at once, by default
+const QUEUE_SIZE = 4
+
+// Downloads are fetched in ranges of this size, by default
+const RANGE_SIZE = 16 * 1024 * 1024
+
+// The most keys deleteObjects takes at once
+const DELETE_BATCH = 1000
+
+// Call an aws-sdk method, as a promise
+const call = function(s3, method, params) {
+    return new Promise((resolve, reject) => {
+        s3[method](params, (err, data) => {
+            if(err) { return reject(err) }
+
+            return resolve(data)
+        })
+    })
+}
+
 S3.prototype.uploadArchive = function(bucket, path, description, hints) {
-    const stream = fs.createReadStream(path)
+    return this.uploadStream(bucket, fs.createReadStream(path), description, hints)
+}
+
+// Upload a stream as a multipart upload, cutting it into parts as it arrives.  Up to
+// options.queueSize parts are in flight at once; beyond that the stream is paused, so that no
+// more than one more part is ever held in memory.  If options.beforeComplete is given, it is
+// called once every part is up and must return a promise; the upload is only completed if that
+// resolves, so that a producer that failed partway does not leave a truncated object behind.
+// Any failure aborts the upload.
+S3.prototype.uploadStream = function(bucket, stream, description, options) {
+    if(options === undefined) { options = {} }
+    const queueSize = options.queueSize || QUEUE_SIZE
+    const basePartSize = options.partSize || PART_SIZE
 
     const params = {
         'Bucket': bucket,
-        'Body': stream,
         'Key': description,
         'StorageClass': 'STANDARD_IA',
         'ACL': 'private'
     }
 
     return new Promise((resolve, reject) => {
-        this.s3.putObject(params, (err, data) => {
-            if(err) { return reject(err) }
+        const parts = []
+        let upload = null
+        let creating = true
+        let chunks = []
+        let buffered = 0
+        let inFlight = 0
+        let nParts = 0
+        let ended = false
+        let failed = null
+        let aborted = false
+
+        const partSize = () => basePartSize * Math.pow(2, Math.floor(nParts / PARTS_PER_STEP))
+
+        // Parts that finish after an abort may be kept, so wait for those in flight first
+        const settle = () => {
+            if(creating || inFlight > 0 || aborted) { return }
+            aborted = true
+            if(upload === null) { return reject(failed) }
+
+            const abort = {'Bucket': bucket, 'Key': description, 'UploadId': upload.UploadId}
+            call(this.s3, 'abortMultipartUpload', abort).catch(() => {}).then(() => reject(failed))
+        }
+
+        const fail = (err) => {
+            if(!failed) {
+                failed = err
+                stream.pause()
+                stream.removeListener('data', onData)
+            }
+
+            settle()
+        }
+
+        const complete = () => {
+            const check = options.beforeComplete ? options.beforeComplete() : Promise.resolve()
+            check.then(() => {
+                parts.sort((a, b) => a.PartNumber - b.PartNumber)
+                return call(this.s3, 'completeMultipartUpload', {
+                    'Bucket': bucket,
+                    'Key': description,
+                    'UploadId': upload.UploadId,
+                    'MultipartUpload': {'Parts': parts}
+                })
+            }).then(() => resolve(description), fail)
+        }
+
+        const send = (body) => {
+            nParts += 1
+            inFlight += 1
+            const partNumber = nParts
+
+            call(this.s3, 'uploadPart', {
+                'Bucket': bucket,
+                'Key': description,
+                'UploadId': upload.UploadId,
+                'PartNumber': partNumber,
+                'Body': body
+            }).then((data) => {
+                inFlight -= 1
+                if(failed) { return settle() }
+
+                parts.push({'ETag': data.ETag, 'PartNumber': partNumber})
+                if(ended) { return finish() }
+                if(inFlight < queueSize) { stream.resume() }
+            }, (err) => {
+                inFlight -= 1
+                fail(err)
+            })
+        }
+
+        // Once the stream has ended, send what is left when there is room, and complete the
+        // upload when everything is up.  The last part may be short, and there is always at
+        // least one.
+        const finish = () => {
+            if(inFlight >= queueSize) { return }
+
+            if(buffered > 0 || nParts === 0) {
+                send(Buffer.concat(chunks, buffered))
+                chunks = []
+                buffered = 0
+            }
+            else if(inFlight === 0) {
+                complete()
+            }
+        }
+
+        // Send off every whole part buffered so far
+        const cut = () => {
+            while(buffered >= partSize()) {
+                const size = partSize()
+                const all = Buffer.concat(chunks, buffered)
+                chunks = [all.slice(size)]
+                buffered -= size
+                send(all.slice(0, size))
+            }
 
-            return resolve(description)
+            if(inFlight >= queueSize) { stream.pause() }
+        }
+
+        const onData = (chunk) => {
+            chunks.push(chunk)
+            buffered += chunk.length
+            cut()
+        }
+
+        // Listen from the start, so that nothing is missed while the upload is created, but
+        // take no data until it has been
+        stream.pause()
+        stream.on('data', onData)
+        stream.on('error', fail)
+
+        // A paused stream still ends once it has nothing left to give
+        stream.on('end', () => {
+            if(failed) { return }
+            ended = true
+            if(upload !== null) { finish() }
+        })
+
+        call(this.s3, 'createMultipartUpload', params).then((data) => {
+            creating = false
+            upload = data
+            if(failed) { return settle() }
+            if(ended) { return finish() }
+            stream.resume()
+        }, (err) => {
+            creating = false
+            fail(err)
         })
     })
 }
 
-S3.prototype.getInventory = function(bucket) {
+// List every key in a bucket, or under options.prefix and after options.marker, a page at a
+// time.  Each level of the key space is split at options.delimiters[level], and the prefixes
+// found are listed alongside each other, up to options.concurrency pages in flight at once;
+// delimiters that follow the shape of the keys let even one huge listing go in parallel.
+// options.ranges, a list of {prefix, marker} pairs, lists several parts of the bucket at once in
+// place of options.prefix and options.marker.
+S3.prototype.getInventory = function(bucket, options) {
+    if(options === undefined) { options = {} }
+    const concurrency = options.concurrency || QUEUE_SIZE
+    const delimiters = options.delimiters || []
+    const ranges = options.ranges || [{'prefix': options.prefix, 'marker': options.marker}]
+
     return new Promise((resolve, reject) => {
-        this.s3.listObjects({'Bucket': bucket}, (err, data) => {
-            if(err) { return reject(err) }
+        const results = []
+        const queue = ranges.map((range) => ({'prefix': range.prefix || '', 'level': 0, 'marker': range.marker}))
+        let inFlight = 0
+        let failed = false
 
-            const results = []
-            for(let archive of data.Contents) {
-                results.push({
-                    'id': archive.Key,
-                    'description': archive.Key
-                })
+        const list = (task) => {
+            const params = {'Bucket': bucket, 'Prefix': task.prefix}
+            if(task.level < delimiters.length) { params.Delimiter = delimiters[task.level] }
+            if(task.marker !== undefined) { params.Marker = task.marker }
+
+            inFlight += 1
+            call(this.s3, 'listObjects', params).then((data) => {
+                inFlight -= 1
+                if(failed) { return }
+
+                for(let archive of data.Contents) {
+                    results.push({
+                        'id': archive.Key,
+                        'description': archive.Key
+                    })
+                }
+
+                const prefixes = data.CommonPrefixes || []
+                for(let common of prefixes) {
+                    queue.push({'prefix': common.Prefix, 'level': task.level + 1, 'marker': task.marker})
+                }
+
+                // Only delimited listings say where the next page starts; otherwise it is after
+                // the last key
+                if(data.IsTruncated) {
+                    let next = data.NextMarker
+                    if(next === undefined) {
+                        const last = data.Contents[data.Contents.length - 1]
+                        next = last ? last.Key : prefixes[prefixes.length - 1].Prefix
+                    }
+                    queue.push({'prefix': task.prefix, 'level': task.level, 'marker': next})
+                }
+
+                pump()
+            }, (err) => {
+                failed = true
+                reject(err)
+            })
+        }
+
+        const pump = () => {
+            while(inFlight < concurrency && queue.length > 0) {
+                list(queue.pop())
             }
-            return resolve(results)
-        })
+
+            if(inFlight === 0) { resolve(results) }
+        }
+
+        pump()
     })
 }
 
-S3.prototype.getArchive = function(bucket, archiveID, writeStream) {
-    return new Promise((resolve, reject) => {
-        this.s3.getObject({'Bucket': bucket, 'Key': archiveID}, (err, data) => {
-            if(err) { return reject(err) }
+// The first level of a bucket split at delimiter: the prefixes up to and including its first
+// occurrence in each key, and the keys that do not contain it, without listing what lies under
+// each prefix.  One page covers a thousand of them.
+S3.prototype.getPrefixes = function(bucket, delimiter) {
+    const prefixes = []
+    const keys = []
+
+    const page = (marker) => {
+        const params = {'Bucket': bucket, 'Delimiter': delimiter}
+        if(marker !== undefined) { params.Marker = marker }
+
+        return call(this.s3, 'listObjects', params).then((data) => {
+            for(let archive of data.Contents) { keys.push(archive.Key) }
+            for(let common of data.CommonPrefixes || []) { prefixes.push(common.Prefix) }
+            if(!data.IsTruncated) { return {'prefixes': prefixes, 'keys': keys} }
+
+            let next = data.NextMarker
+            if(next === undefined) {
+                const lastKey = keys.length > 0 ? keys[keys.length - 1] : ''
+                const lastPrefix = prefixes.length > 0 ? prefixes[prefixes.length - 1] : ''
+                next = lastKey > lastPrefix ? lastKey : lastPrefix
+            }
+            return page(next)
+        })
+    }
+
+    return page(undefined)
+}
+
+// Download an object into writeStream with ranged GETs, up to options.queueSize of them in
+// flight at once, writing each range as soon as those before it have been written.  Ranges
+// start at options.rangeOffset and every options.rangeSize bytes after it (the first also
+// takes everything before rangeOffset), so that a caller can line them up with the records of
+// a file.  No range is fetched more than queueSize ahead of the one being written, and none
+// while the stream is asking us to wait, so memory stays near queueSize ranges however large
+// the object.  The stream is ended once everything is written.
+S3.prototype.getArchive = function(bucket, archiveID, writeStream, options) {
+    if(options === undefined) { options = {} }
+    const queueSize = options.queueSize || QUEUE_SIZE
+    const rangeSize = options.rangeSize || RANGE_SIZE
+    const rangeOffset = options.rangeOffset || 0
+
+    return call(this.s3, 'headObject', {'Bucket': bucket, 'Key': archiveID}).then((head) => {
+        const ranges = []
+        for(let start = 0, end = Math.min(head.ContentLength, rangeOffset + rangeSize);
+            start < head.ContentLength;
+            start = end, end = Math.min(head.ContentLength, end + rangeSize)) {
+            ranges.push([start, end])
+        }
+
+        return new Promise((resolve, reject) => {
+            const fetched = new Map()
+            let nextFetch = 0
+            let nextWrite = 0
+            let waiting = false
+            let failed = false
+
+            const fail = (err) => {
+                if(failed) { return }
+                failed = true
+                reject(err)
+            }
 
-            return resolve({
-                'key': archiveID,
-                'description': archiveID
+            // Pass on every range that is next in line, until the stream wants us to wait
+            const drain = () => {
+                while(!waiting && fetched.has(nextWrite)) {
+                    const body = fetched.get(nextWrite)
+                    fetched.delete(nextWrite)
+                    nextWrite += 1
+                    if(!writeStream.write(body)) {
+                        waiting = true
+                        writeStream.once('drain', () => {
+                            waiting = false
+                            drain()
+                        })
+                    }
+                }
+
+                if(nextWrite === ranges.length) { return writeStream.end() }
+                pump()
+            }
+
+            const pump = () => {
+                while(!failed && !waiting && nextFetch < ranges.length && nextFetch - nextWrite < queueSize) {
+                    fetch(nextFetch)
+                    nextFetch += 1
+                }
+            }
+
+            // Every range comes from the same version of the object, or none do
+            const fetch = (i) => {
+                const range = ranges[i]
+                call(this.s3, 'getObject', {
+                    'Bucket': bucket,
+                    'Key': archiveID,
+                    'Range': 'bytes=' + range[0] + '-' + (range[1] - 1),
+                    'IfMatch': head.ETag
+                }).then((data) => {
+                    if(failed) { return }
+                    if(data.Body.length !== range[1] - range[0]) {
+                        return fail(new Error('Short read of ' + archiveID + ' at byte ' + range[0]))
+                    }
+
+                    fetched.set(i, data.Body)
+                    drain()
+                }, fail)
+            }
+
+            writeStream.on('error', fail)
+            writeStream.on('finish', () => {
+                if(failed) { return }
+                resolve({'key': archiveID, 'description': archiveID})
             })
-        }).createReadStream().pipe(writeStream)
+
+            drain()
+        })
     })
 }
 
-S3.prototype.removeArchives = function(bucket, keys) {
-    const keyObjects = keys.map((key) => { return {'Key': key} })
+// Delete keys in batches of as many as S3 takes at once, options.concurrency batches at a time.
+// options.onDeleted, if given, is called with the keys of each batch that are gone, as soon as
+// they are.  Resolves with the keys that were deleted and the errors for those that were not.
+S3.prototype.removeArchives = function(bucket, keys, options) {
+    if(options === undefined) { options = {} }
+    const concurrency = options.concurrency || QUEUE_SIZE
 
     return new Promise((resolve, reject) => {
-        this.s3.deleteObjects({'Bucket': bucket,
-                               'Delete': {'Objects': keyObjects}}, (err, data) => {
-            if(err) { return reject(err) }
+        const deleted = []
+        const errors = []
+        let next = 0
+        let inFlight = 0
+        let failed = false
 
-            return resolve(data)
-        })
+        const remove = (batch) => {
+            inFlight += 1
+            call(this.s3, 'deleteObjects', {
+                'Bucket': bucket,
+                'Delete': {'Objects': batch.map((key) => { return {'Key': key} }), 'Quiet': true}
+            }).then((data) => {
+                inFlight -= 1
+                if(failed) { return }
+
+                // In quiet mode, only the keys that could not be deleted are reported
+                const refused = new Set()
+                for(let error of data.Errors || []) {
+                    refused.add(error.Key)
+                    errors.push(error)
+                }
+
+                const gone = batch.filter((key) => !refused.has(key))
+                for(let key of gone) { deleted.push(key) }
+                if(options.onDeleted && gone.length > 0) { options.onDeleted(gone) }
+
+                pump()
+            }, (err) => {
+                failed = true
+                reject(err)
+            })
+        }
+
+        const pump = () => {
+            while(inFlight < concurrency && next < keys.length) {
+                remove(keys.slice(next, next + DELETE_BATCH))
+                next += DELETE_BATCH
+            }
+
+            if(inFlight === 0) { resolve({'deleted': deleted, 'errors': errors}) }
+        }
+
+        pump()
     })
 }
 
@@ -0,0 +1,320 @@
+// bench.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+// Throughput benchmarks for the whole pipeline: the KDF, single blocks, and whole files on a
+// RAM-backed filesystem.  Results are printed as JSON, one benchmark per line, so that a run can
+// be saved and later passed back with --baseline to catch regressions.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "blockio.hpp"
+#include "filejob.hpp"
+#include "parity.hpp"
+#include "threadpool.hpp"
+#include "wuffcrypt.hpp"
+
+namespace {
+    struct Result {
+        std::string name;
+        double seconds;
+        uint64_t bytes;
+        uint64_t blocks;
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    double since(Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // In kilobytes
+    long peakRss() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+
+    double megabytesPerSecond(const Result& result) {
+        return (result.seconds > 0)? result.bytes / result.seconds / (1024.0 * 1024.0) : 0;
+    }
+
+    void report(const Result& result) {
+        const double nsPerBlock = (result.blocks > 0)? result.seconds * 1e9 / result.blocks : 0;
+        printf("{\"name\": %s, \"mb_per_s\": %.2f, \"ns_per_block\": %.0f, \"seconds\": %.4f, \"bytes\": %llu, \"peak_rss_kb\": %ld}\n",
+               jsonString(result.name).c_str(), megabytesPerSecond(result), nsPerBlock, result.seconds,
+               static_cast<unsigned long long>(result.bytes), peakRss());
+        fflush(stdout);
+    }
+
+    void fillIncompressible(std::vector<uint8_t>& data) {
+        randombytes_buf(data.data(), data.size());
+    }
+
+    // Text-like data that a general purpose compressor would shrink several times over
+    void fillCompressible(std::vector<uint8_t>& data) {
+        const char* words[] = {"backup ", "archive ", "block ", "wuffcrypt ", "nonce ", "\n"};
+        size_t i = 0;
+        while(i < data.size()) {
+            const char* word = words[randombytes_uniform(6)];
+            for(size_t j = 0; word[j] != '\0' && i < data.size(); j += 1, i += 1) {
+                data[i] = static_cast<uint8_t>(word[j]);
+            }
+        }
+    }
+
+    Result benchKdf(int workFactor) {
+        uint8_t key[crypto_secretbox_xsalsa20poly1305_KEYBYTES];
+        const int rounds = (workFactor < 14)? 8 : 1;
+
+        auto start = Clock::now();
+        for(int i = 0; i < rounds; i += 1) {
+            kdf("benchmark password", workFactor, key, sizeof(key));
+        }
+
+        Result result = {"kdf/wf" + std::to_string(workFactor), since(start) / rounds, 0, 1};
+        return result;
+    }
+
+    Result benchBlocks(const DerivedKey& key, size_t blockSize, bool decrypt) {
+        Encrypter enc(key);
+        Decrypter dec(key, enc.noncePrefix());
+
+        std::vector<uint8_t> msg(blockSize);
+        std::vector<uint8_t> ctext(blockSize + crypto_secretbox_xsalsa20poly1305_MACBYTES);
+        fillIncompressible(msg);
+
+        // Enough blocks for a stable measurement, whatever the block size
+        const uint64_t blocks = (256ULL * 1024 * 1024) / blockSize;
+
+        enc.encrypt(msg.data(), msg.size(), ctext.data(), WuffCryptFile::blockNonce(enc.noncePrefix(), 0, blockSize));
+        const Nonce nonce = WuffCryptFile::blockNonce(enc.noncePrefix(), 0, blockSize);
+
+        auto start = Clock::now();
+        for(uint64_t i = 0; i < blocks; i += 1) {
+            if(decrypt) {
+                verify(dec.decrypt(ctext.data(), ctext.size(), msg.data(), nonce) == 0);
+            }
+            else {
+                enc.encrypt(msg.data(), msg.size(), ctext.data(), nonce);
+            }
+        }
+
+        Result result = {std::string(decrypt? "decrypt/" : "encrypt/") + std::to_string(blockSize / 1024) + "k",
+                         since(start), blocks * blockSize, blocks};
+        return result;
+    }
+
+    // Computing the parity of whole stripes, per byte of data
+    Result benchParity(unsigned k, unsigned m) {
+        std::vector<std::vector<uint8_t>> shards(k + m, std::vector<uint8_t>(WuffCryptFile::ENCRYPTED_BLOCK_SIZE));
+        std::vector<const uint8_t*> data;
+        std::vector<uint8_t*> parity;
+        for(unsigned j = 0; j < k; j += 1) {
+            fillIncompressible(shards[j]);
+            data.push_back(shards[j].data());
+        }
+        for(unsigned i = 0; i < m; i += 1) {
+            parity.push_back(shards[k + i].data());
+        }
+
+        const uint64_t stripes = (256ULL * 1024 * 1024) / (k * WuffCryptFile::ENCRYPTED_BLOCK_SIZE);
+        auto start = Clock::now();
+        for(uint64_t i = 0; i < stripes; i += 1) {
+            parity::encode(k, m, data.data(), parity.data(), WuffCryptFile::ENCRYPTED_BLOCK_SIZE);
+        }
+
+        Result result = {"parity/" + std::to_string(k) + "+" + std::to_string(m), since(start),
+                         stripes * k * WuffCryptFile::ENCRYPTED_BLOCK_SIZE, stripes * k};
+        return result;
+    }
+
+    // WuffCryptFile, as the command line uses it for pipes.  Includes one KDF per call.
+    void benchFile(const std::string& dir, const std::string& kind, const std::vector<uint8_t>& data,
+                   const SecureString& password, std::vector<Result>& results) {
+        const std::string path = dir + "/wuffcrypt-bench.wuff";
+        const uint64_t blocks = WuffCryptFile::blockCount(data.size());
+
+        WuffCryptFile file(path);
+        blockio::MemorySource source(data.data(), data.size());
+        auto start = Clock::now();
+        verify(file.encryptFrom(source, password) == WuffCryptFile::FileStatus::OK);
+        results.push_back({"file-write/" + kind, since(start), data.size(), blocks});
+
+        std::vector<uint8_t> out;
+        out.reserve(data.size());
+        blockio::MemorySink sink(out);
+        start = Clock::now();
+        verify(file.decryptTo(sink, password) == WuffCryptFile::FileStatus::OK);
+        results.push_back({"file-read/" + kind, since(start), data.size(), blocks});
+
+        verify(out == data);
+        unlink(path.c_str());
+    }
+
+    // The parallel job used for regular files, with the key derived up front
+    void benchJob(const std::string& dir, const std::string& kind, const std::vector<uint8_t>& data,
+                  const DerivedKey& key, KeyCache& keys, std::vector<Result>& results) {
+        const std::string inPath = dir + "/wuffcrypt-bench.bin";
+        const std::string outPath = dir + "/wuffcrypt-bench.wuff";
+        const uint64_t blocks = WuffCryptFile::blockCount(data.size());
+
+        FILE* f = fopen(inPath.c_str(), "wb");
+        verify(f != nullptr);
+        verify(fwrite(data.data(), 1, data.size(), f) == data.size());
+        fclose(f);
+
+        WorkStealingPool pool(WorkStealingPool::defaultSize());
+
+        WuffCryptFile::FileStatus status = WuffCryptFile::FileStatus::OK;
+        auto start = Clock::now();
+        FileEncryptJob::start(pool, key, inPath, outPath, WuffCryptFile::Options(), [&status](const FileEncryptJob::Result& result) {
+            status = result.status;
+        });
+        pool.wait();
+        verify(status == WuffCryptFile::FileStatus::OK);
+        results.push_back({"job-encrypt/" + kind, since(start), data.size(), blocks});
+
+        start = Clock::now();
+        FileVerifyJob::start(pool, keys, outPath, WuffCryptFile::Options(), [&status](const FileVerifyJob::Result& result) {
+            status = result.status;
+        });
+        pool.wait();
+        verify(status == WuffCryptFile::FileStatus::OK);
+        results.push_back({"job-verify/" + kind, since(start), data.size(), blocks});
+
+        unlink(inPath.c_str());
+        unlink(outPath.c_str());
+    }
+
+    // Read back a previous run's output: benchmark name to MB/s
+    bool loadBaseline(const char* path, std::map<std::string, double>& out) {
+        FILE* f = fopen(path, "r");
+        if(f == nullptr) return false;
+
+        char line[1024];
+        while(fgets(line, sizeof(line), f) != nullptr) {
+            char name[256];
+            double mbps = 0;
+            if(sscanf(line, "{\"name\": \"%255[^\"]\", \"mb_per_s\": %lf", name, &mbps) == 2) {
+                out[name] = mbps;
+            }
+        }
+
+        fclose(f);
+        return true;
+    }
+
+    void printUsage(const char* path) {
+        printf("Usage: %s [--dir DIR] [--size MiB] [--baseline FILE] [--threshold PERCENT]\n", path);
+        printf("\t--dir: Where to write files.  Defaults to /dev/shm, which is RAM-backed on Linux.\n");
+        printf("\t--size: Size of the whole-file benchmarks.  Defaults to 256.\n");
+        printf("\t--baseline: Fail if throughput falls short of an earlier run's output\n");
+        printf("\t--threshold: How far below the baseline is too far.  Defaults to 10.\n");
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string dir = (access("/dev/shm", W_OK) == 0)? "/dev/shm" : "/tmp";
+    size_t sizeMiB = 256;
+    const char* baselinePath = nullptr;
+    double threshold = 10;
+
+    for(int i = 1; i < argc; i += 1) {
+        const bool hasValue = i + 1 < argc;
+        if(strcmp(argv[i], "--dir") == 0 && hasValue) {
+            dir = argv[++i];
+        }
+        else if(strcmp(argv[i], "--size") == 0 && hasValue) {
+            sizeMiB = static_cast<size_t>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if(strcmp(argv[i], "--baseline") == 0 && hasValue) {
+            baselinePath = argv[++i];
+        }
+        else if(strcmp(argv[i], "--threshold") == 0 && hasValue) {
+            threshold = strtod(argv[++i], nullptr);
+        }
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    verify(sodium_init() >= 0);
+
+    std::map<std::string, double> baseline;
+    if(baselinePath != nullptr && !loadBaseline(baselinePath, baseline)) {
+        fprintf(stderr, "Error reading %s\n", baselinePath);
+        return 1;
+    }
+
+    std::vector<Result> results;
+
+    for(int workFactor : {10, 14, static_cast<int>(WuffCryptFile::WORK_FACTOR)}) {
+        results.push_back(benchKdf(workFactor));
+        report(results.back());
+    }
+
+    char passwordText[] = "benchmark password";
+    SecureString password(passwordText);
+    DerivedKey key(password, WuffCryptFile::WORK_FACTOR);
+    KeyCache keys(password);
+    keys.get(WuffCryptFile::WORK_FACTOR);
+
+    const size_t blockSizes[] = {4096, 16384, 65536, 262144, WuffCryptFile::BLOCK_SIZE};
+    for(size_t blockSize : blockSizes) {
+        for(bool decrypt : {false, true}) {
+            results.push_back(benchBlocks(key, blockSize, decrypt));
+            report(results.back());
+        }
+    }
+
+    for(unsigned m : {1u, 2u, 4u}) {
+        results.push_back(benchParity(16, m));
+        report(results.back());
+    }
+
+    std::vector<uint8_t> data(sizeMiB * 1024 * 1024 + 12345);
+    for(const char* kind : {"incompressible", "compressible"}) {
+        if(strcmp(kind, "incompressible") == 0) {
+            fillIncompressible(data);
+        }
+        else {
+            fillCompressible(data);
+        }
+
+        const size_t first = results.size();
+        benchFile(dir, kind, data, password, results);
+        benchJob(dir, kind, data, key, keys, results);
+        for(size_t i = first; i < results.size(); i += 1) {
+            report(results[i]);
+        }
+    }
+
+    // The KDF is deliberately slow, so only throughput figures are compared
+    int regressions = 0;
+    for(const Result& result : results) {
+        auto old = baseline.find(result.name);
+        if(old == baseline.end() || old->second <= 0 || result.bytes == 0) continue;
+
+        const double mbps = megabytesPerSecond(result);
+        if(mbps < old->second * (1 - threshold / 100)) {
+            fprintf(stderr, "Regression: %s at %.2f MB/s, against %.2f MB/s in the baseline\n",
+                    result.name.c_str(), mbps, old->second);
+            regressions += 1;
+        }
+    }
+
+    return (regressions > 0)? 1 : 0;
+}
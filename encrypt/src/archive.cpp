@@ -0,0 +1,200 @@
+// archive.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "archive.hpp"
+#include "fileio.hpp"
+
+namespace {
+    // Check that children hash to their parent, following merkle::build()
+    bool childrenMatch(const uint8_t* parent, const uint8_t children[2][merkle::NODE_BYTES], int count) {
+        uint8_t computed[merkle::NODE_BYTES];
+        if(count == 2) {
+            merkle::parent(children[0], children[1], computed);
+        }
+        else {
+            memcpy(computed, children[0], merkle::NODE_BYTES);
+        }
+
+        return sodium_memcmp(computed, parent, merkle::NODE_BYTES) == 0;
+    }
+
+    struct Pending {
+        unsigned level;
+        uint64_t i;
+        uint8_t a[merkle::NODE_BYTES];
+        uint8_t b[merkle::NODE_BYTES];
+    };
+}
+
+ArchiveReader::~ArchiveReader() {
+    if(_fd >= 0) close(_fd);
+}
+
+WuffCryptFile::FileStatus ArchiveReader::open(const std::string& path, KeyCache& keys) {
+    _fd = ::open(path.c_str(), O_RDONLY);
+    if(_fd < 0 || !fileio::regularFileSize(_fd, _size)) {
+        return WuffCryptFile::FileStatus::OpenError;
+    }
+
+    uint8_t headerBuf[WuffCryptFile::HEADER_SIZE];
+    ssize_t bytesRead = fileio::preadAll(_fd, headerBuf, sizeof(headerBuf), 0);
+    if(bytesRead < 0) {
+        return WuffCryptFile::FileStatus::ReadError;
+    }
+
+    auto status = WuffCryptFile::decodeHeader(headerBuf, static_cast<size_t>(bytesRead), _header);
+    if(status != WuffCryptFile::FileStatus::OK) {
+        return status;
+    }
+
+    if(_header.version == 0) {
+        return WuffCryptFile::FileStatus::WrongVersion;
+    }
+
+    const DerivedKey* key = keys.tryGet(_header.workFactor);
+    if(key == nullptr) {
+        return WuffCryptFile::FileStatus::NoMemory;
+    }
+
+    _dec.reset(new Decrypter(*key, _header.nonce));
+
+    status = WuffCryptFile::openTrailer(_fd, _size, *_dec, _trailer);
+    if(status != WuffCryptFile::FileStatus::OK) {
+        return status;
+    }
+
+    if(!_trailer.hasMerkleRoot) {
+        return WuffCryptFile::FileStatus::WrongVersion;
+    }
+
+    return WuffCryptFile::FileStatus::OK;
+}
+
+WuffCryptFile::FileStatus ArchiveReader::blockLeaf(uint64_t n, uint8_t* leaf) {
+    // A block of zeros left out of a sparse file stands in the tree with an all-zero tag
+    if(_trailer.isZero(n)) {
+        const uint8_t zeroTag[merkle::TAG_BYTES] = {};
+        merkle::leaf(zeroTag, leaf);
+        return WuffCryptFile::FileStatus::OK;
+    }
+
+    const size_t len = WuffCryptFile::blockLength(_trailer.plaintextLength, n);
+    const size_t encryptedLen = len + crypto_secretbox_xsalsa20poly1305_MACBYTES;
+
+    SodiumEncryptedBuffer buf(len);
+    ssize_t bytesRead = fileio::preadAll(_fd, buf.data(), encryptedLen, WuffCryptFile::blockOffset(n));
+    if(bytesRead < 0 || static_cast<size_t>(bytesRead) != encryptedLen) {
+        return WuffCryptFile::FileStatus::ReadError;
+    }
+
+    if(_dec->authenticate(buf.data(), encryptedLen, WuffCryptFile::blockNonce(_header.nonce, n, len)) != 0) {
+        return WuffCryptFile::FileStatus::VerificationFailed;
+    }
+
+    merkle::leaf(buf.data(), leaf);
+    return WuffCryptFile::FileStatus::OK;
+}
+
+bool ArchiveReader::readNode(unsigned level, uint64_t i, uint8_t* out) {
+    const uint64_t offset = WuffCryptFile::dataEnd(_trailer.plaintextLength) + merkle::nodeOffset(blockCount(), level, i);
+    _nodesRead += 1;
+
+    ssize_t bytesRead = fileio::preadAll(_fd, out, merkle::NODE_BYTES, offset);
+    return bytesRead == static_cast<ssize_t>(merkle::NODE_BYTES);
+}
+
+WuffCryptFile::FileStatus ArchiveReader::verifyBlocks(uint64_t first, uint64_t last, uint64_t& badBlock) {
+    badBlock = UINT64_MAX;
+    verify(first <= last && last < blockCount());
+
+    std::vector<uint8_t> leaves((last - first + 1) * merkle::NODE_BYTES);
+    for(uint64_t n = first; n <= last; n += 1) {
+        auto status = blockLeaf(n, &leaves[(n - first) * merkle::NODE_BYTES]);
+        if(status == WuffCryptFile::FileStatus::VerificationFailed) {
+            badBlock = n;
+        }
+
+        if(status != WuffCryptFile::FileStatus::OK) {
+            return status;
+        }
+    }
+
+    uint8_t root[merkle::NODE_BYTES];
+    auto reader = [this](unsigned level, uint64_t i, uint8_t* out) { return readNode(level, i, out); };
+    if(!merkle::climb(blockCount(), first, leaves, reader, root)) {
+        return WuffCryptFile::FileStatus::ReadError;
+    }
+
+    if(sodium_memcmp(root, _trailer.merkleRoot, merkle::NODE_BYTES) != 0) {
+        return WuffCryptFile::FileStatus::VerificationFailed;
+    }
+
+    return WuffCryptFile::FileStatus::OK;
+}
+
+WuffCryptFile::FileStatus ArchiveReader::compare(ArchiveReader& a, ArchiveReader& b, Comparison& result,
+                                                 std::vector<uint64_t>& differing) {
+    // Blocks can only be lined up if both copies came from the same encryption of the same data
+    if(memcmp(a._header.nonce, b._header.nonce, sizeof(a._header.nonce)) != 0 ||
+       a._trailer.plaintextLength != b._trailer.plaintextLength) {
+        result = Comparison::Unrelated;
+        return WuffCryptFile::FileStatus::OK;
+    }
+
+    if(sodium_memcmp(a._trailer.merkleRoot, b._trailer.merkleRoot, merkle::NODE_BYTES) == 0) {
+        result = Comparison::Identical;
+        return WuffCryptFile::FileStatus::OK;
+    }
+
+    result = Comparison::Different;
+    const uint64_t leaves = a.blockCount();
+
+    // Depth first, right child pushed first, so that differing blocks come out in order
+    std::vector<Pending> stack(1);
+    stack[0].level = merkle::levels(leaves) - 1;
+    stack[0].i = 0;
+    memcpy(stack[0].a, a._trailer.merkleRoot, merkle::NODE_BYTES);
+    memcpy(stack[0].b, b._trailer.merkleRoot, merkle::NODE_BYTES);
+
+    while(!stack.empty()) {
+        const Pending node = stack.back();
+        stack.pop_back();
+
+        if(node.level == 0) {
+            differing.push_back(node.i);
+            continue;
+        }
+
+        const unsigned level = node.level - 1;
+        const int count = (2*node.i + 1 < merkle::levelSize(leaves, level))? 2 : 1;
+
+        uint8_t childrenA[2][merkle::NODE_BYTES];
+        uint8_t childrenB[2][merkle::NODE_BYTES];
+        for(int c = 0; c < count; c += 1) {
+            if(!a.readNode(level, 2*node.i + c, childrenA[c]) || !b.readNode(level, 2*node.i + c, childrenB[c])) {
+                return WuffCryptFile::FileStatus::ReadError;
+            }
+        }
+
+        if(!childrenMatch(node.a, childrenA, count) || !childrenMatch(node.b, childrenB, count)) {
+            return WuffCryptFile::FileStatus::VerificationFailed;
+        }
+
+        for(int c = count - 1; c >= 0; c -= 1) {
+            if(memcmp(childrenA[c], childrenB[c], merkle::NODE_BYTES) == 0) continue;
+
+            Pending child;
+            child.level = level;
+            child.i = 2*node.i + c;
+            memcpy(child.a, childrenA[c], merkle::NODE_BYTES);
+            memcpy(child.b, childrenB[c], merkle::NODE_BYTES);
+            stack.push_back(child);
+        }
+    }
+
+    return WuffCryptFile::FileStatus::OK;
+}
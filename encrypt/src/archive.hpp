@@ -0,0 +1,70 @@
+// archive.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "wuffcrypt.hpp"
+
+// Random access to an existing format 2 file: its authenticated trailer, single blocks, and the
+// nodes of its Merkle index.  Only the parts asked for are read, so checking a few blocks of a
+// huge file, or comparing two copies of it, costs a handful of small reads.
+class ArchiveReader {
+public:
+    ArchiveReader(): _fd(-1), _size(0), _nodesRead(0) {}
+    ArchiveReader(const ArchiveReader& other) = delete;
+    ~ArchiveReader();
+
+    // Open a file and authenticate its trailer.  Files written before the Merkle index was
+    // introduced give WrongVersion.
+    WuffCryptFile::FileStatus open(const std::string& path, KeyCache& keys);
+
+    const WuffCryptFile::Header& header() const { return _header; }
+    const WuffCryptFile::Trailer& trailer() const { return _trailer; }
+
+    uint64_t blockCount() const {
+        return WuffCryptFile::blockCount(_trailer.plaintextLength);
+    }
+
+    // Authenticate block n, and compute its Merkle leaf
+    WuffCryptFile::FileStatus blockLeaf(uint64_t n, uint8_t* leaf);
+
+    // Read one node of the stored index.  Nodes are not authenticated on their own; they must be
+    // checked against the root in the trailer.
+    bool readNode(unsigned level, uint64_t i, uint8_t* out);
+
+    // How many index nodes have been read so far
+    uint64_t nodesRead() const { return _nodesRead; }
+
+    // Authenticate blocks first through last, and check, via the Merkle index, that they are the
+    // blocks recorded in the trailer.  On VerificationFailed, badBlock is the first block that did
+    // not authenticate, or UINT64_MAX if the blocks were fine but the index disagreed.
+    WuffCryptFile::FileStatus verifyBlocks(uint64_t first, uint64_t last, uint64_t& badBlock);
+
+    // The result of comparing two copies of an archive
+    enum class Comparison {
+        Identical,
+        Different,
+
+        // Separately encrypted, or of different lengths; their trees cannot be lined up
+        Unrelated
+    };
+
+    // Compare two copies by walking down both Merkle indexes from their roots, only descending
+    // where they differ.  Every node read is checked against its parent, so a damaged index cannot
+    // hide a difference; if one is found, VerificationFailed is returned.  The differing blocks
+    // are appended to differing.
+    static WuffCryptFile::FileStatus compare(ArchiveReader& a, ArchiveReader& b, Comparison& result,
+                                             std::vector<uint64_t>& differing);
+
+private:
+    int _fd;
+    uint64_t _size;
+    uint64_t _nodesRead;
+    WuffCryptFile::Header _header;
+    WuffCryptFile::Trailer _trailer;
+    std::unique_ptr<Decrypter> _dec;
+};
@@ -1,17 +1,53 @@
 // arguments.cpp - Part of WuffCrypt
 // Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <vector>
 #include "arguments.hpp"
 #include "securestring.hpp"
 
+namespace {
+    // Bytes, or with a K, M or G suffix.  Zero is not a size.
+    bool parseSize(const char* arg, uint64_t& out) {
+        char* end = nullptr;
+        out = strtoull(arg, &end, 10);
+        switch(*end) {
+            case 'k': case 'K': { out <<= 10; end += 1; break; }
+            case 'm': case 'M': { out <<= 20; end += 1; break; }
+            case 'g': case 'G': { out <<= 30; end += 1; break; }
+            default: { break; }
+        }
+
+        return *arg >= '0' && *arg <= '9' && *end == '\0' && out > 0;
+    }
+
+    // Longer than any password anyone types, and small enough to lock into memory
+    const size_t MAX_PASSWORD_SIZE = 4096;
+}
+
 Arguments::Status Arguments::parse(int argc, char** argv) {
     std::vector<char*> plainArgs;
 
     enum class ParseMode {
         None,
-        Password
+        Password,
+        PasswordFd,
+        PasswordPath,
+        Threads,
+        Range,
+        StatsPath,
+        MaxMemory,
+        Cache,
+        Parity,
+        VolumeSize,
+        Rate,
+        CPU,
+        ThrottlePath
     } mode = ParseMode::None;
 
     for(int i = 1; i < argc; i += 1) {
@@ -22,6 +58,109 @@ Arguments::Status Arguments::parse(int argc, char** argv) {
                     SecureString(argv[i]).moveInto(_password);
                     break;
                 }
+                case ParseMode::PasswordFd: {
+                    char* end = nullptr;
+                    long fd = strtol(argv[i], &end, 10);
+                    if(*argv[i] < '0' || *argv[i] > '9' || *end != '\0' || fd > INT_MAX) {
+                        return Status::InvalidValue;
+                    }
+
+                    _passwordFd = static_cast<int>(fd);
+                    _passwordPath.clear();
+                    break;
+                }
+                case ParseMode::PasswordPath: {
+                    _passwordPath = argv[i];
+                    _passwordFd = -1;
+                    break;
+                }
+                case ParseMode::Threads: {
+                    char* end = nullptr;
+                    long threads = strtol(argv[i], &end, 10);
+                    if(*argv[i] == '\0' || *end != '\0' || threads < 1) {
+                        return Status::InvalidValue;
+                    }
+
+                    _threads = static_cast<size_t>(threads);
+                    break;
+                }
+                case ParseMode::MaxMemory: {
+                    if(!parseSize(argv[i], _maxMemory)) return Status::InvalidValue;
+                    break;
+                }
+                case ParseMode::VolumeSize: {
+                    if(!parseSize(argv[i], _volumeSize)) return Status::InvalidValue;
+                    break;
+                }
+                case ParseMode::Cache: {
+                    if(strcmp(argv[i], "keep") == 0) {
+                        _cacheMode = fileio::CacheMode::Keep;
+                    }
+                    else if(strcmp(argv[i], "drop") == 0) {
+                        _cacheMode = fileio::CacheMode::Drop;
+                    }
+                    else if(strcmp(argv[i], "direct") == 0) {
+                        _cacheMode = fileio::CacheMode::Direct;
+                    }
+                    else {
+                        return Status::InvalidValue;
+                    }
+                    break;
+                }
+                case ParseMode::Parity: {
+                    // DATA+PARITY, at most 256 in all
+                    char* end = nullptr;
+                    const unsigned long data = strtoul(argv[i], &end, 10);
+                    if(*argv[i] < '0' || *argv[i] > '9' || *end != '+') return Status::InvalidValue;
+
+                    char* rest = end + 1;
+                    const unsigned long parity = strtoul(rest, &end, 10);
+                    if(*rest < '0' || *rest > '9' || *end != '\0' || data == 0 || parity == 0 || data + parity > 256) {
+                        return Status::InvalidValue;
+                    }
+
+                    _dataShards = static_cast<uint8_t>(data);
+                    _parityShards = static_cast<uint8_t>(parity);
+                    break;
+                }
+                case ParseMode::StatsPath: {
+                    _statsPath = argv[i];
+                    break;
+                }
+                case ParseMode::Rate: {
+                    if(!Throttle::parseRate(argv[i], _limits.readRate, _limits.writeRate)) return Status::InvalidValue;
+                    break;
+                }
+                case ParseMode::CPU: {
+                    char* end = nullptr;
+                    const long percent = strtol(argv[i], &end, 10);
+                    if(*argv[i] == '\0' || *end != '\0' || percent < 1 || percent > 100) {
+                        return Status::InvalidValue;
+                    }
+
+                    _limits.cpuPercent = static_cast<unsigned>(percent);
+                    break;
+                }
+                case ParseMode::ThrottlePath: {
+                    _throttlePath = argv[i];
+                    break;
+                }
+                case ParseMode::Range: {
+                    // Either a single block, or FIRST-LAST
+                    char* end = nullptr;
+                    _rangeFirst = strtoull(argv[i], &end, 10);
+                    _rangeLast = _rangeFirst;
+                    if(end != argv[i] && *end == '-') {
+                        char* rest = end + 1;
+                        _rangeLast = strtoull(rest, &end, 10);
+                        if(end == rest) return Status::InvalidValue;
+                    }
+
+                    if(*argv[i] < '0' || *argv[i] > '9' || *end != '\0' || _rangeLast < _rangeFirst) {
+                        return Status::InvalidValue;
+                    }
+                    break;
+                }
             }
 
             mode = ParseMode::None;
@@ -34,14 +173,92 @@ Arguments::Status Arguments::parse(int argc, char** argv) {
         else if(strcmp(argv[i], "-d") == 0) {
             _operation = Operation::Decrypt;
         }
+        else if(strcmp(argv[i], "-t") == 0) {
+            _operation = Operation::Test;
+        }
+        else if(strcmp(argv[i], "--root") == 0) {
+            _operation = Operation::PrintRoot;
+        }
+        else if(strcmp(argv[i], "--verify-range") == 0) {
+            _operation = Operation::VerifyRange;
+            mode = ParseMode::Range;
+        }
+        else if(strcmp(argv[i], "--compare") == 0) {
+            _operation = Operation::Compare;
+        }
+        else if(strcmp(argv[i], "--upgrade") == 0) {
+            _operation = Operation::Upgrade;
+        }
         else if(strcmp(argv[i], "-p") == 0) {
             mode = ParseMode::Password;
         }
+        else if(strcmp(argv[i], "--password-fd") == 0) {
+            mode = ParseMode::PasswordFd;
+        }
+        else if(strcmp(argv[i], "--password-file") == 0) {
+            mode = ParseMode::PasswordPath;
+        }
+        else if(strcmp(argv[i], "-r") == 0) {
+            _recursive = true;
+        }
+        else if(strcmp(argv[i], "-j") == 0) {
+            mode = ParseMode::Threads;
+        }
+        else if(strcmp(argv[i], "--digest") == 0) {
+            _digestMode = DigestMode::Text;
+        }
+        else if(strcmp(argv[i], "--digest-json") == 0) {
+            _digestMode = DigestMode::JSON;
+        }
+        else if(strcmp(argv[i], "--store-digest") == 0) {
+            _storeDigest = true;
+        }
+        else if(strcmp(argv[i], "--sparse") == 0) {
+            _sparse = true;
+        }
+        else if(strcmp(argv[i], "--resume") == 0) {
+            _resume = true;
+        }
+        else if(strcmp(argv[i], "--append") == 0) {
+            _append = true;
+        }
+        else if(strcmp(argv[i], "--parity") == 0) {
+            mode = ParseMode::Parity;
+        }
+        else if(strcmp(argv[i], "--volume-size") == 0) {
+            mode = ParseMode::VolumeSize;
+        }
+        else if(strcmp(argv[i], "--max-memory") == 0) {
+            mode = ParseMode::MaxMemory;
+        }
+        else if(strcmp(argv[i], "--cache") == 0) {
+            mode = ParseMode::Cache;
+        }
+        else if(strcmp(argv[i], "--rate") == 0) {
+            mode = ParseMode::Rate;
+        }
+        else if(strcmp(argv[i], "--cpu") == 0) {
+            mode = ParseMode::CPU;
+        }
+        else if(strcmp(argv[i], "--throttle-file") == 0) {
+            mode = ParseMode::ThrottlePath;
+        }
+        else if(strcmp(argv[i], "--nice-io") == 0) {
+            _niceIO = true;
+        }
+        else if(strcmp(argv[i], "--stats") == 0) {
+            _stats = true;
+        }
+        else if(strcmp(argv[i], "--stats-file") == 0) {
+            _stats = true;
+            mode = ParseMode::StatsPath;
+        }
         else if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             _showHelp = true;
             return Status::OK;
         }
-        else if(argv[i][0] == '-') {
+        else if(argv[i][0] == '-' && argv[i][1] != '\0') {
+            // A lone - is standard output
             return Status::UnknownOption;
         }
         else {
@@ -49,11 +266,30 @@ Arguments::Status Arguments::parse(int argc, char** argv) {
         }
     }
 
+    _paths.assign(plainArgs.begin(), plainArgs.end());
+
+    if(mode == ParseMode::PasswordFd || mode == ParseMode::PasswordPath || mode == ParseMode::Range || mode == ParseMode::StatsPath || mode == ParseMode::MaxMemory ||
+       mode == ParseMode::Cache || mode == ParseMode::Parity || mode == ParseMode::VolumeSize ||
+       mode == ParseMode::Rate || mode == ParseMode::CPU || mode == ParseMode::ThrottlePath) {
+        return Status::InvalidValue;
+    }
+
+    // Operations that work on files where they are take any number of them
+    if(_operation == Operation::Test || _operation == Operation::PrintRoot || _operation == Operation::VerifyRange ||
+       _operation == Operation::Upgrade) {
+        if(plainArgs.empty()) {
+            return Status::NoPath;
+        }
+
+        _inPath = plainArgs[0];
+        return Status::OK;
+    }
+
     if(plainArgs.size() < 2) {
         return Status::NoPath;
     }
 
-    if(plainArgs.size() > 3) {
+    if(plainArgs.size() > 3 || (_operation == Operation::Compare && plainArgs.size() != 2)) {
         return Status::UnknownOption;
     }
 
@@ -62,3 +298,44 @@ Arguments::Status Arguments::parse(int argc, char** argv) {
 
     return Status::OK;
 }
+
+bool Arguments::readPassword() {
+    if(_passwordFd < 0 && _passwordPath.empty()) return true;
+
+    const int fd = _passwordPath.empty()? _passwordFd : open(_passwordPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return false;
+
+    // Read into locked memory, one byte more than is allowed so that too long a password is
+    // noticed rather than cut short
+    SecureString buf(MAX_PASSWORD_SIZE + 1);
+    size_t len = 0;
+    bool ok = true;
+    while(len < buf.size()) {
+        const ssize_t got = read(fd, buf.data() + len, buf.size() - len);
+        if(got < 0 && errno == EINTR) continue;
+        if(got < 0) {
+            ok = false;
+            break;
+        }
+        if(got == 0) break;
+        len += static_cast<size_t>(got);
+    }
+    close(fd);
+
+    if(!ok || len > MAX_PASSWORD_SIZE) {
+        return false;
+    }
+
+    // As written by echo, or by hand in an editor
+    if(len > 0 && buf.data()[len - 1] == '\n') {
+        len -= 1;
+        if(len > 0 && buf.data()[len - 1] == '\r') len -= 1;
+    }
+
+    SecureString(buf.data(), len).moveInto(_password);
+    return true;
+}
+
+std::string Arguments::passwordSource() const {
+    return _passwordPath.empty()? "file descriptor " + std::to_string(_passwordFd) : _passwordPath;
+}
@@ -3,13 +3,27 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
+#include <vector>
+#include "fileio.hpp"
 #include "securestring.hpp"
+#include "throttle.hpp"
 
 enum class Operation {
     None,
     Encrypt,
-    Decrypt
+    Decrypt,
+    Test,
+
+    // Work with the Merkle index of format 2 files
+    PrintRoot,
+    VerifyRange,
+    Compare,
+
+    // Rewrite older files in the current format
+    Upgrade
 };
 
 class Arguments {
@@ -17,23 +31,111 @@ public:
     enum class Status {
         OK,
         UnknownOption,
+        InvalidValue,
         NoPath
     };
 
-    Arguments(): _showHelp(false), _operation(Operation::None) {}
+    enum class DigestMode {
+        None,
+        Text,
+        JSON
+    };
+
+    Arguments(): _passwordFd(-1), _showHelp(false), _recursive(false), _storeDigest(false), _sparse(false), _resume(false), _append(false), _dataShards(0), _parityShards(0), _volumeSize(0), _stats(false), _threads(0), _maxMemory(0), _cacheMode(fileio::CacheMode::Keep),
+                 _niceIO(false),
+                 _rangeFirst(0), _rangeLast(0), _digestMode(DigestMode::None), _operation(Operation::None) {}
 
     Status parse(int argc, char** argv);
 
     Operation operation() const { return _operation; }
     const std::string& inPath() const { return _inPath; }
     const std::string& outPath() const { return _outPath; }
+
+    // Every path given, for operations that accept any number of files
+    const std::vector<std::string>& paths() const { return _paths; }
     const SecureString& password() const { return _password; }
+
+    // Read the password from --password-fd or --password-file, if either was given, in place of
+    // any -p.  One trailing newline is dropped.  False if it could not be read.
+    bool readPassword();
+
+    // Where readPassword() reads from, for error messages
+    std::string passwordSource() const;
+
     bool showHelp() const { return _showHelp; }
+    bool recursive() const { return _recursive; }
+
+    // How to print the plaintext digest, and whether to store it in new files
+    DigestMode digestMode() const { return _digestMode; }
+    bool storeDigest() const { return _storeDigest; }
+
+    // Whether to leave blocks of zeros out of new files
+    bool sparse() const { return _sparse; }
+
+    // Whether to pick up an interrupted run's output
+    bool resume() const { return _resume; }
+    bool append() const { return _append; }
+
+    // The --parity stripe shape: parity blocks for every run of data blocks, or zero for none
+    uint8_t dataShards() const { return _dataShards; }
+    uint8_t parityShards() const { return _parityShards; }
+
+    // The --volume-size limit in bytes, or zero to write a single file
+    uint64_t volumeSize() const { return _volumeSize; }
+
+    // Zero if the user did not ask for a particular number of threads
+    size_t threads() const { return _threads; }
+
+    // The --max-memory budget in bytes, or zero if there is none
+    uint64_t maxMemory() const { return _maxMemory; }
+
+    // What --cache asked for
+    fileio::CacheMode cacheMode() const { return _cacheMode; }
+
+    // Whether to report timings, and where: an empty path means standard error
+    bool stats() const { return _stats; }
+    const std::string& statsPath() const { return _statsPath; }
+
+    // The limits from --rate and --cpu, and the control file that may change them
+    const Throttle::Limits& limits() const { return _limits; }
+    const std::string& throttlePath() const { return _throttlePath; }
+    bool throttled() const {
+        return _limits.readRate > 0 || _limits.writeRate > 0 || _limits.cpuPercent < 100 || !_throttlePath.empty();
+    }
+
+    // Whether to drop to the idle I/O class
+    bool niceIO() const { return _niceIO; }
+
+    // The inclusive block range given to --verify-range
+    uint64_t rangeFirst() const { return _rangeFirst; }
+    uint64_t rangeLast() const { return _rangeLast; }
 
 private:
+    int _passwordFd;
+    std::string _passwordPath;
     bool _showHelp;
+    bool _recursive;
+    bool _storeDigest;
+    bool _sparse;
+    bool _resume;
+    bool _append;
+    uint8_t _dataShards;
+    uint8_t _parityShards;
+    uint64_t _volumeSize;
+    bool _stats;
+    std::string _statsPath;
+    size_t _threads;
+    uint64_t _maxMemory;
+    fileio::CacheMode _cacheMode;
+    Throttle::Limits _limits;
+    std::string _throttlePath;
+    bool _niceIO;
+    uint64_t _rangeFirst;
+    uint64_t _rangeLast;
+    DigestMode _digestMode;
     SecureString _password;
     std::string _inPath;
     std::string _outPath;
+    std::vector<std::string> _paths;
     Operation _operation;
 };
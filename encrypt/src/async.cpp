@@ -0,0 +1,158 @@
+// async.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <new>
+#include <vector>
+#include <sodium.h>
+
+#include "async.hpp"
+
+void DeriveKeyJob::start(WorkStealingPool& pool, KeyCache& keys, int workFactor, Callback done) {
+    pool.submit([&keys, workFactor, done]() {
+        const DerivedKey* key = nullptr;
+        try {
+            key = &keys.get(workFactor);
+        }
+        catch(const std::bad_alloc&) {}
+
+        done(key);
+    });
+}
+
+struct AsyncEncryptStream::State {
+    State(WorkStealingPool& pool, KeyCache& keysIn, const WuffCryptFile::Options& optionsIn):
+        strand(std::make_shared<Strand>(pool)), keys(keysIn), options(optionsIn) {}
+
+    std::shared_ptr<Strand> strand;
+    KeyCache& keys;
+    const WuffCryptFile::Options options;
+
+    // Created by the first task on the strand, as that is where the KDF runs.  Left null if
+    // that, or anything after it, runs out of memory, as the stream cannot be trusted to carry on.
+    std::unique_ptr<StreamEncrypter> stream;
+    std::vector<uint8_t> out;
+};
+
+namespace {
+    // Run one step of a stream on its strand.  Exceptions must not reach the pool, which has no
+    // one to hand them to, and the only one we expect is running out of memory.
+    template <typename F>
+    WuffCryptFile::FileStatus guarded(F f) {
+        try {
+            return f();
+        }
+        catch(const std::bad_alloc&) {
+            return WuffCryptFile::FileStatus::NoMemory;
+        }
+    }
+}
+
+AsyncEncryptStream::AsyncEncryptStream(WorkStealingPool& pool, KeyCache& keys, const WuffCryptFile::Options& options):
+        _state(std::make_shared<State>(pool, keys, options)) {
+    std::shared_ptr<State> state = _state;
+    _state->strand->post([state]() {
+        guarded([&state]() {
+            state->stream.reset(new StreamEncrypter(state->keys.get(WuffCryptFile::WORK_FACTOR), state->options));
+            return WuffCryptFile::FileStatus::OK;
+        });
+    });
+}
+
+void AsyncEncryptStream::update(const uint8_t* in, size_t len, Callback done) {
+    std::shared_ptr<State> state = _state;
+    _state->strand->post([state, in, len, done]() {
+        size_t written = 0;
+        WuffCryptFile::FileStatus status = WuffCryptFile::FileStatus::NoMemory;
+        if(state->stream) {
+            status = guarded([&state, in, len, &written]() {
+                state->out.resize(state->stream->updateSize(len));
+                written = state->stream->update(in, len, state->out.data());
+                return WuffCryptFile::FileStatus::OK;
+            });
+        }
+        if(status != WuffCryptFile::FileStatus::OK) state->stream.reset();
+
+        Result result = {status, state->out.data(), written, nullptr};
+        done(result);
+    });
+}
+
+void AsyncEncryptStream::final(Callback done) {
+    std::shared_ptr<State> state = _state;
+    _state->strand->post([state, done]() {
+        size_t written = 0;
+        WuffCryptFile::FileStatus status = WuffCryptFile::FileStatus::NoMemory;
+        if(state->stream) {
+            status = guarded([&state, &written]() {
+                state->out.resize(state->stream->finalSize());
+                written = state->stream->final(state->out.data());
+                return WuffCryptFile::FileStatus::OK;
+            });
+        }
+        if(status != WuffCryptFile::FileStatus::OK) state->stream.reset();
+
+        const bool digesting = state->stream && (state->options.digest || state->options.storeDigest);
+        Result result = {status, state->out.data(), written, digesting? &state->stream->digest() : nullptr};
+        done(result);
+
+        std::vector<uint8_t>().swap(state->out);
+    });
+}
+
+struct AsyncDecryptStream::State {
+    State(WorkStealingPool& pool, KeyCache& keys, const WuffCryptFile::Options& optionsIn):
+        strand(std::make_shared<Strand>(pool)), options(optionsIn), stream(keys, options), outOfMemory(false) {}
+
+    // Hand out len bytes of plaintext, then wipe them
+    void deliver(WuffCryptFile::FileStatus status, size_t len, const PlaintextDigest* digest, const Callback& done) {
+        Result result = {status, out.data(), len, digest};
+        done(result);
+        if(len > 0) sodium_memzero(out.data(), len);
+    }
+
+    std::shared_ptr<Strand> strand;
+    const WuffCryptFile::Options options;
+    StreamDecrypter stream;
+    std::vector<uint8_t> out;
+
+    // Set once a step runs out of memory partway, after which the stream cannot be trusted
+    bool outOfMemory;
+};
+
+AsyncDecryptStream::AsyncDecryptStream(WorkStealingPool& pool, KeyCache& keys, const WuffCryptFile::Options& options):
+        _state(std::make_shared<State>(pool, keys, options)) {}
+
+void AsyncDecryptStream::update(const uint8_t* in, size_t len, Callback done) {
+    std::shared_ptr<State> state = _state;
+    _state->strand->post([state, in, len, done]() {
+        size_t written = 0;
+        WuffCryptFile::FileStatus status = WuffCryptFile::FileStatus::NoMemory;
+        if(!state->outOfMemory) {
+            status = guarded([&state, in, len, &written]() {
+                state->out.resize(state->stream.updateSize(len));
+                return state->stream.update(in, len, state->out.data(), written);
+            });
+        }
+        state->outOfMemory = status == WuffCryptFile::FileStatus::NoMemory;
+        state->deliver(status, written, nullptr, done);
+    });
+}
+
+void AsyncDecryptStream::final(Callback done) {
+    std::shared_ptr<State> state = _state;
+    _state->strand->post([state, done]() {
+        size_t written = 0;
+        WuffCryptFile::FileStatus status = WuffCryptFile::FileStatus::NoMemory;
+        if(!state->outOfMemory) {
+            status = guarded([&state, &written]() {
+                state->out.resize(state->stream.finalSize());
+                return state->stream.final(state->out.data(), written);
+            });
+        }
+        state->outOfMemory = status == WuffCryptFile::FileStatus::NoMemory;
+
+        const bool digested = status == WuffCryptFile::FileStatus::OK && state->options.digest;
+        state->deliver(status, written, digested? &state->stream.digest() : nullptr, done);
+        std::vector<uint8_t>().swap(state->out);
+    });
+}
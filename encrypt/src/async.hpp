@@ -0,0 +1,85 @@
+// async.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include "stream.hpp"
+#include "threadpool.hpp"
+#include "wuffcrypt.hpp"
+
+// Non-blocking encryption and decryption, for event loops that cannot wait on the KDF or on a
+// block.  Every call returns at once, having queued its work on a WorkStealingPool, and its
+// callback runs later, from a worker thread.  Each stream's work runs in order on a Strand of its
+// own, so any number of streams can share a handful of threads.  The pool and KeyCache must
+// outlive every callback; a stream object itself may be destroyed with work still queued.
+
+// Derives a key on a worker, so that the KDF's second or so of work does not block the caller
+class DeriveKeyJob {
+public:
+    typedef std::function<void(const DerivedKey* key)> Callback;
+
+    // done is called exactly once, from a worker thread, once the key has been derived or found
+    // in the cache, or with null if there was not enough memory to run the KDF
+    static void start(WorkStealingPool& pool, KeyCache& keys, int workFactor, Callback done);
+};
+
+// A StreamEncrypter on a pool.  The key is derived ahead of the first update, on the pool.  If
+// that, or any later step, runs out of memory, the callback is given FileStatus::NoMemory and
+// every later one fails the same way.
+class AsyncEncryptStream {
+public:
+    struct Result {
+        WuffCryptFile::FileStatus status;
+
+        // The output of the call, which is only valid during the callback
+        const uint8_t* out;
+        size_t len;
+
+        // From final(), with Options::digest or storeDigest; otherwise null
+        const PlaintextDigest* digest;
+    };
+
+    typedef std::function<void(const Result& result)> Callback;
+
+    AsyncEncryptStream(WorkStealingPool& pool, KeyCache& keys, const WuffCryptFile::Options& options = WuffCryptFile::Options());
+    AsyncEncryptStream(const AsyncEncryptStream& other) = delete;
+
+    // Queue len bytes of input, which must stay valid until done is called
+    void update(const uint8_t* in, size_t len, Callback done);
+
+    // Queue the end of the input.  Nothing may be queued afterwards.
+    void final(Callback done);
+
+private:
+    struct State;
+    std::shared_ptr<State> _state;
+};
+
+// A StreamDecrypter on a pool.  The key is derived on the pool once the header has arrived, so the
+// first update to reach past the header takes as long as the KDF.  Plaintext passed to a callback
+// is wiped once it returns.
+class AsyncDecryptStream {
+public:
+    typedef AsyncEncryptStream::Result Result;
+    typedef AsyncEncryptStream::Callback Callback;
+
+    AsyncDecryptStream(WorkStealingPool& pool, KeyCache& keys, const WuffCryptFile::Options& options = WuffCryptFile::Options());
+    AsyncDecryptStream(const AsyncDecryptStream& other) = delete;
+
+    // Queue len bytes of input, which must stay valid until done is called.  Once a call fails,
+    // every later one does too.  Running out of memory, for the KDF or otherwise, is reported as
+    // FileStatus::NoMemory.
+    void update(const uint8_t* in, size_t len, Callback done);
+
+    // Queue the end of the input; only a final() that succeeds vouches for the whole file.
+    // Nothing may be queued afterwards.
+    void final(Callback done);
+
+private:
+    struct State;
+    std::shared_ptr<State> _state;
+};
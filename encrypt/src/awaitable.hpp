@@ -0,0 +1,133 @@
+// awaitable.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+// C++20 coroutine wrappers for the streams in async.hpp.  WuffCrypt itself is C++11, so this
+// header is only for embedders building with coroutines; elsewhere it is empty.
+//
+//     awaitable::Output chunk = co_await awaitable::update(stream, buf, len);
+//
+// The coroutine resumes on the pool worker that finished the work, inside the stream's strand;
+// hop back to your own executor first if the rest of it should not run there.  Output is copied
+// out of the stream, so it stays valid for as long as the coroutine holds on to it, and is wiped
+// when it is freed.
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include <sodium.h>
+#include "async.hpp"
+
+namespace awaitable {
+    // Zeroes memory before handing it back, including the old buffer when a vector grows, so that
+    // decrypted output does not linger on the heap
+    template <typename T>
+    struct WipingAllocator {
+        typedef T value_type;
+
+        WipingAllocator() = default;
+        template <typename U> WipingAllocator(const WipingAllocator<U>&) {}
+
+        T* allocate(size_t n) { return std::allocator<T>().allocate(n); }
+
+        void deallocate(T* p, size_t n) {
+            sodium_memzero(p, n * sizeof(T));
+            std::allocator<T>().deallocate(p, n);
+        }
+
+        template <typename U> bool operator==(const WipingAllocator<U>&) const { return true; }
+    };
+
+    struct Output {
+        WuffCryptFile::FileStatus status;
+        std::vector<uint8_t, WipingAllocator<uint8_t>> data;
+
+        // Set by a final() that computed a digest
+        bool hasDigest;
+        PlaintextDigest digest;
+    };
+
+    // One queued update() or final() on an AsyncEncryptStream or AsyncDecryptStream
+    template <typename Stream>
+    class Step {
+    public:
+        Step(Stream& stream, const uint8_t* in, size_t len, bool last): _stream(stream), _in(in), _len(len), _last(last), _output() {}
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            auto done = [this, handle](const typename Stream::Result& result) {
+                _output.status = result.status;
+                _output.data.assign(result.out, result.out + result.len);
+                _output.hasDigest = result.digest != nullptr;
+                if(_output.hasDigest) _output.digest = *result.digest;
+                handle.resume();
+            };
+
+            if(_last) {
+                _stream.final(done);
+            }
+            else {
+                _stream.update(_in, _len, done);
+            }
+        }
+
+        Output await_resume() { return std::move(_output); }
+
+    private:
+        Stream& _stream;
+        const uint8_t* _in;
+        size_t _len;
+        bool _last;
+        Output _output;
+    };
+
+    // in must stay valid until the co_await completes, which it does by construction
+    template <typename Stream>
+    Step<Stream> update(Stream& stream, const uint8_t* in, size_t len) {
+        return Step<Stream>(stream, in, len, false);
+    }
+
+    template <typename Stream>
+    Step<Stream> final(Stream& stream) {
+        return Step<Stream>(stream, nullptr, 0, true);
+    }
+
+    // The key, derived on a worker
+    class Key {
+    public:
+        Key(WorkStealingPool& pool, KeyCache& keys, int workFactor): _pool(pool), _keys(keys), _workFactor(workFactor), _key(nullptr) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            DeriveKeyJob::start(_pool, _keys, _workFactor, [this, handle](const DerivedKey* key) {
+                _key = key;
+                handle.resume();
+            });
+        }
+
+        // Throws std::bad_alloc into the coroutine if the KDF could not get its memory
+        const DerivedKey& await_resume() {
+            if(_key == nullptr) throw std::bad_alloc();
+            return *_key;
+        }
+
+    private:
+        WorkStealingPool& _pool;
+        KeyCache& _keys;
+        int _workFactor;
+        const DerivedKey* _key;
+    };
+
+    inline Key deriveKey(WorkStealingPool& pool, KeyCache& keys, int workFactor = WuffCryptFile::WORK_FACTOR) {
+        return Key(pool, keys, workFactor);
+    }
+}
+
+#endif
@@ -0,0 +1,434 @@
+// blockio.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "fileio.hpp"
+
+// Plaintext sources and sinks for WuffCryptFile::encryptFrom() and decryptTo().  These are
+// template parameters rather than callbacks, so each call is inlined into the block loop.
+//
+// A source provides
+//     ssize_t read(uint8_t* buf, size_t len);
+// which fills buf, returning fewer than len bytes only at the end of the input, and -1 on error.
+// A source that already holds its data in memory can instead lend it, by declaring
+//     static const bool LENDS = true;
+//     const uint8_t* lend(size_t len, size_t& got);
+// which returns a pointer to the next got bytes (short only at the end), valid until the next
+// call, or nullptr on error.  Lent blocks are encrypted in place, without being copied.
+//
+// A sink provides
+//     bool write(const uint8_t* buf, size_t len);
+// or, to have blocks decrypted straight into its own memory,
+//     static const bool LENDS = true;
+//     uint8_t* borrow(size_t len);
+//     bool commit(size_t len);
+// where borrow() returns room for len bytes, or nullptr if there is none.  A sink that can
+// leave a hole in its output for a block of zeros, rather than have them written, declares
+//     static const bool HOLES = true;
+//     bool skip(size_t len);
+namespace blockio {
+    // Whether T declares LENDS = true
+    template <typename T>
+    struct lends {
+        template <typename U> static std::integral_constant<bool, U::LENDS> test(int);
+        template <typename U> static std::false_type test(...);
+        static const bool value = decltype(test<T>(0))::value;
+    };
+
+    // Whether T declares HOLES = true
+    template <typename T>
+    struct holes {
+        template <typename U> static std::integral_constant<bool, U::HOLES> test(int);
+        template <typename U> static std::false_type test(...);
+        static const bool value = decltype(test<T>(0))::value;
+    };
+
+    template <typename Source>
+    const uint8_t* nextBlock(Source& source, uint8_t* scratch, size_t len, size_t& got, std::true_type) {
+        (void)scratch;
+        return source.lend(len, got);
+    }
+
+    template <typename Source>
+    const uint8_t* nextBlock(Source& source, uint8_t* scratch, size_t len, size_t& got, std::false_type) {
+        ssize_t bytesRead = source.read(scratch, len);
+        if(bytesRead < 0) return nullptr;
+
+        got = static_cast<size_t>(bytesRead);
+        return scratch;
+    }
+
+    // The next len bytes of a source: lent, or read into scratch.  nullptr on error.
+    template <typename Source>
+    const uint8_t* nextBlock(Source& source, uint8_t* scratch, size_t len, size_t& got) {
+        return nextBlock(source, scratch, len, got, std::integral_constant<bool, lends<Source>::value>());
+    }
+
+    // Somewhere to decrypt len bytes bound for a sink: its own memory, or scratch
+    template <typename Sink>
+    uint8_t* blockSpace(Sink& sink, uint8_t* scratch, size_t len, std::true_type) {
+        (void)scratch;
+        return sink.borrow(len);
+    }
+
+    template <typename Sink>
+    uint8_t* blockSpace(Sink& sink, uint8_t* scratch, size_t len, std::false_type) {
+        (void)sink;
+        (void)len;
+        return scratch;
+    }
+
+    template <typename Sink>
+    uint8_t* blockSpace(Sink& sink, uint8_t* scratch, size_t len) {
+        return blockSpace(sink, scratch, len, std::integral_constant<bool, lends<Sink>::value>());
+    }
+
+    // Hand a block from blockSpace() over to the sink
+    template <typename Sink>
+    bool putBlock(Sink& sink, const uint8_t* buf, size_t len, std::true_type) {
+        (void)buf;
+        return sink.commit(len);
+    }
+
+    template <typename Sink>
+    bool putBlock(Sink& sink, const uint8_t* buf, size_t len, std::false_type) {
+        return sink.write(buf, len);
+    }
+
+    template <typename Sink>
+    bool putBlock(Sink& sink, const uint8_t* buf, size_t len) {
+        return putBlock(sink, buf, len, std::integral_constant<bool, lends<Sink>::value>());
+    }
+
+    // Hand len zero bytes to the sink: as a hole, if it can make one
+    template <typename Sink>
+    bool putZeros(Sink& sink, uint8_t* scratch, size_t len, std::true_type) {
+        (void)scratch;
+        return sink.skip(len);
+    }
+
+    template <typename Sink>
+    bool putZeros(Sink& sink, uint8_t* scratch, size_t len, std::false_type) {
+        uint8_t* out = blockSpace(sink, scratch, len);
+        if(out == nullptr) return false;
+
+        memset(out, 0, len);
+        return putBlock(sink, out, len);
+    }
+
+    template <typename Sink>
+    bool putZeros(Sink& sink, uint8_t* scratch, size_t len) {
+        return putZeros(sink, scratch, len, std::integral_constant<bool, holes<Sink>::value>());
+    }
+
+    // A stdio stream, such as a pipe or terminal.  With dropCache, a stream that turns out to
+    // be a file has its pages evicted from the page cache once they have been read or written.
+    class FileSource {
+    public:
+        explicit FileSource(FILE* f, bool dropCache = false): _f(f), _offset(0), _drop(dropCache? fileno(f) : -1, false) {}
+
+        ssize_t read(uint8_t* buf, size_t len) {
+            size_t bytesRead = fread(buf, sizeof(uint8_t), len, _f);
+            if(bytesRead < len && ferror(_f)) return -1;
+
+            _offset += bytesRead;
+            _drop.advanceTo(_offset);
+            return static_cast<ssize_t>(bytesRead);
+        }
+
+    private:
+        FILE* _f;
+        uint64_t _offset;
+        fileio::DropBehind _drop;
+    };
+
+    // Zeros become holes when the stream is a regular file, and are written out otherwise.
+    //
+    // With resume, the stream must be a file opened for update at its start, holding what an
+    // interrupted run wrote.  Anything already there that matches is read rather than written,
+    // so only what is missing or different is rewritten.
+    class FileSink {
+    public:
+        static const bool HOLES = true;
+
+        explicit FileSink(FILE* f, bool dropCache = false, bool resume = false): _f(f), _offset(0), _existing(0), _kept(0),
+                                                                              _dropCache(dropCache), _truncate(true),
+                                                                              _drop(dropCache? fileno(f) : -1, true) {
+            uint64_t size = 0;
+            _seekable = fileio::regularFileSize(fileno(f), size);
+            if(resume && _seekable) _existing = size;
+        }
+
+        bool write(const uint8_t* buf, size_t len) {
+            if(_offset < _existing && matches(buf, len)) {
+                _offset += len;
+                _kept += len;
+                return true;
+            }
+
+            if(fwrite(buf, sizeof(uint8_t), len, _f) != len) return false;
+            _offset += len;
+            if(!_dropCache) return true;
+
+            // The data has to reach the kernel before it can be written back and dropped
+            if(fflush(_f) != 0) return false;
+            _drop.advanceTo(_offset);
+            return true;
+        }
+
+        bool skip(size_t len) {
+            // Seeking would leave whatever an earlier output had there
+            if(!_seekable || _offset < _existing) {
+                static const uint8_t zeros[4096] = {};
+                for(size_t done = 0; done < len; done += sizeof(zeros)) {
+                    if(!write(zeros, std::min(sizeof(zeros), len - done))) return false;
+                }
+                return true;
+            }
+
+            if(fflush(_f) != 0 || fseeko(_f, static_cast<off_t>(len), SEEK_CUR) != 0) return false;
+            _offset += len;
+            return true;
+        }
+
+        // Write from start onwards, as one piece of a larger file, instead of from the beginning.
+        // What is already there is checked and kept as if resuming, so that no earlier contents
+        // survive in holes.  Unless atEnd, finish() leaves whatever follows the piece alone.
+        // Call before anything is written; only regular files can be written this way.
+        bool place(uint64_t start, bool atEnd) {
+            uint64_t size = 0;
+            if(!_seekable || !fileio::regularFileSize(fileno(_f), size) || fseeko(_f, static_cast<off_t>(start), SEEK_SET) != 0) {
+                return false;
+            }
+
+            _offset = start;
+            _existing = size;
+            _truncate = atEnd;
+            return true;
+        }
+
+        // Flush, and drop the tail of the output too.  Call before closing the stream.
+        bool finish() {
+            if(fflush(_f) != 0) return false;
+
+            // A file ends where the output does, even after a final hole, which seeking past the
+            // end does not create, or over an earlier, longer output being resumed.  A piece
+            // placed before the end only makes sure the file reaches past it.
+            if(_seekable) {
+                const off_t end = ftello(_f);
+                uint64_t size = 0;
+                const bool extend = _truncate || (fileio::regularFileSize(fileno(_f), size) && size < static_cast<uint64_t>(end));
+                if(extend && ftruncate(fileno(_f), end) != 0) return false;
+            }
+
+            _drop.finish();
+            return true;
+        }
+
+        // With resume, how many bytes were found already in place
+        uint64_t kept() const { return _kept; }
+
+    private:
+        // Whether the file already holds buf at the current position.  Leaves the position after
+        // it if so, and where it was if not.
+        bool matches(const uint8_t* buf, size_t len) {
+            uint8_t chunk[16384];
+            bool same = true;
+            for(size_t done = 0; done < len && same; done += sizeof(chunk)) {
+                const size_t n = std::min(sizeof(chunk), len - done);
+                same = fread(chunk, sizeof(uint8_t), n, _f) == n && memcmp(chunk, buf + done, n) == 0;
+            }
+
+            // Also required by stdio between a read and a write
+            const uint64_t to = same? _offset + len : _offset;
+            return fseeko(_f, static_cast<off_t>(to), SEEK_SET) == 0 && same;
+        }
+
+        FILE* _f;
+        uint64_t _offset;
+        uint64_t _existing;
+        uint64_t _kept;
+        bool _dropCache;
+        bool _truncate;
+        bool _seekable;
+        fileio::DropBehind _drop;
+    };
+
+    // A raw descriptor, read and written without stdio's extra copy
+    class FdSource {
+    public:
+        explicit FdSource(int fd): _fd(fd) {}
+
+        ssize_t read(uint8_t* buf, size_t len) {
+            size_t total = 0;
+            while(total < len) {
+                ssize_t n = ::read(_fd, buf + total, len - total);
+                if(n < 0 && errno == EINTR) continue;
+                if(n < 0) return -1;
+                if(n == 0) break;
+                total += static_cast<size_t>(n);
+            }
+
+            return static_cast<ssize_t>(total);
+        }
+
+    private:
+        int _fd;
+    };
+
+    class FdSink {
+    public:
+        explicit FdSink(int fd): _fd(fd) {}
+
+        bool write(const uint8_t* buf, size_t len) {
+            size_t total = 0;
+            while(total < len) {
+                ssize_t n = ::write(_fd, buf + total, len - total);
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0) return false;
+                total += static_cast<size_t>(n);
+            }
+
+            return true;
+        }
+
+    private:
+        int _fd;
+    };
+
+    // Data already in memory, lent block by block
+    class MemorySource {
+    public:
+        static const bool LENDS = true;
+
+        MemorySource(const uint8_t* data, size_t len): _data(data), _len(len), _offset(0) {}
+
+        const uint8_t* lend(size_t len, size_t& got) {
+            got = (len < _len - _offset)? len : _len - _offset;
+            const uint8_t* block = _data + _offset;
+            _offset += got;
+            return block;
+        }
+
+    private:
+        const uint8_t* _data;
+        size_t _len;
+        size_t _offset;
+    };
+
+    // A file mapped into memory, and lent like a MemorySource
+    class MappedSource {
+    public:
+        static const bool LENDS = true;
+
+        explicit MappedSource(const std::string& path): _map(nullptr), _len(0), _offset(0), _ok(false) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if(fd < 0) return;
+
+            struct stat st;
+            if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                _len = static_cast<size_t>(st.st_size);
+                if(_len == 0) {
+                    _ok = true;
+                }
+                else {
+                    void* map = mmap(nullptr, _len, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if(map != MAP_FAILED) {
+                        _map = static_cast<const uint8_t*>(map);
+                        madvise(map, _len, MADV_SEQUENTIAL);
+                        _ok = true;
+                    }
+                }
+            }
+
+            close(fd);
+        }
+
+        MappedSource(const MappedSource& other) = delete;
+
+        ~MappedSource() {
+            if(_map != nullptr) munmap(const_cast<uint8_t*>(_map), _len);
+        }
+
+        // False if the file could not be opened or mapped
+        bool ok() const { return _ok; }
+
+        const uint8_t* lend(size_t len, size_t& got) {
+            static const uint8_t empty = 0;
+            if(!_ok) return nullptr;
+
+            got = (len < _len - _offset)? len : _len - _offset;
+            const uint8_t* block = (_map != nullptr)? _map + _offset : &empty;
+            _offset += got;
+            return block;
+        }
+
+    private:
+        const uint8_t* _map;
+        size_t _len;
+        size_t _offset;
+        bool _ok;
+    };
+
+    // Appends to a vector, decrypting directly into its storage
+    class MemorySink {
+    public:
+        static const bool LENDS = true;
+
+        explicit MemorySink(std::vector<uint8_t>& out): _out(out), _start(0) {}
+
+        uint8_t* borrow(size_t len) {
+            _start = _out.size();
+            _out.resize(_start + len);
+            return _out.data() + _start;
+        }
+
+        bool commit(size_t len) {
+            _out.resize(_start + len);
+            return true;
+        }
+
+    private:
+        std::vector<uint8_t>& _out;
+        size_t _start;
+    };
+
+    // Fills a fixed span of caller-owned memory, failing if the plaintext does not fit
+    class SpanSink {
+    public:
+        static const bool LENDS = true;
+
+        SpanSink(uint8_t* data, size_t capacity): _data(data), _capacity(capacity), _size(0) {}
+
+        uint8_t* borrow(size_t len) {
+            if(len > _capacity - _size) return nullptr;
+            return _data + _size;
+        }
+
+        bool commit(size_t len) {
+            _size += len;
+            return true;
+        }
+
+        size_t size() const { return _size; }
+
+    private:
+        uint8_t* _data;
+        size_t _capacity;
+        size_t _size;
+    };
+}
@@ -0,0 +1,29 @@
+// budget.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include "budget.hpp"
+#include "securearena.hpp"
+
+namespace budget {
+    uint64_t kdfBytes(int workFactor) {
+        // The reference scrypt's V, XY and B arrays, with r = 8 and p = 1
+        const uint64_t r = 8;
+        return (128 * r << workFactor) + 256 * r + 128 * r;
+    }
+
+    uint64_t minimum(int workFactor) {
+        return BASELINE + kdfBytes(workFactor) + slots(1) * SecureArena::BLOCK_SLOT_SIZE;
+    }
+
+    size_t threads(uint64_t budget, int workFactor, size_t wanted) {
+        if(budget < minimum(workFactor)) return 0;
+
+        const uint64_t perThread = WORKER_SLOTS * SecureArena::BLOCK_SLOT_SIZE;
+        const uint64_t fit = 1 + (budget - minimum(workFactor)) / perThread;
+        return (fit < wanted)? static_cast<size_t>(fit) : wanted;
+    }
+
+    size_t slots(size_t threads) {
+        return WORKER_SLOTS * threads + MAIN_SLOTS;
+    }
+}
@@ -0,0 +1,34 @@
+// budget.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fitting a run into --max-memory.  Almost everything wuffcrypt allocates is either the scrypt
+// working set, of which there is only ever one at a time, or a block buffer from the SecureArena.
+// The budget pays for the KDF first, then for the buffers the main thread may hold, and what is
+// left decides how many workers can run.
+namespace budget {
+    // Code, stacks, stdio, and per-file bookkeeping such as tag lists
+    const uint64_t BASELINE = 8 * 1024 * 1024;
+
+    // Block buffers held by the main thread when it streams a pipe
+    const size_t MAIN_SLOTS = 4;
+
+    // Block buffers held by each worker: a plaintext and a ciphertext block
+    const size_t WORKER_SLOTS = 2;
+
+    // The scrypt working set at a given work factor
+    uint64_t kdfBytes(int workFactor);
+
+    // The smallest budget that can run one worker
+    uint64_t minimum(int workFactor);
+
+    // How many workers, up to wanted, fit in a budget.  Zero if not even one does.
+    size_t threads(uint64_t budget, int workFactor, size_t wanted);
+
+    // The block buffers to reserve for a number of workers
+    size_t slots(size_t threads);
+}
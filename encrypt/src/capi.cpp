@@ -0,0 +1,259 @@
+// capi.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <string.h>
+#include <new>
+#include <sodium.h>
+
+#include "stream.hpp"
+#include "wuffcrypt.h"
+#include "wuffcrypt.hpp"
+
+struct wuffcrypt_key {
+    wuffcrypt_key(const char* str, size_t len): password(len), keys(password) {
+        memcpy(password.data(), str, len);
+    }
+
+    SecureString password;
+    KeyCache keys;
+};
+
+struct wuffcrypt_encrypt_stream {
+    wuffcrypt_encrypt_stream(const DerivedKey& key, const WuffCryptFile::Options& options): stream(key, options) {}
+
+    StreamEncrypter stream;
+};
+
+struct wuffcrypt_decrypt_stream {
+    wuffcrypt_decrypt_stream(KeyCache& keys, const WuffCryptFile::Options& options): stream(keys, options) {}
+
+    StreamDecrypter stream;
+};
+
+namespace {
+    WuffCryptFile::Options optionsFor(int flags) {
+        WuffCryptFile::Options options;
+        options.digest = (flags & WUFFCRYPT_DIGEST) != 0;
+        options.storeDigest = (flags & WUFFCRYPT_STORE_DIGEST) != 0;
+        return options;
+    }
+
+    wuffcrypt_status toStatus(WuffCryptFile::FileStatus status) {
+        switch(status) {
+            case WuffCryptFile::FileStatus::OK: return WUFFCRYPT_OK;
+            case WuffCryptFile::FileStatus::InvalidFileType: return WUFFCRYPT_INVALID_FILE_TYPE;
+            case WuffCryptFile::FileStatus::CorruptHeader: return WUFFCRYPT_CORRUPT_HEADER;
+            case WuffCryptFile::FileStatus::WrongVersion: return WUFFCRYPT_WRONG_VERSION;
+            case WuffCryptFile::FileStatus::Truncated: return WUFFCRYPT_TRUNCATED;
+            case WuffCryptFile::FileStatus::NoMemory: return WUFFCRYPT_NO_MEMORY;
+
+            // Nothing here opens, reads or writes files, so nothing else should come up
+            default: return WUFFCRYPT_VERIFICATION_FAILED;
+        }
+    }
+
+    // C callers cannot catch exceptions, and the only one we expect is running out of memory,
+    // including scrypt failing to get the memory for the KDF
+    template <typename F>
+    wuffcrypt_status guarded(F f) {
+        try {
+            return f();
+        }
+        catch(const std::bad_alloc&) {
+            return WUFFCRYPT_NO_MEMORY;
+        }
+    }
+
+    wuffcrypt_status encryptFinal(StreamEncrypter& stream, uint8_t* out, size_t outLen, size_t* written) {
+        if(stream.finished()) return WUFFCRYPT_MISUSE;
+        if(outLen < stream.finalSize()) return WUFFCRYPT_BUFFER_TOO_SMALL;
+
+        *written = stream.final(out);
+        return WUFFCRYPT_OK;
+    }
+
+    wuffcrypt_status decryptFinal(StreamDecrypter& stream, uint8_t* out, size_t outLen, size_t* written) {
+        if(stream.finished()) return WUFFCRYPT_MISUSE;
+        if(outLen < stream.finalSize()) return WUFFCRYPT_BUFFER_TOO_SMALL;
+
+        return toStatus(stream.final(out, *written));
+    }
+}
+
+extern "C" {
+
+int wuffcrypt_init(void) {
+    return (sodium_init() < 0)? -1 : 0;
+}
+
+unsigned wuffcrypt_api_version(void) {
+    return WUFFCRYPT_API_VERSION;
+}
+
+const char* wuffcrypt_version(void) {
+    return WUFFCRYPT_VERSION;
+}
+
+const char* wuffcrypt_status_string(wuffcrypt_status status) {
+    switch(status) {
+        case WUFFCRYPT_OK: return "OK";
+        case WUFFCRYPT_INVALID_FILE_TYPE: return "not a wuffcrypt file";
+        case WUFFCRYPT_CORRUPT_HEADER: return "corrupt header";
+        case WUFFCRYPT_VERIFICATION_FAILED: return "verification failed";
+        case WUFFCRYPT_WRONG_VERSION: return "unsupported format version";
+        case WUFFCRYPT_TRUNCATED: return "truncated";
+        case WUFFCRYPT_BUFFER_TOO_SMALL: return "output buffer too small";
+        case WUFFCRYPT_MISUSE: return "library misuse";
+        case WUFFCRYPT_NO_MEMORY: return "out of memory";
+    }
+
+    return "unknown status";
+}
+
+wuffcrypt_key* wuffcrypt_key_new(const char* password, size_t len) {
+    if(password == nullptr && len > 0) return nullptr;
+
+    try {
+        return new wuffcrypt_key(password, len);
+    }
+    catch(const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void wuffcrypt_key_free(wuffcrypt_key* key) {
+    delete key;
+}
+
+wuffcrypt_encrypt_stream* wuffcrypt_encrypt_new(wuffcrypt_key* key, int flags) {
+    if(key == nullptr) return nullptr;
+
+    try {
+        return new wuffcrypt_encrypt_stream(key->keys.get(WuffCryptFile::WORK_FACTOR), optionsFor(flags));
+    }
+    catch(const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+size_t wuffcrypt_encrypt_update_size(const wuffcrypt_encrypt_stream* stream, size_t len) {
+    return (stream == nullptr)? 0 : stream->stream.updateSize(len);
+}
+
+wuffcrypt_status wuffcrypt_encrypt_update(wuffcrypt_encrypt_stream* stream, const uint8_t* in, size_t len,
+                                          uint8_t* out, size_t out_len, size_t* written) {
+    if(stream == nullptr || written == nullptr || stream->stream.finished()) return WUFFCRYPT_MISUSE;
+    if(out_len < stream->stream.updateSize(len)) return WUFFCRYPT_BUFFER_TOO_SMALL;
+
+    return guarded([&]() {
+        *written = stream->stream.update(in, len, out);
+        return WUFFCRYPT_OK;
+    });
+}
+
+size_t wuffcrypt_encrypt_final_size(const wuffcrypt_encrypt_stream* stream) {
+    return (stream == nullptr || stream->stream.finished())? 0 : stream->stream.finalSize();
+}
+
+wuffcrypt_status wuffcrypt_encrypt_final(wuffcrypt_encrypt_stream* stream, uint8_t* out, size_t out_len, size_t* written) {
+    if(stream == nullptr || written == nullptr) return WUFFCRYPT_MISUSE;
+    return guarded([&]() { return encryptFinal(stream->stream, out, out_len, written); });
+}
+
+wuffcrypt_status wuffcrypt_encrypt_digest(const wuffcrypt_encrypt_stream* stream, uint8_t* out) {
+    if(stream == nullptr || out == nullptr || !stream->stream.digest().finished()) return WUFFCRYPT_MISUSE;
+
+    memcpy(out, stream->stream.digest().value(), WUFFCRYPT_DIGEST_BYTES);
+    return WUFFCRYPT_OK;
+}
+
+void wuffcrypt_encrypt_free(wuffcrypt_encrypt_stream* stream) {
+    delete stream;
+}
+
+wuffcrypt_decrypt_stream* wuffcrypt_decrypt_new(wuffcrypt_key* key, int flags) {
+    if(key == nullptr) return nullptr;
+
+    try {
+        return new wuffcrypt_decrypt_stream(key->keys, optionsFor(flags));
+    }
+    catch(const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+size_t wuffcrypt_decrypt_update_size(const wuffcrypt_decrypt_stream* stream, size_t len) {
+    return (stream == nullptr)? 0 : stream->stream.updateSize(len);
+}
+
+wuffcrypt_status wuffcrypt_decrypt_update(wuffcrypt_decrypt_stream* stream, const uint8_t* in, size_t len,
+                                          uint8_t* out, size_t out_len, size_t* written) {
+    if(stream == nullptr || written == nullptr || stream->stream.finished()) return WUFFCRYPT_MISUSE;
+    if(out_len < stream->stream.updateSize(len)) return WUFFCRYPT_BUFFER_TOO_SMALL;
+
+    return guarded([&]() { return toStatus(stream->stream.update(in, len, out, *written)); });
+}
+
+size_t wuffcrypt_decrypt_final_size(const wuffcrypt_decrypt_stream* stream) {
+    return (stream == nullptr || stream->stream.finished())? 0 : stream->stream.finalSize();
+}
+
+wuffcrypt_status wuffcrypt_decrypt_final(wuffcrypt_decrypt_stream* stream, uint8_t* out, size_t out_len, size_t* written) {
+    if(stream == nullptr || written == nullptr) return WUFFCRYPT_MISUSE;
+    return guarded([&]() { return decryptFinal(stream->stream, out, out_len, written); });
+}
+
+wuffcrypt_status wuffcrypt_decrypt_digest(const wuffcrypt_decrypt_stream* stream, uint8_t* out) {
+    if(stream == nullptr || out == nullptr || !stream->stream.digest().finished()) return WUFFCRYPT_MISUSE;
+
+    memcpy(out, stream->stream.digest().value(), WUFFCRYPT_DIGEST_BYTES);
+    return WUFFCRYPT_OK;
+}
+
+void wuffcrypt_decrypt_free(wuffcrypt_decrypt_stream* stream) {
+    delete stream;
+}
+
+uint64_t wuffcrypt_encrypted_size(uint64_t len, int flags) {
+    return StreamEncrypter::encryptedSize(len, optionsFor(flags));
+}
+
+wuffcrypt_status wuffcrypt_encrypt_buffer(wuffcrypt_key* key, int flags, const uint8_t* in, size_t len,
+                                          uint8_t* out, size_t out_len, size_t* written) {
+    if(key == nullptr || written == nullptr) return WUFFCRYPT_MISUSE;
+    if(out_len < wuffcrypt_encrypted_size(len, flags)) return WUFFCRYPT_BUFFER_TOO_SMALL;
+
+    return guarded([&]() {
+        StreamEncrypter stream(key->keys.get(WuffCryptFile::WORK_FACTOR), optionsFor(flags));
+        *written = stream.update(in, len, out);
+        *written += stream.final(out + *written);
+        return WUFFCRYPT_OK;
+    });
+}
+
+wuffcrypt_status wuffcrypt_decrypt_buffer(wuffcrypt_key* key, const uint8_t* in, size_t len,
+                                          uint8_t* out, size_t out_len, size_t* written) {
+    if(key == nullptr || written == nullptr) return WUFFCRYPT_MISUSE;
+    if(out_len < len) return WUFFCRYPT_BUFFER_TOO_SMALL;
+
+    *written = 0;
+    wuffcrypt_status status = guarded([&]() {
+        StreamDecrypter stream(key->keys);
+        size_t finalWritten = 0;
+        wuffcrypt_status result = toStatus(stream.update(in, len, out, *written));
+        if(result == WUFFCRYPT_OK) {
+            result = toStatus(stream.final(out + *written, finalWritten));
+            *written += finalWritten;
+        }
+        return result;
+    });
+
+    if(status != WUFFCRYPT_OK) {
+        sodium_memzero(out, out_len);
+        *written = 0;
+    }
+
+    return status;
+}
+
+}
@@ -0,0 +1,63 @@
+// digest.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <string.h>
+#include <sodium.h>
+#include "digest.hpp"
+#include "util.hpp"
+
+const size_t PlaintextDigest::BYTES;
+const char* const PlaintextDigest::ALGORITHM = "wuffcrypt-blake2b-256";
+
+void PlaintextDigest::leaf(const uint8_t* block, size_t len, uint8_t* out) {
+    const uint8_t domain = 0x00;
+
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, nullptr, 0, BYTES);
+    crypto_generichash_update(&state, &domain, 1);
+    crypto_generichash_update(&state, block, len);
+    crypto_generichash_final(&state, out, BYTES);
+}
+
+void PlaintextDigest::add(const uint8_t* leafHash) {
+    verify(!_finished);
+
+    uint8_t input[1 + 2*BYTES];
+    input[0] = 0x01;
+    memcpy(input + 1, _chain, BYTES);
+    memcpy(input + 1 + BYTES, leafHash, BYTES);
+
+    crypto_generichash(_chain, BYTES, input, sizeof(input), nullptr, 0);
+    _blocks += 1;
+}
+
+void PlaintextDigest::reset(const uint8_t* fromChain, uint64_t blocks) {
+    if(fromChain != nullptr) {
+        memcpy(_chain, fromChain, BYTES);
+    }
+    else {
+        memset(_chain, 0, BYTES);
+    }
+
+    memset(_value, 0, BYTES);
+    _blocks = blocks;
+    _finished = false;
+}
+
+void PlaintextDigest::finish(uint64_t length) {
+    uint8_t input[1 + BYTES + 8];
+    input[0] = 0x02;
+    memcpy(input + 1, _chain, BYTES);
+    for(int i = 0; i < 8; i += 1) {
+        input[1 + BYTES + i] = static_cast<uint8_t>(length >> (8*i));
+    }
+
+    crypto_generichash(_value, BYTES, input, sizeof(input), nullptr, 0);
+    _finished = true;
+}
+
+std::string PlaintextDigest::hex() const {
+    char out[2*BYTES + 1];
+    sodium_bin2hex(out, sizeof(out), _value, BYTES);
+    return std::string(out);
+}
@@ -0,0 +1,51 @@
+// digest.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// A digest of a file's plaintext, computed as it streams through wuffcrypt.  Each block is hashed
+// on its own with BLAKE2b, so blocks can be hashed in parallel and in any order; the block hashes
+// are then chained together in order, and the chain finished off with the total length:
+//
+//     leaf(i)  = BLAKE2b-256(0x00 || block i)
+//     chain(0) = 32 zero bytes
+//     chain(i+1) = BLAKE2b-256(0x01 || chain(i) || leaf(i))
+//     digest   = BLAKE2b-256(0x02 || chain(n) || length as 64-bit little endian)
+class PlaintextDigest {
+public:
+    static const size_t BYTES = 32;
+    static const char* const ALGORITHM;
+
+    PlaintextDigest(): _blocks(0), _finished(false) {
+        reset();
+    }
+
+    // Hash one block.  Thread-safe; does not touch any digest.
+    static void leaf(const uint8_t* block, size_t len, uint8_t* out);
+
+    // Feed in the next block's leaf hash
+    void add(const uint8_t* leafHash);
+
+    // Start over, optionally continuing from a chain value saved by chain()
+    void reset(const uint8_t* fromChain = nullptr, uint64_t blocks = 0);
+
+    void finish(uint64_t length);
+
+    // The chain value after the blocks added so far
+    const uint8_t* chain() const { return _chain; }
+    uint64_t blocks() const { return _blocks; }
+
+    bool finished() const { return _finished; }
+    const uint8_t* value() const { return _value; }
+    std::string hex() const;
+
+private:
+    uint8_t _chain[BYTES];
+    uint8_t _value[BYTES];
+    uint64_t _blocks;
+    bool _finished;
+};
@@ -0,0 +1,286 @@
+// fileio.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "fileio.hpp"
+
+ssize_t fileio::preadAll(int fd, uint8_t* buf, size_t len, uint64_t offset) {
+    size_t total = 0;
+    while(total < len) {
+        ssize_t n = pread(fd, buf + total, len - total, static_cast<off_t>(offset + total));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        if(n == 0) break;
+        total += static_cast<size_t>(n);
+    }
+
+    return static_cast<ssize_t>(total);
+}
+
+bool fileio::pwriteAll(int fd, const uint8_t* buf, size_t len, uint64_t offset) {
+    size_t total = 0;
+    while(total < len) {
+        ssize_t n = pwrite(fd, buf + total, len - total, static_cast<off_t>(offset + total));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+
+        total += static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+namespace {
+    // Skip past what a vectored write managed, which may end partway through a buffer
+    void consume(struct iovec*& iov, int& count, size_t written) {
+        while(count > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov += 1;
+            count -= 1;
+        }
+
+        if(count > 0) {
+            iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+bool fileio::pwritevAll(int fd, struct iovec* iov, int count, uint64_t offset) {
+    while(count > 0) {
+        ssize_t n = pwritev(fd, iov, (count < IOV_MAX)? count : IOV_MAX, static_cast<off_t>(offset));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+
+        offset += static_cast<uint64_t>(n);
+        consume(iov, count, static_cast<size_t>(n));
+    }
+
+    return true;
+}
+
+bool fileio::writevAll(int fd, struct iovec* iov, int count) {
+    while(count > 0) {
+        ssize_t n = writev(fd, iov, (count < IOV_MAX)? count : IOV_MAX);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+
+        consume(iov, count, static_cast<size_t>(n));
+    }
+
+    return true;
+}
+
+bool fileio::preallocate(int fd, uint64_t len) {
+#ifdef __linux__
+    // Not posix_fallocate(), which falls back to writing zeroes over the whole length
+    return fallocate(fd, 0, 0, static_cast<off_t>(len)) == 0;
+#else
+    (void)fd;
+    (void)len;
+    return false;
+#endif
+}
+
+bool fileio::idlePriority() {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    // glibc has no wrapper, nor the constants from linux/ioprio.h
+    const int IOPRIO_WHO_PROCESS = 1;
+    const int IOPRIO_CLASS_IDLE = 3;
+    const int IOPRIO_CLASS_SHIFT = 13;
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == 0;
+#else
+    return false;
+#endif
+}
+
+bool fileio::allZero(const uint8_t* buf, size_t len) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    // Four vectors at a time, bailing out at the first set byte: most data is not zero, and
+    // says so in its first few bytes
+    for(; i + 64 <= len; i += 64) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(buf + i);
+        const __m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                                         _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff) return false;
+    }
+#else
+    for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        if(word != 0) return false;
+    }
+#endif
+
+    for(; i < len; i += 1) {
+        if(buf[i] != 0) return false;
+    }
+
+    return true;
+}
+
+void fileio::findHoles(int fd, uint64_t size, std::vector<std::pair<uint64_t, uint64_t>>& holes) {
+    holes.clear();
+
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+    uint64_t offset = 0;
+    while(offset < size) {
+        const off_t data = lseek(fd, static_cast<off_t>(offset), SEEK_DATA);
+        if(data < 0) {
+            // ENXIO: nothing but hole from here to the end.  Anything else: no support.
+            if(errno == ENXIO) holes.push_back(std::make_pair(offset, size - offset));
+            break;
+        }
+
+        const uint64_t dataStart = std::min(static_cast<uint64_t>(data), size);
+        if(dataStart > offset) holes.push_back(std::make_pair(offset, dataStart - offset));
+        if(dataStart >= size) break;
+
+        const off_t hole = lseek(fd, static_cast<off_t>(dataStart), SEEK_HOLE);
+        if(hole < 0) break;
+        offset = static_cast<uint64_t>(hole);
+    }
+#else
+    (void)fd;
+    (void)size;
+#endif
+}
+
+bool fileio::regularFileSize(int fd, uint64_t& size) {
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    size = static_cast<uint64_t>(st.st_size);
+    return true;
+}
+
+bool fileio::syncParent(const std::string& path) {
+    const size_t slash = path.rfind('/');
+    const std::string dir = (slash == std::string::npos)? "." : (slash == 0)? "/" : path.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+
+    const bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+int fileio::openDirect(const std::string& path, bool& direct) {
+    direct = false;
+#ifdef O_DIRECT
+    // tmpfs, among others, refuses O_DIRECT outright
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+    if(fd >= 0) {
+        direct = true;
+        return fd;
+    }
+#endif
+
+    return open(path.c_str(), O_RDONLY);
+}
+
+ssize_t fileio::preadDirect(int fd, uint8_t* buf, size_t len, uint64_t offset) {
+#ifdef O_DIRECT
+    size_t total = 0;
+    while(total < len) {
+        ssize_t n = pread(fd, buf + total, len - total, static_cast<off_t>(offset + total));
+        if(n < 0 && errno == EINTR) continue;
+
+        if(n < 0 && errno == EINVAL) {
+            // Some filesystems accept O_DIRECT at open, then want a larger alignment than ours
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            ssize_t rest = preadAll(fd, buf + total, len - total, offset + total);
+            if(rest < 0) return -1;
+            return static_cast<ssize_t>(total) + rest;
+        }
+
+        if(n < 0) return -1;
+        total += static_cast<size_t>(n);
+
+        // A read that stops short of alignment has hit the end of the file, and another one at
+        // the unaligned offset would only fail
+        if(n == 0 || static_cast<size_t>(n) % DIRECT_ALIGNMENT != 0) break;
+    }
+
+    return static_cast<ssize_t>(total);
+#else
+    return preadAll(fd, buf, len, offset);
+#endif
+}
+
+fileio::DropBehind::DropBehind(int fd, bool writing, uint64_t start): _fd(fd), _writing(writing), _dropped(start), _pending(start) {}
+
+fileio::DropBehind::~DropBehind() {
+    finish();
+}
+
+void fileio::DropBehind::advanceTo(uint64_t end) {
+    if(_fd < 0 || end <= _pending) return;
+
+    if(!_writing) {
+        drop(end, false);
+        _pending = end;
+        return;
+    }
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    // Start writing the new range, then retire the one before it
+    sync_file_range(_fd, static_cast<off_t>(_pending), static_cast<off_t>(end - _pending), SYNC_FILE_RANGE_WRITE);
+#endif
+    drop(_pending, true);
+    _pending = end;
+}
+
+void fileio::DropBehind::finish() {
+    if(_fd < 0) return;
+
+    drop(_pending, true);
+    _fd = -1;
+}
+
+void fileio::DropBehind::drop(uint64_t end, bool wait) {
+    if(end <= _dropped) return;
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    // Dirty pages cannot be dropped until they are clean
+    if(_writing && wait) {
+        sync_file_range(_fd, static_cast<off_t>(_dropped), static_cast<off_t>(end - _dropped),
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#else
+    (void)wait;
+#endif
+
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(_fd, static_cast<off_t>(_dropped), static_cast<off_t>(end - _dropped), POSIX_FADV_DONTNEED);
+#endif
+
+    // The kernel only drops whole pages, so the one the range ends in is covered again next time
+    static const uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    _dropped = end / pageSize * pageSize;
+}
@@ -0,0 +1,104 @@
+// fileio.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fileio {
+    // What to do about the page cache while working through a file.  Keep leaves it to the
+    // kernel; Drop evicts data once it has been read or written, so that a large backup does not
+    // push everything else out of memory; Direct also bypasses the cache entirely with O_DIRECT
+    // where the platform and filesystem allow it, and drops what it cannot bypass.
+    enum class CacheMode {
+        Keep,
+        Drop,
+        Direct
+    };
+
+    // O_DIRECT transfers must start and end on this boundary, in memory and in the file
+    const size_t DIRECT_ALIGNMENT = 4096;
+
+    inline size_t alignUp(size_t len) {
+        return (len + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+    }
+
+    // Read exactly len bytes at offset, retrying short reads.  Returns the number of bytes read,
+    // which is only less than len at end of file, or -1 on error.
+    ssize_t preadAll(int fd, uint8_t* buf, size_t len, uint64_t offset);
+
+    // Write all len bytes at offset.  Returns false on error.
+    bool pwriteAll(int fd, const uint8_t* buf, size_t len, uint64_t offset);
+
+    // Write count buffers back to back, starting at offset, in as few calls as the kernel
+    // allows.  The iovecs are used up in the process.  Returns false on error.
+    bool pwritevAll(int fd, struct iovec* iov, int count, uint64_t offset);
+
+    // The same, at the descriptor's current position, so that it also works on pipes
+    bool writevAll(int fd, struct iovec* iov, int count);
+
+    // Reserve len bytes of disk for a file, and extend it to that length, so that the
+    // filesystem can lay it out in as few extents as possible.  Best effort: returns false where
+    // the platform or filesystem cannot, and the file is then left as it was.
+    bool preallocate(int fd, uint64_t len);
+
+    // Put the calling thread, and the threads it starts from then on, in the idle I/O class, so
+    // that the disk serves it only when nothing else wants it.  Linux only; false elsewhere, or
+    // if the kernel refuses.
+    bool idlePriority();
+
+    // Whether len bytes are all zero, as a block read from a hole in a sparse file is
+    bool allZero(const uint8_t* buf, size_t len);
+
+    // The holes in the first size bytes of a file, as (offset, length) pairs in order, found
+    // with SEEK_HOLE and SEEK_DATA.  Where those are not supported nothing is reported, and the
+    // whole file is treated as data.
+    void findHoles(int fd, uint64_t size, std::vector<std::pair<uint64_t, uint64_t>>& holes);
+
+    // Returns true and sets size if fd refers to a regular file
+    bool regularFileSize(int fd, uint64_t& size);
+
+    // Flush the directory holding path, so that a file just created in it, or removed from it,
+    // stays that way after a crash
+    bool syncParent(const std::string& path);
+
+    // Open a file to read with O_DIRECT, or normally if that is refused.  Sets direct to which.
+    int openDirect(const std::string& path, bool& direct);
+
+    // preadAll() for a descriptor from openDirect().  buf, offset and len should be aligned to
+    // DIRECT_ALIGNMENT; if the kernel rejects a transfer anyway, O_DIRECT is switched off for the
+    // descriptor and the read carries on through the cache.
+    ssize_t preadDirect(int fd, uint8_t* buf, size_t len, uint64_t offset);
+
+    // Evicts a file's pages from the page cache as it is processed front to back, once they are
+    // behind the cursor.  When writing, each range is first flushed asynchronously and only
+    // waited on a step later, so writeback overlaps with the next block instead of stalling it.
+    // Pages that straddle the cursor are left until it has passed them entirely.
+    class DropBehind {
+    public:
+        // A negative fd does nothing, so that callers need not check whether dropping is wanted
+        DropBehind(int fd, bool writing, uint64_t start = 0);
+        DropBehind(const DropBehind& other) = delete;
+        ~DropBehind();
+
+        // Everything before end is done with
+        void advanceTo(uint64_t end);
+
+        // Drop the rest, waiting for it to reach the disk if it was written
+        void finish();
+
+    private:
+        void drop(uint64_t end, bool wait);
+
+        int _fd;
+        bool _writing;
+        uint64_t _dropped;
+        uint64_t _pending;
+    };
+}
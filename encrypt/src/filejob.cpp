@@ -0,0 +1,1314 @@
+// filejob.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "filejob.hpp"
+#include "fileio.hpp"
+#include "parity.hpp"
+
+const uint64_t FileEncryptJob::CHUNK_BLOCKS;
+
+namespace {
+    // What every job shares between its chunks
+    class JobState {
+    public:
+        JobState(): inFd(-1), outFd(-1), direct(false), cache(fileio::CacheMode::Keep), firstBlock(0), nBlocks(0),
+                    chunkBlocks(FileEncryptJob::CHUNK_BLOCKS), remaining(0),
+                    _status(WuffCryptFile::FileStatus::OK) {}
+        JobState(const JobState& other) = delete;
+
+        virtual ~JobState() {
+            if(inFd >= 0) close(inFd);
+            if(outFd >= 0) close(outFd);
+        }
+
+        // Record the first failure; later chunks still run, but their results are moot
+        void fail(WuffCryptFile::FileStatus why) {
+            std::lock_guard<std::mutex> guard(_statusLock);
+            if(_status == WuffCryptFile::FileStatus::OK) _status = why;
+        }
+
+        bool ok() {
+            return status() == WuffCryptFile::FileStatus::OK;
+        }
+
+        WuffCryptFile::FileStatus status() {
+            std::lock_guard<std::mutex> guard(_statusLock);
+            return _status;
+        }
+
+        // Whether a run of blocks starting at first still needs doing
+        virtual bool wants(uint64_t first) {
+            (void)first;
+            return ok();
+        }
+
+        // Close the files and report back.  Called once, by whichever chunk finishes last.
+        void finish() {
+            if(ok()) finalize();
+
+            if(inFd >= 0) close(inFd);
+            if(outFd >= 0 && close(outFd) != 0) fail(WuffCryptFile::FileStatus::WriteError);
+            inFd = outFd = -1;
+
+            done();
+        }
+
+        int inFd;
+        int outFd;
+
+        // Whether inFd was opened with O_DIRECT, and whether to keep pages out of the cache
+        bool direct;
+        fileio::CacheMode cache;
+
+        // Descriptors for DropBehind: -1 if the cache is to be left alone
+        int dropInFd() const { return (cache != fileio::CacheMode::Keep)? inFd : -1; }
+        int dropOutFd() const { return (cache != fileio::CacheMode::Keep)? outFd : -1; }
+
+        // The blocks to work through: all of them, unless appending to what is already there
+        uint64_t firstBlock;
+        uint64_t nBlocks;
+
+        // Blocks per chunk: CHUNK_BLOCKS, or whole parity stripes
+        uint64_t chunkBlocks;
+        std::atomic<uint64_t> remaining;
+
+    protected:
+        // Anything that must happen after every block succeeded, but before the files close
+        virtual void finalize() {}
+
+        virtual void done() = 0;
+
+    private:
+        std::mutex _statusLock;
+        WuffCryptFile::FileStatus _status;
+    };
+
+    // Run body over every block of the job in runs of chunkBlocks, then finish the job.  The
+    // tail of the file is handed to other workers, and the head run by the calling task.  It is
+    // queued back to front so that this worker, popping its own deque newest-first, proceeds in
+    // file order while thieves take the far end.
+    template <typename State>
+    void runChunks(WorkStealingPool& pool, std::shared_ptr<State> state, void (*body)(State&, uint64_t, uint64_t)) {
+        const uint64_t chunkBlocks = state->chunkBlocks;
+        const uint64_t start = state->firstBlock;
+        const uint64_t nChunks = (state->nBlocks - start + chunkBlocks - 1) / chunkBlocks;
+        state->remaining = nChunks;
+
+        auto runChunk = [state, body](uint64_t first, uint64_t last) {
+            if(state->wants(first)) {
+                body(*state, first, last);
+            }
+
+            if(--state->remaining == 0) {
+                state->finish();
+            }
+        };
+
+        for(uint64_t i = nChunks - 1; i > 0; i -= 1) {
+            const uint64_t first = start + i * chunkBlocks;
+            const uint64_t last = std::min(state->nBlocks, first + chunkBlocks);
+            pool.submit([runChunk, first, last]() { runChunk(first, last); });
+        }
+
+        runChunk(start, std::min(state->nBlocks, start + chunkBlocks));
+    }
+
+    class EncryptState: public JobState {
+    public:
+        EncryptState(const DerivedKey& key, const uint8_t* noncePrefix, const WuffCryptFile::Options& jobOptions, FileEncryptJob::Callback callback):
+            enc(key, noncePrefix), inOffset(0), size(0), options(jobOptions), reopened(false), resumeEnd(0), kept(0), _callback(callback) {}
+
+        Encrypter enc;
+        uint8_t header[WuffCryptFile::HEADER_SIZE];
+
+        // The part of the input to encrypt: all of it, unless this is one volume of a set
+        uint64_t inOffset;
+        uint64_t size;
+        WuffCryptFile::Options options;
+
+        // The output existed before the job, and may be longer than what the job leaves in it
+        bool reopened;
+
+        // When appending, the trailer of the file as it was, and the Merkle leaves of the blocks
+        // before firstBlock, which are kept
+        WuffCryptFile::Trailer carried;
+        std::vector<uint8_t> carriedLeaves;
+
+        // When upgrading, the older file read in place of plaintext, and its trailer from format 1
+        // on.  Each block is decrypted as it is read.
+        std::unique_ptr<Decrypter> source;
+        WuffCryptFile::Header sourceHeader;
+        WuffCryptFile::Trailer sourceTrailer;
+
+        // When resuming, checks the blocks of the earlier output, which ends at resumeEnd
+        std::unique_ptr<Decrypter> dec;
+        uint64_t resumeEnd;
+        std::atomic<uint64_t> kept;
+
+        // The checkpoint beside the output, removed once it is complete; empty if there is none
+        std::string checkpoint;
+
+        // Options::append: where the end of the archive as it was is saved, to be removed once
+        // the new end is on disk
+        std::string rollback;
+
+        // Each block's PlaintextDigest leaf, filled in as the blocks are encrypted
+        std::vector<uint8_t> leaves;
+
+        // Each block's authentication tag, for the Merkle index
+        std::vector<uint8_t> tags;
+
+        // Options::sparse: which blocks are all zeros, marked from the input's holes before
+        // starting and as the rest are read.  Empty otherwise.
+        std::vector<uint8_t> zero;
+
+        // Where everything after the blocks goes, apart from the trailer's own size
+        WuffCryptFile::Trailer layout;
+
+    protected:
+        void finalize() override {
+            WuffCryptFile::Trailer trailer;
+            trailer.plaintextLength = size;
+            trailer.zeroRuns = carried.zeroRuns;
+            trailer.dataShards = layout.dataShards;
+            trailer.parityShards = layout.parityShards;
+            trailer.hasVolume = layout.hasVolume;
+            trailer.volume = layout.volume;
+
+            // The block hashes were computed in parallel; chaining them is cheap.  An appended
+            // file carries on from the chain before its old final block, which is all zeros
+            // for a new one.
+            if(!leaves.empty()) {
+                _digest.reset(carried.digestChain, firstBlock);
+                for(uint64_t n = firstBlock; n < nBlocks; n += 1) {
+                    if(n + 1 == nBlocks) {
+                        memcpy(trailer.digestChain, _digest.chain(), PlaintextDigest::BYTES);
+                    }
+                    _digest.add(&leaves[n * PlaintextDigest::BYTES]);
+                }
+
+                _digest.finish(size);
+            }
+
+            if(options.storeDigest) {
+                trailer.hasDigest = true;
+                memcpy(trailer.digest, _digest.value(), PlaintextDigest::BYTES);
+            }
+
+            // An upgraded file has to hold what the old one said it did
+            if(source && sourceTrailer.hasDigest && sodium_memcmp(_digest.value(), sourceTrailer.digest, PlaintextDigest::BYTES) != 0) {
+                fail(WuffCryptFile::FileStatus::VerificationFailed);
+                return;
+            }
+
+            for(uint64_t n = firstBlock; n < zero.size(); n += 1) {
+                if(zero[n]) trailer.addZero(n);
+            }
+
+            std::vector<uint8_t> end(merkle::indexSize(nBlocks));
+            if(!carriedLeaves.empty()) memcpy(end.data(), carriedLeaves.data(), carriedLeaves.size());
+            for(uint64_t n = firstBlock; n < nBlocks; n += 1) {
+                merkle::leaf(&tags[n * merkle::TAG_BYTES], &end[n * merkle::NODE_BYTES]);
+            }
+            merkle::complete(end, nBlocks);
+            trailer.hasMerkleRoot = true;
+            memcpy(trailer.merkleRoot, &end[end.size() - merkle::NODE_BYTES], merkle::NODE_BYTES);
+
+            // The index goes straight after the blocks, and the trailer after the parity, if any
+            const size_t indexBytes = end.size();
+            WuffCryptFile::sealTrailer(enc, trailer, end);
+            const uint64_t trailerEnd = WuffCryptFile::trailerOffset(trailer) + (end.size() - indexBytes);
+            if(!fileio::pwriteAll(outFd, end.data(), indexBytes, WuffCryptFile::dataEnd(size)) ||
+               !fileio::pwriteAll(outFd, end.data() + indexBytes, end.size() - indexBytes, WuffCryptFile::trailerOffset(trailer))) {
+                fail(WuffCryptFile::FileStatus::WriteError);
+            }
+
+            // A resumed output may be longer than this one, if it was written from something else
+            if(reopened && ftruncate(outFd, static_cast<off_t>(trailerEnd)) != 0) {
+                fail(WuffCryptFile::FileStatus::WriteError);
+            }
+
+            // The saved end may only go once there is no going back to it
+            if(!rollback.empty() && fsync(outFd) != 0) {
+                fail(WuffCryptFile::FileStatus::WriteError);
+            }
+        }
+
+        void done() override {
+            FileEncryptJob::Result result;
+            result.status = status();
+            result.digest = _digest;
+            result.keptBlocks = kept;
+            if(result.status == WuffCryptFile::FileStatus::OK && !checkpoint.empty()) unlink(checkpoint.c_str());
+            if(result.status == WuffCryptFile::FileStatus::OK && !rollback.empty()) unlink(rollback.c_str());
+            _callback(result);
+        }
+
+    private:
+        PlaintextDigest _digest;
+        FileEncryptJob::Callback _callback;
+    };
+
+    // Options::parityShards: the parity of the stripe a chunk is working through, written out
+    // after its last block.  Chunks hold whole stripes, so no two workers share one.
+    class StripeParity {
+    public:
+        explicit StripeParity(const EncryptState& state):
+            _state(state), _k(state.layout.dataShards), _m(state.layout.parityShards),
+            _shards(_m * WuffCryptFile::ENCRYPTED_BLOCK_SIZE, 0) {}
+
+        bool enabled() const { return _m > 0; }
+
+        // Add block n, as stored: its MAC and then its ciphertext.  Blocks of zeros are left out.
+        void add(uint64_t n, const uint8_t* mac, const uint8_t* ctext, size_t len) {
+            if(_m == 0) return;
+
+            const unsigned j = static_cast<unsigned>(n % _k);
+            const size_t macLen = crypto_secretbox_xsalsa20poly1305_MACBYTES;
+            for(unsigned i = 0; i < _m; i += 1) {
+                uint8_t* shard = &_shards[i * WuffCryptFile::ENCRYPTED_BLOCK_SIZE];
+                const uint8_t c = parity::coefficient(_k, i, j);
+                parity::mulAdd(shard, mac, c, macLen);
+                parity::mulAdd(shard + macLen, ctext, c, len);
+            }
+        }
+
+        // Call once block n is done with.  If it ends a stripe, write out the stripe's parity.
+        bool done(uint64_t n) {
+            if(_m == 0 || ((n + 1) % _k != 0 && n + 1 != _state.nBlocks)) return true;
+
+            // A new sparse output need not fill in the parity of a stripe of zeros
+            if(!_state.zero.empty() && !_state.reopened && fileio::allZero(_shards.data(), _shards.size())) return true;
+
+            const uint64_t stripe = n / _k;
+            const size_t shardSize = WuffCryptFile::shardSize(_state.layout, stripe);
+            bool written = true;
+            {
+                ThrottledIO throttled(Throttle::Direction::Write, static_cast<uint64_t>(_m) * shardSize);
+                StageTimer writing(Stats::Stage::Write);
+                for(unsigned i = 0; i < _m && written; i += 1) {
+                    written = fileio::pwriteAll(_state.outFd, &_shards[i * WuffCryptFile::ENCRYPTED_BLOCK_SIZE], shardSize,
+                                                WuffCryptFile::parityOffset(_state.layout, stripe, i));
+                }
+            }
+            std::fill(_shards.begin(), _shards.end(), 0);
+            return written;
+        }
+
+    private:
+        const EncryptState& _state;
+        const unsigned _k;
+        const unsigned _m;
+        std::vector<uint8_t> _shards;
+    };
+
+    // Blocks are encrypted in place, with their MACs set aside, and written out this many at a
+    // time with one pwritev() gathering each MAC and ciphertext into place.  Two is what a
+    // worker's pair of arena buffers allows.
+    const size_t WRITE_BATCH = 2;
+
+    // Read and decode the header of an existing output, which must be format 1 or later and
+    // written with the key's work factor
+    bool readHeader(const DerivedKey& key, int outFd, uint8_t* raw, WuffCryptFile::Header& header) {
+        ssize_t bytesRead = fileio::preadAll(outFd, raw, WuffCryptFile::HEADER_SIZE, 0);
+        return bytesRead >= 0 && WuffCryptFile::decodeHeader(raw, static_cast<size_t>(bytesRead), header) == WuffCryptFile::FileStatus::OK &&
+               header.version != 0 && header.workFactor == key.workFactor();
+    }
+
+    // The times that identify an input, to the nanosecond
+    const struct timespec& modifiedTime(const struct stat& st) {
+#ifdef __APPLE__
+        return st.st_mtimespec;
+#else
+        return st.st_mtim;
+#endif
+    }
+
+    const struct timespec& changedTime(const struct stat& st) {
+#ifdef __APPLE__
+        return st.st_ctimespec;
+#else
+        return st.st_ctim;
+#endif
+    }
+
+    // Every output being encrypted has a checkpoint beside it, outPath + ".resume", recording the
+    // input it is being written from and the nonce prefix of its blocks, sealed with the key.  It
+    // is removed once the output is complete.  A write to the input changes its ctime, which
+    // cannot be set back, so an input that still matches holds exactly what the output's blocks
+    // were encrypted from, and any block can safely be encrypted again under its old nonce.
+    const size_t CHECKPOINT_BYTES = 9 * sizeof(uint64_t) + encrypt_NONCEPREFIXBYTES;
+    const size_t SEALED_CHECKPOINT_BYTES = crypto_secretbox_xsalsa20poly1305_NONCEBYTES + crypto_secretbox_xsalsa20poly1305_MACBYTES + CHECKPOINT_BYTES;
+
+    std::string checkpointPath(const std::string& outPath) {
+        return outPath + ".resume";
+    }
+
+    // The checkpoint for the size bytes of the input from inOffset, encrypted under noncePrefix
+    bool describeInput(int inFd, uint64_t inOffset, uint64_t size, const uint8_t* noncePrefix, uint8_t* out) {
+        struct stat st;
+        if(fstat(inFd, &st) != 0) return false;
+
+        const uint64_t fields[] = {static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino), static_cast<uint64_t>(st.st_size),
+                                   static_cast<uint64_t>(modifiedTime(st).tv_sec), static_cast<uint64_t>(modifiedTime(st).tv_nsec),
+                                   static_cast<uint64_t>(changedTime(st).tv_sec), static_cast<uint64_t>(changedTime(st).tv_nsec),
+                                   inOffset, size};
+        for(size_t i = 0; i < 9; i += 1) {
+            byteorder::storeLittleEndian64(out + i * sizeof(uint64_t), fields[i]);
+        }
+        // Only the first 16 bytes of the prefix go into the header and the nonces; see blockNonce()
+        memcpy(out + 9 * sizeof(uint64_t), noncePrefix, 16);
+        memset(out + 9 * sizeof(uint64_t) + 16, 0, encrypt_NONCEPREFIXBYTES - 16);
+        return true;
+    }
+
+    // Seal a checkpoint under a random nonce, which it carries in front.  Best effort: without
+    // one, a later --resume just starts over.
+    void writeCheckpoint(const DerivedKey& key, const std::string& path, const uint8_t* checkpoint) {
+        uint8_t sealed[SEALED_CHECKPOINT_BYTES];
+        Nonce nonce;
+        randombytes_buf(nonce.bytes, sizeof(nonce.bytes));
+        memcpy(sealed, nonce.bytes, sizeof(nonce.bytes));
+        Encrypter(key).encrypt(checkpoint, CHECKPOINT_BYTES, sealed + sizeof(nonce.bytes), nonce);
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if(fd < 0) return;
+        if(!fileio::pwriteAll(fd, sealed, sizeof(sealed), 0)) {
+            close(fd);
+            unlink(path.c_str());
+            return;
+        }
+        close(fd);
+    }
+
+    // Whether the checkpoint at path authenticates and says what expected does
+    bool checkpointMatches(const DerivedKey& key, const std::string& path, const uint8_t* expected) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+
+        uint8_t sealed[SEALED_CHECKPOINT_BYTES + 1];
+        const ssize_t bytesRead = fileio::preadAll(fd, sealed, sizeof(sealed), 0);
+        close(fd);
+        if(bytesRead != static_cast<ssize_t>(SEALED_CHECKPOINT_BYTES)) return false;
+
+        Nonce nonce;
+        memcpy(nonce.bytes, sealed, sizeof(nonce.bytes));
+        uint8_t checkpoint[CHECKPOINT_BYTES];
+        const Decrypter dec(key, nonce.bytes);
+        return dec.decrypt(sealed + sizeof(nonce.bytes), SEALED_CHECKPOINT_BYTES - sizeof(nonce.bytes), checkpoint, nonce) == 0 &&
+               sodium_memcmp(checkpoint, expected, CHECKPOINT_BYTES) == 0;
+    }
+
+    // Whether an interrupted run left an output we can pick up from: a header we could have
+    // written with this key, and a checkpoint that names the same nonce prefix and an input that
+    // has not changed since.  Otherwise re-encrypting its blocks under the same nonces would be
+    // unsafe.
+    bool canResume(const DerivedKey& key, const std::string& outPath, int inFd, uint64_t inOffset, uint64_t size, int outFd,
+                   uint8_t* noncePrefix, uint64_t& outSize) {
+        struct stat outStat;
+        if(fstat(outFd, &outStat) != 0 || !S_ISREG(outStat.st_mode)) return false;
+
+        uint8_t headerBuf[WuffCryptFile::HEADER_SIZE];
+        WuffCryptFile::Header header;
+        if(!readHeader(key, outFd, headerBuf, header)) return false;
+
+        uint8_t checkpoint[CHECKPOINT_BYTES];
+        if(!describeInput(inFd, inOffset, size, header.nonce, checkpoint) ||
+           !checkpointMatches(key, checkpointPath(outPath), checkpoint)) {
+            return false;
+        }
+
+        memcpy(noncePrefix, header.nonce, encrypt_NONCEPREFIXBYTES);
+        outSize = static_cast<uint64_t>(outStat.st_size);
+        return true;
+    }
+
+    // Keep block n of an earlier output if it authenticates, reading it into buf, which needs
+    // room for the MAC as well as the block
+    bool keepBlock(EncryptState& state, StripeParity& parity, uint64_t n, size_t len, uint8_t* buf) {
+        const size_t encryptedLen = len + crypto_secretbox_xsalsa20poly1305_MACBYTES;
+        const uint64_t offset = WuffCryptFile::blockOffset(n);
+        if(offset + encryptedLen > state.resumeEnd) return false;
+
+        {
+            ThrottledIO throttled(Throttle::Direction::Read, encryptedLen);
+            StageTimer reading(Stats::Stage::Read);
+            ssize_t bytesRead = fileio::preadAll(state.outFd, buf, encryptedLen, offset);
+            if(bytesRead < 0 || static_cast<size_t>(bytesRead) != encryptedLen) return false;
+        }
+
+        ThrottledCPU cpu;
+        StageTimer crypto(Stats::Stage::Crypto);
+        const Nonce nonce = WuffCryptFile::blockNonce(state.enc.noncePrefix(), n, len);
+        uint8_t* ctext = buf + crypto_secretbox_xsalsa20poly1305_MACBYTES;
+        if(state.leaves.empty() || parity.enabled()) {
+            if(state.dec->authenticate(buf, encryptedLen, nonce) != 0) return false;
+        }
+
+        // Parity is over the ciphertext, which decrypting in place would lose
+        memcpy(&state.tags[n * merkle::TAG_BYTES], buf, merkle::TAG_BYTES);
+        parity.add(n, buf, ctext, len);
+
+        if(!state.leaves.empty()) {
+            // The digest needs the plaintext, which decrypting in place also authenticates
+            if(state.dec->decrypt(buf, encryptedLen, ctext, nonce) != 0) return false;
+            PlaintextDigest::leaf(ctext, len, &state.leaves[n * PlaintextDigest::BYTES]);
+        }
+
+        state.kept += 1;
+        return true;
+    }
+
+    // Options::append rewrites the archive's old final block, index and trailer in place.  Before
+    // it does, they are saved beside it in out + ".append", along with the archive's nonce prefix
+    // and length, sealed with the key under a random nonce that the file carries in front.  An
+    // append that never finished is undone by the next one.
+    const size_t ROLLBACK_BYTES = 16 + 2 * sizeof(uint64_t);
+    const size_t ROLLBACK_OVERHEAD = crypto_secretbox_xsalsa20poly1305_NONCEBYTES + crypto_secretbox_xsalsa20poly1305_MACBYTES + ROLLBACK_BYTES;
+
+    std::string rollbackPath(const std::string& outPath) {
+        return outPath + ".append";
+    }
+
+    // Save everything in the archive from offset on, and see that it is on disk before the
+    // archive is touched.  The archive is fileSize bytes long.
+    bool saveRollback(const DerivedKey& key, const std::string& path, int outFd, const uint8_t* noncePrefix, uint64_t offset, uint64_t fileSize) {
+        const size_t tailLen = static_cast<size_t>(fileSize - offset);
+        std::vector<uint8_t> plain(ROLLBACK_BYTES + tailLen);
+        memcpy(plain.data(), noncePrefix, 16);
+        byteorder::storeLittleEndian64(&plain[16], fileSize);
+        byteorder::storeLittleEndian64(&plain[16 + sizeof(uint64_t)], offset);
+        if(fileio::preadAll(outFd, &plain[ROLLBACK_BYTES], tailLen, offset) != static_cast<ssize_t>(tailLen)) return false;
+
+        const size_t nonceLen = crypto_secretbox_xsalsa20poly1305_NONCEBYTES;
+        std::vector<uint8_t> sealed(nonceLen + crypto_secretbox_xsalsa20poly1305_MACBYTES + plain.size());
+        Nonce nonce;
+        randombytes_buf(nonce.bytes, sizeof(nonce.bytes));
+        memcpy(sealed.data(), nonce.bytes, nonceLen);
+        Encrypter(key).encrypt(plain.data(), plain.size(), &sealed[nonceLen], nonce);
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if(fd < 0) return false;
+        const bool written = fileio::pwriteAll(fd, sealed.data(), sealed.size(), 0) && fsync(fd) == 0;
+        if(close(fd) != 0 || !written) {
+            unlink(path.c_str());
+            return false;
+        }
+        return fileio::syncParent(path);
+    }
+
+    // Put back the end of the archive saved by an append that never finished.  One that does not
+    // authenticate was cut short before the archive was touched, and one for another archive was
+    // left over from before it was encrypted again; both are only removed.
+    WuffCryptFile::FileStatus restoreRollback(const DerivedKey& key, const std::string& path, int outFd) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) return (errno == ENOENT)? WuffCryptFile::FileStatus::OK : WuffCryptFile::FileStatus::ReadError;
+
+        uint64_t size = 0;
+        std::vector<uint8_t> sealed;
+        bool read = fileio::regularFileSize(fd, size);
+        if(read) {
+            sealed.resize(static_cast<size_t>(size));
+            read = fileio::preadAll(fd, sealed.data(), sealed.size(), 0) == static_cast<ssize_t>(sealed.size());
+        }
+        close(fd);
+        if(!read) return WuffCryptFile::FileStatus::ReadError;
+
+        const size_t nonceLen = crypto_secretbox_xsalsa20poly1305_NONCEBYTES;
+        uint8_t headerBuf[WuffCryptFile::HEADER_SIZE];
+        WuffCryptFile::Header header;
+        const ssize_t headerRead = fileio::preadAll(outFd, headerBuf, sizeof(headerBuf), 0);
+        const bool hasHeader = headerRead >= 0 &&
+                               WuffCryptFile::decodeHeader(headerBuf, static_cast<size_t>(headerRead), header) == WuffCryptFile::FileStatus::OK;
+
+        std::vector<uint8_t> plain;
+        bool ours = hasHeader && sealed.size() >= ROLLBACK_OVERHEAD;
+        if(ours) {
+            Nonce nonce;
+            memcpy(nonce.bytes, sealed.data(), nonceLen);
+            plain.resize(sealed.size() - nonceLen - crypto_secretbox_xsalsa20poly1305_MACBYTES);
+            ours = Decrypter(key, nonce.bytes).decrypt(&sealed[nonceLen], sealed.size() - nonceLen, plain.data(), nonce) == 0 &&
+                   memcmp(plain.data(), header.nonce, 16) == 0;
+        }
+
+        if(ours) {
+            const uint64_t fileSize = byteorder::loadLittleEndian64(&plain[16]);
+            const uint64_t offset = byteorder::loadLittleEndian64(&plain[16 + sizeof(uint64_t)]);
+            if(offset + (plain.size() - ROLLBACK_BYTES) != fileSize ||
+               !fileio::pwriteAll(outFd, &plain[ROLLBACK_BYTES], plain.size() - ROLLBACK_BYTES, offset) ||
+               ftruncate(outFd, static_cast<off_t>(fileSize)) != 0 || fsync(outFd) != 0) {
+                return WuffCryptFile::FileStatus::WriteError;
+            }
+        }
+
+        unlink(path.c_str());
+        fileio::syncParent(path);
+        return WuffCryptFile::FileStatus::OK;
+    }
+
+    // Options::append: check that the output is a finished archive of the start of the input,
+    // and set the job up to carry on from the archive's final block, which is always partial and
+    // so has to be encrypted again.  The blocks before it are taken as they are; only the final
+    // one is compared with the input.  Once all that checks out, what is about to be rewritten is
+    // saved for rollback.
+    WuffCryptFile::FileStatus openAppend(EncryptState& state, const DerivedKey& key) {
+        uint64_t fileSize = 0;
+        if(!fileio::regularFileSize(state.outFd, fileSize)) return WuffCryptFile::FileStatus::ReadError;
+
+        const Decrypter dec(key, state.enc.noncePrefix());
+        WuffCryptFile::FileStatus status = WuffCryptFile::openTrailer(state.outFd, fileSize, dec, state.carried);
+        if(status != WuffCryptFile::FileStatus::OK) return status;
+
+        // Format 1 has no Merkle index to extend, and the parity of format 4 sits after it, so
+        // would all have to move
+        if(!state.carried.hasMerkleRoot || state.carried.parityShards > 0) return WuffCryptFile::FileStatus::WrongVersion;
+
+        const uint64_t oldSize = state.carried.plaintextLength;
+        if(state.size < oldSize) return WuffCryptFile::FileStatus::VerificationFailed;
+
+        // The leaves of the index have to lead to the authenticated root
+        const uint64_t oldBlocks = WuffCryptFile::blockCount(oldSize);
+        const size_t leavesLen = oldBlocks * merkle::NODE_BYTES;
+        std::vector<uint8_t> index(merkle::indexSize(oldBlocks));
+        if(fileio::preadAll(state.outFd, index.data(), leavesLen, WuffCryptFile::dataEnd(oldSize)) != static_cast<ssize_t>(leavesLen)) {
+            return WuffCryptFile::FileStatus::ReadError;
+        }
+        merkle::complete(index, oldBlocks);
+        if(memcmp(&index[index.size() - merkle::NODE_BYTES], state.carried.merkleRoot, merkle::NODE_BYTES) != 0) {
+            return WuffCryptFile::FileStatus::VerificationFailed;
+        }
+
+        // The old final block has to authenticate, and be what the input still holds
+        const uint64_t n = oldBlocks - 1;
+        const size_t len = static_cast<size_t>(oldSize - n * WuffCryptFile::BLOCK_SIZE);
+        const size_t encryptedLen = len + crypto_secretbox_xsalsa20poly1305_MACBYTES;
+        SodiumMessageBuffer stored(WuffCryptFile::BLOCK_SIZE);
+        SodiumMessageBuffer input(WuffCryptFile::BLOCK_SIZE);
+        uint8_t* inBlock = state.direct? input.rawData() : input.data();
+
+        ssize_t bytesRead = fileio::preadAll(state.outFd, stored.rawData(), encryptedLen, WuffCryptFile::blockOffset(n));
+        if(bytesRead != static_cast<ssize_t>(encryptedLen)) return WuffCryptFile::FileStatus::ReadError;
+
+        const uint64_t inOffset = state.inOffset + n * WuffCryptFile::BLOCK_SIZE;
+        bytesRead = state.direct? fileio::preadDirect(state.inFd, inBlock, fileio::alignUp(len), inOffset) :
+                                  fileio::preadAll(state.inFd, inBlock, len, inOffset);
+        if(bytesRead < 0 || static_cast<size_t>(bytesRead) < len) return WuffCryptFile::FileStatus::ReadError;
+
+        uint8_t leaf[merkle::NODE_BYTES];
+        merkle::leaf(stored.rawData(), leaf);
+        uint8_t* plain = stored.rawData() + crypto_secretbox_xsalsa20poly1305_MACBYTES;
+        if(memcmp(leaf, &index[n * merkle::NODE_BYTES], merkle::NODE_BYTES) != 0 ||
+           dec.decrypt(stored.rawData(), encryptedLen, plain, WuffCryptFile::blockNonce(dec.noncePrefix(), n, len)) != 0 ||
+           memcmp(plain, inBlock, len) != 0) {
+            return WuffCryptFile::FileStatus::VerificationFailed;
+        }
+
+        if(!saveRollback(key, state.rollback, state.outFd, dec.noncePrefix(), WuffCryptFile::blockOffset(n), fileSize)) {
+            return WuffCryptFile::FileStatus::WriteError;
+        }
+
+        index.resize(leavesLen - merkle::NODE_BYTES);
+        state.carriedLeaves.swap(index);
+        state.firstBlock = n;
+        return WuffCryptFile::FileStatus::OK;
+    }
+
+    // Upgrading: find how much plaintext the older file holds.  Format 0 only says so through its
+    // size; later formats record it in their trailer.
+    WuffCryptFile::FileStatus openSource(EncryptState& state, uint64_t fileSize) {
+        if(state.sourceHeader.version != 0) {
+            WuffCryptFile::FileStatus status = WuffCryptFile::openTrailer(state.inFd, fileSize, *state.source, state.sourceTrailer);
+            state.size = state.sourceTrailer.plaintextLength;
+            return status;
+        }
+
+        // Every file ends with a partial block, with at least its MAC.  If the data ends on a
+        // block boundary, the final block is missing, and the file has been truncated.
+        const size_t macLen = crypto_secretbox_xsalsa20poly1305_MACBYTES;
+        const uint64_t dataSize = fileSize - WuffCryptFile::HEADER_SIZE;
+        const uint64_t nBlocks = dataSize / WuffCryptFile::ENCRYPTED_BLOCK_SIZE + 1;
+        const uint64_t tail = dataSize % WuffCryptFile::ENCRYPTED_BLOCK_SIZE;
+        if(tail == 0) return WuffCryptFile::FileStatus::Truncated;
+        if(tail < macLen) return WuffCryptFile::FileStatus::VerificationFailed;
+
+        state.size = dataSize - nBlocks * macLen;
+        state.sourceTrailer.plaintextLength = state.size;
+        return WuffCryptFile::FileStatus::OK;
+    }
+
+    // Upgrading: read block n of the older file, and decrypt it into block.  There must be room
+    // for the MAC in front of block, as there is in front of SodiumMessageBuffer::data().
+    WuffCryptFile::FileStatus readSourceBlock(EncryptState& state, uint64_t n, size_t len, uint8_t* block) {
+        // Blocks of zeros were never stored
+        if(state.sourceTrailer.isZero(n)) {
+            memset(block, 0, len);
+            return WuffCryptFile::FileStatus::OK;
+        }
+
+        const size_t encryptedLen = len + crypto_secretbox_xsalsa20poly1305_MACBYTES;
+        uint8_t* stored = block - crypto_secretbox_xsalsa20poly1305_MACBYTES;
+        {
+            ThrottledIO throttled(Throttle::Direction::Read, encryptedLen);
+            StageTimer reading(Stats::Stage::Read);
+            ssize_t bytesRead = fileio::preadAll(state.inFd, stored, encryptedLen, WuffCryptFile::blockOffset(n));
+            if(bytesRead < 0 || static_cast<size_t>(bytesRead) != encryptedLen) return WuffCryptFile::FileStatus::ReadError;
+        }
+
+        ThrottledCPU cpu;
+        StageTimer crypto(Stats::Stage::Crypto);
+        const WuffCryptFile::Header& header = state.sourceHeader;
+        const Nonce nonce = (header.version == 0)? Nonce::counter(header.nonce, header.counter(n)) :
+                                                   WuffCryptFile::blockNonce(header.nonce, n, len);
+        WUFF_PROBE2(block__decrypt__start, n, len);
+        const bool ok = state.source->decrypt(stored, encryptedLen, block, nonce) == 0;
+        WUFF_PROBE3(block__decrypt__done, n, len, ok);
+        return ok? WuffCryptFile::FileStatus::OK : WuffCryptFile::FileStatus::VerificationFailed;
+    }
+
+    void encryptRange(EncryptState& state, uint64_t first, uint64_t last) {
+        SodiumMessageBuffer bufA(WuffCryptFile::BLOCK_SIZE);
+        SodiumMessageBuffer bufB(WuffCryptFile::BLOCK_SIZE);
+        uint8_t* raw[WRITE_BATCH] = {bufA.rawData(), bufB.rawData()};
+
+        // O_DIRECT reads go to the start of each buffer, which is page aligned when it comes
+        // from the arena; the padding in front of data() is only needed by the padded API
+        uint8_t* blocks[WRITE_BATCH] = {state.direct? bufA.rawData() : bufA.data(),
+                                        state.direct? bufB.rawData() : bufB.data()};
+        uint8_t macs[WRITE_BATCH][crypto_secretbox_xsalsa20poly1305_MACBYTES];
+        size_t lens[WRITE_BATCH];
+        BlockTimer timers[WRITE_BATCH];
+        StripeParity parity(state);
+
+        fileio::DropBehind dropIn(state.dropInFd(), false, state.inOffset + first * WuffCryptFile::BLOCK_SIZE);
+        fileio::DropBehind dropOut(state.dropOutFd(), true, (first == 0)? 0 : WuffCryptFile::blockOffset(first));
+
+        uint64_t n = first;
+        while(n < last) {
+            const uint64_t batchFirst = n;
+
+            // The first block carries the header along with it
+            struct iovec iov[2 * WRITE_BATCH + 1];
+            int nIov = 0;
+            if(batchFirst == 0) {
+                iov[nIov].iov_base = state.header;
+                iov[nIov].iov_len = sizeof(state.header);
+                nIov += 1;
+            }
+
+            // Up to WRITE_BATCH blocks that sit next to each other in the output.  A block of
+            // zeros or one kept from an earlier run is not written, so it ends the batch early.
+            size_t batch = 0;
+            while(batch < WRITE_BATCH && n < last) {
+                const uint64_t offset = n * WuffCryptFile::BLOCK_SIZE;
+                const size_t len = static_cast<size_t>(std::min<uint64_t>(WuffCryptFile::BLOCK_SIZE, state.size - offset));
+                uint8_t* block = blocks[batch];
+                timers[batch] = BlockTimer();
+                lens[batch] = len;
+
+                if(state.dec && keepBlock(state, parity, n, len, raw[batch])) {
+                    timers[batch].done(len);
+                    if(!parity.done(n)) {
+                        state.fail(WuffCryptFile::FileStatus::WriteError);
+                        return;
+                    }
+                    n += 1;
+                    break;
+                }
+
+                // Blocks found in a hole up front need not be read at all
+                bool zero = !state.zero.empty() && state.zero[n];
+                if(!zero && state.source) {
+                    WuffCryptFile::FileStatus status = readSourceBlock(state, n, len, block);
+                    if(status != WuffCryptFile::FileStatus::OK) {
+                        state.fail(status);
+                        return;
+                    }
+                }
+                else if(!zero) {
+                    ssize_t bytesRead = 0;
+                    {
+                        ThrottledIO throttled(Throttle::Direction::Read, len);
+                        StageTimer reading(Stats::Stage::Read);
+                        if(state.direct) {
+                            bytesRead = fileio::preadDirect(state.inFd, block, fileio::alignUp(len), state.inOffset + offset);
+                        }
+                        else {
+                            bytesRead = fileio::preadAll(state.inFd, block, len, state.inOffset + offset);
+                        }
+                    }
+                    WUFF_PROBE2(block__read, n, bytesRead);
+                    if(bytesRead < 0 || static_cast<size_t>(bytesRead) < len) {
+                        // Either an I/O error, or the file shrank out from under us
+                        state.fail(WuffCryptFile::FileStatus::ReadError);
+                        return;
+                    }
+                }
+
+                // Only full blocks are left out, so that the file still ends with a real one
+                if(!zero && !state.zero.empty() && len == WuffCryptFile::BLOCK_SIZE) {
+                    StageTimer crypto(Stats::Stage::Crypto);
+                    zero = fileio::allZero(block, len);
+                    state.zero[n] = zero;
+                }
+
+                if(zero) {
+                    // Its tag stays all zeros
+                    if(!state.leaves.empty()) {
+                        memcpy(&state.leaves[n * PlaintextDigest::BYTES], WuffCryptFile::zeroLeaf(), PlaintextDigest::BYTES);
+                    }
+
+                    timers[batch].done(len);
+                    if(!parity.done(n)) {
+                        state.fail(WuffCryptFile::FileStatus::WriteError);
+                        return;
+                    }
+                    n += 1;
+                    break;
+                }
+
+                {
+                    ThrottledCPU cpu;
+                    StageTimer crypto(Stats::Stage::Crypto);
+                    if(!state.leaves.empty()) {
+                        PlaintextDigest::leaf(block, len, &state.leaves[n * PlaintextDigest::BYTES]);
+                    }
+
+                    WUFF_PROBE2(block__encrypt__start, n, len);
+                    state.enc.encryptInPlace(block, len, macs[batch], WuffCryptFile::blockNonce(state.enc.noncePrefix(), n, len));
+                    WUFF_PROBE2(block__encrypt__done, n, len);
+                    parity.add(n, macs[batch], block, len);
+                }
+
+                memcpy(&state.tags[n * merkle::TAG_BYTES], macs[batch], merkle::TAG_BYTES);
+                if(!parity.done(n)) {
+                    state.fail(WuffCryptFile::FileStatus::WriteError);
+                    return;
+                }
+
+                iov[nIov].iov_base = macs[batch];
+                iov[nIov].iov_len = sizeof(macs[batch]);
+                iov[nIov + 1].iov_base = block;
+                iov[nIov + 1].iov_len = len;
+                nIov += 2;
+                batch += 1;
+                n += 1;
+            }
+
+            if(nIov > 0) {
+                const uint64_t batchOffset = (batchFirst == 0)? 0 : WuffCryptFile::blockOffset(batchFirst);
+
+                uint64_t batchBytes = 0;
+                for(int i = 0; i < nIov; i += 1) {
+                    batchBytes += iov[i].iov_len;
+                }
+
+                bool written = false;
+                {
+                    ThrottledIO throttled(Throttle::Direction::Write, batchBytes);
+                    StageTimer writing(Stats::Stage::Write);
+                    written = fileio::pwritevAll(state.outFd, iov, nIov, batchOffset);
+                }
+                if(!written) {
+                    state.fail(WuffCryptFile::FileStatus::WriteError);
+                    return;
+                }
+            }
+
+            for(size_t b = 0; b < batch; b += 1) {
+                WUFF_PROBE2(block__write, batchFirst + b, lens[b]);
+                timers[b].done(lens[b]);
+            }
+
+            if(batch > 0) {
+                dropOut.advanceTo(WuffCryptFile::blockOffset(batchFirst + batch - 1) +
+                                  lens[batch - 1] + crypto_secretbox_xsalsa20poly1305_MACBYTES);
+            }
+            dropIn.advanceTo(state.inOffset + std::min(n * WuffCryptFile::BLOCK_SIZE, state.size));
+        }
+    }
+
+    // Pick the output's format from the job's options, and work out where everything after the
+    // blocks goes.  The header goes out with the first block.
+    void layOut(EncryptState& state) {
+        const WuffCryptFile::Options& options = state.options;
+        const bool hasParity = options.parityShards > 0 && options.dataShards > 0;
+        WuffCryptFile::encodeHeader(state.enc, state.header,
+                                    hasParity? WuffCryptFile::PARITY_VERSION :
+                                    options.sparse? WuffCryptFile::SPARSE_VERSION : WuffCryptFile::VERSION);
+        state.nBlocks = WuffCryptFile::blockCount(state.size);
+        state.layout.plaintextLength = state.size;
+        state.layout.hasMerkleRoot = true;
+        if(hasParity) {
+            // Chunks of whole stripes, so that each stripe's parity is worked out by one worker
+            state.layout.dataShards = options.dataShards;
+            state.layout.parityShards = options.parityShards;
+            state.chunkBlocks = (FileEncryptJob::CHUNK_BLOCKS + options.dataShards - 1) / options.dataShards * options.dataShards;
+        }
+    }
+
+    // Set aside room for the tags and digest leaves, and hand the blocks out to the workers.  A
+    // sparse output must already have marked what it knows to be zeros.
+    void queueBlocks(WorkStealingPool& pool, std::shared_ptr<EncryptState> state) {
+        if(!state->options.sparse) {
+            // Everything up to the trailer, whose size depends on its records, is known now, so
+            // let the filesystem allocate it in one go.  Not for sparse output, which would lose
+            // its holes.
+            fileio::preallocate(state->outFd, WuffCryptFile::trailerOffset(state->layout));
+        }
+
+        state->tags.resize(state->nBlocks * merkle::TAG_BYTES);
+        if(state->options.digest || state->options.storeDigest) {
+            state->leaves.resize(state->nBlocks * PlaintextDigest::BYTES);
+        }
+
+        runChunks(pool, state, encryptRange);
+    }
+
+    class VerifyState: public JobState {
+    public:
+        explicit VerifyState(FileVerifyJob::Callback callback): dataSize(0), badBlock(UINT64_MAX), badIndex(false), rebuilt(0), _callback(callback) {}
+
+        WuffCryptFile::Header header;
+        std::unique_ptr<Decrypter> dec;
+        uint64_t dataSize;
+
+        // Format 1 and later
+        WuffCryptFile::Trailer trailer;
+
+        // Each block's tag, if the file has a Merkle index to check
+        std::vector<uint8_t> tags;
+
+        // The lowest failing block seen so far
+        std::atomic<uint64_t> badBlock;
+        bool badIndex;
+
+        // Damaged blocks that parity could stand in for
+        std::atomic<uint64_t> rebuilt;
+
+        void failBlock(uint64_t n) {
+            uint64_t seen = badBlock;
+            while(n < seen && !badBlock.compare_exchange_weak(seen, n)) {}
+            fail(WuffCryptFile::FileStatus::VerificationFailed);
+        }
+
+        // Keep checking blocks before a failure, so that we can report the first bad block
+        bool wants(uint64_t first) override {
+            auto why = status();
+            return first < badBlock && (why == WuffCryptFile::FileStatus::OK || why == WuffCryptFile::FileStatus::VerificationFailed);
+        }
+
+    protected:
+        // Every block is authentic; make sure the stored index is the one they produce, so that
+        // later partial checks against it can be trusted
+        void finalize() override {
+            if(!trailer.hasMerkleRoot) return;
+
+            std::vector<uint8_t> expected;
+            merkle::build(tags, expected);
+
+            std::vector<uint8_t> stored(expected.size());
+            const uint64_t offset = WuffCryptFile::dataEnd(trailer.plaintextLength);
+            ssize_t bytesRead = fileio::preadAll(inFd, stored.data(), stored.size(), offset);
+            if(bytesRead < 0 || static_cast<size_t>(bytesRead) != stored.size()) {
+                fail(WuffCryptFile::FileStatus::ReadError);
+                return;
+            }
+
+            if(sodium_memcmp(&expected[expected.size() - merkle::NODE_BYTES], trailer.merkleRoot, merkle::NODE_BYTES) != 0 ||
+               memcmp(expected.data(), stored.data(), stored.size()) != 0) {
+                badIndex = true;
+                fail(WuffCryptFile::FileStatus::VerificationFailed);
+            }
+        }
+
+        void done() override {
+            FileVerifyJob::Result result;
+            result.status = status();
+            result.badIndex = badIndex;
+            result.rebuiltBlocks = rebuilt;
+            result.badBlock = badBlock;
+            result.badOffset = (result.badBlock == UINT64_MAX)? 0 : WuffCryptFile::blockOffset(result.badBlock);
+            _callback(result);
+        }
+
+    private:
+        FileVerifyJob::Callback _callback;
+    };
+
+    void verifyRange(VerifyState& state, uint64_t first, uint64_t last) {
+        SodiumEncryptedBuffer buf(WuffCryptFile::BLOCK_SIZE);
+        fileio::DropBehind dropIn(state.dropInFd(), false, WuffCryptFile::HEADER_SIZE + first * WuffCryptFile::ENCRYPTED_BLOCK_SIZE);
+
+        for(uint64_t n = first; n < last && n < state.badBlock; n += 1) {
+            // Blocks of zeros were never stored, and their tags are left as zeros
+            if(state.trailer.isZero(n)) continue;
+
+            const uint64_t offset = n * WuffCryptFile::ENCRYPTED_BLOCK_SIZE;
+            size_t len = 0;
+            Nonce nonce;
+
+            if(state.header.version == 0) {
+                len = static_cast<size_t>(std::min<uint64_t>(WuffCryptFile::ENCRYPTED_BLOCK_SIZE, state.dataSize - offset));
+                nonce = Nonce::counter(state.header.nonce, state.header.counter(n));
+            }
+            else {
+                const size_t plainLen = WuffCryptFile::blockLength(state.trailer.plaintextLength, n);
+                len = plainLen + crypto_secretbox_xsalsa20poly1305_MACBYTES;
+                nonce = WuffCryptFile::blockNonce(state.header.nonce, n, plainLen);
+            }
+
+            BlockTimer timer;
+            ssize_t bytesRead = 0;
+            {
+                ThrottledIO throttled(Throttle::Direction::Read, len);
+                StageTimer reading(Stats::Stage::Read);
+                bytesRead = fileio::preadAll(state.inFd, buf.data(), len, WuffCryptFile::HEADER_SIZE + offset);
+            }
+            WUFF_PROBE2(block__read, n, bytesRead);
+            if(bytesRead < 0 || static_cast<size_t>(bytesRead) != len) {
+                state.fail(WuffCryptFile::FileStatus::ReadError);
+                return;
+            }
+
+            int failed = 0;
+            {
+                ThrottledCPU cpu;
+                StageTimer crypto(Stats::Stage::Crypto);
+                const size_t plainLen = len - crypto_secretbox_xsalsa20poly1305_MACBYTES;
+                WUFF_PROBE2(block__decrypt__start, n, plainLen);
+                failed = state.dec->authenticate(buf.data(), len, nonce);
+                WUFF_PROBE3(block__decrypt__done, n, plainLen, failed == 0);
+            }
+            if(failed != 0 && state.trailer.parityShards > 0 &&
+               WuffCryptFile::rebuildBlock(state.inFd, state.trailer, *state.dec, n, buf.data()) == WuffCryptFile::FileStatus::OK) {
+                failed = 0;
+                state.rebuilt += 1;
+            }
+            if(failed != 0) {
+                state.failBlock(n);
+                return;
+            }
+
+            if(!state.tags.empty()) {
+                memcpy(&state.tags[n * merkle::TAG_BYTES], buf.data(), merkle::TAG_BYTES);
+            }
+
+            dropIn.advanceTo(WuffCryptFile::HEADER_SIZE + offset + len);
+
+            timer.done(len);
+        }
+    }
+}
+
+void FileEncryptJob::start(WorkStealingPool& pool, const DerivedKey& key,
+                           const std::string& inPath, const std::string& outPath,
+                           const WuffCryptFile::Options& options, Callback done) {
+    startPart(pool, key, inPath, outPath, nullptr, 0, options, done);
+}
+
+void FileEncryptJob::startVolume(WorkStealingPool& pool, const DerivedKey& key,
+                                 const std::string& inPath, const std::string& outPath,
+                                 const WuffCryptFile::Volume& volume, uint64_t length,
+                                 const WuffCryptFile::Options& options, Callback done) {
+    startPart(pool, key, inPath, outPath, &volume, length, options, done);
+}
+
+void FileEncryptJob::startPart(WorkStealingPool& pool, const DerivedKey& key,
+                               const std::string& inPath, const std::string& outPath,
+                               const WuffCryptFile::Volume* volumePtr, uint64_t length,
+                               const WuffCryptFile::Options& options, Callback done) {
+    const DerivedKey* keyPtr = &key;
+    WorkStealingPool* poolPtr = &pool;
+    const bool isVolume = volumePtr != nullptr;
+    const WuffCryptFile::Volume volume = isVolume? *volumePtr : WuffCryptFile::Volume();
+
+    pool.submit([poolPtr, keyPtr, inPath, outPath, isVolume, volume, length, options, done]() {
+        bool direct = false;
+        uint64_t fileSize = 0;
+        int inFd = (options.cache == fileio::CacheMode::Direct)? fileio::openDirect(inPath, direct) : open(inPath.c_str(), O_RDONLY);
+        bool inOK = inFd >= 0 && fileio::regularFileSize(inFd, fileSize);
+
+        // A volume whose part of the input is no longer there cannot be written
+        const uint64_t inOffset = isVolume? volume.offset : 0;
+        const uint64_t size = isVolume? length : fileSize;
+        if(isVolume && (inOffset > fileSize || size > fileSize - inOffset)) inOK = false;
+
+        int outFd = -1;
+        if(inOK && options.append) {
+            outFd = open(outPath.c_str(), O_RDWR);
+        }
+        if(inOK && outFd < 0 && !(options.append && errno != ENOENT)) {
+            outFd = open(outPath.c_str(), options.resume? (O_RDWR | O_CREAT) : (O_WRONLY | O_CREAT | O_TRUNC), 0666);
+        }
+
+        // An earlier append that never finished is undone before anything else is read
+        WuffCryptFile::FileStatus restored = WuffCryptFile::FileStatus::OK;
+        if(options.append && outFd >= 0) restored = restoreRollback(*keyPtr, rollbackPath(outPath), outFd);
+
+        // Appending carries on with the existing archive's header, and nothing else will do
+        uint8_t existingHeader[WuffCryptFile::HEADER_SIZE];
+        WuffCryptFile::Header header;
+        const bool appending = options.append && outFd >= 0 && (fileio::preadAll(outFd, existingHeader, 1, 0) == 1);
+        const bool appendable = appending && readHeader(*keyPtr, outFd, existingHeader, header);
+
+        // Carry on with the nonce prefix of an interrupted output, or start over
+        uint8_t noncePrefix[encrypt_NONCEPREFIXBYTES];
+        uint64_t resumeEnd = 0;
+        const bool resuming = options.resume && !options.append && outFd >= 0 && canResume(*keyPtr, outPath, inFd, inOffset, size, outFd, noncePrefix, resumeEnd);
+        if(options.resume && !options.append && outFd >= 0 && !resuming && ftruncate(outFd, 0) != 0) {
+            close(outFd);
+            outFd = -1;
+        }
+        if(appendable) {
+            memcpy(noncePrefix, header.nonce, sizeof(noncePrefix));
+        }
+
+        std::shared_ptr<EncryptState> state(new EncryptState(*keyPtr, (resuming || appendable)? noncePrefix : nullptr, options, done));
+        state->cache = options.cache;
+        state->inFd = inFd;
+        state->outFd = outFd;
+        state->direct = direct;
+        state->inOffset = inOffset;
+        state->size = size;
+        if(resuming) {
+            state->reopened = true;
+            state->dec.reset(new Decrypter(*keyPtr, noncePrefix));
+            state->resumeEnd = resumeEnd;
+        }
+
+        if(!inOK) {
+            state->fail(WuffCryptFile::FileStatus::ReadError);
+            state->finish();
+            return;
+        }
+
+        if(state->outFd < 0) {
+            state->fail(WuffCryptFile::FileStatus::OpenError);
+            state->finish();
+            return;
+        }
+
+        if(restored != WuffCryptFile::FileStatus::OK) {
+            state->fail(restored);
+            state->finish();
+            return;
+        }
+
+        layOut(*state);
+        state->layout.hasVolume = isVolume;
+        state->layout.volume = volume;
+
+        if(appending) {
+            state->reopened = true;
+            state->rollback = rollbackPath(outPath);
+            WuffCryptFile::FileStatus status = appendable? openAppend(*state, *keyPtr) : WuffCryptFile::FileStatus::WrongVersion;
+            if(status == WuffCryptFile::FileStatus::OK && !state->carried.hasDigest && (options.digest || options.storeDigest)) {
+                // The digest covers every block, and the old ones are not read again
+                status = WuffCryptFile::FileStatus::WrongVersion;
+            }
+
+            if(status != WuffCryptFile::FileStatus::OK) {
+                state->fail(status);
+                state->finish();
+                return;
+            }
+
+            // Keep what the archive already records: its format, its digest, and whether it may
+            // have holes
+            memcpy(state->header, existingHeader, sizeof(state->header));
+            state->options.storeDigest = state->carried.hasDigest;
+            state->options.sparse = options.sparse && header.version >= WuffCryptFile::SPARSE_VERSION;
+            state->layout.dataShards = state->layout.parityShards = 0;
+            state->chunkBlocks = FileEncryptJob::CHUNK_BLOCKS;
+        }
+
+        // Before any block goes out under a new nonce prefix, record what it is encrypting, so
+        // that an interrupted run can be resumed.  One block is as quick to encrypt again as to
+        // check, so small outputs go without.
+        if(!appending) state->checkpoint = checkpointPath(outPath);
+        if(!appending && !resuming) {
+            unlink(rollbackPath(outPath).c_str());
+            uint8_t checkpoint[CHECKPOINT_BYTES];
+            if(state->nBlocks > 1 && describeInput(inFd, inOffset, size, state->enc.noncePrefix(), checkpoint)) {
+                writeCheckpoint(*keyPtr, state->checkpoint, checkpoint);
+            }
+            else {
+                unlink(state->checkpoint.c_str());
+            }
+        }
+
+        // The kept blocks may not include the first, which would otherwise bring the header
+        if(resuming && !fileio::pwriteAll(state->outFd, state->header, sizeof(state->header), 0)) {
+            state->fail(WuffCryptFile::FileStatus::WriteError);
+            state->finish();
+            return;
+        }
+
+        if(state->options.sparse) {
+            // Full blocks lying entirely in a hole are zeros without having to read them.  The
+            // final block is always stored.
+            state->zero.resize(state->nBlocks);
+            std::vector<std::pair<uint64_t, uint64_t>> holes;
+            fileio::findHoles(state->inFd, inOffset + state->size, holes);
+            for(const auto& hole : holes) {
+                // Holes before a volume's part of the input come to nothing
+                const uint64_t holeEnd = hole.first + hole.second;
+                if(holeEnd <= inOffset) continue;
+
+                const uint64_t start = std::max(hole.first, inOffset) - inOffset;
+                const uint64_t end = std::min((holeEnd - inOffset) / WuffCryptFile::BLOCK_SIZE, state->nBlocks - 1);
+                for(uint64_t n = (start + WuffCryptFile::BLOCK_SIZE - 1) / WuffCryptFile::BLOCK_SIZE; n < end; n += 1) {
+                    state->zero[n] = 1;
+                }
+            }
+        }
+
+        queueBlocks(*poolPtr, state);
+    });
+}
+
+void FileEncryptJob::startUpgrade(WorkStealingPool& pool, KeyCache& keys,
+                                  const std::string& inPath, const std::string& outPath,
+                                  const WuffCryptFile::Options& options, Callback done) {
+    KeyCache* keysPtr = &keys;
+    WorkStealingPool* poolPtr = &pool;
+
+    pool.submit([poolPtr, keysPtr, inPath, outPath, options, done]() {
+        WuffCryptFile::Options jobOptions = options;
+        jobOptions.resume = false;
+        jobOptions.append = false;
+        const DerivedKey* key = keysPtr->tryGet(WuffCryptFile::WORK_FACTOR);
+        if(key == nullptr) {
+            FileEncryptJob::Result result;
+            result.status = WuffCryptFile::FileStatus::NoMemory;
+            result.keptBlocks = 0;
+            done(result);
+            return;
+        }
+        std::shared_ptr<EncryptState> state(new EncryptState(*key, nullptr, jobOptions, done));
+
+        // The older file's blocks are not aligned, so it is never read with O_DIRECT
+        state->cache = options.cache;
+        uint64_t fileSize = 0;
+        state->inFd = open(inPath.c_str(), O_RDONLY);
+        if(state->inFd < 0 || !fileio::regularFileSize(state->inFd, fileSize)) {
+            state->fail(WuffCryptFile::FileStatus::OpenError);
+            state->finish();
+            return;
+        }
+
+        uint8_t headerBuf[WuffCryptFile::HEADER_SIZE];
+        ssize_t bytesRead = fileio::preadAll(state->inFd, headerBuf, sizeof(headerBuf), 0);
+        WuffCryptFile::FileStatus status = (bytesRead < 0)? WuffCryptFile::FileStatus::ReadError :
+                                           WuffCryptFile::decodeHeader(headerBuf, static_cast<size_t>(bytesRead), state->sourceHeader);
+        const DerivedKey* sourceKey = (status == WuffCryptFile::FileStatus::OK)? keysPtr->tryGet(state->sourceHeader.workFactor) : nullptr;
+        if(status == WuffCryptFile::FileStatus::OK && sourceKey == nullptr) {
+            status = WuffCryptFile::FileStatus::NoMemory;
+        }
+        if(status == WuffCryptFile::FileStatus::OK) {
+            state->source.reset(new Decrypter(*sourceKey, state->sourceHeader.nonce));
+            status = openSource(*state, fileSize);
+        }
+
+        if(status != WuffCryptFile::FileStatus::OK) {
+            state->fail(status);
+            state->finish();
+            return;
+        }
+
+        state->outFd = open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if(state->outFd < 0) {
+            state->fail(WuffCryptFile::FileStatus::OpenError);
+            state->finish();
+            return;
+        }
+
+        // A stored digest is carried over, and checked once every block has been re-encrypted
+        if(state->sourceTrailer.hasDigest) state->options.storeDigest = true;
+
+        layOut(*state);
+        if(state->options.sparse) state->zero.resize(state->nBlocks);
+        queueBlocks(*poolPtr, state);
+    });
+}
+
+void FileVerifyJob::start(WorkStealingPool& pool, KeyCache& keys, const std::string& path,
+                          const WuffCryptFile::Options& options, Callback done) {
+    KeyCache* keysPtr = &keys;
+    WorkStealingPool* poolPtr = &pool;
+    const fileio::CacheMode cache = options.cache;
+
+    pool.submit([poolPtr, keysPtr, path, cache, done]() {
+        std::shared_ptr<VerifyState> state(new VerifyState(done));
+        state->cache = cache;
+
+        uint64_t size = 0;
+        state->inFd = open(path.c_str(), O_RDONLY);
+        if(state->inFd < 0 || !fileio::regularFileSize(state->inFd, size)) {
+            state->fail(WuffCryptFile::FileStatus::OpenError);
+            state->finish();
+            return;
+        }
+
+        uint8_t headerBuf[WuffCryptFile::HEADER_SIZE];
+        ssize_t bytesRead = fileio::preadAll(state->inFd, headerBuf, sizeof(headerBuf), 0);
+        if(bytesRead < 0) {
+            state->fail(WuffCryptFile::FileStatus::ReadError);
+            state->finish();
+            return;
+        }
+
+        auto status = WuffCryptFile::decodeHeader(headerBuf, static_cast<size_t>(bytesRead), state->header);
+        if(status != WuffCryptFile::FileStatus::OK) {
+            state->fail(status);
+            state->finish();
+            return;
+        }
+
+        const DerivedKey* key = keysPtr->tryGet(state->header.workFactor);
+        if(key == nullptr) {
+            state->fail(WuffCryptFile::FileStatus::NoMemory);
+            state->finish();
+            return;
+        }
+
+        state->dec.reset(new Decrypter(*key, state->header.nonce));
+
+        if(state->header.version == 0) {
+            // Every file ends with a partial block.  If the data ends on a block boundary, the
+            // final block is missing, and the file has been truncated.
+            state->dataSize = size - WuffCryptFile::HEADER_SIZE;
+            state->nBlocks = state->dataSize / WuffCryptFile::ENCRYPTED_BLOCK_SIZE + 1;
+            if(state->dataSize % WuffCryptFile::ENCRYPTED_BLOCK_SIZE == 0) {
+                state->failBlock(state->nBlocks - 1);
+                state->finish();
+                return;
+            }
+        }
+        else {
+            // Later formats record their length in an authenticated trailer
+            status = WuffCryptFile::openTrailer(state->inFd, size, *state->dec, state->trailer);
+            if(status != WuffCryptFile::FileStatus::OK) {
+                state->fail(status);
+                state->finish();
+                return;
+            }
+
+            state->nBlocks = WuffCryptFile::blockCount(state->trailer.plaintextLength);
+            if(state->trailer.hasMerkleRoot) {
+                state->tags.resize(state->nBlocks * merkle::TAG_BYTES);
+            }
+        }
+
+        runChunks(*poolPtr, state, verifyRange);
+    });
+}
@@ -0,0 +1,90 @@
+// filejob.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include "threadpool.hpp"
+#include "wuffcrypt.hpp"
+
+// Encrypts one regular file into a wuffcrypt file on a WorkStealingPool.  Blocks are encrypted
+// independently and written directly into their final position in the output, so a large file
+// is split into runs of blocks that idle workers can steal, while a small file is handled by a
+// single task.
+class FileEncryptJob {
+public:
+    struct Result {
+        WuffCryptFile::FileStatus status;
+
+        // Filled in if Options::digest or Options::storeDigest was set
+        PlaintextDigest digest;
+
+        // With Options::resume, how many blocks of the earlier output were kept
+        uint64_t keptBlocks;
+    };
+
+    typedef std::function<void(const Result& result)> Callback;
+
+    // Blocks per task when splitting up a large file
+    static const uint64_t CHUNK_BLOCKS = 8;
+
+    // Queue the job.  done is called exactly once, from a worker thread, after the output has
+    // been closed.  The key must outlive the job.
+    static void start(WorkStealingPool& pool, const DerivedKey& key,
+                      const std::string& inPath, const std::string& outPath,
+                      const WuffCryptFile::Options& options, Callback done);
+
+    // Queue a job for one volume of a set: the length bytes of the input from volume.offset,
+    // which must be a multiple of BLOCK_SIZE, as a complete file of its own with the volume
+    // recorded in its trailer.  Options::append is not supported.
+    static void startVolume(WorkStealingPool& pool, const DerivedKey& key,
+                            const std::string& inPath, const std::string& outPath,
+                            const WuffCryptFile::Volume& volume, uint64_t length,
+                            const WuffCryptFile::Options& options, Callback done);
+
+    // Queue a job that rewrites an older wuffcrypt file in the current format, under a fresh
+    // nonce prefix.  Each block is decrypted and encrypted again in memory, so no plaintext
+    // reaches the disk, and the whole file must authenticate for the job to succeed.  A stored
+    // digest is carried over and checked.  keys must hold, or be able to derive, the keys for the
+    // older file's work factor and WORK_FACTOR.  Options::resume and Options::append are ignored.
+    static void startUpgrade(WorkStealingPool& pool, KeyCache& keys,
+                             const std::string& inPath, const std::string& outPath,
+                             const WuffCryptFile::Options& options, Callback done);
+
+private:
+    // start() or startVolume(); volume is null for a whole file
+    static void startPart(WorkStealingPool& pool, const DerivedKey& key,
+                          const std::string& inPath, const std::string& outPath,
+                          const WuffCryptFile::Volume* volume, uint64_t length,
+                          const WuffCryptFile::Options& options, Callback done);
+};
+
+// Authenticates every block of a wuffcrypt file without decrypting it or producing any output.
+// Blocks are checked in parallel in the same runs as FileEncryptJob.
+class FileVerifyJob {
+public:
+    struct Result {
+        WuffCryptFile::FileStatus status;
+
+        // If status is VerificationFailed, the first block that did not authenticate, and its
+        // position in the file.  If the trailer itself failed, badBlock is UINT64_MAX.
+        uint64_t badBlock;
+        uint64_t badOffset;
+
+        // Every block was authentic, but the Merkle index does not match them
+        bool badIndex;
+
+        // Blocks that failed, but that their stripe's parity rebuilt.  The file still decrypts,
+        // but is damaged.
+        uint64_t rebuiltBlocks;
+    };
+
+    typedef std::function<void(const Result& result)> Callback;
+
+    // Queue the job.  done is called exactly once, from a worker thread.  Only options.cache
+    // applies; verification never reads with O_DIRECT, as blocks are not aligned in the file.
+    static void start(WorkStealingPool& pool, KeyCache& keys, const std::string& path,
+                      const WuffCryptFile::Options& options, Callback done);
+};
@@ -1,16 +1,72 @@
 // main.cpp - Part of WuffCrypt
 // Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
 
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include "archive.hpp"
 #include "arguments.hpp"
+#include "budget.hpp"
+#include "filejob.hpp"
+#include "securearena.hpp"
+#include "stats.hpp"
+#include "stream.hpp"
+#include "threadpool.hpp"
+#include "throttle.hpp"
+#include "tree.hpp"
 #include "wuffcrypt.hpp"
 
 void printUsage(const char* path) {
     printf("wuffcrypt %s\n", WUFFCRYPT_VERSION);
     printf("Usage: %s [-d | -e] -p [password] infile outfile\n", path);
+    printf("       %s -e -p [password] infile -\n", path);
+    printf("       %s -d -p [password] - outfile\n", path);
+    printf("       %s -e -r -p [password] srcdir dstdir\n", path);
+    printf("       %s -t -p [password] file...\n", path);
+    printf("       %s [--root | --verify-range first[-last]] -p [password] file...\n", path);
+    printf("       %s --compare -p [password] file1 file2\n", path);
+    printf("       %s --upgrade -p [password] file...\n", path);
     printf("\t-d: Decrypt\n");
     printf("\t-e: Encrypt\n");
+    printf("\t-t: Test that every block of each file is authentic, without decrypting\n");
     printf("\t-p: Password.  If this argument is missing, a prompt will be offered.\n");
+    printf("\t--password-fd: Read the password from file descriptor N instead, such as a pipe, so that it\n");
+    printf("\t               does not appear in the process list.  One trailing newline is dropped.\n");
+    printf("\t--password-file: Read the password from a file instead\n");
+    printf("\t-r: Encrypt every file under srcdir into a matching .wuff file under dstdir\n");
+    printf("\t-j: Number of worker threads.  Defaults to the number of processors.\n");
+    printf("\t--cache: keep (the default), drop to evict file data from the page cache once it has\n");
+    printf("\t         been processed, or direct to also read with O_DIRECT where possible\n");
+    printf("\t--max-memory: Stay within SIZE bytes (or K, M, G), with fewer threads if need be\n");
+    printf("\t--rate: Read and write at most RATE bytes (or K, M, G) a second, or READ:WRITE to limit\n");
+    printf("\t        each on its own, where 0 is unlimited.  Reads slow down further while the source is busy.\n");
+    printf("\t--cpu: Let crypto take at most PERCENT of each worker thread\n");
+    printf("\t--throttle-file: Take \"rate READ[:WRITE]\" and \"cpu PERCENT\" lines from a file, rereading it\n");
+    printf("\t                 whenever it changes or on SIGHUP\n");
+    printf("\t--nice-io: Only use the disk when nothing else wants it (Linux's idle I/O class)\n");
+    printf("\t--digest: Print a digest of the plaintext as it is encrypted or decrypted\n");
+    printf("\t--digest-json: Print the digest as a JSON object\n");
+    printf("\t--store-digest: Record the digest in the encrypted file, to be checked when decrypting\n");
+    printf("\t--sparse: Store blocks of zeros as holes instead of encrypting them.  Reveals where they are.\n");
+    printf("\t--resume: Keep what an interrupted -e or -d already wrote to the output, and do only the rest\n");
+    printf("\t--parity: With DATA+PARITY, such as 16+2, add PARITY blocks for every DATA blocks, so that\n");
+    printf("\t          up to PARITY damaged blocks in each run can be rebuilt when decrypting\n");
+    printf("\t--append: Extend the output with what was added to the end of the input since it was encrypted\n");
+    printf("\t--volume-size: Split the output into outfile.000, outfile.001 and so on, each holding at most\n");
+    printf("\t               SIZE bytes (or K, M, G) of the input and decryptable on its own.  -d outfile\n");
+    printf("\t               checks and decrypts the whole set; -d outfile.001 writes just its part in place.\n");
+    printf("\t--root: Print the authenticated Merkle root of each file's block tags\n");
+    printf("\t--verify-range: Test only the given blocks, and check them against the Merkle root\n");
+    printf("\t--stats: Print a JSON summary of where time was spent to standard error\n");
+    printf("\t--stats-file: Write the --stats summary to a file instead\n");
+    printf("\t--compare: Check that two copies of a file record the same blocks, reading only their Merkle indexes\n");
+    printf("\t--upgrade: Rewrite each file written by an older version in the current format, in place.\n");
+    printf("\t           --sparse, --parity and --store-digest apply to the rewritten files.\n");
 }
 
 void printUsageError(const char* path, const char* msg) {
@@ -19,8 +75,300 @@ void printUsageError(const char* path, const char* msg) {
     exit(1);
 }
 
+void printDigest(Arguments::DigestMode mode, const std::string& archive, const std::string& plaintext, const PlaintextDigest& digest) {
+    switch(mode) {
+        case Arguments::DigestMode::None: { break; }
+        case Arguments::DigestMode::Text: {
+            printf("%s  %s\n", digest.hex().c_str(), plaintext.c_str());
+            break;
+        }
+        case Arguments::DigestMode::JSON: {
+            printf("{\"archive\": %s, \"plaintext\": %s, \"algorithm\": %s, \"digest\": \"%s\"}\n",
+                   jsonString(archive).c_str(), jsonString(plaintext).c_str(),
+                   jsonString(PlaintextDigest::ALGORITHM).c_str(), digest.hex().c_str());
+            break;
+        }
+    }
+
+    fflush(stdout);
+}
+
+// Why a file could not be opened or checked, for the Merkle index operations
+const char* describeFailure(WuffCryptFile::FileStatus status) {
+    switch(status) {
+        case WuffCryptFile::FileStatus::OK: return "OK";
+        case WuffCryptFile::FileStatus::OpenError: return "error opening file";
+        case WuffCryptFile::FileStatus::InvalidFileType: return "not a wuffcrypt file";
+        case WuffCryptFile::FileStatus::CorruptHeader: return "corrupt header";
+        case WuffCryptFile::FileStatus::VerificationFailed: return "does not authenticate";
+        case WuffCryptFile::FileStatus::WrongVersion: return "no Merkle index; written by an older version";
+        case WuffCryptFile::FileStatus::Truncated: return "truncated, or never finished";
+        case WuffCryptFile::FileStatus::WriteError: return "error writing file";
+        case WuffCryptFile::FileStatus::NoMemory: return "out of memory";
+        default: return "error reading file";
+    }
+}
+
+// Read and decode the header of a wuffcrypt file
+WuffCryptFile::FileStatus peekHeader(const std::string& path, WuffCryptFile::Header& header) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if(f == nullptr) return WuffCryptFile::FileStatus::OpenError;
+
+    uint8_t buf[WuffCryptFile::HEADER_SIZE];
+    const size_t bytesRead = fread(buf, sizeof(uint8_t), sizeof(buf), f);
+    const bool failed = ferror(f) != 0;
+    fclose(f);
+
+    return failed? WuffCryptFile::FileStatus::ReadError : WuffCryptFile::decodeHeader(buf, bytesRead, header);
+}
+
+// Derive the key to write with, saying so if there is not the memory for it
+const DerivedKey* writingKey(KeyCache& keys) {
+    const DerivedKey* key = keys.tryGet(WuffCryptFile::WORK_FACTOR);
+    if(key == nullptr) fprintf(stderr, "Out of memory deriving the key\n");
+    return key;
+}
+
+// Put a finished rewrite of a file in its place, with the original's permissions.  It reaches
+// the disk first, so that a crash leaves one copy or the other.
+bool replaceFile(const std::string& path, const std::string& newPath) {
+    struct stat st;
+    int fd = open(newPath.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+
+    const bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced && stat(path.c_str(), &st) == 0 && chmod(newPath.c_str(), st.st_mode & 07777) == 0 &&
+           rename(newPath.c_str(), path.c_str()) == 0;
+}
+
+// The path of volume i of a set written to base
+std::string volumePath(const std::string& base, uint32_t i) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%03u", i);
+    return base + suffix;
+}
+
+// Find every volume of the set written to base, and check, from their authenticated trailers,
+// that they belong together: one set, each volume in its place, and none missing.  Says what is
+// wrong if they do not.
+bool findVolumes(const std::string& base, KeyCache& keys, std::vector<std::string>& paths) {
+    WuffCryptFile::Volume first;
+    uint64_t expected = 0;
+    for(uint32_t i = 0; i == 0 || i < first.count; i += 1) {
+        const std::string path = volumePath(base, i);
+        ArchiveReader archive;
+        auto status = archive.open(path, keys);
+        if(status != WuffCryptFile::FileStatus::OK) {
+            fprintf(stderr, "%s: %s\n", path.c_str(), (status == WuffCryptFile::FileStatus::OpenError)? "missing volume" : describeFailure(status));
+            return false;
+        }
+
+        const WuffCryptFile::Trailer& trailer = archive.trailer();
+        if(!trailer.hasVolume) {
+            fprintf(stderr, "%s: not a volume of a set\n", path.c_str());
+            return false;
+        }
+
+        const WuffCryptFile::Volume& volume = trailer.volume;
+        if(i == 0) first = volume;
+        if(volume.index != i || volume.count != first.count || volume.offset != expected ||
+           volume.totalLength != first.totalLength || memcmp(volume.setId, first.setId, sizeof(first.setId)) != 0) {
+            fprintf(stderr, "%s: volume %u of %u of another set, or renamed\n", path.c_str(), volume.index + 1, volume.count);
+            return false;
+        }
+
+        expected += trailer.plaintextLength;
+        paths.push_back(path);
+    }
+
+    if(expected != first.totalLength) {
+        fprintf(stderr, "%s: volumes hold %llu of %llu bytes\n", base.c_str(),
+                static_cast<unsigned long long>(expected), static_cast<unsigned long long>(first.totalLength));
+        return false;
+    }
+
+    return true;
+}
+
+// Say why decrypting part into outPath failed, if it did
+bool reportDecryption(WuffCryptFile::FileStatus status, const std::string& part, const std::string& outPath) {
+    switch(status) {
+        case WuffCryptFile::FileStatus::OpenError: {
+            fprintf(stderr, "Error opening %s.\n", part.c_str());
+            return false;
+        }
+        case WuffCryptFile::FileStatus::InvalidFileType: {
+            fprintf(stderr, "%s is not a wuffcrypt file.\n", part.c_str());
+            return false;
+        }
+        case WuffCryptFile::FileStatus::CorruptHeader: {
+            fprintf(stderr, "%s is a corrupt wuffcrypt file.\n", part.c_str());
+            return false;
+        }
+        case WuffCryptFile::FileStatus::VerificationFailed: {
+            fprintf(stderr, "Failed to decrypt.  Either the password is wrong, or the file has been tampered with in some way.\n");
+            return false;
+        }
+        case WuffCryptFile::FileStatus::WrongVersion: {
+            fprintf(stderr, "File version mismatch\n");
+            return false;
+        }
+        case WuffCryptFile::FileStatus::ReadError: {
+            fprintf(stderr, "Error reading %s\n", part.c_str());
+            return false;
+        }
+        case WuffCryptFile::FileStatus::WriteError: {
+            fprintf(stderr, "Error writing %s\n", outPath.c_str());
+            return false;
+        }
+        case WuffCryptFile::FileStatus::Truncated: {
+            fprintf(stderr, "%s is truncated, or was never finished.\n", part.c_str());
+            return false;
+        }
+        case WuffCryptFile::FileStatus::NoMemory: {
+            fprintf(stderr, "Out of memory\n");
+            return false;
+        }
+        case WuffCryptFile::FileStatus::OK: { break; }
+    }
+
+    return true;
+}
+
+// Decrypt standard input, which can only be read front to back, into outPath.  It is read a
+// block for each thread at a time, and each run of blocks is decrypted across the pool while the
+// next is awaited, so a download piped in is decrypted as fast as the pool allows, in one pass.
+int decryptStandardInput(const Arguments& args, const WuffCryptFile::Options& options, size_t nThreads, bool dropCache) {
+    KeyCache keys(args.password());
+    WorkStealingPool pool(nThreads);
+    StreamDecrypter decrypter(keys, options);
+    decrypter.setPool(&pool);
+
+    FILE* outFile = args.resume()? fopen(args.outPath().c_str(), "r+b") : nullptr;
+    if(outFile == nullptr) {
+        outFile = fopen(args.outPath().c_str(), "wb");
+    }
+    if(outFile == nullptr) {
+        fprintf(stderr, "Error opening %s\n", args.outPath().c_str());
+        return 1;
+    }
+    blockio::FileSink sink(outFile, dropCache, args.resume());
+    blockio::FdSource source(STDIN_FILENO);
+
+    // What is held back between calls is less than a block, so the output never needs more
+    // than a block for each one read
+    std::vector<uint8_t> ctext(nThreads * WuffCryptFile::ENCRYPTED_BLOCK_SIZE);
+    SodiumMessageBuffer plain(nThreads * WuffCryptFile::BLOCK_SIZE);
+    const std::string name = "standard input";
+
+    for(;;) {
+        BlockTimer blockTimer;
+        ssize_t bytesRead = 0;
+        {
+            ThrottledIO throttled(Throttle::Direction::Read, ctext.size());
+            StageTimer timer(Stats::Stage::Read);
+            bytesRead = source.read(ctext.data(), ctext.size());
+        }
+        if(bytesRead < 0) {
+            fprintf(stderr, "Error reading %s\n", name.c_str());
+            return 1;
+        }
+        if(bytesRead == 0) break;
+
+        size_t written = 0;
+        WuffCryptFile::FileStatus status;
+        {
+            ThrottledCPU cpu;
+            StageTimer timer(Stats::Stage::Crypto);
+            status = decrypter.update(ctext.data(), static_cast<size_t>(bytesRead), plain.data(), written);
+        }
+        if(!reportDecryption(status, name, args.outPath())) return 1;
+
+        {
+            ThrottledIO throttled(Throttle::Direction::Write, written);
+            StageTimer timer(Stats::Stage::Write);
+            if(!sink.write(plain.data(), written)) {
+                fprintf(stderr, "Error writing %s\n", args.outPath().c_str());
+                return 1;
+            }
+        }
+
+        // Every block of a run took as long as the run
+        for(size_t done = 0; done < written; done += WuffCryptFile::BLOCK_SIZE) {
+            blockTimer.done(WuffCryptFile::BLOCK_SIZE);
+        }
+    }
+
+    // The final block, Merkle index and trailer, checked as a whole.  Only the final block is
+    // left to decrypt, and it fits where the others went.
+    size_t written = 0;
+    if(!reportDecryption(decrypter.final(plain.data(), written), name, args.outPath())) return 1;
+    if(!sink.write(plain.data(), written) || !sink.finish()) {
+        fprintf(stderr, "Error writing %s\n", args.outPath().c_str());
+        return 1;
+    }
+
+    if(sink.kept() > 0) {
+        fprintf(stderr, "Resumed %s, keeping %llu MiB\n", args.outPath().c_str(),
+                static_cast<unsigned long long>(sink.kept() >> 20));
+    }
+
+    fclose(outFile);
+    printDigest(args.digestMode(), args.inPath(), args.outPath(), decrypter.digest());
+    return 0;
+}
+
+// Writes the --stats summary, and peak memory use under --max-memory, however main() returns
+class RunReport {
+public:
+    RunReport(const Arguments& args, size_t threads): _args(args), _threads(threads) {
+        if(_args.stats()) Stats::activate(&_stats);
+    }
+
+    ~RunReport() {
+        if(_args.maxMemory() > 0) {
+            const SecureArena& arena = SecureArena::blocks();
+            fprintf(stderr, "Peak memory use: %.1f MiB of %.1f MiB (block buffers: %zu of %zu; threads: %zu)\n",
+                    Stats::peakRssKb() / 1024.0, _args.maxMemory() / (1024.0 * 1024.0),
+                    arena.peakInUse(), arena.slots(), _threads);
+        }
+
+        if(!_args.stats()) return;
+        Stats::activate(nullptr);
+
+        FILE* f = _args.statsPath().empty()? stderr : fopen(_args.statsPath().c_str(), "w");
+        if(f == nullptr) {
+            fprintf(stderr, "Error opening %s\n", _args.statsPath().c_str());
+            return;
+        }
+
+        _stats.write(f, operationName(_args.operation()), _threads);
+        if(f != stderr) fclose(f);
+    }
+
+private:
+    static const char* operationName(Operation operation) {
+        switch(operation) {
+            case Operation::Encrypt: return "encrypt";
+            case Operation::Decrypt: return "decrypt";
+            case Operation::Test: return "test";
+            case Operation::PrintRoot: return "root";
+            case Operation::VerifyRange: return "verify-range";
+            case Operation::Compare: return "compare";
+            case Operation::Upgrade: return "upgrade";
+            default: return "none";
+        }
+    }
+
+    const Arguments& _args;
+    const size_t _threads;
+    Stats _stats;
+};
+
 int main(int argc, char** argv) {
-    printf("\nwuffcrypt is experimental software; while it is belived to provide\n"
+    // Standard output is kept for results that other programs may want to parse
+    fprintf(stderr, "\nwuffcrypt is experimental software; while it is belived to provide\n"
            "best-of-breed encryption, it has not undergone any third-party vetting\n"
            "or peer-review process.  It is therefore suggested that you use it only in\n"
            "circumstances where you are willing to accept the cost of faulty functioning.\n\n");
@@ -33,6 +381,10 @@ int main(int argc, char** argv) {
             printUsageError(argv[0], "Unknown option");
             break;
         }
+        case Arguments::Status::InvalidValue: {
+            printUsageError(argv[0], "Invalid option value");
+            break;
+        }
         case Arguments::Status::NoPath: {
             printUsageError(argv[0], "No path provided");
             break;
@@ -56,67 +408,593 @@ int main(int argc, char** argv) {
         printUsageError(argv[0], "No operation provided");
     }
 
+    if(!args.readPassword()) {
+        fprintf(stderr, "Error reading the password from %s\n", args.passwordSource().c_str());
+        return 1;
+    }
+
     if(args.password().empty()) {
         printUsageError(argv[0], "No password provided");
     }
 
-    if(args.operation() == Operation::Encrypt) {
-        FILE* inFile = fopen(args.inPath().c_str(), "rb");
-        if(inFile == nullptr) {
-            fprintf(stderr, "Error opening %s\n", args.inPath().c_str());
+    if(args.recursive() && args.operation() != Operation::Encrypt) {
+        printUsageError(argv[0], "Recursive mode only supports encryption");
+    }
+
+    if(args.append() && (args.operation() != Operation::Encrypt || args.resume())) {
+        printUsageError(argv[0], "--append only supports encryption, without --resume");
+    }
+
+    if(args.volumeSize() > 0 && (args.operation() != Operation::Encrypt || args.recursive() || args.append())) {
+        printUsageError(argv[0], "--volume-size only supports encrypting a single file, without --append");
+    }
+
+    if(args.outPath() == "-" && (args.operation() != Operation::Encrypt || args.recursive() || args.volumeSize() > 0)) {
+        printUsageError(argv[0], "Only encrypting a single file can write to standard output");
+    }
+
+    if(args.inPath() == "-" && (args.operation() != Operation::Decrypt || args.outPath() == "-")) {
+        printUsageError(argv[0], "Only decrypting into a file can read from standard input");
+    }
+
+    if(args.outPath() == "-" && args.digestMode() != Arguments::DigestMode::None) {
+        printUsageError(argv[0], "--digest prints to standard output, which is taken by the encrypted file");
+    }
+
+    if(args.volumeSize() > 0 && args.digestMode() != Arguments::DigestMode::None) {
+        printUsageError(argv[0], "--digest covers a single file, not a set of volumes");
+    }
+
+    size_t nThreads = (args.threads() > 0)? args.threads() : WorkStealingPool::defaultSize();
+
+    // Every worker holds at most a plaintext and a ciphertext block at once.  Under a budget,
+    // there are only as many workers as can hold them alongside the KDF, and no more buffers
+    // than that: anything that runs ahead waits for one to be released.
+    if(args.maxMemory() > 0) {
+        const size_t fit = budget::threads(args.maxMemory(), WuffCryptFile::WORK_FACTOR, nThreads);
+        if(fit == 0) {
+            fprintf(stderr, "--max-memory must be at least %llu MiB\n",
+                    static_cast<unsigned long long>((budget::minimum(WuffCryptFile::WORK_FACTOR) + (1 << 20) - 1) >> 20));
             return 1;
         }
 
-        WuffCryptFile outFile(args.outPath());
+        if(fit < nThreads && args.threads() > 0) {
+            fprintf(stderr, "Using %zu threads to stay within --max-memory\n", fit);
+        }
 
-        auto status = outFile.write([&inFile](uint8_t* outBuf, size_t& outBufWritten, size_t blockSize) {
-            outBufWritten = fread(outBuf, sizeof(uint8_t), blockSize, inFile);
-        }, args.password());
+        nThreads = fit;
+        SecureArena::boundBlocks(budget::slots(nThreads));
+    }
+    else {
+        SecureArena::reserveBlocks(budget::slots(nThreads));
+    }
 
-        if(status == WuffCryptFile::FileStatus::OpenError) {
-            fprintf(stderr, "Error opening %s\n", args.outPath().c_str());
+    RunReport runReport(args, nThreads);
+
+    // Before any pool is started, so that every worker inherits the I/O class and the limits
+    if(args.niceIO() && !fileio::idlePriority()) {
+        fprintf(stderr, "Could not switch to the idle I/O class; carrying on without it\n");
+    }
+
+    Throttle throttle(args.limits());
+    if(args.throttled()) {
+        if(!args.throttlePath().empty() && !throttle.watch(args.throttlePath())) {
+            fprintf(stderr, "Cannot take limits from %s\n", args.throttlePath().c_str());
             return 1;
         }
 
-        fclose(inFile);
+        Throttle::activate(&throttle);
     }
-    else if(args.operation() == Operation::Decrypt) {
-        FILE* outFile = fopen(args.outPath().c_str(), "wb");
-        if(outFile == nullptr) {
-            fprintf(stderr, "Error opening %s\n", args.outPath().c_str());
+
+    WuffCryptFile::Options options;
+    options.digest = args.digestMode() != Arguments::DigestMode::None;
+    options.storeDigest = args.storeDigest();
+    options.sparse = args.sparse();
+    options.resume = args.resume();
+    options.append = args.append();
+    options.dataShards = args.dataShards();
+    options.parityShards = args.parityShards();
+    options.cache = args.cacheMode();
+    const bool dropCache = options.cache != fileio::CacheMode::Keep;
+
+    struct stat inStat;
+    const bool inIsRegular = stat(args.inPath().c_str(), &inStat) == 0 && S_ISREG(inStat.st_mode);
+
+    // Output to standard output (-) or a pipe has to be written front to back as it is encrypted
+    struct stat outStat;
+    const bool outIsStream = args.outPath() == "-" ||
+                             (stat(args.outPath().c_str(), &outStat) == 0 && !S_ISREG(outStat.st_mode) && !S_ISDIR(outStat.st_mode));
+
+    if(args.operation() == Operation::Test) {
+        KeyCache keys(args.password());
+        WorkStealingPool pool(nThreads);
+        std::mutex reportLock;
+        size_t failures = 0;
+
+        for(const std::string& path : args.paths()) {
+            FileVerifyJob::start(pool, keys, path, options, [&, path](const FileVerifyJob::Result& result) {
+                std::lock_guard<std::mutex> guard(reportLock);
+
+                switch(result.status) {
+                    case WuffCryptFile::FileStatus::OK: {
+                        if(result.rebuiltBlocks > 0) {
+                            printf("%s: OK (%llu damaged blocks, all of which parity can rebuild)\n", path.c_str(),
+                                   static_cast<unsigned long long>(result.rebuiltBlocks));
+                            return;
+                        }
+
+                        printf("%s: OK\n", path.c_str());
+                        return;
+                    }
+                    case WuffCryptFile::FileStatus::VerificationFailed: {
+                        if(result.badIndex) {
+                            printf("%s: FAILED (Merkle index does not match the blocks)\n", path.c_str());
+                            break;
+                        }
+
+                        if(result.badBlock == UINT64_MAX) {
+                            printf("%s: FAILED (trailer does not authenticate)\n", path.c_str());
+                            break;
+                        }
+
+                        printf("%s: FAILED at block %llu (byte offset %llu)\n", path.c_str(),
+                               static_cast<unsigned long long>(result.badBlock),
+                               static_cast<unsigned long long>(result.badOffset));
+                        break;
+                    }
+                    case WuffCryptFile::FileStatus::Truncated: {
+                        printf("%s: FAILED (truncated, or never finished)\n", path.c_str());
+                        break;
+                    }
+                    case WuffCryptFile::FileStatus::OpenError: {
+                        printf("%s: FAILED (error opening file)\n", path.c_str());
+                        break;
+                    }
+                    case WuffCryptFile::FileStatus::InvalidFileType: {
+                        printf("%s: FAILED (not a wuffcrypt file)\n", path.c_str());
+                        break;
+                    }
+                    case WuffCryptFile::FileStatus::CorruptHeader: {
+                        printf("%s: FAILED (corrupt header)\n", path.c_str());
+                        break;
+                    }
+                    case WuffCryptFile::FileStatus::WrongVersion: {
+                        printf("%s: FAILED (file version mismatch)\n", path.c_str());
+                        break;
+                    }
+                    case WuffCryptFile::FileStatus::NoMemory: {
+                        printf("%s: FAILED (out of memory)\n", path.c_str());
+                        break;
+                    }
+                    default: {
+                        printf("%s: FAILED (error reading file)\n", path.c_str());
+                        break;
+                    }
+                }
+
+                failures += 1;
+            });
+        }
+
+        pool.wait();
+
+        if(failures > 0) {
+            fprintf(stderr, "%zu of %zu files failed verification\n", failures, args.paths().size());
+            return 1;
+        }
+    }
+    else if(args.operation() == Operation::PrintRoot || args.operation() == Operation::VerifyRange) {
+        KeyCache keys(args.password());
+        size_t failures = 0;
+
+        for(const std::string& path : args.paths()) {
+            ArchiveReader archive;
+            auto status = archive.open(path, keys);
+            if(status != WuffCryptFile::FileStatus::OK) {
+                printf("%s: FAILED (%s)\n", path.c_str(), describeFailure(status));
+                failures += 1;
+                continue;
+            }
+
+            if(args.operation() == Operation::PrintRoot) {
+                char hex[2*merkle::NODE_BYTES + 1];
+                sodium_bin2hex(hex, sizeof(hex), archive.trailer().merkleRoot, merkle::NODE_BYTES);
+                printf("%s  %s\n", hex, path.c_str());
+                continue;
+            }
+
+            if(args.rangeLast() >= archive.blockCount()) {
+                printf("%s: FAILED (file has only %llu blocks)\n", path.c_str(),
+                       static_cast<unsigned long long>(archive.blockCount()));
+                failures += 1;
+                continue;
+            }
+
+            uint64_t badBlock = UINT64_MAX;
+            status = archive.verifyBlocks(args.rangeFirst(), args.rangeLast(), badBlock);
+
+            if(status == WuffCryptFile::FileStatus::OK) {
+                printf("%s: blocks %llu-%llu OK\n", path.c_str(),
+                       static_cast<unsigned long long>(args.rangeFirst()), static_cast<unsigned long long>(args.rangeLast()));
+                continue;
+            }
+
+            if(status != WuffCryptFile::FileStatus::VerificationFailed) {
+                printf("%s: FAILED (%s)\n", path.c_str(), describeFailure(status));
+            }
+            else if(badBlock != UINT64_MAX) {
+                printf("%s: FAILED at block %llu (byte offset %llu)\n", path.c_str(),
+                       static_cast<unsigned long long>(badBlock),
+                       static_cast<unsigned long long>(WuffCryptFile::blockOffset(badBlock)));
+            }
+            else {
+                printf("%s: FAILED (blocks do not match the Merkle root)\n", path.c_str());
+            }
+
+            failures += 1;
+        }
+
+        if(failures > 0) {
+            return 1;
+        }
+    }
+    else if(args.operation() == Operation::Compare) {
+        KeyCache keys(args.password());
+        ArchiveReader a;
+        ArchiveReader b;
+
+        for(auto pair : {std::make_pair(&a, args.inPath()), std::make_pair(&b, args.outPath())}) {
+            auto status = pair.first->open(pair.second, keys);
+            if(status != WuffCryptFile::FileStatus::OK) {
+                fprintf(stderr, "%s: %s\n", pair.second.c_str(), describeFailure(status));
+                return 1;
+            }
+        }
+
+        ArchiveReader::Comparison result;
+        std::vector<uint64_t> differing;
+        auto status = ArchiveReader::compare(a, b, result, differing);
+        if(status != WuffCryptFile::FileStatus::OK) {
+            fprintf(stderr, "Error comparing: %s\n", describeFailure(status));
+            return 1;
+        }
+
+        switch(result) {
+            case ArchiveReader::Comparison::Identical: {
+                printf("Identical\n");
+                break;
+            }
+            case ArchiveReader::Comparison::Unrelated: {
+                printf("Unrelated: not copies of the same encrypted file\n");
+                return 1;
+            }
+            case ArchiveReader::Comparison::Different: {
+                // Print runs of consecutive blocks
+                for(size_t i = 0; i < differing.size();) {
+                    size_t j = i;
+                    while(j + 1 < differing.size() && differing[j + 1] == differing[j] + 1) j += 1;
+
+                    printf("Blocks %llu-%llu differ\n", static_cast<unsigned long long>(differing[i]),
+                           static_cast<unsigned long long>(differing[j]));
+                    i = j + 1;
+                }
+                break;
+            }
+        }
+
+        fprintf(stderr, "Read %llu index nodes from each copy\n", static_cast<unsigned long long>(a.nodesRead()));
+        if(result != ArchiveReader::Comparison::Identical) return 1;
+    }
+    else if(args.operation() == Operation::Upgrade) {
+        // Every file at once, each rewritten beside itself and only then put in its place
+        KeyCache keys(args.password());
+        WorkStealingPool pool(nThreads);
+        std::mutex reportLock;
+        size_t failures = 0;
+
+        for(const std::string& path : args.paths()) {
+            WuffCryptFile::Header header;
+            auto status = peekHeader(path, header);
+            if(status != WuffCryptFile::FileStatus::OK) {
+                std::lock_guard<std::mutex> guard(reportLock);
+                printf("%s: FAILED (%s)\n", path.c_str(), describeFailure(status));
+                failures += 1;
+                continue;
+            }
+
+            if(header.version >= WuffCryptFile::VERSION) {
+                std::lock_guard<std::mutex> guard(reportLock);
+                printf("%s: already format %u\n", path.c_str(), header.version);
+                continue;
+            }
+
+            const std::string newPath = path + ".upgrading";
+            const unsigned version = header.version;
+            FileEncryptJob::startUpgrade(pool, keys, path, newPath, options, [&, path, newPath, version](const FileEncryptJob::Result& result) {
+                const bool replaced = result.status == WuffCryptFile::FileStatus::OK && replaceFile(path, newPath);
+                if(!replaced) unlink(newPath.c_str());
+
+                std::lock_guard<std::mutex> guard(reportLock);
+                if(replaced) {
+                    printf("%s: upgraded from format %u\n", path.c_str(), version);
+                    return;
+                }
+
+                printf("%s: FAILED (%s)\n", path.c_str(), (result.status == WuffCryptFile::FileStatus::OK)? "error replacing file" :
+                                                            describeFailure(result.status));
+                failures += 1;
+            });
+        }
+
+        pool.wait();
+
+        if(failures > 0) {
+            fprintf(stderr, "%zu of %zu files could not be upgraded\n", failures, args.paths().size());
+            return 1;
+        }
+    }
+    else if(args.operation() == Operation::Encrypt && args.recursive()) {
+        // One key for the whole tree, rather than running the KDF for every file
+        KeyCache keys(args.password());
+        const DerivedKey* derived = writingKey(keys);
+        if(derived == nullptr) return 1;
+        const DerivedKey& key = *derived;
+        WorkStealingPool pool(nThreads);
+        TreeEncrypter tree(pool, key, options);
+        tree.onFile([&args](const std::string& srcPath, const std::string& dstPath, const FileEncryptJob::Result& result) {
+            printDigest(args.digestMode(), dstPath, srcPath, result.digest);
+        });
+
+        if(!tree.run(args.inPath(), args.outPath())) {
+            fprintf(stderr, "Failed to encrypt %zu of %zu files\n", tree.failures(), tree.files());
+            return 1;
+        }
+    }
+    else if(args.operation() == Operation::Encrypt && inIsRegular && args.volumeSize() > 0) {
+        // Volumes hold whole blocks, and are encrypted all at once as independent files
+        KeyCache keys(args.password());
+        const DerivedKey* derived = writingKey(keys);
+        if(derived == nullptr) return 1;
+        const DerivedKey& key = *derived;
+        WorkStealingPool pool(nThreads);
+        const uint64_t size = static_cast<uint64_t>(inStat.st_size);
+        const uint64_t perVolume = std::max<uint64_t>(args.volumeSize() / WuffCryptFile::BLOCK_SIZE, 1) * WuffCryptFile::BLOCK_SIZE;
+        const uint64_t count = std::max<uint64_t>((size + perVolume - 1) / perVolume, 1);
+        if(count > UINT32_MAX) {
+            fprintf(stderr, "--volume-size is too small for %s\n", args.inPath().c_str());
             return 1;
         }
-        WuffCryptFile inFile(args.inPath());
 
-        auto status = inFile.read([&outFile](const SodiumMessageBuffer& msg) {
-            fwrite(msg.data(), sizeof(uint8_t), msg.size(), outFile);
-        }, args.password());
+        WuffCryptFile::Volume volume;
+        volume.count = static_cast<uint32_t>(count);
+        volume.totalLength = size;
+        randombytes_buf(volume.setId, sizeof(volume.setId));
+
+        std::vector<FileEncryptJob::Result> results(count);
+        for(uint32_t i = 0; i < volume.count; i += 1) {
+            volume.index = i;
+            volume.offset = i * perVolume;
+            FileEncryptJob::Result* result = &results[i];
+            FileEncryptJob::startVolume(pool, key, args.inPath(), volumePath(args.outPath(), i), volume,
+                                        std::min(perVolume, size - volume.offset), options,
+                                        [result](const FileEncryptJob::Result& jobResult) { *result = jobResult; });
+        }
+        pool.wait();
+
+        uint64_t kept = 0;
+        size_t failures = 0;
+        for(uint32_t i = 0; i < volume.count; i += 1) {
+            const std::string path = volumePath(args.outPath(), i);
+            kept += results[i].keptBlocks;
+            switch(results[i].status) {
+                case WuffCryptFile::FileStatus::OK: { continue; }
+                case WuffCryptFile::FileStatus::OpenError: {
+                    fprintf(stderr, "Error opening %s\n", path.c_str());
+                    break;
+                }
+                case WuffCryptFile::FileStatus::ReadError: {
+                    fprintf(stderr, "Error reading %s for %s\n", args.inPath().c_str(), path.c_str());
+                    break;
+                }
+                case WuffCryptFile::FileStatus::WriteError: {
+                    fprintf(stderr, "Error writing %s\n", path.c_str());
+                    break;
+                }
+                default: {
+                    fprintf(stderr, "Error encrypting %s (%s)\n", path.c_str(), describeFailure(results[i].status));
+                    break;
+                }
+            }
+            failures += 1;
+        }
+
+        if(failures > 0) {
+            fprintf(stderr, "Failed to write %zu of %u volumes\n", failures, volume.count);
+            return 1;
+        }
+
+        if(kept > 0) {
+            fprintf(stderr, "Resumed %s, keeping %llu blocks\n", args.outPath().c_str(), static_cast<unsigned long long>(kept));
+        }
+    }
+    else if(args.operation() == Operation::Encrypt && inIsRegular && !outIsStream) {
+        // Regular files can be split up and encrypted on every core
+        KeyCache keys(args.password());
+        const DerivedKey* derived = writingKey(keys);
+        if(derived == nullptr) return 1;
+        const DerivedKey& key = *derived;
+        WorkStealingPool pool(nThreads);
+        FileEncryptJob::Result result;
+
+        FileEncryptJob::start(pool, key, args.inPath(), args.outPath(), options, [&result](const FileEncryptJob::Result& jobResult) {
+            result = jobResult;
+        });
+        pool.wait();
 
-        switch(status) {
+        switch(result.status) {
+            case WuffCryptFile::FileStatus::OK: {
+                if(result.keptBlocks > 0) {
+                    fprintf(stderr, "Resumed %s, keeping %llu blocks\n", args.outPath().c_str(),
+                            static_cast<unsigned long long>(result.keptBlocks));
+                }
+                printDigest(args.digestMode(), args.outPath(), args.inPath(), result.digest);
+                break;
+            }
             case WuffCryptFile::FileStatus::OpenError: {
-                fprintf(stderr, "Error opening %s.\n", args.inPath().c_str());
+                fprintf(stderr, "Error opening %s\n", args.outPath().c_str());
                 return 1;
             }
-            case WuffCryptFile::FileStatus::InvalidFileType: {
-                fprintf(stderr, "%s is not a wuffcrypt file.\n", args.inPath().c_str());
+            case WuffCryptFile::FileStatus::ReadError: {
+                fprintf(stderr, "Error reading %s\n", args.inPath().c_str());
                 return 1;
             }
-            case WuffCryptFile::FileStatus::CorruptHeader: {
-                fprintf(stderr, "%s is a corrupt wuffcrypt file.\n", args.inPath().c_str());
+            case WuffCryptFile::FileStatus::WriteError: {
+                fprintf(stderr, "Error writing %s\n", args.outPath().c_str());
+                return 1;
+            }
+            case WuffCryptFile::FileStatus::WrongVersion: {
+                // Only --append reads the output
+                fprintf(stderr, "Cannot append to %s: written by an older version or with another work factor, "
+                                "or without the digest requested\n", args.outPath().c_str());
                 return 1;
             }
             case WuffCryptFile::FileStatus::VerificationFailed: {
-                fprintf(stderr, "Failed to decrypt.  Either the password is wrong, or the file has been tampered with in some way.\n");
+                fprintf(stderr, "Cannot append to %s: it does not authenticate, or is not of the start of %s\n",
+                        args.outPath().c_str(), args.inPath().c_str());
                 return 1;
             }
-            case WuffCryptFile::FileStatus::WrongVersion: {
-                fprintf(stderr, "File version mismatch\n");
+            default: {
+                fprintf(stderr, "Cannot append to %s (%s)\n", args.outPath().c_str(), describeFailure(result.status));
                 return 1;
             }
-            case WuffCryptFile::FileStatus::OK: { break; }
+        }
+    }
+    else if(args.operation() == Operation::Encrypt) {
+        // A stream cannot be read again from where an earlier run stopped
+        if(args.resume() || args.append() || args.parityShards() > 0 || args.volumeSize() > 0) {
+            fprintf(stderr, "%s needs regular input and output files\n", args.resume()? "--resume" : args.append()? "--append" :
+                                                              (args.parityShards() > 0)? "--parity" : "--volume-size");
+            return 1;
+        }
+
+        FILE* inFile = fopen(args.inPath().c_str(), "rb");
+        if(inFile == nullptr) {
+            fprintf(stderr, "Error opening %s\n", args.inPath().c_str());
+            return 1;
+        }
+
+        WuffCryptFile outFile(args.outPath());
+        blockio::FileSource source(inFile, dropCache);
+
+        WuffCryptFile::FileStatus status;
+        try {
+            status = outFile.encryptFrom(source, args.password(), options);
+        }
+        catch(const std::bad_alloc&) {
+            status = WuffCryptFile::FileStatus::NoMemory;
+        }
+
+        if(status == WuffCryptFile::FileStatus::NoMemory) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+
+        if(status == WuffCryptFile::FileStatus::ReadError) {
+            fprintf(stderr, "Error reading %s\n", args.inPath().c_str());
+            return 1;
+        }
+
+        if(status == WuffCryptFile::FileStatus::OpenError) {
+            fprintf(stderr, "Error opening %s\n", args.outPath().c_str());
+            return 1;
+        }
+
+        if(status == WuffCryptFile::FileStatus::WriteError) {
+            fprintf(stderr, "Error writing %s\n", args.outPath().c_str());
+            return 1;
+        }
+
+        printDigest(args.digestMode(), args.outPath(), args.inPath(), outFile.digest());
+
+        fclose(inFile);
+    }
+    else if(args.operation() == Operation::Decrypt && args.inPath() == "-") {
+        return decryptStandardInput(args, options, nThreads, dropCache);
+    }
+    else if(args.operation() == Operation::Decrypt) {
+        KeyCache keys(args.password());
+
+        // A set of volumes is named by the output it was split from: out rather than out.000
+        std::vector<std::string> parts;
+        struct stat partStat;
+        const bool isSet = stat(args.inPath().c_str(), &partStat) != 0 && stat(volumePath(args.inPath(), 0).c_str(), &partStat) == 0;
+        if(isSet) {
+            if(args.digestMode() != Arguments::DigestMode::None) {
+                printUsageError(argv[0], "--digest covers a single file, not a set of volumes");
+            }
+            if(!findVolumes(args.inPath(), keys, parts)) return 1;
+        }
+        else {
+            parts.push_back(args.inPath());
+        }
+
+        // A single volume goes where it belongs in a regular output, next to any others already
+        // decrypted there
+        WuffCryptFile::Volume volume;
+        bool placed = false;
+        if(!isSet && (stat(args.outPath().c_str(), &partStat) != 0 || S_ISREG(partStat.st_mode))) {
+            ArchiveReader archive;
+            placed = archive.open(args.inPath(), keys) == WuffCryptFile::FileStatus::OK && archive.trailer().hasVolume;
+            volume = archive.trailer().volume;
+        }
+
+        // Blocks already in the output are checked against the decrypted ones, not rewritten
+        FILE* outFile = (args.resume() || placed)? fopen(args.outPath().c_str(), "r+b") : nullptr;
+        if(outFile == nullptr) {
+            outFile = fopen(args.outPath().c_str(), "wb");
+        }
+        if(outFile == nullptr) {
+            fprintf(stderr, "Error opening %s\n", args.outPath().c_str());
+            return 1;
+        }
+        blockio::FileSink sink(outFile, dropCache, args.resume());
+
+        if(placed) {
+            if(!sink.place(volume.offset, volume.index + 1 == volume.count)) {
+                fprintf(stderr, "Error writing %s\n", args.outPath().c_str());
+                return 1;
+            }
+            fprintf(stderr, "%s is volume %u of %u, from byte %llu of %llu\n", args.inPath().c_str(), volume.index + 1, volume.count,
+                    static_cast<unsigned long long>(volume.offset), static_cast<unsigned long long>(volume.totalLength));
+        }
+
+        PlaintextDigest digest;
+        for(const std::string& part : parts) {
+            WuffCryptFile inFile(part);
+            auto status = inFile.decryptTo(sink, keys, options);
+
+            if(!reportDecryption(status, part, args.outPath())) return 1;
+
+            if(inFile.rebuiltBlocks() > 0) {
+                fprintf(stderr, "Rebuilt %llu damaged blocks of %s from parity\n",
+                        static_cast<unsigned long long>(inFile.rebuiltBlocks()), part.c_str());
+            }
+
+            digest = inFile.digest();
+        }
+
+        if(!sink.finish()) {
+            fprintf(stderr, "Error writing %s\n", args.outPath().c_str());
+            return 1;
+        }
+
+        if(sink.kept() > 0) {
+            fprintf(stderr, "Resumed %s, keeping %llu MiB\n", args.outPath().c_str(),
+                    static_cast<unsigned long long>(sink.kept() >> 20));
         }
 
         fclose(outFile);
+        printDigest(args.digestMode(), args.inPath(), args.outPath(), digest);
     }
 
     return 0;
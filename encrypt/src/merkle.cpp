@@ -0,0 +1,139 @@
+// merkle.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <string.h>
+#include <sodium.h>
+#include "merkle.hpp"
+#include "util.hpp"
+
+void merkle::leaf(const uint8_t* tag, uint8_t* out) {
+    uint8_t input[1 + TAG_BYTES];
+    input[0] = 0x00;
+    memcpy(input + 1, tag, TAG_BYTES);
+
+    crypto_generichash(out, NODE_BYTES, input, sizeof(input), nullptr, 0);
+}
+
+void merkle::parent(const uint8_t* left, const uint8_t* right, uint8_t* out) {
+    uint8_t input[1 + 2*NODE_BYTES];
+    input[0] = 0x01;
+    memcpy(input + 1, left, NODE_BYTES);
+    memcpy(input + 1 + NODE_BYTES, right, NODE_BYTES);
+
+    crypto_generichash(out, NODE_BYTES, input, sizeof(input), nullptr, 0);
+}
+
+unsigned merkle::levels(uint64_t leaves) {
+    unsigned n = 1;
+    while(leaves > 1) {
+        leaves = (leaves + 1) / 2;
+        n += 1;
+    }
+
+    return n;
+}
+
+uint64_t merkle::levelSize(uint64_t leaves, unsigned level) {
+    for(unsigned i = 0; i < level; i += 1) {
+        leaves = (leaves + 1) / 2;
+    }
+
+    return leaves;
+}
+
+uint64_t merkle::nodeOffset(uint64_t leaves, unsigned level, uint64_t i) {
+    uint64_t offset = 0;
+    for(unsigned l = 0; l < level; l += 1) {
+        offset += levelSize(leaves, l);
+    }
+
+    return (offset + i) * NODE_BYTES;
+}
+
+uint64_t merkle::indexSize(uint64_t leaves) {
+    const unsigned n = levels(leaves);
+    return nodeOffset(leaves, n - 1, 1);
+}
+
+void merkle::build(const std::vector<uint8_t>& tags, std::vector<uint8_t>& index) {
+    const uint64_t leaves = tags.size() / TAG_BYTES;
+    verify(leaves > 0);
+
+    index.resize(indexSize(leaves));
+
+    for(uint64_t i = 0; i < leaves; i += 1) {
+        leaf(&tags[i * TAG_BYTES], &index[i * NODE_BYTES]);
+    }
+
+    complete(index, leaves);
+}
+
+void merkle::complete(std::vector<uint8_t>& index, uint64_t leaves) {
+    verify(leaves > 0 && index.size() == indexSize(leaves));
+
+    uint64_t below = 0;
+    uint64_t here = leaves * NODE_BYTES;
+    for(unsigned level = 1; level < levels(leaves); level += 1) {
+        const uint64_t childCount = levelSize(leaves, level - 1);
+        const uint64_t count = levelSize(leaves, level);
+
+        for(uint64_t i = 0; i < count; i += 1) {
+            const uint8_t* left = &index[below + 2*i * NODE_BYTES];
+            uint8_t* out = &index[here + i * NODE_BYTES];
+
+            if(2*i + 1 < childCount) {
+                parent(left, left + NODE_BYTES, out);
+            }
+            else {
+                memcpy(out, left, NODE_BYTES);
+            }
+        }
+
+        below = here;
+        here += count * NODE_BYTES;
+    }
+}
+
+bool merkle::climb(uint64_t leaves, uint64_t first, const std::vector<uint8_t>& runLeaves,
+                   NodeReader readNode, uint8_t* root) {
+    std::vector<uint8_t> nodes(runLeaves);
+    uint64_t lo = first;
+
+    for(unsigned level = 0; level + 1 < levels(leaves); level += 1) {
+        const uint64_t size = levelSize(leaves, level);
+        const uint64_t hi = lo + nodes.size() / NODE_BYTES;
+
+        const uint64_t parentLo = lo / 2;
+        const uint64_t parentHi = (hi + 1) / 2;
+        std::vector<uint8_t> parents((parentHi - parentLo) * NODE_BYTES);
+
+        for(uint64_t p = parentLo; p < parentHi; p += 1) {
+            uint8_t children[2][NODE_BYTES];
+            const uint64_t childCount = (2*p + 1 < size)? 2 : 1;
+
+            for(uint64_t c = 0; c < childCount; c += 1) {
+                const uint64_t i = 2*p + c;
+                if(i >= lo && i < hi) {
+                    memcpy(children[c], &nodes[(i - lo) * NODE_BYTES], NODE_BYTES);
+                }
+                else if(!readNode(level, i, children[c])) {
+                    return false;
+                }
+            }
+
+            uint8_t* out = &parents[(p - parentLo) * NODE_BYTES];
+            if(childCount == 2) {
+                parent(children[0], children[1], out);
+            }
+            else {
+                memcpy(out, children[0], NODE_BYTES);
+            }
+        }
+
+        nodes.swap(parents);
+        lo = parentLo;
+    }
+
+    memcpy(root, nodes.data(), NODE_BYTES);
+    return true;
+}
@@ -0,0 +1,48 @@
+// merkle.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+// A Merkle tree over the authentication tags of a file's blocks.  The root is kept in the
+// authenticated trailer, and every level of the tree is stored, unencrypted, just before it, so
+// that any node can be fetched with one small read and checked against the root:
+//
+//     leaf(i)        = BLAKE2b-256(0x00 || tag of block i)
+//     parent(l, r)   = BLAKE2b-256(0x01 || l || r)
+//
+// A level with an odd number of nodes promotes its last node unchanged.  Levels are stored
+// leaves first, so the root is the index's last node.
+namespace merkle {
+    const size_t NODE_BYTES = 32;
+    const size_t TAG_BYTES = 16;
+
+    void leaf(const uint8_t* tag, uint8_t* out);
+    void parent(const uint8_t* left, const uint8_t* right, uint8_t* out);
+
+    // The shape of a tree with the given number of leaves
+    unsigned levels(uint64_t leaves);
+    uint64_t levelSize(uint64_t leaves, unsigned level);
+
+    // Byte offsets within the stored index
+    uint64_t nodeOffset(uint64_t leaves, unsigned level, uint64_t i);
+    uint64_t indexSize(uint64_t leaves);
+
+    // Build the stored index from each block's tag, concatenated
+    void build(const std::vector<uint8_t>& tags, std::vector<uint8_t>& index);
+
+    // Fill in every level above the leaves, which index must already be sized for and start with
+    void complete(std::vector<uint8_t>& index, uint64_t leaves);
+
+    typedef std::function<bool(unsigned level, uint64_t i, uint8_t* out)> NodeReader;
+
+    // Compute the root from the leaves of a contiguous run of blocks starting at first, fetching
+    // whatever other nodes are needed (at most two per level) through readNode.  Returns false
+    // if readNode fails.
+    bool climb(uint64_t leaves, uint64_t first, const std::vector<uint8_t>& runLeaves,
+               NodeReader readNode, uint8_t* root);
+}
@@ -6,15 +6,25 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <sodium.h>
+#include "securearena.hpp"
 #include "util.hpp"
 
 // Wrapper around a buffer that includes an additional zero-padded buffer of length P at the
 // beginning that is excluded from size checks.  The parameter D is an additional stretch of
 // allocation added to all buffers, and included in size checks.
+//
+// Buffers come from the shared SecureArena when one is free and large enough, and from the heap
+// otherwise, unless the arena is bounded by a memory budget; then block-sized buffers wait for a
+// free slot.  Either way, they are wiped when destroyed.
 template <int P, int D>
 class PaddedBuffer {
 public:
-    explicit PaddedBuffer(size_t len): _data(new uint8_t[P+D+len]), _size(0), _capacity(D+len) {
+    explicit PaddedBuffer(size_t len): _data(SecureArena::takeBlock(P+D+len)), _size(0), _capacity(D+len) {
+        if(_data == nullptr) {
+            _data = new uint8_t[P+D+len];
+        }
+
         memset(_data, 0, P);
     }
     PaddedBuffer() = delete;
@@ -58,6 +68,12 @@ public:
     }
 
     ~PaddedBuffer() {
+        if(SecureArena::blocks().owns(_data)) {
+            SecureArena::blocks().release(_data);
+            return;
+        }
+
+        sodium_memzero(_data, P+_capacity);
         delete[] _data;
     }
 
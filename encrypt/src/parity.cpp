@@ -0,0 +1,205 @@
+// parity.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <string.h>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WUFF_PARITY_SIMD 1
+#endif
+
+#include "parity.hpp"
+#include "util.hpp"
+
+namespace {
+    // Logarithms and powers of the generator 2, built once.  exp is doubled up so that the sum
+    // of two logarithms needs no reduction.
+    struct Field {
+        Field() {
+            unsigned x = 1;
+            for(unsigned i = 0; i < 255; i += 1) {
+                exp[i] = exp[i + 255] = static_cast<uint8_t>(x);
+                log[x] = static_cast<uint8_t>(i);
+                x <<= 1;
+                if(x & 0x100) x ^= 0x11d;
+            }
+            exp[510] = exp[511] = exp[0];
+            log[0] = 0;
+        }
+
+        uint8_t exp[512];
+        uint8_t log[256];
+    };
+
+    const Field& field() {
+        static const Field f;
+        return f;
+    }
+
+    // Multiplying by a constant is two table lookups, one per nibble, which is what pshufb does
+    // sixteen or thirty-two bytes at a time.  Each kernel returns how many bytes it handled; the
+    // caller finishes off the rest.
+    typedef size_t (*Kernel)(uint8_t* dst, const uint8_t* src, const uint8_t* lo, const uint8_t* hi, size_t len);
+
+    size_t mulAddNone(uint8_t*, const uint8_t*, const uint8_t*, const uint8_t*, size_t) {
+        return 0;
+    }
+
+#ifdef WUFF_PARITY_SIMD
+    __attribute__((target("ssse3")))
+    size_t mulAddSsse3(uint8_t* dst, const uint8_t* src, const uint8_t* lo, const uint8_t* hi, size_t len) {
+        const __m128i tableLo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo));
+        const __m128i tableHi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hi));
+        const __m128i mask = _mm_set1_epi8(0x0f);
+
+        size_t i = 0;
+        for(; i + 16 <= len; i += 16) {
+            const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            const __m128i product = _mm_xor_si128(_mm_shuffle_epi8(tableLo, _mm_and_si128(s, mask)),
+                                                  _mm_shuffle_epi8(tableHi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+            __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+            _mm_storeu_si128(d, _mm_xor_si128(_mm_loadu_si128(d), product));
+        }
+
+        return i;
+    }
+
+    __attribute__((target("avx2")))
+    size_t mulAddAvx2(uint8_t* dst, const uint8_t* src, const uint8_t* lo, const uint8_t* hi, size_t len) {
+        const __m256i tableLo = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lo)));
+        const __m256i tableHi = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hi)));
+        const __m256i mask = _mm256_set1_epi8(0x0f);
+
+        size_t i = 0;
+        for(; i + 32 <= len; i += 32) {
+            const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            const __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(tableLo, _mm256_and_si256(s, mask)),
+                                                     _mm256_shuffle_epi8(tableHi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+            __m256i* d = reinterpret_cast<__m256i*>(dst + i);
+            _mm256_storeu_si256(d, _mm256_xor_si256(_mm256_loadu_si256(d), product));
+        }
+
+        return i;
+    }
+#endif
+
+    Kernel pickKernel() {
+#ifdef WUFF_PARITY_SIMD
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")) return mulAddAvx2;
+        if(__builtin_cpu_supports("ssse3")) return mulAddSsse3;
+#endif
+        return mulAddNone;
+    }
+
+    // Invert a k by k matrix in place, by Gauss-Jordan elimination.  False if it is singular.
+    bool invert(std::vector<uint8_t>& a, unsigned k) {
+        std::vector<uint8_t> inv(k * k, 0);
+        for(unsigned i = 0; i < k; i += 1) inv[i * k + i] = 1;
+
+        for(unsigned col = 0; col < k; col += 1) {
+            unsigned pivot = col;
+            while(pivot < k && a[pivot * k + col] == 0) pivot += 1;
+            if(pivot == k) return false;
+
+            if(pivot != col) {
+                std::swap_ranges(&a[pivot * k], &a[pivot * k] + k, &a[col * k]);
+                std::swap_ranges(&inv[pivot * k], &inv[pivot * k] + k, &inv[col * k]);
+            }
+
+            const uint8_t scale = parity::inverse(a[col * k + col]);
+            for(unsigned j = 0; j < k; j += 1) {
+                a[col * k + j] = parity::mul(a[col * k + j], scale);
+                inv[col * k + j] = parity::mul(inv[col * k + j], scale);
+            }
+
+            for(unsigned row = 0; row < k; row += 1) {
+                const uint8_t factor = a[row * k + col];
+                if(row == col || factor == 0) continue;
+
+                for(unsigned j = 0; j < k; j += 1) {
+                    a[row * k + j] ^= parity::mul(factor, a[col * k + j]);
+                    inv[row * k + j] ^= parity::mul(factor, inv[col * k + j]);
+                }
+            }
+        }
+
+        a.swap(inv);
+        return true;
+    }
+}
+
+uint8_t parity::mul(uint8_t a, uint8_t b) {
+    if(a == 0 || b == 0) return 0;
+
+    const Field& f = field();
+    return f.exp[f.log[a] + f.log[b]];
+}
+
+uint8_t parity::inverse(uint8_t a) {
+    verify(a != 0);
+
+    const Field& f = field();
+    return f.exp[255 - f.log[a]];
+}
+
+uint8_t parity::coefficient(unsigned k, unsigned i, unsigned j) {
+    verify(j < k && k + i < MAX_SHARDS);
+    return inverse(static_cast<uint8_t>((k + i) ^ j));
+}
+
+void parity::mulAdd(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    if(c == 0) return;
+
+    static const Kernel kernel = pickKernel();
+
+    uint8_t lo[16];
+    uint8_t hi[16];
+    for(unsigned x = 0; x < 16; x += 1) {
+        lo[x] = mul(c, static_cast<uint8_t>(x));
+        hi[x] = mul(c, static_cast<uint8_t>(x << 4));
+    }
+
+    for(size_t i = kernel(dst, src, lo, hi, len); i < len; i += 1) {
+        dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+    }
+}
+
+void parity::encode(unsigned k, unsigned m, const uint8_t* const* data, uint8_t* const* parity, size_t len) {
+    for(unsigned i = 0; i < m; i += 1) {
+        memset(parity[i], 0, len);
+        for(unsigned j = 0; j < k; j += 1) {
+            mulAdd(parity[i], data[j], coefficient(k, i, j), len);
+        }
+    }
+}
+
+bool parity::reconstruct(unsigned k, const std::vector<unsigned>& present, const uint8_t* const* shards,
+                         const std::vector<unsigned>& lost, uint8_t* const* out, size_t len) {
+    if(present.size() != k) return false;
+
+    // The rows of the encoding matrix for the shards we have: the identity for data shards, and
+    // the Cauchy matrix for parity.  Its inverse turns them back into the data.
+    std::vector<uint8_t> matrix(k * k, 0);
+    for(unsigned r = 0; r < k; r += 1) {
+        if(present[r] >= MAX_SHARDS) return false;
+
+        for(unsigned j = 0; j < k; j += 1) {
+            matrix[r * k + j] = (present[r] < k)? static_cast<uint8_t>(present[r] == j) : coefficient(k, present[r] - k, j);
+        }
+    }
+
+    if(!invert(matrix, k)) return false;
+
+    for(size_t l = 0; l < lost.size(); l += 1) {
+        if(lost[l] >= k) return false;
+
+        memset(out[l], 0, len);
+        for(unsigned r = 0; r < k; r += 1) {
+            mulAdd(out[l], shards[r], matrix[lost[l] * k + r], len);
+        }
+    }
+
+    return true;
+}
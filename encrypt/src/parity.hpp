@@ -0,0 +1,41 @@
+// parity.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Reed-Solomon erasure coding over GF(2^8), for rebuilding damaged blocks.  A stripe of k data
+// shards gets m parity shards, each the same length, and any k of the k + m shards are enough
+// to recover the rest.  Parity shard i is the sum over data shards j of
+//
+//     shard(j) * 1 / ((k + i) xor j)
+//
+// which is a Cauchy matrix under the identity, so that every k by k choice of rows can be
+// inverted.  The field is the usual one, with polynomial 0x11d.
+namespace parity {
+    // At most this many shards in all, data and parity together
+    const unsigned MAX_SHARDS = 256;
+
+    uint8_t mul(uint8_t a, uint8_t b);
+
+    // a must not be zero
+    uint8_t inverse(uint8_t a);
+
+    // The multiple of data shard j in parity shard i of a stripe with k data shards
+    uint8_t coefficient(unsigned k, unsigned i, unsigned j);
+
+    // dst ^= c * src, for len bytes.  Uses SSSE3 or AVX2 where the processor has them.
+    void mulAdd(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len);
+
+    // Compute the m parity shards of a stripe from its k data shards
+    void encode(unsigned k, unsigned m, const uint8_t* const* data, uint8_t* const* parity, size_t len);
+
+    // Rebuild lost data shards.  present lists k shards that survived, numbered 0 to k - 1 for
+    // data and k up for parity, with shards[r] holding shard present[r].  Each shard numbered in
+    // lost is written to the matching out.  False if present does not list k distinct shards.
+    bool reconstruct(unsigned k, const std::vector<unsigned>& present, const uint8_t* const* shards,
+                     const std::vector<unsigned>& lost, uint8_t* const* out, size_t len);
+}
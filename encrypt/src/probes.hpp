@@ -0,0 +1,31 @@
+// probes.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+// Static tracepoints for bpftrace, perf and SystemTap, under the provider name "wuffcrypt".  An
+// untraced probe is a single nop, so they stay enabled in release builds.  Without <sys/sdt.h>
+// (systemtap-sdt-dev or similar) they compile to nothing.
+//
+//     kdf__start(workFactor)                   kdf__done(workFactor)
+//     block__read(block, bytes)                block__write(block, bytes)
+//     block__encrypt__start(block, bytes)      block__encrypt__done(block, bytes)
+//     block__decrypt__start(block, bytes)      block__decrypt__done(block, bytes, ok)
+//
+// Byte counts are plaintext, except for block__read when verifying, which is the encrypted size.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define WUFF_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef WUFF_HAVE_SDT
+#define WUFF_PROBE1(name, a) DTRACE_PROBE1(wuffcrypt, name, a)
+#define WUFF_PROBE2(name, a, b) DTRACE_PROBE2(wuffcrypt, name, a, b)
+#define WUFF_PROBE3(name, a, b, c) DTRACE_PROBE3(wuffcrypt, name, a, b, c)
+#else
+#define WUFF_PROBE1(name, a) do { (void)(a); } while(0)
+#define WUFF_PROBE2(name, a, b) do { (void)(a); (void)(b); } while(0)
+#define WUFF_PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while(0)
+#endif
@@ -0,0 +1,570 @@
+// secretbox.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <string.h>
+#include <sodium.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WUFF_SECRETBOX_SIMD 1
+#endif
+
+#include "secretbox.hpp"
+
+namespace {
+    // Shorter messages go to libsodium, as setting up the lanes would cost more than it saves
+    const size_t MIN_LEN = 1024;
+
+    const uint32_t MASK26 = 0x3ffffff;
+    const uint32_t HIBIT = 1 << 24;
+
+    uint32_t load32(const uint8_t* p) {
+        return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+               static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+    }
+
+    void store32(uint8_t* p, uint32_t v) {
+        p[0] = static_cast<uint8_t>(v);
+        p[1] = static_cast<uint8_t>(v >> 8);
+        p[2] = static_cast<uint8_t>(v >> 16);
+        p[3] = static_cast<uint8_t>(v >> 24);
+    }
+
+    // Each kernel returns how many bytes it handled, always whole steps of all its lanes; the
+    // caller finishes off the rest.  The Poly1305 kernel is handed r, r^2, ... up to its lane
+    // count, and adds whole 16-byte blocks into h.  The Salsa20 kernel xors keystream starting at
+    // 64-byte block counter into in.  A kernel without one leaves Salsa20 to libsodium.
+    typedef size_t (*PolyKernel)(uint32_t h[5], const uint32_t powers[][5], const uint8_t* m, size_t len);
+    typedef size_t (*SalsaKernel)(uint8_t* out, const uint8_t* in, size_t len, const uint8_t* nonce, uint64_t counter, const uint8_t* key);
+
+    struct Kernel {
+        const char* name;
+        unsigned lanes;
+        PolyKernel poly;
+        SalsaKernel salsa;
+    };
+
+    // Poly1305 with 26-bit limbs, after poly1305-donna.  After a multiplication the limbs are
+    // carried, but h1 may still be a little over 26 bits.
+    struct Poly1305 {
+        uint32_t h[5];
+        uint32_t powers[8][5];
+        uint32_t pad[4];
+        uint8_t buffer[16];
+        size_t buffered;
+    };
+
+    void carry(const uint64_t d[5], uint32_t out[5]) {
+        uint64_t c = d[0] >> 26;
+        uint64_t h0 = d[0] & MASK26;
+        uint64_t d1 = d[1] + c;
+        c = d1 >> 26;
+        out[1] = static_cast<uint32_t>(d1 & MASK26);
+        uint64_t d2 = d[2] + c;
+        c = d2 >> 26;
+        out[2] = static_cast<uint32_t>(d2 & MASK26);
+        uint64_t d3 = d[3] + c;
+        c = d3 >> 26;
+        out[3] = static_cast<uint32_t>(d3 & MASK26);
+        uint64_t d4 = d[4] + c;
+        c = d4 >> 26;
+        out[4] = static_cast<uint32_t>(d4 & MASK26);
+        h0 += c * 5;
+        out[0] = static_cast<uint32_t>(h0 & MASK26);
+        out[1] += static_cast<uint32_t>(h0 >> 26);
+    }
+
+    // out = a * b, modulo 2^130 - 5.  out may be a.
+    void mulmod(uint32_t out[5], const uint32_t a[5], const uint32_t b[5]) {
+        const uint64_t s1 = b[1] * 5ULL;
+        const uint64_t s2 = b[2] * 5ULL;
+        const uint64_t s3 = b[3] * 5ULL;
+        const uint64_t s4 = b[4] * 5ULL;
+        const uint64_t a0 = a[0], a1 = a[1], a2 = a[2], a3 = a[3], a4 = a[4];
+
+        const uint64_t d[5] = {
+            a0 * b[0] + a1 * s4 + a2 * s3 + a3 * s2 + a4 * s1,
+            a0 * b[1] + a1 * b[0] + a2 * s4 + a3 * s3 + a4 * s2,
+            a0 * b[2] + a1 * b[1] + a2 * b[0] + a3 * s4 + a4 * s3,
+            a0 * b[3] + a1 * b[2] + a2 * b[1] + a3 * b[0] + a4 * s4,
+            a0 * b[4] + a1 * b[3] + a2 * b[2] + a3 * b[1] + a4 * b[0]
+        };
+        carry(d, out);
+    }
+
+    void polyInit(Poly1305& st, const uint8_t key[32], unsigned lanes) {
+        uint32_t* r = st.powers[0];
+        r[0] = load32(key) & 0x3ffffff;
+        r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+        r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+        r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+        r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+        for(unsigned i = 1; i < lanes; i += 1) {
+            mulmod(st.powers[i], st.powers[i - 1], r);
+        }
+
+        memset(st.h, 0, sizeof(st.h));
+        for(unsigned i = 0; i < 4; i += 1) {
+            st.pad[i] = load32(key + 16 + 4 * i);
+        }
+        st.buffered = 0;
+    }
+
+    // h = (h + m) * r for each 16-byte block of m
+    void polyBlocks(Poly1305& st, const uint8_t* m, size_t len, uint32_t hibit) {
+        for(; len >= 16; m += 16, len -= 16) {
+            st.h[0] += load32(m) & MASK26;
+            st.h[1] += (load32(m + 3) >> 2) & MASK26;
+            st.h[2] += (load32(m + 6) >> 4) & MASK26;
+            st.h[3] += (load32(m + 9) >> 6) & MASK26;
+            st.h[4] += (load32(m + 12) >> 8) | hibit;
+            mulmod(st.h, st.h, st.powers[0]);
+        }
+    }
+
+    void polyUpdate(Poly1305& st, const Kernel& kernel, const uint8_t* m, size_t len) {
+        if(st.buffered > 0) {
+            const size_t want = (16 - st.buffered < len)? 16 - st.buffered : len;
+            memcpy(st.buffer + st.buffered, m, want);
+            st.buffered += want;
+            m += want;
+            len -= want;
+            if(st.buffered < 16) return;
+
+            polyBlocks(st, st.buffer, 16, HIBIT);
+            st.buffered = 0;
+        }
+
+        const size_t wide = kernel.poly(st.h, st.powers, m, len);
+        m += wide;
+        len -= wide;
+
+        const size_t whole = len & ~static_cast<size_t>(15);
+        polyBlocks(st, m, whole, HIBIT);
+        memcpy(st.buffer, m + whole, len - whole);
+        st.buffered = len - whole;
+    }
+
+    void polyFinal(Poly1305& st, uint8_t mac[16]) {
+        if(st.buffered > 0) {
+            st.buffer[st.buffered] = 1;
+            memset(st.buffer + st.buffered + 1, 0, 16 - st.buffered - 1);
+            polyBlocks(st, st.buffer, 16, 0);
+        }
+
+        uint32_t h0 = st.h[0], h1 = st.h[1], h2 = st.h[2], h3 = st.h[3], h4 = st.h[4];
+        uint32_t c = h1 >> 26; h1 &= MASK26;
+        h2 += c; c = h2 >> 26; h2 &= MASK26;
+        h3 += c; c = h3 >> 26; h3 &= MASK26;
+        h4 += c; c = h4 >> 26; h4 &= MASK26;
+        h0 += c * 5; c = h0 >> 26; h0 &= MASK26;
+        h1 += c;
+
+        // h - p, which is what to keep if it does not go negative
+        uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= MASK26;
+        uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= MASK26;
+        uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= MASK26;
+        uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= MASK26;
+        uint32_t g4 = h4 + c - (1UL << 26);
+
+        uint32_t mask = (g4 >> 31) - 1;
+        g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+        mask = ~mask;
+        h0 = (h0 & mask) | g0;
+        h1 = (h1 & mask) | g1;
+        h2 = (h2 & mask) | g2;
+        h3 = (h3 & mask) | g3;
+        h4 = (h4 & mask) | g4;
+
+        // h mod 2^128, plus the pad
+        const uint32_t w[4] = {h0 | (h1 << 26), (h1 >> 6) | (h2 << 20), (h2 >> 12) | (h3 << 14), (h3 >> 18) | (h4 << 8)};
+        uint64_t f = 0;
+        for(unsigned i = 0; i < 4; i += 1) {
+            f = static_cast<uint64_t>(w[i]) + st.pad[i] + (f >> 32);
+            store32(mac + 4 * i, static_cast<uint32_t>(f));
+        }
+    }
+
+    // The Salsa20 state for key, nonce and counter, as sixteen words
+    void salsaInput(uint32_t j[16], const uint8_t* nonce, uint64_t counter, const uint8_t* key) {
+        j[0] = 0x61707865;
+        j[5] = 0x3320646e;
+        j[10] = 0x79622d32;
+        j[15] = 0x6b206574;
+        for(unsigned i = 0; i < 4; i += 1) {
+            j[1 + i] = load32(key + 4 * i);
+            j[11 + i] = load32(key + 16 + 4 * i);
+        }
+        j[6] = load32(nonce);
+        j[7] = load32(nonce + 4);
+        j[8] = static_cast<uint32_t>(counter);
+        j[9] = static_cast<uint32_t>(counter >> 32);
+    }
+
+// Ten double rounds over x[16], one Salsa20 block per lane
+#define WUFF_SALSA_QUARTER(a, b, c, d, ADD, XOR, ROTL) \
+    b = XOR(b, ROTL(ADD(a, d), 7)); \
+    c = XOR(c, ROTL(ADD(b, a), 9)); \
+    d = XOR(d, ROTL(ADD(c, b), 13)); \
+    a = XOR(a, ROTL(ADD(d, c), 18));
+
+#define WUFF_SALSA_ROUNDS(x, ADD, XOR, ROTL) \
+    for(int round = 0; round < 20; round += 2) { \
+        WUFF_SALSA_QUARTER(x[0], x[4], x[8], x[12], ADD, XOR, ROTL) \
+        WUFF_SALSA_QUARTER(x[5], x[9], x[13], x[1], ADD, XOR, ROTL) \
+        WUFF_SALSA_QUARTER(x[10], x[14], x[2], x[6], ADD, XOR, ROTL) \
+        WUFF_SALSA_QUARTER(x[15], x[3], x[7], x[11], ADD, XOR, ROTL) \
+        WUFF_SALSA_QUARTER(x[0], x[1], x[2], x[3], ADD, XOR, ROTL) \
+        WUFF_SALSA_QUARTER(x[5], x[6], x[7], x[4], ADD, XOR, ROTL) \
+        WUFF_SALSA_QUARTER(x[10], x[11], x[8], x[9], ADD, XOR, ROTL) \
+        WUFF_SALSA_QUARTER(x[15], x[12], x[13], x[14], ADD, XOR, ROTL) \
+    }
+
+// One step of Poly1305 in every lane: a = (a + t) * r, with s = 5r
+#define WUFF_POLY_MUL(a, r, s, MUL, ADD, SRL, AND, SLL, mask) { \
+    const auto d0 = ADD(ADD(ADD(MUL(a[0], r[0]), MUL(a[1], s[4])), ADD(MUL(a[2], s[3]), MUL(a[3], s[2]))), MUL(a[4], s[1])); \
+    auto d1 = ADD(ADD(ADD(MUL(a[0], r[1]), MUL(a[1], r[0])), ADD(MUL(a[2], s[4]), MUL(a[3], s[3]))), MUL(a[4], s[2])); \
+    auto d2 = ADD(ADD(ADD(MUL(a[0], r[2]), MUL(a[1], r[1])), ADD(MUL(a[2], r[0]), MUL(a[3], s[4]))), MUL(a[4], s[3])); \
+    auto d3 = ADD(ADD(ADD(MUL(a[0], r[3]), MUL(a[1], r[2])), ADD(MUL(a[2], r[1]), MUL(a[3], r[0]))), MUL(a[4], s[4])); \
+    auto d4 = ADD(ADD(ADD(MUL(a[0], r[4]), MUL(a[1], r[3])), ADD(MUL(a[2], r[2]), MUL(a[3], r[1]))), MUL(a[4], r[0])); \
+    a[0] = AND(d0, mask); d1 = ADD(d1, SRL(d0, 26)); \
+    a[1] = AND(d1, mask); d2 = ADD(d2, SRL(d1, 26)); \
+    a[2] = AND(d2, mask); d3 = ADD(d3, SRL(d2, 26)); \
+    a[3] = AND(d3, mask); d4 = ADD(d4, SRL(d3, 26)); \
+    a[4] = AND(d4, mask); \
+    const auto c = SRL(d4, 26); \
+    a[0] = ADD(a[0], ADD(c, SLL(c, 2))); \
+    a[1] = ADD(a[1], SRL(a[0], 26)); \
+    a[0] = AND(a[0], mask); \
+}
+
+    // Split lanes of 128-bit blocks, given as low and high halves, into 26-bit limbs
+#define WUFF_POLY_LIMBS(t, lo, hi, SRL, SLL, AND, OR, mask, hibit) \
+    t[0] = AND(lo, mask); \
+    t[1] = AND(SRL(lo, 26), mask); \
+    t[2] = AND(OR(SRL(lo, 52), SLL(hi, 12)), mask); \
+    t[3] = AND(SRL(hi, 14), mask); \
+    t[4] = OR(SRL(hi, 40), hibit);
+
+    // Sum the lanes' accumulators, each already multiplied up to the same power of r, into h
+    void foldLanes(uint32_t h[5], const uint64_t* lanes, unsigned count) {
+        uint64_t d[5] = {0, 0, 0, 0, 0};
+        for(unsigned i = 0; i < 5; i += 1) {
+            for(unsigned l = 0; l < count; l += 1) {
+                d[i] += lanes[i * count + l];
+            }
+        }
+        carry(d, h);
+    }
+
+#ifdef WUFF_SECRETBOX_SIMD
+    __attribute__((target("avx2"))) inline __m256i mul256(__m256i a, __m256i b) { return _mm256_mul_epu32(a, b); }
+    __attribute__((target("avx2"))) inline __m256i add256q(__m256i a, __m256i b) { return _mm256_add_epi64(a, b); }
+    __attribute__((target("avx2"))) inline __m256i srl256q(__m256i a, int n) { return _mm256_srli_epi64(a, n); }
+    __attribute__((target("avx2"))) inline __m256i sll256q(__m256i a, int n) { return _mm256_slli_epi64(a, n); }
+    __attribute__((target("avx2"))) inline __m256i and256(__m256i a, __m256i b) { return _mm256_and_si256(a, b); }
+    __attribute__((target("avx2"))) inline __m256i or256(__m256i a, __m256i b) { return _mm256_or_si256(a, b); }
+
+    // Four accumulators, lane i taking blocks i, i + 4, i + 8 and so on.  Every step multiplies
+    // by r^4, except the last, which multiplies lane i by r^(4 - i) to line them all up.
+    __attribute__((target("avx2")))
+    size_t polyAvx2(uint32_t h[5], const uint32_t powers[][5], const uint8_t* m, size_t len) {
+        const size_t blocks = len / 64 * 64;
+        if(blocks == 0) return 0;
+
+        const __m256i mask = _mm256_set1_epi64x(MASK26);
+        const __m256i hibit = _mm256_set1_epi64x(HIBIT);
+        __m256i r[5], s[5], a[5];
+        for(unsigned i = 0; i < 5; i += 1) {
+            r[i] = _mm256_set1_epi64x(powers[3][i]);
+            s[i] = _mm256_add_epi64(r[i], _mm256_slli_epi64(r[i], 2));
+            a[i] = _mm256_set_epi64x(0, 0, 0, h[i]);
+        }
+
+        for(size_t i = 0; i < blocks; i += 64) {
+            if(i + 64 == blocks) {
+                for(unsigned k = 0; k < 5; k += 1) {
+                    r[k] = _mm256_set_epi64x(powers[0][k], powers[1][k], powers[2][k], powers[3][k]);
+                    s[k] = _mm256_add_epi64(r[k], _mm256_slli_epi64(r[k], 2));
+                }
+            }
+
+            // Blocks 0 and 1, then 2 and 3.  The unpack leaves them in lane order 0, 2, 1, 3, which the
+            // permute puts right.
+            const __m256i m0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m + i));
+            const __m256i m1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m + i + 32));
+            const __m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(m0, m1), 0xd8);
+            const __m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(m0, m1), 0xd8);
+
+            __m256i t[5];
+            WUFF_POLY_LIMBS(t, lo, hi, srl256q, sll256q, and256, or256, mask, hibit)
+            for(unsigned k = 0; k < 5; k += 1) a[k] = _mm256_add_epi64(a[k], t[k]);
+            WUFF_POLY_MUL(a, r, s, mul256, add256q, srl256q, and256, sll256q, mask)
+        }
+
+        uint64_t lanes[5 * 4];
+        for(unsigned k = 0; k < 5; k += 1) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes + 4 * k), a[k]);
+        }
+        foldLanes(h, lanes, 4);
+        return blocks;
+    }
+
+// GCC 12's AVX-512 headers set off -Wmaybe-uninitialized with their own placeholder values
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+    __attribute__((target("avx512f"))) inline __m512i add512(__m512i a, __m512i b) { return _mm512_add_epi32(a, b); }
+    __attribute__((target("avx512f"))) inline __m512i xor512(__m512i a, __m512i b) { return _mm512_xor_si512(a, b); }
+
+// The rotate takes an immediate, so this cannot be a function
+#define WUFF_ROTL512(a, n) _mm512_rol_epi32(a, n)
+
+    // Sixteen blocks of keystream at a time.  Lane i of x[w] is word w of block counter + i, so
+    // the lanes are transposed back into blocks on the way out: 4x4 transposes of words within
+    // each 128-bit piece, then a 4x4 transpose of the pieces.
+    __attribute__((target("avx512f")))
+    size_t salsaAvx512(uint8_t* out, const uint8_t* in, size_t len, const uint8_t* nonce, uint64_t counter, const uint8_t* key) {
+        uint32_t j[16];
+        salsaInput(j, nonce, counter, key);
+
+        size_t done = 0;
+        for(; done + 16 * 64 <= len; done += 16 * 64, counter += 16) {
+            uint32_t lo[16], hi[16];
+            for(unsigned l = 0; l < 16; l += 1) {
+                lo[l] = static_cast<uint32_t>(counter + l);
+                hi[l] = static_cast<uint32_t>((counter + l) >> 32);
+            }
+
+            __m512i input[16];
+            for(unsigned w = 0; w < 16; w += 1) {
+                input[w] = _mm512_set1_epi32(static_cast<int>(j[w]));
+            }
+            input[8] = _mm512_loadu_si512(lo);
+            input[9] = _mm512_loadu_si512(hi);
+
+            __m512i x[16];
+            for(unsigned w = 0; w < 16; w += 1) x[w] = input[w];
+            WUFF_SALSA_ROUNDS(x, add512, xor512, WUFF_ROTL512)
+            for(unsigned w = 0; w < 16; w += 1) x[w] = _mm512_add_epi32(x[w], input[w]);
+
+            // After the 4x4 transposes, 128-bit piece q of u[g][k] is words 4g to 4g + 3 of
+            // block 4q + k
+            __m512i u[4][4];
+            for(unsigned g = 0; g < 4; g += 1) {
+                const __m512i* r = x + 4 * g;
+                const __m512i t0 = _mm512_unpacklo_epi32(r[0], r[1]);
+                const __m512i t1 = _mm512_unpackhi_epi32(r[0], r[1]);
+                const __m512i t2 = _mm512_unpacklo_epi32(r[2], r[3]);
+                const __m512i t3 = _mm512_unpackhi_epi32(r[2], r[3]);
+                u[g][0] = _mm512_unpacklo_epi64(t0, t2);
+                u[g][1] = _mm512_unpackhi_epi64(t0, t2);
+                u[g][2] = _mm512_unpacklo_epi64(t1, t3);
+                u[g][3] = _mm512_unpackhi_epi64(t1, t3);
+            }
+
+            for(unsigned k = 0; k < 4; k += 1) {
+                const __m512i v0 = _mm512_shuffle_i32x4(u[0][k], u[1][k], 0x44);
+                const __m512i v1 = _mm512_shuffle_i32x4(u[0][k], u[1][k], 0xee);
+                const __m512i v2 = _mm512_shuffle_i32x4(u[2][k], u[3][k], 0x44);
+                const __m512i v3 = _mm512_shuffle_i32x4(u[2][k], u[3][k], 0xee);
+                const __m512i blocks[4] = {_mm512_shuffle_i32x4(v0, v2, 0x88), _mm512_shuffle_i32x4(v0, v2, 0xdd),
+                                           _mm512_shuffle_i32x4(v1, v3, 0x88), _mm512_shuffle_i32x4(v1, v3, 0xdd)};
+                for(unsigned q = 0; q < 4; q += 1) {
+                    const size_t at = done + 64 * (4 * q + k);
+                    const __m512i m = _mm512_loadu_si512(in + at);
+                    _mm512_storeu_si512(out + at, _mm512_xor_si512(m, blocks[q]));
+                }
+            }
+        }
+
+        return done;
+    }
+
+    __attribute__((target("avx512f"))) inline __m512i mul512(__m512i a, __m512i b) { return _mm512_mul_epu32(a, b); }
+    __attribute__((target("avx512f"))) inline __m512i add512q(__m512i a, __m512i b) { return _mm512_add_epi64(a, b); }
+    __attribute__((target("avx512f"))) inline __m512i srl512q(__m512i a, unsigned n) { return _mm512_srli_epi64(a, n); }
+    __attribute__((target("avx512f"))) inline __m512i sll512q(__m512i a, unsigned n) { return _mm512_slli_epi64(a, n); }
+    __attribute__((target("avx512f"))) inline __m512i and512(__m512i a, __m512i b) { return _mm512_and_si512(a, b); }
+    __attribute__((target("avx512f"))) inline __m512i or512(__m512i a, __m512i b) { return _mm512_or_si512(a, b); }
+
+    // As polyAvx2, with eight accumulators and r^8
+    __attribute__((target("avx512f")))
+    size_t polyAvx512(uint32_t h[5], const uint32_t powers[][5], const uint8_t* m, size_t len) {
+        const size_t blocks = len / 128 * 128;
+        if(blocks == 0) return 0;
+
+        const __m512i mask = _mm512_set1_epi64(MASK26);
+        const __m512i hibit = _mm512_set1_epi64(HIBIT);
+        const __m512i lowHalves = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+        const __m512i highHalves = _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1);
+        __m512i r[5], s[5], a[5];
+        for(unsigned i = 0; i < 5; i += 1) {
+            r[i] = _mm512_set1_epi64(powers[7][i]);
+            s[i] = _mm512_add_epi64(r[i], _mm512_slli_epi64(r[i], 2));
+            a[i] = _mm512_set_epi64(0, 0, 0, 0, 0, 0, 0, h[i]);
+        }
+
+        for(size_t i = 0; i < blocks; i += 128) {
+            if(i + 128 == blocks) {
+                for(unsigned k = 0; k < 5; k += 1) {
+                    r[k] = _mm512_set_epi64(powers[0][k], powers[1][k], powers[2][k], powers[3][k],
+                                            powers[4][k], powers[5][k], powers[6][k], powers[7][k]);
+                    s[k] = _mm512_add_epi64(r[k], _mm512_slli_epi64(r[k], 2));
+                }
+            }
+
+            const __m512i m0 = _mm512_loadu_si512(m + i);
+            const __m512i m1 = _mm512_loadu_si512(m + i + 64);
+            const __m512i lo = _mm512_permutex2var_epi64(m0, lowHalves, m1);
+            const __m512i hi = _mm512_permutex2var_epi64(m0, highHalves, m1);
+
+            __m512i t[5];
+            WUFF_POLY_LIMBS(t, lo, hi, srl512q, sll512q, and512, or512, mask, hibit)
+            for(unsigned k = 0; k < 5; k += 1) a[k] = _mm512_add_epi64(a[k], t[k]);
+            WUFF_POLY_MUL(a, r, s, mul512, add512q, srl512q, and512, sll512q, mask)
+        }
+
+        uint64_t lanes[5 * 8];
+        for(unsigned k = 0; k < 5; k += 1) {
+            _mm512_storeu_si512(lanes + 8 * k, a[k]);
+        }
+        foldLanes(h, lanes, 8);
+        return blocks;
+    }
+
+#pragma GCC diagnostic pop
+#endif
+
+    // An eight-lane AVX2 Salsa20 runs out of registers, and loses to libsodium's own
+    const Kernel NONE = {"none", 1, nullptr, nullptr};
+#ifdef WUFF_SECRETBOX_SIMD
+    const Kernel AVX2 = {"avx2", 4, polyAvx2, nullptr};
+    const Kernel AVX512 = {"avx512", 8, polyAvx512, salsaAvx512};
+#endif
+
+    std::vector<const Kernel*> supported() {
+        std::vector<const Kernel*> out;
+#ifdef WUFF_SECRETBOX_SIMD
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx512f")) out.push_back(&AVX512);
+        if(__builtin_cpu_supports("avx2")) out.push_back(&AVX2);
+#endif
+        out.push_back(&NONE);
+        return out;
+    }
+
+    const Kernel*& current() {
+        static const Kernel* kernel = supported().front();
+        return kernel;
+    }
+
+    // The XSalsa20 subkey for nonce, and the first block of its keystream, whose first half is
+    // the Poly1305 key and whose second half encrypts the first 32 bytes of the message
+    struct Setup {
+        Setup(const uint8_t* nonce, const uint8_t* key, const Kernel& kernel) {
+            crypto_core_hsalsa20(subkey, nonce, key, nullptr);
+            memset(block0, 0, sizeof(block0));
+            crypto_stream_salsa20_xor_ic(block0, block0, sizeof(block0), nonce + 16, 0, subkey);
+            polyInit(poly, block0, kernel.lanes);
+        }
+
+        ~Setup() {
+            sodium_memzero(subkey, sizeof(subkey));
+            sodium_memzero(block0, sizeof(block0));
+            sodium_memzero(&poly, sizeof(poly));
+        }
+
+        uint8_t subkey[32];
+        uint8_t block0[64];
+        Poly1305 poly;
+    };
+
+    // Xor keystream into len bytes, starting at block counter
+    void streamXor(const Kernel& kernel, const uint8_t* subkey, uint8_t* out, const uint8_t* in, size_t len, const uint8_t* nonce, uint64_t counter) {
+        const size_t wide = (kernel.salsa == nullptr)? 0 : kernel.salsa(out, in, len, nonce + 16, counter, subkey);
+        crypto_stream_salsa20_xor_ic(out + wide, in + wide, len - wide, nonce + 16, counter + wide / 64, subkey);
+    }
+
+    int check(const Kernel& kernel, Setup& setup, const uint8_t* ctext, const uint8_t* mac, size_t len) {
+        uint8_t computed[16];
+        polyUpdate(setup.poly, kernel, ctext, len);
+        polyFinal(setup.poly, computed);
+        const int status = sodium_memcmp(computed, mac, sizeof(computed));
+        sodium_memzero(computed, sizeof(computed));
+        return (status == 0)? 0 : 1;
+    }
+}
+
+void secretbox::seal(uint8_t* ctext, uint8_t* mac, const uint8_t* msg, size_t len, const uint8_t* nonce, const uint8_t* key) {
+    const Kernel& kernel = *current();
+    if(kernel.poly == nullptr || len < MIN_LEN) {
+        crypto_secretbox_detached(ctext, mac, msg, len, nonce, key);
+        return;
+    }
+
+    // Doing the MAC a few kilobytes behind the keystream, to catch the ciphertext in L1, turned
+    // out slower than two passes over a block that fits in L2
+    Setup setup(nonce, key, kernel);
+    for(size_t i = 0; i < 32; i += 1) {
+        ctext[i] = msg[i] ^ setup.block0[32 + i];
+    }
+    streamXor(kernel, setup.subkey, ctext + 32, msg + 32, len - 32, nonce, 1);
+    polyUpdate(setup.poly, kernel, ctext, len);
+    polyFinal(setup.poly, mac);
+}
+
+int secretbox::open(uint8_t* msg, const uint8_t* ctext, const uint8_t* mac, size_t len, const uint8_t* nonce, const uint8_t* key) {
+    const Kernel& kernel = *current();
+    if(kernel.poly == nullptr || len < MIN_LEN) {
+        return (crypto_secretbox_open_detached(msg, ctext, mac, len, nonce, key) == 0)? 0 : 1;
+    }
+
+    // The whole MAC has to be checked before anything is decrypted, so there is no single pass
+    Setup setup(nonce, key, kernel);
+    if(check(kernel, setup, ctext, mac, len) != 0) {
+        return 1;
+    }
+
+    for(size_t i = 0; i < 32; i += 1) {
+        msg[i] = ctext[i] ^ setup.block0[32 + i];
+    }
+    streamXor(kernel, setup.subkey, msg + 32, ctext + 32, len - 32, nonce, 1);
+    return 0;
+}
+
+int secretbox::authenticate(const uint8_t* ctext, const uint8_t* mac, size_t len, const uint8_t* nonce, const uint8_t* key) {
+    const Kernel& kernel = *current();
+    if(kernel.poly == nullptr || len < MIN_LEN) {
+        uint8_t polyKey[crypto_onetimeauth_poly1305_KEYBYTES];
+        crypto_stream_xsalsa20(polyKey, sizeof(polyKey), nonce, key);
+        const int status = crypto_onetimeauth_poly1305_verify(mac, ctext, len, polyKey);
+        sodium_memzero(polyKey, sizeof(polyKey));
+        return (status == 0)? 0 : 1;
+    }
+
+    Setup setup(nonce, key, kernel);
+    return check(kernel, setup, ctext, mac, len);
+}
+
+const char* secretbox::kernel() {
+    return current()->name;
+}
+
+std::vector<const char*> secretbox::kernels() {
+    std::vector<const char*> out;
+    for(const Kernel* k : supported()) {
+        out.push_back(k->name);
+    }
+    return out;
+}
+
+bool secretbox::useKernel(const char* name) {
+    for(const Kernel* k : supported()) {
+        if(strcmp(k->name, name) == 0) {
+            current() = k;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,41 @@
+// secretbox.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// XSalsa20-Poly1305, byte for byte the same as libsodium's crypto_secretbox_detached() and
+// crypto_secretbox_open_detached(), but quicker on a single core for the large blocks that
+// WuffCrypt seals.  Poly1305 keeps four accumulators with AVX2, or eight with AVX-512, one per
+// vector lane, each taking every fourth or eighth 16-byte block; at the end they are multiplied
+// up by the matching powers of the key and added together.  With AVX-512, Salsa20 also runs
+// sixteen 64-byte blocks of keystream side by side, one per lane.  Elsewhere, and for short
+// messages, it all goes straight to libsodium.
+namespace secretbox {
+    const size_t KEY_BYTES = 32;
+    const size_t NONCE_BYTES = 24;
+    const size_t MAC_BYTES = 16;
+
+    // Encrypt len bytes of msg into ctext, which may be the same buffer, and write the MAC to mac
+    void seal(uint8_t* ctext, uint8_t* mac, const uint8_t* msg, size_t len, const uint8_t* nonce, const uint8_t* key);
+
+    // Check mac against len bytes of ctext and, only if it is right, decrypt them into msg, which
+    // may be the same buffer.  0 on success.
+    int open(uint8_t* msg, const uint8_t* ctext, const uint8_t* mac, size_t len, const uint8_t* nonce, const uint8_t* key);
+
+    // Only check the MAC.  0 if it is right.
+    int authenticate(const uint8_t* ctext, const uint8_t* mac, size_t len, const uint8_t* nonce, const uint8_t* key);
+
+    // The kernel in use: "avx512", "avx2" or "none", which leaves everything to libsodium
+    const char* kernel();
+
+    // Every kernel this processor can run, best first
+    std::vector<const char*> kernels();
+
+    // Switch to another of kernels(), for tests and benchmarks.  Not thread-safe.  False if the
+    // processor cannot run it.
+    bool useKernel(const char* name);
+}
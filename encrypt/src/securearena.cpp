@@ -0,0 +1,156 @@
+// securearena.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <thread>
+#include <sodium.h>
+
+#include "securearena.hpp"
+#include "util.hpp"
+
+const size_t SecureArena::BLOCK_SLOT_SIZE;
+
+namespace {
+    std::atomic<size_t> blockSlots(0);
+    std::atomic<bool> blocksBounded(false);
+}
+
+SecureArena::SecureArena(size_t slotSize, size_t slots): SecureArena(slotSize, slots, std::nothrow) {
+    if(_region == nullptr) {
+        throw std::bad_alloc();
+    }
+}
+
+SecureArena::SecureArena(size_t slotSize, size_t slots, const std::nothrow_t&): _region(nullptr), _slotSize(0), _slots(slots), _locked(false),
+                                                        _head(0), _next(new std::atomic<uint32_t>[slots]),
+                                                        _inUse(0), _peak(0), _waiters(0) {
+    verify(slots > 0 && slots < UINT32_MAX);
+
+    // Whole pages, so that every buffer starts page aligned
+    const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    _slotSize = (slotSize + pageSize - 1) / pageSize * pageSize;
+
+    void* region = mmap(nullptr, _slotSize * _slots, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) {
+        _slots = 0;
+        return;
+    }
+    _region = static_cast<uint8_t*>(region);
+
+#ifdef MADV_DONTDUMP
+    // Keep plaintext out of core dumps, too
+    madvise(_region, _slotSize * _slots, MADV_DONTDUMP);
+#endif
+
+    _locked = sodium_mlock(_region, _slotSize * _slots) == 0;
+
+    for(size_t i = 0; i < _slots; i += 1) {
+        _next[i] = static_cast<uint32_t>((i + 1 < _slots)? i + 2 : 0);
+    }
+    _head = 1;
+}
+
+SecureArena::~SecureArena() {
+    if(_region == nullptr) return;
+
+    // Unlocking wipes the region
+    if(_locked) {
+        sodium_munlock(_region, _slotSize * _slots);
+    }
+    else {
+        sodium_memzero(_region, _slotSize * _slots);
+    }
+
+    munmap(_region, _slotSize * _slots);
+}
+
+uint8_t* SecureArena::acquire(size_t len) {
+    if(len > _slotSize) return nullptr;
+
+    uint64_t head = _head.load(std::memory_order_acquire);
+    while(true) {
+        const uint32_t slot = static_cast<uint32_t>(head);
+        if(slot == 0) return nullptr;
+
+        const uint64_t next = ((head >> 32) + 1) << 32 | _next[slot - 1].load(std::memory_order_relaxed);
+        if(_head.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            const size_t inUse = _inUse.fetch_add(1) + 1;
+            size_t peak = _peak.load();
+            while(inUse > peak && !_peak.compare_exchange_weak(peak, inUse)) {}
+
+            return _region + (slot - 1) * _slotSize;
+        }
+    }
+}
+
+uint8_t* SecureArena::acquireWait(size_t len) {
+    if(len > _slotSize || _slots == 0) return nullptr;
+
+    uint8_t* buf = acquire(len);
+    if(buf != nullptr) return buf;
+
+    // Announce ourselves before trying again, so that a release racing with us either hands us
+    // its slot on the retry or sees a waiter and wakes us
+    std::unique_lock<std::mutex> guard(_waitLock);
+    _waiters += 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while((buf = acquire(len)) == nullptr) {
+        _released.wait(guard);
+    }
+    _waiters -= 1;
+
+    return buf;
+}
+
+void SecureArena::release(uint8_t* buf) {
+    verify(owns(buf));
+    const size_t index = static_cast<size_t>(buf - _region) / _slotSize;
+    sodium_memzero(buf, _slotSize);
+
+    uint64_t head = _head.load(std::memory_order_acquire);
+    while(true) {
+        _next[index].store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+
+        const uint64_t next = ((head >> 32) + 1) << 32 | (index + 1);
+        if(_head.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            break;
+        }
+    }
+
+    _inUse -= 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(_waiters > 0) {
+        std::lock_guard<std::mutex> guard(_waitLock);
+        _released.notify_one();
+    }
+}
+
+void SecureArena::reserveBlocks(size_t slots) {
+    blockSlots = slots;
+}
+
+void SecureArena::boundBlocks(size_t slots) {
+    blockSlots = slots;
+    blocksBounded = true;
+}
+
+uint8_t* SecureArena::takeBlock(size_t len) {
+    SecureArena& arena = blocks();
+
+    // Small buffers, such as for trailers, are not what the budget counts slots for, and waiting
+    // on them could deadlock a thread that already holds its share
+    if(blocksBounded && len > arena.slotSize() / 2) {
+        return arena.acquireWait(len);
+    }
+
+    return arena.acquire(len);
+}
+
+SecureArena& SecureArena::blocks() {
+    // Two buffers for every worker, and a few for the main thread, unless told otherwise.  If
+    // the region cannot be mapped, every buffer comes from the heap instead, where running out
+    // of memory is reported as std::bad_alloc like anywhere else.
+    static SecureArena arena(BLOCK_SLOT_SIZE, (blockSlots > 0)? blockSlots.load() : 2 * std::thread::hardware_concurrency() + 4, std::nothrow);
+    return arena;
+}
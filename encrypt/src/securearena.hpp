@@ -0,0 +1,90 @@
+// securearena.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <new>
+
+// A fixed pool of equally sized, page-aligned buffers carved out of one region that is locked
+// into memory once, up front, rather than with a syscall per buffer.  Buffers are recycled
+// through a lock-free free list and wiped as they are released, so plaintext never reaches swap
+// and never lingers after use.
+class SecureArena {
+public:
+    // Room for one file block, plus the padding libsodium wants in front of it
+    static const size_t BLOCK_SLOT_SIZE = 1024*1024 + 4096;
+
+    // Throws std::bad_alloc if the region cannot be mapped
+    SecureArena(size_t slotSize, size_t slots);
+
+    // Like the above, but if the region cannot be mapped the arena is left with no slots, and
+    // every acquire() returns nullptr
+    SecureArena(size_t slotSize, size_t slots, const std::nothrow_t&);
+
+    SecureArena(const SecureArena& other) = delete;
+    SecureArena& operator=(const SecureArena& other) = delete;
+    ~SecureArena();
+
+    // Take a buffer of at least len bytes.  Returns nullptr if len is larger than a slot or
+    // every slot is in use.  Thread-safe.
+    uint8_t* acquire(size_t len);
+
+    // Like acquire(), but if every slot is in use, wait for one to be released.  Returns nullptr
+    // only if len is larger than a slot, or the arena has no slots.  Thread-safe.
+    uint8_t* acquireWait(size_t len);
+
+    // Wipe a buffer from acquire() and return it to the arena.  Thread-safe.
+    void release(uint8_t* buf);
+
+    bool owns(const uint8_t* buf) const {
+        return buf >= _region && buf < _region + _slotSize * _slots;
+    }
+
+    // False if the operating system refused to lock the region, in which case the buffers work
+    // as normal but may be swapped out
+    bool locked() const { return _locked; }
+
+    size_t slotSize() const { return _slotSize; }
+    size_t slots() const { return _slots; }
+
+    // The most slots that have been in use at once
+    size_t peakInUse() const { return _peak; }
+
+    // The arena shared by every block buffer in the program, created on first use.  Call
+    // reserveBlocks() before that to size it for the number of worker threads.
+    static SecureArena& blocks();
+    static void reserveBlocks(size_t slots);
+
+    // Like reserveBlocks(), but for a hard memory budget: once the slots run out, block-sized
+    // buffers wait for one to be released rather than spilling onto the heap.
+    static void boundBlocks(size_t slots);
+
+    // A buffer of len bytes from blocks(), or nullptr if the caller should use the heap instead
+    static uint8_t* takeBlock(size_t len);
+
+private:
+    uint8_t* _region;
+    size_t _slotSize;
+    size_t _slots;
+    bool _locked;
+
+    // The free list: the head packs a generation count into its top half, so that a slot popped
+    // and pushed back between another thread's load and compare-exchange is noticed.  Slot
+    // numbers are stored plus one, leaving zero for the end of the list.
+    std::atomic<uint64_t> _head;
+    std::unique_ptr<std::atomic<uint32_t>[]> _next;
+
+    std::atomic<size_t> _inUse;
+    std::atomic<size_t> _peak;
+
+    // Only touched when a thread has to wait for a slot
+    std::mutex _waitLock;
+    std::condition_variable _released;
+    std::atomic<size_t> _waiters;
+};
@@ -0,0 +1,74 @@
+// stats.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+
+#include "stats.hpp"
+
+Stats* Stats::_active = nullptr;
+
+namespace {
+    double seconds(uint64_t ns) {
+        return ns / 1e9;
+    }
+
+    // The pth percentile of a sorted list, in microseconds
+    double percentile(const std::vector<uint64_t>& sorted, double p) {
+        if(sorted.empty()) return 0;
+
+        size_t i = static_cast<size_t>(p / 100 * (sorted.size() - 1) + 0.5);
+        return sorted[i] / 1e3;
+    }
+}
+
+Stats::Stats(): _start(now()), _bytes(0) {
+    for(std::atomic<uint64_t>& stage : _stages) {
+        stage = 0;
+    }
+}
+
+long Stats::peakRssKb() {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+uint64_t Stats::now() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void Stats::block(uint64_t bytes, uint64_t ns) {
+    _bytes += bytes;
+
+    std::lock_guard<std::mutex> guard(_latencyLock);
+    _latencies.push_back(ns);
+}
+
+void Stats::write(FILE* f, const char* operation, size_t threads) {
+    const uint64_t wall = now() - _start;
+
+    std::vector<uint64_t> sorted;
+    {
+        std::lock_guard<std::mutex> guard(_latencyLock);
+        sorted = _latencies;
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    fprintf(f, "{\"operation\": \"%s\", \"threads\": %zu, \"wall_seconds\": %.6f, "
+               "\"kdf_seconds\": %.6f, \"read_seconds\": %.6f, \"crypto_seconds\": %.6f, \"write_seconds\": %.6f, "
+               "\"bytes\": %llu, \"blocks\": %zu, \"peak_rss_kb\": %ld, "
+               "\"block_latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}\n",
+            operation, threads, seconds(wall),
+            seconds(_stages[static_cast<int>(Stage::KDF)]), seconds(_stages[static_cast<int>(Stage::Read)]),
+            seconds(_stages[static_cast<int>(Stage::Crypto)]), seconds(_stages[static_cast<int>(Stage::Write)]),
+            static_cast<unsigned long long>(_bytes.load()), sorted.size(), peakRssKb(),
+            percentile(sorted, 50), percentile(sorted, 90), percentile(sorted, 99), percentile(sorted, 100));
+    fflush(f);
+}
@@ -0,0 +1,89 @@
+// stats.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Where time goes while a file is processed, for --stats.  Stage times are summed over every
+// thread, so on a busy pool they can add up to more than the wall clock time.  Nothing is
+// recorded unless a Stats has been made active, and the timers below cost only a null check
+// when none is.
+class Stats {
+public:
+    enum class Stage {
+        KDF,
+        Read,
+        Crypto,
+        Write,
+        Count
+    };
+
+    Stats();
+    Stats(const Stats& other) = delete;
+
+    // The instance being recorded into, or nullptr.  Set it before starting any threads.
+    static Stats* active() { return _active; }
+    static void activate(Stats* stats) { _active = stats; }
+
+    // A monotonic clock, in nanoseconds
+    static uint64_t now();
+
+    // The most memory the process has had resident at once
+    static long peakRssKb();
+
+    void add(Stage stage, uint64_t ns) {
+        _stages[static_cast<int>(stage)] += ns;
+    }
+
+    // One block finished, ns after it was started.  Thread-safe.
+    void block(uint64_t bytes, uint64_t ns);
+
+    // A JSON summary, on one line
+    void write(FILE* f, const char* operation, size_t threads);
+
+private:
+    static Stats* _active;
+
+    const uint64_t _start;
+    std::atomic<uint64_t> _stages[static_cast<int>(Stage::Count)];
+    std::atomic<uint64_t> _bytes;
+
+    std::mutex _latencyLock;
+    std::vector<uint64_t> _latencies;
+};
+
+// Adds the time until it goes out of scope to a stage of the active Stats
+class StageTimer {
+public:
+    explicit StageTimer(Stats::Stage stage): _stats(Stats::active()), _stage(stage), _start(_stats? Stats::now() : 0) {}
+    StageTimer(const StageTimer& other) = delete;
+
+    ~StageTimer() {
+        if(_stats) _stats->add(_stage, Stats::now() - _start);
+    }
+
+private:
+    Stats* _stats;
+    Stats::Stage _stage;
+    uint64_t _start;
+};
+
+// Times one block from when it is read to when it is written out
+class BlockTimer {
+public:
+    BlockTimer(): _stats(Stats::active()), _start(_stats? Stats::now() : 0) {}
+
+    void done(uint64_t bytes) {
+        if(_stats) _stats->block(bytes, Stats::now() - _start);
+    }
+
+private:
+    Stats* _stats;
+    uint64_t _start;
+};
@@ -0,0 +1,448 @@
+// stream.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+#include "fileio.hpp"
+#include "merkle.hpp"
+#include "stream.hpp"
+#include "util.hpp"
+
+namespace {
+    const size_t BLOCK_SIZE = WuffCryptFile::BLOCK_SIZE;
+    const size_t ENCRYPTED_BLOCK_SIZE = WuffCryptFile::ENCRYPTED_BLOCK_SIZE;
+    const size_t HEADER_SIZE = WuffCryptFile::HEADER_SIZE;
+    const size_t MAC_BYTES = crypto_secretbox_xsalsa20poly1305_MACBYTES;
+
+    // The trailer of a stream, but for the values that do not change its size
+    WuffCryptFile::Trailer trailerShape(bool storeDigest) {
+        WuffCryptFile::Trailer trailer;
+        trailer.hasMerkleRoot = true;
+        trailer.hasDigest = storeDigest;
+        return trailer;
+    }
+}
+
+StreamEncrypter::StreamEncrypter(const DerivedKey& key, const WuffCryptFile::Options& options):
+        _enc(key), _digesting(options.digest || options.storeDigest), _storeDigest(options.storeDigest),
+        _held(BLOCK_SIZE), _heldLen(0), _n(0), _total(0), _headerWritten(false), _finished(false) {
+    verify(key.workFactor() == WuffCryptFile::WORK_FACTOR);
+}
+
+size_t StreamEncrypter::updateSize(size_t len) const {
+    const size_t header = _headerWritten? 0 : HEADER_SIZE;
+    return header + (_heldLen + len) / BLOCK_SIZE * ENCRYPTED_BLOCK_SIZE;
+}
+
+size_t StreamEncrypter::update(const uint8_t* in, size_t len, uint8_t* out) {
+    verify(!_finished);
+
+    size_t written = 0;
+    if(!_headerWritten) {
+        WuffCryptFile::encodeHeader(_enc, out);
+        written += HEADER_SIZE;
+        _headerWritten = true;
+    }
+
+    while(len > 0) {
+        // Whole blocks are encrypted straight from the input
+        if(_heldLen == 0 && len >= BLOCK_SIZE) {
+            seal(in, BLOCK_SIZE, out + written);
+            in += BLOCK_SIZE;
+            len -= BLOCK_SIZE;
+            written += ENCRYPTED_BLOCK_SIZE;
+            continue;
+        }
+
+        const size_t take = std::min(len, BLOCK_SIZE - _heldLen);
+        memcpy(_held.data() + _heldLen, in, take);
+        _heldLen += take;
+        in += take;
+        len -= take;
+
+        if(_heldLen == BLOCK_SIZE) {
+            seal(_held.data(), BLOCK_SIZE, out + written);
+            _heldLen = 0;
+            written += ENCRYPTED_BLOCK_SIZE;
+        }
+    }
+
+    return written;
+}
+
+size_t StreamEncrypter::finalSize() const {
+    const size_t header = _headerWritten? 0 : HEADER_SIZE;
+    return header + _heldLen + MAC_BYTES + merkle::indexSize(_n + 1) + WuffCryptFile::sealedTrailerSize(trailerShape(_storeDigest));
+}
+
+size_t StreamEncrypter::final(uint8_t* out) {
+    verify(!_finished);
+
+    size_t written = 0;
+    if(!_headerWritten) {
+        WuffCryptFile::encodeHeader(_enc, out);
+        written += HEADER_SIZE;
+        _headerWritten = true;
+    }
+
+    WuffCryptFile::Trailer trailer = trailerShape(_storeDigest);
+    if(_digesting) {
+        memcpy(trailer.digestChain, _digest.chain(), PlaintextDigest::BYTES);
+    }
+
+    seal(_held.data(), _heldLen, out + written);
+    written += _heldLen + MAC_BYTES;
+    _heldLen = 0;
+    _finished = true;
+
+    if(_digesting) {
+        _digest.finish(_total);
+        memcpy(trailer.digest, _digest.value(), PlaintextDigest::BYTES);
+    }
+
+    std::vector<uint8_t> end;
+    merkle::build(_tags, end);
+    memcpy(trailer.merkleRoot, &end[end.size() - merkle::NODE_BYTES], merkle::NODE_BYTES);
+    trailer.plaintextLength = _total;
+    WuffCryptFile::sealTrailer(_enc, trailer, end);
+
+    memcpy(out + written, end.data(), end.size());
+    return written + end.size();
+}
+
+uint64_t StreamEncrypter::encryptedSize(uint64_t plaintextSize, const WuffCryptFile::Options& options) {
+    return WuffCryptFile::dataEnd(plaintextSize) + merkle::indexSize(WuffCryptFile::blockCount(plaintextSize)) +
+           WuffCryptFile::sealedTrailerSize(trailerShape(options.storeDigest));
+}
+
+void StreamEncrypter::seal(const uint8_t* block, size_t len, uint8_t* out) {
+    _enc.encrypt(block, len, out, WuffCryptFile::blockNonce(_enc.noncePrefix(), _n, len));
+    _tags.insert(_tags.end(), out, out + merkle::TAG_BYTES);
+
+    if(_digesting) {
+        uint8_t leaf[PlaintextDigest::BYTES];
+        PlaintextDigest::leaf(block, len, leaf);
+        _digest.add(leaf);
+    }
+
+    _n += 1;
+    _total += len;
+}
+
+StreamDecrypter::StreamDecrypter(KeyCache& keys, const WuffCryptFile::Options& options):
+        _keys(keys), _digesting(options.digest), _header(), _pool(nullptr), _tail(false), _trailerLimit(0),
+        _tailSkipped(0), _n(0), _total(0), _finished(false),
+        _status(WuffCryptFile::FileStatus::OK) {}
+
+size_t StreamDecrypter::updateSize(size_t len) const {
+    // Past the last full block, everything waits for final()
+    if(_tail) return 0;
+    return (_pending.size() + len) / ENCRYPTED_BLOCK_SIZE * BLOCK_SIZE;
+}
+
+WuffCryptFile::FileStatus StreamDecrypter::update(const uint8_t* in, size_t len, uint8_t* out, size_t& written) {
+    verify(!_finished);
+
+    written = 0;
+    if(_status != WuffCryptFile::FileStatus::OK) return _status;
+
+    if(!_dec) {
+        const size_t take = std::min(len, HEADER_SIZE - _pending.size());
+        _pending.insert(_pending.end(), in, in + take);
+        in += take;
+        len -= take;
+        if(_pending.size() < HEADER_SIZE) return WuffCryptFile::FileStatus::OK;
+
+        WuffCryptFile::FileStatus status = WuffCryptFile::decodeHeader(_pending.data(), _pending.size(), _header);
+        if(status != WuffCryptFile::FileStatus::OK) return fail(status);
+
+        // decodeHeader() has already turned away work factors beyond WORK_FACTOR
+        const DerivedKey* key = _keys.tryGet(_header.workFactor);
+        if(key == nullptr) return fail(WuffCryptFile::FileStatus::NoMemory);
+
+        _dec.reset(new Decrypter(*key, _header.nonce));
+        _pending.clear();
+    }
+
+    // Try everything the size of a full block as one, until something is not
+    while(!_tail) {
+        const uint8_t* chunk = nullptr;
+        size_t count = 0;
+        const bool fromPending = !_pending.empty();
+        if(fromPending) {
+            const size_t take = std::min(len, ENCRYPTED_BLOCK_SIZE - _pending.size());
+            _pending.insert(_pending.end(), in, in + take);
+            in += take;
+            len -= take;
+            if(_pending.size() < ENCRYPTED_BLOCK_SIZE) break;
+            chunk = _pending.data();
+            count = 1;
+        }
+        else {
+            count = len / ENCRYPTED_BLOCK_SIZE;
+            if(count == 0) break;
+            chunk = in;
+            in += count * ENCRYPTED_BLOCK_SIZE;
+            len -= count * ENCRYPTED_BLOCK_SIZE;
+        }
+
+        const size_t passed = openBlocks(chunk, count, out + written);
+        written += passed * BLOCK_SIZE;
+        if(passed < count) {
+            // Format 0 has nothing after its blocks to account for a bad one
+            if(_header.version == 0) return fail(WuffCryptFile::FileStatus::VerificationFailed);
+
+            // Most likely the final block and trailer; either way, final() will tell
+            startTail();
+            if(!fromPending) {
+                _pending.clear();
+                WuffCryptFile::FileStatus status = holdTail(chunk + passed * ENCRYPTED_BLOCK_SIZE, (count - passed) * ENCRYPTED_BLOCK_SIZE);
+                if(status != WuffCryptFile::FileStatus::OK) return status;
+            }
+            break;
+        }
+
+        _pending.clear();
+    }
+
+    if(_tail) return holdTail(in, len);
+
+    _pending.insert(_pending.end(), in, in + len);
+    return WuffCryptFile::FileStatus::OK;
+}
+
+void StreamDecrypter::startTail() {
+    _tail = true;
+
+    // Every record there is, with a zero run for each one seen so far and one more for the final
+    // block; the trailer is checked against the runs seen, so it cannot list more
+    WuffCryptFile::Trailer largest;
+    largest.hasDigest = true;
+    largest.hasMerkleRoot = true;
+    largest.zeroRuns.resize(_zeroRuns.size() + 1);
+    largest.dataShards = 1;
+    largest.parityShards = 1;
+    largest.hasVolume = true;
+    _trailerLimit = WuffCryptFile::sealedTrailerSize(largest);
+}
+
+WuffCryptFile::FileStatus StreamDecrypter::holdTail(const uint8_t* in, size_t len) {
+    if(_header.version < WuffCryptFile::PARITY_VERSION) {
+        if(_pending.size() + len > ENCRYPTED_BLOCK_SIZE + merkle::indexSize(_n + 1) + _trailerLimit) {
+            return fail(WuffCryptFile::FileStatus::VerificationFailed);
+        }
+
+        _pending.insert(_pending.end(), in, in + len);
+        return WuffCryptFile::FileStatus::OK;
+    }
+
+    // Parity runs to any length, so keep the first block's worth, which holds the final block,
+    // and then only as much of the end as the trailer could need
+    if(_pending.size() < ENCRYPTED_BLOCK_SIZE) {
+        const size_t take = std::min(len, ENCRYPTED_BLOCK_SIZE - _pending.size());
+        _pending.insert(_pending.end(), in, in + take);
+        in += take;
+        len -= take;
+    }
+
+    if(len >= _trailerLimit) {
+        _tailSkipped += _pending.size() - ENCRYPTED_BLOCK_SIZE + (len - _trailerLimit);
+        _pending.resize(ENCRYPTED_BLOCK_SIZE);
+        _pending.insert(_pending.end(), in + len - _trailerLimit, in + len);
+        return WuffCryptFile::FileStatus::OK;
+    }
+
+    _pending.insert(_pending.end(), in, in + len);
+    if(_pending.size() > ENCRYPTED_BLOCK_SIZE + _trailerLimit) {
+        const size_t excess = _pending.size() - ENCRYPTED_BLOCK_SIZE - _trailerLimit;
+        _pending.erase(_pending.begin() + ENCRYPTED_BLOCK_SIZE, _pending.begin() + ENCRYPTED_BLOCK_SIZE + excess);
+        _tailSkipped += excess;
+    }
+
+    return WuffCryptFile::FileStatus::OK;
+}
+
+WuffCryptFile::FileStatus StreamDecrypter::final(uint8_t* out, size_t& written) {
+    verify(!_finished);
+
+    written = 0;
+    if(_status != WuffCryptFile::FileStatus::OK) return _status;
+    _finished = true;
+
+    WuffCryptFile::FileStatus status = finishBlocks(out, written);
+    if(status != WuffCryptFile::FileStatus::OK) return fail(status);
+    return WuffCryptFile::FileStatus::OK;
+}
+
+WuffCryptFile::FileStatus StreamDecrypter::finishBlocks(uint8_t* out, size_t& written) {
+    if(!_dec) {
+        WuffCryptFile::FileStatus status = WuffCryptFile::decodeHeader(_pending.data(), _pending.size(), _header);
+        return (status == WuffCryptFile::FileStatus::CorruptHeader)? WuffCryptFile::FileStatus::Truncated : status;
+    }
+
+    // Format 0 has no trailer: what is left is the final block
+    if(_header.version == 0) {
+        if(_pending.size() < MAC_BYTES || !open(_pending.data(), _pending.size() - MAC_BYTES, out)) {
+            return WuffCryptFile::FileStatus::VerificationFailed;
+        }
+
+        written = _pending.size() - MAC_BYTES;
+        if(_digesting) _digest.finish(_total);
+        return WuffCryptFile::FileStatus::OK;
+    }
+
+    // Anything dropped from the middle was index or parity, which the trailer accounts for
+    WuffCryptFile::Trailer trailer;
+    const uint64_t fileSize = WuffCryptFile::blockOffset(_n) + _pending.size() + _tailSkipped;
+    WuffCryptFile::FileStatus status = WuffCryptFile::openTrailer(_pending.data(), _pending.size(), fileSize, *_dec, trailer);
+    if(status != WuffCryptFile::FileStatus::OK) return status;
+
+    // Only full blocks are ever left out as zeros, so every block but the final one went through
+    // update(); if one did not, it failed there
+    const uint64_t nBlocks = WuffCryptFile::blockCount(trailer.plaintextLength);
+    if(nBlocks != _n + 1) return WuffCryptFile::FileStatus::VerificationFailed;
+
+    // The zero blocks already passed on have to be the ones the trailer lists
+    std::vector<std::pair<uint64_t, uint64_t>> listed;
+    for(const auto& run : trailer.zeroRuns) {
+        if(run.first >= _n) break;
+        listed.push_back(std::make_pair(run.first, std::min(run.second, _n - run.first)));
+    }
+    if(listed != _zeroRuns) return WuffCryptFile::FileStatus::VerificationFailed;
+
+    // The trailer's offset has been checked, so the final block lies within the start of what we
+    // hold, which is never dropped
+    const size_t len = WuffCryptFile::blockLength(trailer.plaintextLength, _n);
+    if(trailer.isZero(_n) || !open(_pending.data(), len, out)) {
+        return WuffCryptFile::FileStatus::VerificationFailed;
+    }
+    written = len;
+
+    if(_digesting) {
+        _digest.finish(_total);
+
+        if(trailer.hasDigest && sodium_memcmp(_digest.value(), trailer.digest, PlaintextDigest::BYTES) != 0) {
+            return WuffCryptFile::FileStatus::VerificationFailed;
+        }
+    }
+
+    if(trailer.hasMerkleRoot) {
+        std::vector<uint8_t> index;
+        merkle::build(_tags, index);
+        if(sodium_memcmp(&index[index.size() - merkle::NODE_BYTES], trailer.merkleRoot, merkle::NODE_BYTES) != 0) {
+            return WuffCryptFile::FileStatus::VerificationFailed;
+        }
+    }
+
+    return WuffCryptFile::FileStatus::OK;
+}
+
+bool StreamDecrypter::open(const uint8_t* ctext, size_t len, uint8_t* out) {
+    if(_dec->decrypt(ctext, len + MAC_BYTES, out, nonce(_n, len)) != 0) {
+        return false;
+    }
+
+    uint8_t leaf[PlaintextDigest::BYTES];
+    if(_digesting) PlaintextDigest::leaf(out, len, leaf);
+    accept(ctext, len, leaf);
+    return true;
+}
+
+size_t StreamDecrypter::openBlocks(const uint8_t* ctext, size_t count, uint8_t* out) {
+    const bool sparse = _header.version >= WuffCryptFile::SPARSE_VERSION;
+    if(_pool == nullptr || count < 2) {
+        for(size_t i = 0; i < count; i += 1) {
+            const uint8_t* chunk = ctext + i * ENCRYPTED_BLOCK_SIZE;
+            if(sparse && fileio::allZero(chunk, ENCRYPTED_BLOCK_SIZE)) {
+                skipZero(out + i * BLOCK_SIZE);
+            }
+            else if(!open(chunk, BLOCK_SIZE, out + i * BLOCK_SIZE)) {
+                return i;
+            }
+        }
+
+        return count;
+    }
+
+    // Every block is checked, decrypted and hashed by itself; only the results are taken in order
+    enum Outcome: uint8_t { Failed, Opened, Zero };
+    std::vector<uint8_t> outcomes(count, Failed);
+    std::vector<uint8_t> leaves(_digesting? count * PlaintextDigest::BYTES : 0);
+
+    std::mutex lock;
+    std::condition_variable done;
+    size_t remaining = count;
+    for(size_t i = 0; i < count; i += 1) {
+        _pool->submit([&, i]() {
+            const uint8_t* chunk = ctext + i * ENCRYPTED_BLOCK_SIZE;
+            uint8_t* plain = out + i * BLOCK_SIZE;
+            if(sparse && fileio::allZero(chunk, ENCRYPTED_BLOCK_SIZE)) {
+                outcomes[i] = Zero;
+            }
+            else if(_dec->decrypt(chunk, ENCRYPTED_BLOCK_SIZE, plain, nonce(_n + i, BLOCK_SIZE)) == 0) {
+                if(_digesting) PlaintextDigest::leaf(plain, BLOCK_SIZE, &leaves[i * PlaintextDigest::BYTES]);
+                outcomes[i] = Opened;
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            remaining -= 1;
+            if(remaining == 0) done.notify_one();
+        });
+    }
+
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&remaining]() { return remaining == 0; });
+    }
+
+    for(size_t i = 0; i < count; i += 1) {
+        if(outcomes[i] == Zero) {
+            skipZero(out + i * BLOCK_SIZE);
+        }
+        else if(outcomes[i] == Opened) {
+            accept(ctext + i * ENCRYPTED_BLOCK_SIZE, BLOCK_SIZE, _digesting? &leaves[i * PlaintextDigest::BYTES] : nullptr);
+        }
+        else {
+            return i;
+        }
+    }
+
+    return count;
+}
+
+void StreamDecrypter::accept(const uint8_t* ctext, size_t len, const uint8_t* leaf) {
+    if(_digesting) {
+        _digest.add(leaf);
+    }
+
+    _tags.insert(_tags.end(), ctext, ctext + merkle::TAG_BYTES);
+    _n += 1;
+    _total += len;
+}
+
+Nonce StreamDecrypter::nonce(uint64_t n, size_t len) const {
+    return (_header.version == 0)? Nonce::counter(_header.nonce, _header.counter(n)) :
+                                   WuffCryptFile::blockNonce(_header.nonce, n, len);
+}
+
+void StreamDecrypter::skipZero(uint8_t* out) {
+    memset(out, 0, BLOCK_SIZE);
+
+    if(!_zeroRuns.empty() && _zeroRuns.back().first + _zeroRuns.back().second == _n) {
+        _zeroRuns.back().second += 1;
+    }
+    else {
+        _zeroRuns.push_back(std::make_pair(_n, static_cast<uint64_t>(1)));
+    }
+
+    if(_digesting) {
+        _digest.add(WuffCryptFile::zeroLeaf());
+    }
+
+    _tags.insert(_tags.end(), merkle::TAG_BYTES, 0);
+    _n += 1;
+    _total += BLOCK_SIZE;
+}
@@ -0,0 +1,171 @@
+// stream.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include "digest.hpp"
+#include "paddedbuffer.hpp"
+#include "threadpool.hpp"
+#include "wuffcrypt.hpp"
+
+// Incremental encryption and decryption, for embedding: input is fed in pieces of any size, and
+// the output goes into the caller's memory, in exactly the format WuffCryptFile reads and writes.
+// Neither needs a file, a seekable stream, or a thread.
+
+// Writes a format 2 file under a fresh nonce prefix.  Full blocks go out as soon as they fill;
+// the last block, which is always partial, waits for final(), along with the Merkle index and
+// trailer.  Of the options, only digest and storeDigest apply.
+class StreamEncrypter {
+public:
+    explicit StreamEncrypter(const DerivedKey& key, const WuffCryptFile::Options& options = WuffCryptFile::Options());
+    StreamEncrypter(const StreamEncrypter& other) = delete;
+
+    // How many bytes update() writes for len more bytes of input
+    size_t updateSize(size_t len) const;
+
+    // Encrypt len bytes into out, which must have room for updateSize(len), and return how many
+    // bytes were written
+    size_t update(const uint8_t* in, size_t len, uint8_t* out);
+
+    // How many bytes final() writes
+    size_t finalSize() const;
+
+    // Write out everything that is left.  Nothing may be added afterwards.
+    size_t final(uint8_t* out);
+
+    bool finished() const { return _finished; }
+
+    // With Options::digest or storeDigest, the digest of everything encrypted, once finished
+    const PlaintextDigest& digest() const { return _digest; }
+
+    // The size of a whole file of plaintextSize bytes
+    static uint64_t encryptedSize(uint64_t plaintextSize, const WuffCryptFile::Options& options = WuffCryptFile::Options());
+
+private:
+    // Encrypt the next block into out
+    void seal(const uint8_t* block, size_t len, uint8_t* out);
+
+    Encrypter _enc;
+    const bool _digesting;
+    const bool _storeDigest;
+    PlaintextDigest _digest;
+
+    // Plaintext waiting for a block to fill
+    SodiumMessageBuffer _held;
+    size_t _heldLen;
+
+    std::vector<uint8_t> _tags;
+    uint64_t _n;
+    uint64_t _total;
+    bool _headerWritten;
+    bool _finished;
+};
+
+// Reads any format that WuffCryptFile does.  Each full block is authenticated and decrypted into
+// the output as soon as it arrives; what follows the last of them, the final block, Merkle index
+// and trailer, is held until final(), which checks the whole.  As with WuffCryptFile::decryptTo(),
+// output is released before the whole has been checked, so none of it is to be trusted until
+// final() returns OK.
+//
+// Blocks of zeros in format 3 and 4 files count as blocks, and are checked against the trailer at
+// the end.  Parity is not used, so damaged blocks cannot be rebuilt, and a format 4 file's parity
+// is read past rather than held.  What is held after the last full block is at most a block, the
+// Merkle index and the largest trailer there could be; anything longer fails at once, as it can
+// only be a damaged block with the rest of the file behind it.
+//
+// Given a pool, the full blocks of each update() are decrypted across it at once, and only their
+// bookkeeping is done in order, so feeding in several blocks at a time keeps every thread busy.
+class StreamDecrypter {
+public:
+    explicit StreamDecrypter(KeyCache& keys, const WuffCryptFile::Options& options = WuffCryptFile::Options());
+    StreamDecrypter(const StreamDecrypter& other) = delete;
+
+    // Decrypt on pool from now on, or on the calling thread again if nullptr.  update() waits for
+    // its blocks, so it must not be called from a task on the same pool.
+    void setPool(WorkStealingPool* pool) { _pool = pool; }
+
+    // At most how many bytes update() writes for len more bytes of input
+    size_t updateSize(size_t len) const;
+
+    // Decrypt len bytes into out, which must have room for updateSize(len).  Once anything
+    // fails, so does every later call.
+    WuffCryptFile::FileStatus update(const uint8_t* in, size_t len, uint8_t* out, size_t& written);
+
+    // At most how many bytes final() writes: only the final block, which is never a full one,
+    // follows the blocks update() has already decrypted
+    size_t finalSize() const {
+        return (_pending.size() < WuffCryptFile::BLOCK_SIZE)? _pending.size() : WuffCryptFile::BLOCK_SIZE;
+    }
+
+    // Decrypt what is left, and check the file as a whole
+    WuffCryptFile::FileStatus final(uint8_t* out, size_t& written);
+
+    bool finished() const { return _finished; }
+
+    // With Options::digest, the digest of everything decrypted, once finished.  A digest stored
+    // in the file is only checked when this is computed.
+    const PlaintextDigest& digest() const { return _digest; }
+
+private:
+    WuffCryptFile::FileStatus finishBlocks(uint8_t* out, size_t& written);
+
+    // Start holding everything after the last full block, or the first block to fail
+    void startTail();
+
+    // Hold len more bytes of the tail: its start, where the final block is, and its end, where
+    // the trailer is.  Only a format 4 file may have more between them than the Merkle index,
+    // namely its parity, which is counted and dropped.
+    WuffCryptFile::FileStatus holdTail(const uint8_t* in, size_t len);
+
+    // Decrypt block _n, ctext being its MAC followed by len bytes of ciphertext.  False if it
+    // does not authenticate.
+    bool open(const uint8_t* ctext, size_t len, uint8_t* out);
+
+    // Decrypt count full blocks from _n on, laid out one after another in ctext, on the pool, and
+    // return how many of them passed before the first that did not
+    size_t openBlocks(const uint8_t* ctext, size_t count, uint8_t* out);
+
+    // Account for block _n having authenticated, with its plaintext's digest leaf if digesting
+    void accept(const uint8_t* ctext, size_t len, const uint8_t* leaf);
+
+    Nonce nonce(uint64_t n, size_t len) const;
+
+    // Account for block _n being a full block of zeros that was never stored
+    void skipZero(uint8_t* out);
+
+    WuffCryptFile::FileStatus fail(WuffCryptFile::FileStatus status) {
+        _status = status;
+        return status;
+    }
+
+    KeyCache& _keys;
+    const bool _digesting;
+    PlaintextDigest _digest;
+    WuffCryptFile::Header _header;
+    std::unique_ptr<Decrypter> _dec;
+    WorkStealingPool* _pool;
+
+    // Ciphertext not yet handled: part of the header, or of a block, or everything after the
+    // last full block once _tail is set
+    std::vector<uint8_t> _pending;
+    bool _tail;
+
+    // Once _tail is set: the most a trailer could take, and how much of the tail has been
+    // dropped from the middle of _pending
+    size_t _trailerLimit;
+    uint64_t _tailSkipped;
+
+    // Zero blocks seen so far, as (first block, count) runs, to compare with the trailer
+    std::vector<std::pair<uint64_t, uint64_t>> _zeroRuns;
+
+    std::vector<uint8_t> _tags;
+    uint64_t _n;
+    uint64_t _total;
+    bool _finished;
+    WuffCryptFile::FileStatus _status;
+};
@@ -0,0 +1,149 @@
+// threadpool.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include "threadpool.hpp"
+
+namespace {
+    // Identifies the pool and deque owned by the current thread, if it is a worker
+    thread_local WorkStealingPool* currentPool = nullptr;
+    thread_local size_t currentWorker = 0;
+}
+
+WorkStealingPool::WorkStealingPool(size_t nThreads): _queued(0), _pending(0), _nextVictim(0), _stopping(false) {
+    if(nThreads == 0) nThreads = 1;
+
+    for(size_t i = 0; i < nThreads; i += 1) {
+        _workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+
+    for(size_t i = 0; i < nThreads; i += 1) {
+        _threads.push_back(std::thread(&WorkStealingPool::run, this, i));
+    }
+}
+
+size_t WorkStealingPool::defaultSize() {
+    size_t n = std::thread::hardware_concurrency();
+    return (n == 0)? 1 : n;
+}
+
+void WorkStealingPool::submit(Task task) {
+    _pending += 1;
+
+    // Workers keep their own subtasks close; everyone else spreads work round-robin
+    size_t target = (currentPool == this)? currentWorker : (_nextVictim++ % _workers.size());
+
+    // Counted before it can be popped, so that the count never drops below zero; a worker that
+    // wakes in between finds nothing yet and looks again
+    _queued += 1;
+    {
+        std::lock_guard<std::mutex> guard(_workers[target]->lock);
+        _workers[target]->tasks.push_back(std::move(task));
+    }
+
+    // Taking the lock orders the wakeup after any worker's check of _queued
+    {
+        std::lock_guard<std::mutex> guard(_sleepLock);
+    }
+    _wake.notify_one();
+}
+
+void WorkStealingPool::wait() {
+    std::unique_lock<std::mutex> guard(_sleepLock);
+    _idle.wait(guard, [this]() { return _pending == 0; });
+}
+
+bool WorkStealingPool::tryPop(size_t self, Task& out) {
+    // Our own deque first, newest task first
+    {
+        Worker& worker = *_workers[self];
+        std::lock_guard<std::mutex> guard(worker.lock);
+        if(!worker.tasks.empty()) {
+            out = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+            _queued -= 1;
+            return true;
+        }
+    }
+
+    // Then steal the oldest task from somebody else
+    for(size_t i = 1; i < _workers.size(); i += 1) {
+        Worker& victim = *_workers[(self + i) % _workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if(!victim.tasks.empty()) {
+            out = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            _queued -= 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void WorkStealingPool::run(size_t self) {
+    currentPool = this;
+    currentWorker = self;
+
+    while(true) {
+        Task task;
+        if(tryPop(self, task)) {
+            task();
+            task = nullptr;
+
+            if(--_pending == 0) {
+                std::lock_guard<std::mutex> guard(_sleepLock);
+                _idle.notify_all();
+            }
+
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(_sleepLock);
+        _wake.wait(guard, [this]() { return _stopping || _queued > 0; });
+        if(_stopping && _queued == 0) return;
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    wait();
+
+    {
+        std::lock_guard<std::mutex> guard(_sleepLock);
+        _stopping = true;
+    }
+    _wake.notify_all();
+
+    for(auto& thread : _threads) {
+        thread.join();
+    }
+}
+
+void Strand::post(WorkStealingPool::Task task) {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _tasks.push_back(std::move(task));
+        if(_running) return;
+        _running = true;
+    }
+
+    std::shared_ptr<Strand> self = shared_from_this();
+    _pool.submit([self]() { self->drain(); });
+}
+
+void Strand::drain() {
+    while(true) {
+        WorkStealingPool::Task task;
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            if(_tasks.empty()) {
+                _running = false;
+                return;
+            }
+
+            task = std::move(_tasks.front());
+            _tasks.pop_front();
+        }
+
+        task();
+    }
+}
@@ -0,0 +1,89 @@
+// threadpool.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads, each with its own task deque.  Tasks submitted from inside a
+// worker go onto that worker's deque and are popped LIFO, so a task that fans out into subtasks
+// keeps working on its own (cache-warm) data.  Idle workers steal the oldest task from another
+// worker's deque, which tends to be the largest remaining piece of work.
+class WorkStealingPool {
+public:
+    typedef std::function<void()> Task;
+
+    explicit WorkStealingPool(size_t nThreads);
+    WorkStealingPool(const WorkStealingPool& other) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool& other) = delete;
+
+    // Queue a task.  May be called from any thread, including from within a running task.
+    void submit(Task task);
+
+    // Block until every submitted task, including tasks submitted by other tasks, has finished.
+    // Must not be called from within a task.
+    void wait();
+
+    size_t size() const {
+        return _threads.size();
+    }
+
+    // The number of threads to use when the user did not ask for a specific number.
+    static size_t defaultSize();
+
+    ~WorkStealingPool();
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    bool tryPop(size_t self, Task& out);
+    void run(size_t self);
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::vector<std::thread> _threads;
+
+    std::mutex _sleepLock;
+    std::condition_variable _wake;
+    std::condition_variable _idle;
+
+    // Tasks sitting in a deque, and tasks that have been submitted but not yet finished
+    std::atomic<size_t> _queued;
+    std::atomic<size_t> _pending;
+    std::atomic<size_t> _nextVictim;
+    bool _stopping;
+};
+
+// Runs tasks on a pool one at a time, in the order they were posted, without tying up a thread
+// between them.  Lets many independent streams of work, each of which must stay in order, share
+// a pool.  Always owned by a std::shared_ptr, which queued work holds on to.
+class Strand: public std::enable_shared_from_this<Strand> {
+public:
+    explicit Strand(WorkStealingPool& pool): _pool(pool), _running(false) {}
+    Strand(const Strand& other) = delete;
+    Strand& operator=(const Strand& other) = delete;
+
+    // Queue a task to run after every task posted before it has finished.  May be called from
+    // any thread, including from within one of the strand's own tasks.
+    void post(WorkStealingPool::Task task);
+
+private:
+    void drain();
+
+    WorkStealingPool& _pool;
+    std::mutex _lock;
+    std::deque<WorkStealingPool::Task> _tasks;
+
+    // Whether a drain() is queued or running; only one ever is
+    bool _running;
+};
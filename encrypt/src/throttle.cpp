@@ -0,0 +1,299 @@
+// throttle.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "throttle.hpp"
+
+Throttle* Throttle::_active = nullptr;
+volatile sig_atomic_t Throttle::_hangup = 0;
+
+namespace {
+    const uint64_t SECOND = 1000000000;
+
+    // However low the rate, a whole block may go through without waiting
+    const double MIN_BURST = 2 * 1024 * 1024;
+
+    // Reads shorter than this are mostly seek and syscall, and say little about throughput
+    const uint64_t MIN_SAMPLE = 64 * 1024;
+
+    // The read rate moves at most this often, and is considered congested while reads take
+    // this much longer than the baseline, and clear again below the lower bound
+    const uint64_t ADAPT_INTERVAL = SECOND / 4;
+    const double CONGESTED = 2.0;
+    const double CLEAR = 1.25;
+
+    // Crypto sleeps off its debt once it has run up this much, rather than after every block
+    const uint64_t MIN_SLEEP = SECOND / 100;
+
+    // How often to look at the control file for changes
+    const uint64_t POLL_INTERVAL = SECOND;
+
+    // Bytes per second, or with a K, M or G suffix.  Zero means unlimited.
+    bool parseSize(const char* arg, const char* stop, uint64_t& out) {
+        char* end = nullptr;
+        out = strtoull(arg, &end, 10);
+        switch(*end) {
+            case 'k': case 'K': { out <<= 10; end += 1; break; }
+            case 'm': case 'M': { out <<= 20; end += 1; break; }
+            case 'g': case 'G': { out <<= 30; end += 1; break; }
+            default: { break; }
+        }
+
+        return *arg >= '0' && *arg <= '9' && end == stop;
+    }
+
+    void sleepFor(uint64_t ns) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+    }
+
+    void describe(char* buf, size_t len, uint64_t rate) {
+        if(rate == 0) {
+            snprintf(buf, len, "unlimited");
+        }
+        else {
+            snprintf(buf, len, "%.1f MiB/s", rate / (1024.0 * 1024.0));
+        }
+    }
+}
+
+Throttle::Throttle(const Limits& limits): _latency(0), _baseline(0), _lastAdapt(0), _lastPoll(0), _mtime(0), _size(-1),
+                                          _handlingHangup(false) {
+    setLimits(limits);
+}
+
+Throttle::~Throttle() {
+    if(_handlingHangup) sigaction(SIGHUP, &_oldHangup, nullptr);
+    if(_active == this) _active = nullptr;
+}
+
+bool Throttle::parseRate(const std::string& arg, uint64_t& read, uint64_t& write) {
+    const char* start = arg.c_str();
+    const char* colon = strchr(start, ':');
+    const char* end = start + arg.size();
+
+    uint64_t r = 0;
+    uint64_t w = 0;
+    if(colon == nullptr) {
+        if(!parseSize(start, end, r)) return false;
+        w = r;
+    }
+    else if(!parseSize(start, colon, r) || !parseSize(colon + 1, end, w)) {
+        return false;
+    }
+
+    read = r;
+    write = w;
+    return true;
+}
+
+bool Throttle::parseControl(const std::string& text, Limits& limits) {
+    Limits parsed = limits;
+
+    size_t start = 0;
+    while(start < text.size()) {
+        size_t end = text.find('\n', start);
+        if(end == std::string::npos) end = text.size();
+
+        // Two words at most, separated by blanks
+        char key[16];
+        char value[64];
+        char extra[2];
+        const std::string line = text.substr(start, end - start);
+        start = end + 1;
+
+        const int words = sscanf(line.c_str(), " %15s %63s %1s", key, value, extra);
+        if(words <= 0 || key[0] == '#') continue;
+        if(words != 2) return false;
+
+        if(strcmp(key, "rate") == 0) {
+            if(!parseRate(value, parsed.readRate, parsed.writeRate)) return false;
+        }
+        else if(strcmp(key, "cpu") == 0) {
+            char* stop = nullptr;
+            const unsigned long percent = strtoul(value, &stop, 10);
+            if(*value < '0' || *value > '9' || *stop != '\0' || percent < 1 || percent > 100) return false;
+            parsed.cpuPercent = static_cast<unsigned>(percent);
+        }
+        else {
+            return false;
+        }
+    }
+
+    limits = parsed;
+    return true;
+}
+
+void Throttle::setLimits(const Limits& limits) {
+    std::lock_guard<std::mutex> guard(_lock);
+    _limits = limits;
+    _read.rate = limits.readRate;
+    _write.rate = limits.writeRate;
+
+    // Start over learning what the device can do
+    _latency = 0;
+    _baseline = 0;
+}
+
+Throttle::Limits Throttle::limits() const {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _limits;
+}
+
+uint64_t Throttle::readRate() const {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _read.rate;
+}
+
+bool Throttle::watch(const std::string& path) {
+    _path = path;
+    if(!_handlingHangup) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = onHangup;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        _handlingHangup = sigaction(SIGHUP, &action, &_oldHangup) == 0;
+    }
+
+    _lastPoll = Stats::now();
+    return reload(false);
+}
+
+void Throttle::onHangup(int) {
+    _hangup = 1;
+}
+
+void Throttle::poll() {
+    if(_path.empty()) return;
+
+    // One thread looks, at most once a POLL_INTERVAL, unless asked to by SIGHUP
+    const uint64_t now = Stats::now();
+    uint64_t last = _lastPoll;
+    if(_hangup == 0 && now - last < POLL_INTERVAL) return;
+    if(!_lastPoll.compare_exchange_strong(last, now)) return;
+
+    const bool hangup = _hangup != 0;
+    _hangup = 0;
+
+    struct stat st;
+    if(stat(_path.c_str(), &st) != 0) return;
+    if(!hangup && static_cast<int64_t>(st.st_mtime) == _mtime && static_cast<int64_t>(st.st_size) == _size) return;
+
+    reload(true);
+}
+
+bool Throttle::reload(bool announce) {
+    FILE* f = fopen(_path.c_str(), "r");
+    if(f == nullptr) {
+        if(announce) fprintf(stderr, "Error opening %s; keeping the current limits\n", _path.c_str());
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fileno(f), &st) == 0) {
+        _mtime = static_cast<int64_t>(st.st_mtime);
+        _size = static_cast<int64_t>(st.st_size);
+    }
+
+    std::string text;
+    char buf[1024];
+    size_t n = 0;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0 && text.size() < 64 * 1024) {
+        text.append(buf, n);
+    }
+    fclose(f);
+
+    Limits limits = this->limits();
+    if(!parseControl(text, limits)) {
+        if(announce) fprintf(stderr, "Error parsing %s; keeping the current limits\n", _path.c_str());
+        return false;
+    }
+
+    setLimits(limits);
+    if(announce) {
+        char read[32];
+        char written[32];
+        describe(read, sizeof(read), limits.readRate);
+        describe(written, sizeof(written), limits.writeRate);
+        fprintf(stderr, "Throttling to reads of %s, writes of %s and %u%% CPU\n", read, written, limits.cpuPercent);
+    }
+
+    return true;
+}
+
+uint64_t Throttle::draw(Bucket& bucket, uint64_t len, uint64_t now) {
+    if(bucket.rate == 0) return 0;
+
+    const double rate = static_cast<double>(bucket.rate);
+    const double burst = std::max(rate / 8, MIN_BURST);
+    if(bucket.last == 0) bucket.tokens = burst;
+    else bucket.tokens = std::min(burst, bucket.tokens + (now - bucket.last) * rate / SECOND);
+    bucket.last = now;
+
+    bucket.tokens -= static_cast<double>(len);
+    return (bucket.tokens >= 0)? 0 : static_cast<uint64_t>(-bucket.tokens * SECOND / rate);
+}
+
+void Throttle::admit(Direction direction, uint64_t len) {
+    poll();
+    if(len == 0) return;
+
+    uint64_t wait = 0;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        wait = draw((direction == Direction::Read)? _read : _write, len, Stats::now());
+    }
+
+    if(wait > 0) sleepFor(wait);
+}
+
+void Throttle::observeRead(uint64_t len, uint64_t ns) {
+    if(len < MIN_SAMPLE) return;
+
+    const double perMiB = static_cast<double>(ns) * (1024 * 1024) / len;
+    const uint64_t now = Stats::now();
+
+    std::lock_guard<std::mutex> guard(_lock);
+    const uint64_t limit = _limits.readRate;
+    if(limit == 0) return;
+
+    // The baseline follows any drop at once, but forgets slowly, so that a device that has
+    // become permanently slower is eventually taken as it is
+    _latency = (_latency == 0)? perMiB : _latency + (perMiB - _latency) / 8;
+    if(_baseline == 0 || _latency < _baseline) _baseline = _latency;
+    else _baseline += (_latency - _baseline) / 256;
+
+    if(now - _lastAdapt < ADAPT_INTERVAL) return;
+    _lastAdapt = now;
+
+    const uint64_t step = std::max<uint64_t>(limit / 16, 1);
+    if(_latency > _baseline * CONGESTED) {
+        _read.rate = std::max(step, _read.rate / 4 * 3);
+    }
+    else if(_latency < _baseline * CLEAR) {
+        _read.rate = std::min(limit, _read.rate + step);
+    }
+}
+
+void Throttle::computed(uint64_t ns) {
+    poll();
+
+    const unsigned percent = limits().cpuPercent;
+    if(percent >= 100) return;
+
+    // Each thread keeps its own account, so that one thread's sleep does not hold up another
+    static thread_local uint64_t owed = 0;
+    owed += ns * (100 - percent) / percent;
+    if(owed < MIN_SLEEP) return;
+
+    const uint64_t start = Stats::now();
+    sleepFor(owed);
+    owed -= std::min(owed, Stats::now() - start);
+}
@@ -0,0 +1,155 @@
+// throttle.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <signal.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include "stats.hpp"
+
+// Holds a backup down to a share of the machine, so that it can run beside a busy database,
+// for --rate and --cpu.  Reads and writes each draw on a token bucket; a transfer is let
+// through at once and sleeps off whatever it overdrew, so a burst of up to an eighth of a
+// second's worth goes straight through and anything beyond that is spread out.  Reads also
+// slow down by themselves when the source gets slow: while they take much longer than the
+// quickest the device has lately managed, the read rate steps down towards a sixteenth of
+// its limit, and climbs back once they recover.  Crypto is held to its share of each thread
+// by sleeping in proportion to the time it took.
+//
+// Like Stats, nothing happens unless a Throttle has been made active, and the scopes below
+// cost only a null check when none is.
+class Throttle {
+public:
+    enum class Direction {
+        Read,
+        Write
+    };
+
+    // Rates are in bytes per second, and 0 leaves that direction alone.  cpuPercent is the
+    // share of each worker thread that crypto may take, from 1 to 100.
+    struct Limits {
+        Limits(): readRate(0), writeRate(0), cpuPercent(100) {}
+
+        uint64_t readRate;
+        uint64_t writeRate;
+        unsigned cpuPercent;
+    };
+
+    explicit Throttle(const Limits& limits);
+    Throttle(const Throttle& other) = delete;
+    ~Throttle();
+
+    // The instance in force, or nullptr.  Set it before starting any threads.
+    static Throttle* active() { return _active; }
+    static void activate(Throttle* throttle) { _active = throttle; }
+
+    // Parse a --rate argument: READ or READ:WRITE, each a number of bytes (or K, M, G) per
+    // second, where 0 is unlimited.  A single rate applies to both directions.
+    static bool parseRate(const std::string& arg, uint64_t& read, uint64_t& write);
+
+    // Parse a control file: a "rate" line taking the same value as --rate, and a "cpu" line
+    // taking a percentage.  Blank lines and lines starting with # are ignored.  Only what the
+    // file mentions is changed in limits.  False, leaving limits alone, if anything is wrong.
+    static bool parseControl(const std::string& text, Limits& limits);
+
+    // Change the limits.  Thread-safe; transfers already waiting keep to the old ones.
+    void setLimits(const Limits& limits);
+    Limits limits() const;
+
+    // The read rate currently allowed, after adapting to the source's latency; 0 if unlimited
+    uint64_t readRate() const;
+
+    // Take the limits from a control file now, and again whenever the file changes or the
+    // process receives SIGHUP.  False if the file cannot be read or parsed.
+    bool watch(const std::string& path);
+
+    // Wait until len more bytes may be transferred.  Thread-safe.
+    void admit(Direction direction, uint64_t len);
+
+    // A read of len bytes took ns, not counting any wait in admit()
+    void observeRead(uint64_t len, uint64_t ns);
+
+    // The calling thread just spent ns on crypto; sleep as long as its CPU share calls for
+    void computed(uint64_t ns);
+
+private:
+    struct Bucket {
+        Bucket(): rate(0), tokens(0), last(0) {}
+
+        uint64_t rate;
+
+        // May go negative, when transfers have been let through on credit
+        double tokens;
+        uint64_t last;
+    };
+
+    // How long a transfer of len bytes must wait.  Call with _lock held.
+    static uint64_t draw(Bucket& bucket, uint64_t len, uint64_t now);
+
+    // Reload the control file if it has changed, or on SIGHUP
+    void poll();
+    bool reload(bool announce);
+
+    static void onHangup(int sig);
+
+    static Throttle* _active;
+    static volatile sig_atomic_t _hangup;
+
+    mutable std::mutex _lock;
+    Limits _limits;
+    Bucket _read;
+    Bucket _write;
+
+    // Read latency per MiB: a quick moving average, the lowest it has lately been, and when
+    // the read rate was last adjusted to match
+    double _latency;
+    double _baseline;
+    uint64_t _lastAdapt;
+
+    std::string _path;
+    std::atomic<uint64_t> _lastPoll;
+    int64_t _mtime;
+    int64_t _size;
+    bool _handlingHangup;
+    struct sigaction _oldHangup;
+};
+
+// Waits for the active Throttle to admit a read or write of len bytes, and times the read
+// that follows.  Put it before the StageTimer, so that waiting does not count as I/O.
+class ThrottledIO {
+public:
+    ThrottledIO(Throttle::Direction direction, uint64_t len): _throttle(Throttle::active()), _len(len), _start(0) {
+        if(_throttle == nullptr) return;
+        _throttle->admit(direction, len);
+        if(direction == Throttle::Direction::Read) _start = Stats::now();
+    }
+    ThrottledIO(const ThrottledIO& other) = delete;
+
+    ~ThrottledIO() {
+        if(_start != 0) _throttle->observeRead(_len, Stats::now() - _start);
+    }
+
+private:
+    Throttle* _throttle;
+    uint64_t _len;
+    uint64_t _start;
+};
+
+// Holds crypto to the active Throttle's CPU share, sleeping when it goes out of scope.  Put
+// it before the StageTimer, so that sleeping does not count as crypto.
+class ThrottledCPU {
+public:
+    ThrottledCPU(): _throttle(Throttle::active()), _start(_throttle? Stats::now() : 0) {}
+    ThrottledCPU(const ThrottledCPU& other) = delete;
+
+    ~ThrottledCPU() {
+        if(_throttle) _throttle->computed(Stats::now() - _start);
+    }
+
+private:
+    Throttle* _throttle;
+    uint64_t _start;
+};
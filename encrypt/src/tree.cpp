@@ -0,0 +1,121 @@
+// tree.cpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filejob.hpp"
+#include "tree.hpp"
+
+namespace {
+    const char* describe(WuffCryptFile::FileStatus status) {
+        switch(status) {
+            case WuffCryptFile::FileStatus::OpenError: return "Error opening output";
+            case WuffCryptFile::FileStatus::ReadError: return "Error reading";
+            case WuffCryptFile::FileStatus::WriteError: return "Error writing output";
+            default: return "Error encrypting";
+        }
+    }
+}
+
+bool TreeEncrypter::run(const std::string& srcDir, const std::string& dstDir) {
+    struct stat st;
+    if(stat(srcDir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        report(srcDir, "Not a directory");
+        return false;
+    }
+
+    // The destination may lie inside the source, and must not be walked into, or every run
+    // would encrypt its own output again, one level deeper each time
+    struct stat dst;
+    if((mkdir(dstDir.c_str(), 0777) != 0 && errno != EEXIST) || stat(dstDir.c_str(), &dst) != 0 || !S_ISDIR(dst.st_mode)) {
+        report(dstDir, "Error creating directory");
+        return false;
+    }
+
+    if(dst.st_dev == st.st_dev && dst.st_ino == st.st_ino) {
+        report(dstDir, "Cannot encrypt a directory into itself");
+        return false;
+    }
+
+    _dstDev = dst.st_dev;
+    _dstIno = dst.st_ino;
+
+    _pool.submit([this, srcDir, dstDir]() { visitDirectory(srcDir, dstDir); });
+    _pool.wait();
+
+    return _failures == 0;
+}
+
+void TreeEncrypter::visitDirectory(const std::string& src, const std::string& dst) {
+    if(mkdir(dst.c_str(), 0777) != 0 && errno != EEXIST) {
+        report(dst, "Error creating directory");
+        return;
+    }
+
+    DIR* dir = opendir(src.c_str());
+    if(dir == nullptr) {
+        report(src, "Error opening directory");
+        return;
+    }
+
+    while(true) {
+        errno = 0;
+        struct dirent* entry = readdir(dir);
+        if(entry == nullptr) {
+            if(errno != 0) report(src, "Error reading directory");
+            break;
+        }
+
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        const std::string srcPath = src + "/" + entry->d_name;
+        const std::string dstPath = dst + "/" + entry->d_name;
+
+        struct stat st;
+        if(fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            report(srcPath, "Error reading file information");
+            continue;
+        }
+
+        if(S_ISDIR(st.st_mode) && st.st_dev == _dstDev && st.st_ino == _dstIno) {
+            std::lock_guard<std::mutex> guard(_reportLock);
+            fprintf(stderr, "Skipping %s: it is the destination\n", srcPath.c_str());
+        }
+        else if(S_ISDIR(st.st_mode)) {
+            _pool.submit([this, srcPath, dstPath]() { visitDirectory(srcPath, dstPath); });
+        }
+        else if(S_ISREG(st.st_mode)) {
+            _files += 1;
+            const std::string outPath = dstPath + ".wuff";
+            FileEncryptJob::start(_pool, _key, srcPath, outPath, _options, [this, srcPath, outPath](const FileEncryptJob::Result& result) {
+                if(result.status != WuffCryptFile::FileStatus::OK) {
+                    report(srcPath, describe(result.status));
+                }
+                else if(_onFile) {
+                    std::lock_guard<std::mutex> guard(_reportLock);
+                    _onFile(srcPath, outPath, result);
+                }
+            });
+        }
+        else {
+            // Symbolic links, devices, and the like have no contents of their own to back up
+            std::lock_guard<std::mutex> guard(_reportLock);
+            fprintf(stderr, "Skipping %s: not a regular file\n", srcPath.c_str());
+        }
+    }
+
+    closedir(dir);
+}
+
+void TreeEncrypter::report(const std::string& path, const char* msg) {
+    _failures += 1;
+
+    std::lock_guard<std::mutex> guard(_reportLock);
+    fprintf(stderr, "%s: %s\n", msg, path.c_str());
+}
@@ -0,0 +1,53 @@
+// tree.hpp - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+#pragma once
+
+#include <sys/types.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include "filejob.hpp"
+#include "threadpool.hpp"
+#include "wuffcrypt.hpp"
+
+// Mirrors a directory tree into another, encrypting every regular file F into F.wuff.  Directory
+// listing, whole small files, and runs of blocks within large files are all tasks on the same
+// pool, so workers are never left idle behind one huge file.
+class TreeEncrypter {
+public:
+    typedef std::function<void(const std::string& srcPath, const std::string& dstPath, const FileEncryptJob::Result& result)> FileCallback;
+
+    TreeEncrypter(WorkStealingPool& pool, const DerivedKey& key, const WuffCryptFile::Options& options):
+        _pool(pool), _key(key), _options(options), _dstDev(0), _dstIno(0), _files(0), _failures(0) {}
+    TreeEncrypter(const TreeEncrypter& other) = delete;
+
+    // Returns false if anything could not be encrypted.  Problems are reported on stderr as they
+    // happen, and do not stop the rest of the tree from being processed.  A dstDir inside srcDir
+    // is left out of the walk; dstDir being srcDir itself is refused.
+    bool run(const std::string& srcDir, const std::string& dstDir);
+
+    // Called after each file is successfully encrypted.  Calls are serialized.
+    void onFile(FileCallback callback) { _onFile = callback; }
+
+    size_t files() const { return _files; }
+    size_t failures() const { return _failures; }
+
+private:
+    void visitDirectory(const std::string& src, const std::string& dst);
+    void report(const std::string& path, const char* msg);
+
+    WorkStealingPool& _pool;
+    const DerivedKey& _key;
+    const WuffCryptFile::Options _options;
+    FileCallback _onFile;
+
+    // The destination directory, so that it is not walked into when it lies within the source
+    dev_t _dstDev;
+    ino_t _dstIno;
+
+    std::mutex _reportLock;
+    std::atomic<size_t> _files;
+    std::atomic<size_t> _failures;
+};
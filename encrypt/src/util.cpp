@@ -10,3 +10,29 @@ int __fail(const char* file, int line, const char* msg) {
 
     return 0;
 }
+
+std::string jsonString(const std::string& str) {
+    std::string out("\"");
+
+    for(char c : str) {
+        switch(c) {
+            case '"': { out += "\\\""; break; }
+            case '\\': { out += "\\\\"; break; }
+            case '\n': { out += "\\n"; break; }
+            case '\t': { out += "\\t"; break; }
+            default: {
+                if(static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+                    out += escaped;
+                }
+                else {
+                    out += c;
+                }
+            }
+        }
+    }
+
+    out += "\"";
+    return out;
+}
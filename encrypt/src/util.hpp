@@ -5,11 +5,15 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string>
 
 int __fail(const char* file, int line, const char* msg);
 
 #define verify(x) ((x)? 0: __fail(__FILE__, __LINE__, #x))
 
+// Quote and escape a string for inclusion in JSON output
+std::string jsonString(const std::string& str);
+
 namespace byteorder {
     enum class ByteOrder {
         LittleEndian,
@@ -25,4 +29,25 @@ namespace byteorder {
         uint8_t* data = reinterpret_cast<uint8_t*>(&x);
         return (data[3]<<0) | (data[2]<<8) | (data[1]<<16) | (data[0]<<24);
     }
+
+    // Serialization helpers for fields that are always stored little endian
+    inline void storeLittleEndian32(uint8_t* out, uint32_t x) {
+        for(int i = 0; i < 4; i += 1) out[i] = static_cast<uint8_t>(x >> (8*i));
+    }
+
+    inline void storeLittleEndian64(uint8_t* out, uint64_t x) {
+        for(int i = 0; i < 8; i += 1) out[i] = static_cast<uint8_t>(x >> (8*i));
+    }
+
+    inline uint32_t loadLittleEndian32(const uint8_t* in) {
+        uint32_t x = 0;
+        for(int i = 0; i < 4; i += 1) x |= static_cast<uint32_t>(in[i]) << (8*i);
+        return x;
+    }
+
+    inline uint64_t loadLittleEndian64(const uint8_t* in) {
+        uint64_t x = 0;
+        for(int i = 0; i < 8; i += 1) x |= static_cast<uint64_t>(in[i]) << (8*i);
+        return x;
+    }
 }
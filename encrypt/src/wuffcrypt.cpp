@@ -1,173 +1,884 @@
 // wuffcrypt.cpp - Part of WuffCrypt
 // Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
 
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <algorithm>
+#include <new>
 #include <string>
 
 #include <crypto_scrypt.h>
 
+#include "fileio.hpp"
+#include "parity.hpp"
 #include "wuffcrypt.hpp"
 #include "util.hpp"
 
 void kdf(const std::string& password, int workFactor, uint8_t* outBuf, size_t bufLen) {
+    StageTimer timer(Stats::Stage::KDF);
+    WUFF_PROBE1(kdf__start, workFactor);
     int result = crypto_scrypt(reinterpret_cast<const uint8_t*>(password.data()), password.size(),
                                nullptr, 0, static_cast<int>(powf(2, workFactor)), 8, 1, outBuf, bufLen);
+    WUFF_PROBE1(kdf__done, workFactor);
 
-    verify(result == 0);
+    // scrypt only fails when it cannot allocate its working memory, which at the higher work
+    // factors is considerable.  Leave it to the caller to decide whether that is fatal, since a
+    // host process embedding the library must not be taken down by it.
+    if(result != 0) {
+        throw std::bad_alloc();
+    }
 }
 
-class File {
-public:
-    File(const std::string& path, const std::string& options) {
-        _f = fopen(path.c_str(), options.c_str());
+const DerivedKey& KeyCache::get(int workFactor) {
+    std::lock_guard<std::mutex> guard(_lock);
+
+    std::unique_ptr<DerivedKey>& key = _keys[workFactor];
+    if(!key) {
+        key.reset(new DerivedKey(_password, workFactor));
     }
 
-    template <typename T>
-    size_t readValue(T& out) const {
-        if(_f == nullptr) return 0;
+    return *key;
+}
 
-        size_t valuesRead = fread(&out, sizeof(T), 1, _f);
-        return valuesRead;
+const DerivedKey* KeyCache::tryGet(int workFactor) {
+    try {
+        return &get(workFactor);
+    }
+    catch(const std::bad_alloc&) {
+        return nullptr;
     }
+}
 
-    FILE* handle() {
-        return _f;
+namespace {
+    // Trailer record types.  Each record is a type byte, a 32-bit little endian length, and
+    // that many bytes of value.  Unknown records are skipped.
+    enum TrailerRecord: uint8_t {
+        DigestRecord = 1,
+        MerkleRootRecord = 2,
+        ZeroRunsRecord = 3,
+        ParityRecord = 4,
+        VolumeRecord = 5
+    };
+
+    // Each zero run is a little endian 64-bit first block and count
+    const size_t ZERO_RUN_BYTES = 16;
+
+    // A volume is its little endian 32-bit index and count, 64-bit offset and total length, and
+    // the set's identifier
+    const size_t VOLUME_BYTES = 4 + 4 + 8 + 8 + sizeof(WuffCryptFile::Volume().setId);
+
+    const char FOOTER_MAGIC[] = "WEND";
+
+    void appendRecord(std::vector<uint8_t>& out, uint8_t type, const uint8_t* value, size_t len) {
+        uint8_t prefix[5];
+        prefix[0] = type;
+        byteorder::storeLittleEndian32(prefix + 1, static_cast<uint32_t>(len));
+
+        out.insert(out.end(), prefix, prefix + sizeof(prefix));
+        out.insert(out.end(), value, value + len);
     }
 
-    ~File() {
-        if(_f != nullptr) {
-            fclose(_f);
+    WuffCryptFile::FileStatus parseTrailer(const uint8_t* buf, size_t len, WuffCryptFile::Trailer& out) {
+        size_t i = 0;
+        while(i < len) {
+            if(len - i < 5) return WuffCryptFile::FileStatus::CorruptHeader;
+
+            const uint8_t type = buf[i];
+            const size_t recordLen = byteorder::loadLittleEndian32(buf + i + 1);
+            i += 5;
+            if(len - i < recordLen) return WuffCryptFile::FileStatus::CorruptHeader;
+
+            const uint8_t* value = buf + i;
+            i += recordLen;
+
+            switch(type) {
+                case DigestRecord: {
+                    if(recordLen != 2 * PlaintextDigest::BYTES) return WuffCryptFile::FileStatus::CorruptHeader;
+                    out.hasDigest = true;
+                    memcpy(out.digest, value, PlaintextDigest::BYTES);
+                    memcpy(out.digestChain, value + PlaintextDigest::BYTES, PlaintextDigest::BYTES);
+                    break;
+                }
+                case MerkleRootRecord: {
+                    if(recordLen != merkle::NODE_BYTES) return WuffCryptFile::FileStatus::CorruptHeader;
+                    out.hasMerkleRoot = true;
+                    memcpy(out.merkleRoot, value, merkle::NODE_BYTES);
+                    break;
+                }
+                case ZeroRunsRecord: {
+                    if(recordLen % ZERO_RUN_BYTES != 0) return WuffCryptFile::FileStatus::CorruptHeader;
+
+                    // In order, apart, and never covering the final partial block
+                    const uint64_t fullBlocks = WuffCryptFile::blockCount(out.plaintextLength) - 1;
+                    uint64_t end = 0;
+                    out.zeroRuns.clear();
+                    for(size_t j = 0; j < recordLen; j += ZERO_RUN_BYTES) {
+                        const uint64_t first = byteorder::loadLittleEndian64(value + j);
+                        const uint64_t count = byteorder::loadLittleEndian64(value + j + 8);
+                        if(count == 0 || first < end || first >= fullBlocks || count > fullBlocks - first) {
+                            return WuffCryptFile::FileStatus::CorruptHeader;
+                        }
+
+                        out.zeroRuns.push_back(std::make_pair(first, count));
+                        end = first + count;
+                    }
+                    break;
+                }
+                case ParityRecord: {
+                    // Data and parity shards per stripe, a byte each
+                    if(recordLen != 2) return WuffCryptFile::FileStatus::CorruptHeader;
+                    out.dataShards = value[0];
+                    out.parityShards = value[1];
+                    if(out.dataShards == 0 || out.parityShards == 0 || out.dataShards + out.parityShards > parity::MAX_SHARDS) {
+                        return WuffCryptFile::FileStatus::CorruptHeader;
+                    }
+                    break;
+                }
+                case VolumeRecord: {
+                    if(recordLen != VOLUME_BYTES) return WuffCryptFile::FileStatus::CorruptHeader;
+                    WuffCryptFile::Volume& volume = out.volume;
+                    volume.index = byteorder::loadLittleEndian32(value);
+                    volume.count = byteorder::loadLittleEndian32(value + 4);
+                    volume.offset = byteorder::loadLittleEndian64(value + 8);
+                    volume.totalLength = byteorder::loadLittleEndian64(value + 16);
+                    memcpy(volume.setId, value + 24, sizeof(volume.setId));
+
+                    // The plaintext length, from the footer, is known before any record
+                    if(volume.index >= volume.count || volume.offset > volume.totalLength ||
+                       out.plaintextLength > volume.totalLength - volume.offset) {
+                        return WuffCryptFile::FileStatus::CorruptHeader;
+                    }
+                    out.hasVolume = true;
+                    break;
+                }
+                default: { break; }
+            }
         }
+
+        return WuffCryptFile::FileStatus::OK;
     }
+}
 
-private:
-    FILE* _f;
-};
+bool WuffCryptFile::Trailer::isZero(uint64_t n) const {
+    auto after = std::upper_bound(zeroRuns.begin(), zeroRuns.end(), n,
+                                  [](uint64_t block, const std::pair<uint64_t, uint64_t>& run) { return block < run.first; });
+    if(after == zeroRuns.begin()) return false;
 
-WuffCryptFile::FileStatus WuffCryptFile::read(std::function<void(const SodiumMessageBuffer& msg)> blockHandler, const SecureString& password) const {
-    File f(_path, "rb");
-    if(f.handle() == nullptr) return FileStatus::OpenError;
+    --after;
+    return n - after->first < after->second;
+}
 
-    byteorder::ByteOrder byteOrder;
+void WuffCryptFile::Trailer::addZero(uint64_t n) {
+    if(!zeroRuns.empty() && zeroRuns.back().first + zeroRuns.back().second == n) {
+        zeroRuns.back().second += 1;
+        return;
+    }
 
-    // Check the file type and determine byte order
-    {
-        const size_t headerLength = 9;
+    verify(zeroRuns.empty() || n > zeroRuns.back().first + zeroRuns.back().second);
+    zeroRuns.push_back(std::make_pair(n, 1));
+}
+
+const uint8_t* WuffCryptFile::zeroLeaf() {
+    struct ZeroLeaf {
+        ZeroLeaf() {
+            std::vector<uint8_t> zeros(BLOCK_SIZE);
+            PlaintextDigest::leaf(zeros.data(), zeros.size(), bytes);
+        }
+
+        uint8_t bytes[PlaintextDigest::BYTES];
+    };
+
+    static const ZeroLeaf leaf;
+    return leaf.bytes;
+}
+
+Nonce WuffCryptFile::blockNonce(const uint8_t* prefix, uint64_t n, size_t len) {
+    verify(n <= UINT32_MAX);
+    verify(len <= BLOCK_SIZE);
+
+    Nonce nonce;
+    memcpy(nonce.bytes, prefix, 16);
+    byteorder::storeLittleEndian32(nonce.bytes + 16, static_cast<uint32_t>(n));
+    byteorder::storeLittleEndian32(nonce.bytes + 20, static_cast<uint32_t>(len));
+    return nonce;
+}
 
-        char header[10] = {0};
-        size_t bytesRead = fread(header, sizeof(char), headerLength, f.handle());
-        if(bytesRead < headerLength) {
-            return FileStatus::InvalidFileType;
+Nonce WuffCryptFile::trailerNonce(const uint8_t* prefix, uint64_t plaintextLength) {
+    Nonce nonce;
+    memcpy(nonce.bytes, prefix, 16);
+    byteorder::storeLittleEndian64(nonce.bytes + 16, plaintextLength | (1ULL << 63));
+    return nonce;
+}
+
+namespace {
+    // The records of a trailer, before encryption; the reverse of parseTrailer()
+    void encodeRecords(const WuffCryptFile::Trailer& trailer, std::vector<uint8_t>& records) {
+        if(trailer.hasDigest) {
+            uint8_t value[2 * PlaintextDigest::BYTES];
+            memcpy(value, trailer.digest, PlaintextDigest::BYTES);
+            memcpy(value + PlaintextDigest::BYTES, trailer.digestChain, PlaintextDigest::BYTES);
+            appendRecord(records, DigestRecord, value, sizeof(value));
         }
 
-        if(strcmp(header, "wuffcrypt") == 0) {
-            byteOrder = byteorder::ByteOrder::LittleEndian;
+        if(trailer.hasMerkleRoot) {
+            appendRecord(records, MerkleRootRecord, trailer.merkleRoot, merkle::NODE_BYTES);
         }
-        else if(strcmp(header, "wuffcrytp") == 0) {
-            byteOrder = byteorder::ByteOrder::BigEndian;
+
+        if(!trailer.zeroRuns.empty()) {
+            std::vector<uint8_t> value(trailer.zeroRuns.size() * ZERO_RUN_BYTES);
+            for(size_t i = 0; i < trailer.zeroRuns.size(); i += 1) {
+                byteorder::storeLittleEndian64(&value[i * ZERO_RUN_BYTES], trailer.zeroRuns[i].first);
+                byteorder::storeLittleEndian64(&value[i * ZERO_RUN_BYTES + 8], trailer.zeroRuns[i].second);
+            }
+            appendRecord(records, ZeroRunsRecord, value.data(), value.size());
         }
-        else {
-            return FileStatus::InvalidFileType;
+
+        if(trailer.parityShards > 0) {
+            const uint8_t value[2] = {trailer.dataShards, trailer.parityShards};
+            appendRecord(records, ParityRecord, value, sizeof(value));
+        }
+
+        if(trailer.hasVolume) {
+            uint8_t value[VOLUME_BYTES];
+            byteorder::storeLittleEndian32(value, trailer.volume.index);
+            byteorder::storeLittleEndian32(value + 4, trailer.volume.count);
+            byteorder::storeLittleEndian64(value + 8, trailer.volume.offset);
+            byteorder::storeLittleEndian64(value + 16, trailer.volume.totalLength);
+            memcpy(value + 24, trailer.volume.setId, sizeof(trailer.volume.setId));
+            appendRecord(records, VolumeRecord, value, sizeof(value));
         }
     }
+}
 
-    // Check if the file format version is right
-    uint8_t version = 0;
+void WuffCryptFile::sealTrailer(const Encrypter& enc, const Trailer& trailer, std::vector<uint8_t>& out) {
+    std::vector<uint8_t> records;
+    encodeRecords(trailer, records);
 
-    // Read in the work factor
-    uint8_t workFactor = 0;
+    SodiumMessageBuffer msg(records.size());
+    SodiumEncryptedBuffer ctext(records.size());
+    if(!records.empty()) memcpy(msg.data(), records.data(), records.size());
+    msg.setSize(records.size());
 
-    // Read in the nonce prefix
-    uint8_t nonce[encrypt_NONCEPREFIXBYTES] = {0};
+    enc.encrypt(msg, ctext, trailerNonce(enc.noncePrefix(), trailer.plaintextLength));
+    out.insert(out.end(), ctext.data(), ctext.data() + ctext.size());
 
-    bool headerOK = f.readValue(version)
-        && f.readValue(workFactor)
-        && f.readValue(nonce);
+    uint8_t footer[FOOTER_SIZE];
+    byteorder::storeLittleEndian64(footer, trailer.plaintextLength);
+    byteorder::storeLittleEndian32(footer + 8, static_cast<uint32_t>(ctext.size()));
+    memcpy(footer + 12, FOOTER_MAGIC, 4);
+    out.insert(out.end(), footer, footer + sizeof(footer));
+}
 
-    if(!headerOK) {
+size_t WuffCryptFile::sealedTrailerSize(const Trailer& trailer) {
+    std::vector<uint8_t> records;
+    encodeRecords(trailer, records);
+    return records.size() + crypto_secretbox_xsalsa20poly1305_MACBYTES + FOOTER_SIZE;
+}
+
+WuffCryptFile::FileStatus WuffCryptFile::readFooter(const uint8_t* footer, uint64_t fileSize, uint64_t& plaintextLength, size_t& trailerLen) {
+    if(memcmp(footer + 12, FOOTER_MAGIC, 4) != 0) return FileStatus::Truncated;
+
+    plaintextLength = byteorder::loadLittleEndian64(footer);
+    trailerLen = byteorder::loadLittleEndian32(footer + 8);
+    if(trailerLen < crypto_secretbox_xsalsa20poly1305_MACBYTES || trailerLen > fileSize - HEADER_SIZE - FOOTER_SIZE) {
         return FileStatus::CorruptHeader;
     }
 
-    if(version != VERSION) {
-        return FileStatus::WrongVersion;
+    return FileStatus::OK;
+}
+
+WuffCryptFile::FileStatus WuffCryptFile::openTrailer(int fd, uint64_t fileSize, const Decrypter& dec, Trailer& out) {
+    // A file that was never finished has no footer
+    if(fileSize < HEADER_SIZE + FOOTER_SIZE) return FileStatus::Truncated;
+
+    uint8_t footer[FOOTER_SIZE];
+    ssize_t bytesRead = fileio::preadAll(fd, footer, sizeof(footer), fileSize - FOOTER_SIZE);
+    if(bytesRead != static_cast<ssize_t>(sizeof(footer))) return FileStatus::ReadError;
+
+    uint64_t plaintextLength = 0;
+    size_t trailerLen = 0;
+    FileStatus status = readFooter(footer, fileSize, plaintextLength, trailerLen);
+    if(status != FileStatus::OK) return status;
+
+    const uint64_t offset = fileSize - FOOTER_SIZE - trailerLen;
+
+    SodiumEncryptedBuffer ctext(trailerLen);
+    bytesRead = fileio::preadAll(fd, ctext.data(), trailerLen, offset);
+    if(bytesRead != static_cast<ssize_t>(trailerLen)) return FileStatus::ReadError;
+    ctext.setSize(trailerLen);
+
+    return unsealTrailer(dec, ctext, plaintextLength, offset, out);
+}
+
+WuffCryptFile::FileStatus WuffCryptFile::openTrailer(const uint8_t* tail, size_t len, uint64_t fileSize, const Decrypter& dec, Trailer& out) {
+    if(fileSize < HEADER_SIZE + FOOTER_SIZE || len < FOOTER_SIZE) return FileStatus::Truncated;
+
+    uint64_t plaintextLength = 0;
+    size_t trailerLen = 0;
+    FileStatus status = readFooter(tail + len - FOOTER_SIZE, fileSize, plaintextLength, trailerLen);
+    if(status != FileStatus::OK) return status;
+
+    // Whatever the footer claims has to lie within what we were given
+    if(trailerLen > len - FOOTER_SIZE) return FileStatus::VerificationFailed;
+
+    SodiumEncryptedBuffer ctext(trailerLen);
+    memcpy(ctext.data(), tail + len - FOOTER_SIZE - trailerLen, trailerLen);
+    ctext.setSize(trailerLen);
+
+    return unsealTrailer(dec, ctext, plaintextLength, fileSize - FOOTER_SIZE - trailerLen, out);
+}
+
+WuffCryptFile::FileStatus WuffCryptFile::unsealTrailer(const Decrypter& dec, const SodiumEncryptedBuffer& ctext, uint64_t plaintextLength,
+                                                       uint64_t offset, Trailer& out) {
+    SodiumMessageBuffer msg(ctext.size());
+
+    // The footer is not encrypted, but the trailer's nonce includes the plaintext length, so it
+    // cannot be altered without the trailer failing to authenticate
+    if(dec.decrypt(ctext, msg, trailerNonce(dec.noncePrefix(), plaintextLength)) != 0) {
+        return FileStatus::VerificationFailed;
+    }
+
+    out = Trailer();
+    out.plaintextLength = plaintextLength;
+    FileStatus status = parseTrailer(msg.data(), msg.size(), out);
+    if(status != FileStatus::OK) {
+        return status;
+    }
+
+    // Anything between the blocks and the trailer has to be accounted for
+    if(offset != trailerOffset(out)) {
+        return FileStatus::VerificationFailed;
+    }
+
+    return FileStatus::OK;
+}
+
+WuffCryptFile::FileStatus WuffCryptFile::rebuildBlock(int fd, const Trailer& trailer, const Decrypter& dec, uint64_t n, uint8_t* out) {
+    const size_t macLen = crypto_secretbox_xsalsa20poly1305_MACBYTES;
+    const unsigned k = trailer.dataShards;
+    const unsigned m = trailer.parityShards;
+    if(m == 0) return FileStatus::VerificationFailed;
+
+    const uint64_t nBlocks = blockCount(trailer.plaintextLength);
+    const uint64_t stripe = n / k;
+    const uint64_t first = stripe * k;
+
+    // The whole stripe, data then parity.  Only ever needed for a damaged file, so there is no
+    // point in anything cleverer than reading all of it.
+    std::vector<uint8_t> shards(static_cast<size_t>(k + m) * ENCRYPTED_BLOCK_SIZE, 0);
+    auto shard = [&shards](unsigned s) { return &shards[static_cast<size_t>(s) * ENCRYPTED_BLOCK_SIZE]; };
+
+    // Data shards that fail to authenticate are lost, and so is parity that cannot be read
+    std::vector<unsigned> present;
+    std::vector<unsigned> lost;
+    for(unsigned j = 0; j < k; j += 1) {
+        const uint64_t b = first + j;
+        if(b >= nBlocks || trailer.isZero(b)) {
+            present.push_back(j);
+            continue;
+        }
+
+        const size_t len = blockLength(trailer.plaintextLength, b) + macLen;
+        ssize_t bytesRead = fileio::preadAll(fd, shard(j), len, blockOffset(b));
+        if(bytesRead == static_cast<ssize_t>(len) && dec.authenticate(shard(j), len, blockNonce(dec.noncePrefix(), b, len - macLen)) == 0) {
+            present.push_back(j);
+        }
+        else {
+            lost.push_back(j);
+        }
+    }
+
+    const size_t shardLen = shardSize(trailer, stripe);
+    std::vector<unsigned> parityPresent;
+    for(unsigned i = 0; i < m; i += 1) {
+        ssize_t bytesRead = fileio::preadAll(fd, shard(k + i), shardLen, parityOffset(trailer, stripe, i));
+        if(bytesRead == static_cast<ssize_t>(shardLen)) parityPresent.push_back(k + i);
+    }
+
+    const unsigned target = static_cast<unsigned>(n - first);
+    if(std::find(lost.begin(), lost.end(), target) == lost.end()) {
+        memcpy(out, shard(target), blockLength(trailer.plaintextLength, n) + macLen);
+        return FileStatus::OK;
+    }
+
+    if(lost.size() > parityPresent.size()) return FileStatus::VerificationFailed;
+
+    // Parity is not authenticated, so a damaged parity block only shows up as rebuilt blocks
+    // that fail.  Try each choice of parity blocks in turn, within reason.
+    std::vector<uint8_t> rebuilt(lost.size() * ENCRYPTED_BLOCK_SIZE);
+    std::vector<uint8_t*> outs;
+    for(size_t l = 0; l < lost.size(); l += 1) outs.push_back(&rebuilt[l * ENCRYPTED_BLOCK_SIZE]);
+
+    std::vector<bool> chosen(parityPresent.size(), false);
+    std::fill(chosen.begin(), chosen.begin() + lost.size(), true);
+    for(int tries = 0; tries < 64; tries += 1) {
+        std::vector<unsigned> rows(present);
+        for(size_t i = 0; i < chosen.size(); i += 1) {
+            if(chosen[i]) rows.push_back(parityPresent[i]);
+        }
+
+        std::vector<const uint8_t*> inputs;
+        for(unsigned row : rows) inputs.push_back(shard(row));
+
+        if(parity::reconstruct(k, rows, inputs.data(), lost, outs.data(), shardLen)) {
+            bool ok = true;
+            for(size_t l = 0; l < lost.size() && ok; l += 1) {
+                const uint64_t b = first + lost[l];
+                const size_t len = blockLength(trailer.plaintextLength, b);
+                ok = dec.authenticate(outs[l], len + macLen, blockNonce(dec.noncePrefix(), b, len)) == 0;
+            }
+
+            if(ok) {
+                const size_t l = std::find(lost.begin(), lost.end(), target) - lost.begin();
+                memcpy(out, outs[l], blockLength(trailer.plaintextLength, n) + macLen);
+                return FileStatus::OK;
+            }
+        }
+
+        if(!std::prev_permutation(chosen.begin(), chosen.end())) break;
+    }
+
+    return FileStatus::VerificationFailed;
+}
+
+WuffCryptFile::BlockReader::BlockReader(const std::string& path, KeyCache& keys, const Options& options, PlaintextDigest& digest,
+                                        uint64_t& rebuilt):
+        _f(fopen(path.c_str(), "rb")), _drop((_f != nullptr && options.cache != fileio::CacheMode::Keep)? fileno(_f) : -1, false),
+        _options(options), _digest(digest), _rebuilt(rebuilt), _buf(BLOCK_SIZE),
+        _n(0), _nBlocks(0), _total(0), _zero(false), _status(FileStatus::OK) {
+    if(_f == nullptr) {
+        _status = FileStatus::OpenError;
+        return;
+    }
+
+    uint8_t headerBuf[HEADER_SIZE];
+    size_t bytesRead = fread(headerBuf, sizeof(uint8_t), sizeof(headerBuf), _f);
+
+    _status = decodeHeader(headerBuf, bytesRead, _header);
+    if(_status != FileStatus::OK) {
+        return;
+    }
+
+    const DerivedKey* key = keys.tryGet(_header.workFactor);
+    if(key == nullptr) {
+        _status = FileStatus::NoMemory;
+        return;
+    }
+
+    _dec.reset(new Decrypter(*key, _header.nonce));
+    _digest.reset();
+
+    if(_header.version == 0) {
+        // The first partial block marks the end of the file
+        return;
+    }
+
+    // Later formats say up front how much data they hold, so truncation and tampering with the
+    // end of the file are caught before any plaintext is handed out
+    uint64_t fileSize = 0;
+    if(!fileio::regularFileSize(fileno(_f), fileSize)) {
+        _status = FileStatus::ReadError;
+        return;
+    }
+
+    _status = openTrailer(fileno(_f), fileSize, *_dec, _trailer);
+    _nBlocks = blockCount(_trailer.plaintextLength);
+}
+
+WuffCryptFile::BlockReader::~BlockReader() {
+    if(_f != nullptr) fclose(_f);
+}
+
+WuffCryptFile::FileStatus WuffCryptFile::BlockReader::next(size_t& len, bool& last) {
+    const size_t macLen = crypto_secretbox_xsalsa20poly1305_MACBYTES;
+
+    // Blocks of zeros were never stored, and cost nothing to skip
+    const uint64_t toRead = (_header.version == 0)? ENCRYPTED_BLOCK_SIZE :
+                            _trailer.isZero(_n)? 0 : blockLength(_trailer.plaintextLength, _n) + macLen;
+    ThrottledIO throttled(Throttle::Direction::Read, toRead);
+    StageTimer timer(Stats::Stage::Read);
+
+    if(_header.version == 0) {
+        size_t bytesRead = fread(_buf.data(), sizeof(uint8_t), ENCRYPTED_BLOCK_SIZE, _f);
+        if(bytesRead < ENCRYPTED_BLOCK_SIZE && ferror(_f)) return FileStatus::ReadError;
+
+        // Every file ends with a partial block, with at least its MAC
+        if(bytesRead < macLen) return FileStatus::VerificationFailed;
+
+        _buf.setSize(bytesRead);
+        _drop.advanceTo(static_cast<uint64_t>(ftello(_f)));
+        len = bytesRead - macLen;
+        last = bytesRead < ENCRYPTED_BLOCK_SIZE;
+        WUFF_PROBE2(block__read, _n, len);
+        return FileStatus::OK;
+    }
+
+    len = blockLength(_trailer.plaintextLength, _n);
+    last = _n + 1 == _nBlocks;
+
+    _zero = _trailer.isZero(_n);
+    if(_zero) {
+        // Nothing was stored; the next block is ENCRYPTED_BLOCK_SIZE bytes on
+        return (fseeko(_f, static_cast<off_t>(ENCRYPTED_BLOCK_SIZE), SEEK_CUR) == 0)? FileStatus::OK : FileStatus::ReadError;
+    }
+
+    size_t bytesRead = fread(_buf.data(), sizeof(uint8_t), len + macLen, _f);
+    if(bytesRead != len + macLen) {
+        return FileStatus::ReadError;
+    }
+
+    _buf.setSize(bytesRead);
+    _drop.advanceTo(blockOffset(_n) + bytesRead);
+    WUFF_PROBE2(block__read, _n, len);
+    return FileStatus::OK;
+}
+
+WuffCryptFile::FileStatus WuffCryptFile::BlockReader::open(uint8_t* out) {
+    const size_t len = _buf.size() - crypto_secretbox_xsalsa20poly1305_MACBYTES;
+    const Nonce nonce = (_header.version == 0)? Nonce::counter(_header.nonce, _header.counter(_n)) : blockNonce(_header.nonce, _n, len);
+    const uint64_t n = _n;
+    _n += 1;
+
+    ThrottledCPU cpu;
+    StageTimer timer(Stats::Stage::Crypto);
+    WUFF_PROBE2(block__decrypt__start, n, len);
+    bool ok = _dec->decrypt(_buf.data(), _buf.size(), out, nonce) == 0;
+
+    // A damaged block may still be rebuilt from the rest of its stripe
+    if(!ok && _trailer.parityShards > 0 && rebuildBlock(fileno(_f), _trailer, *_dec, n, _buf.data()) == FileStatus::OK) {
+        ok = _dec->decrypt(_buf.data(), _buf.size(), out, nonce) == 0;
+        _rebuilt += ok? 1 : 0;
+    }
+    WUFF_PROBE3(block__decrypt__done, n, len, ok);
+    if(!ok) {
+        return FileStatus::VerificationFailed;
+    }
+
+    if(_options.digest || _trailer.hasDigest) {
+        uint8_t leaf[PlaintextDigest::BYTES];
+        PlaintextDigest::leaf(out, len, leaf);
+        _digest.add(leaf);
+    }
+
+    if(_trailer.hasMerkleRoot) {
+        _tags.insert(_tags.end(), _buf.data(), _buf.data() + merkle::TAG_BYTES);
     }
 
-    // Decrypt each block, and feed it into the blockHandler
-    Decrypter dec(password, nonce, workFactor);
-    SodiumEncryptedBuffer buf(BLOCK_SIZE);
-    SodiumMessageBuffer decBuf(BLOCK_SIZE);
+    _total += len;
+    return FileStatus::OK;
+}
 
-    // Each encrypted block has an additional handful of bytes alongside it.
-    const size_t encryptedBlockSize = BLOCK_SIZE + crypto_secretbox_xsalsa20poly1305_BOXZEROBYTES;
+void WuffCryptFile::BlockReader::skipZero() {
+    verify(_zero);
+    _n += 1;
+    _zero = false;
 
-    uint32_t n = 0;
-    size_t bytesRead = encryptedBlockSize;
-    while(bytesRead == encryptedBlockSize) {
-        bytesRead = fread(buf.data(), sizeof(uint8_t), encryptedBlockSize, f.handle());
-        buf.setSize(bytesRead);
+    if(_options.digest || _trailer.hasDigest) {
+        _digest.add(zeroLeaf());
+    }
 
-        // Because the nonce used will vary with system endianness, we have to adapt ourselves
-        // to whatever platform created the file
-        uint32_t endianN = (byteOrder == byteorder::ByteOrder::LittleEndian)? byteorder::fromLittleEndian(n) : byteorder::fromBigEndian(n);
-        n += 1;
+    if(_trailer.hasMerkleRoot) {
+        _tags.insert(_tags.end(), merkle::TAG_BYTES, 0);
+    }
+
+    _total += BLOCK_SIZE;
+}
 
-        int status = dec.decrypt(buf, decBuf, endianN);
-        if(status != 0) {
-            // Verification failed
+WuffCryptFile::FileStatus WuffCryptFile::BlockReader::finish() {
+    if(_options.digest || _trailer.hasDigest) {
+        _digest.finish(_total);
+
+        if(_trailer.hasDigest && sodium_memcmp(_digest.value(), _trailer.digest, PlaintextDigest::BYTES) != 0) {
             return FileStatus::VerificationFailed;
         }
+    }
 
-        blockHandler(decBuf);
+    if(_trailer.hasMerkleRoot) {
+        std::vector<uint8_t> index;
+        merkle::build(_tags, index);
+        if(sodium_memcmp(&index[index.size() - merkle::NODE_BYTES], _trailer.merkleRoot, merkle::NODE_BYTES) != 0) {
+            return FileStatus::VerificationFailed;
+        }
     }
 
     return FileStatus::OK;
 }
 
-WuffCryptFile::FileStatus WuffCryptFile::write(std::function<void(uint8_t* outBuf, size_t& outBufWritten, size_t blockSize)> blockFeeder, const SecureString& password) {
-    File f(_path, "wb");
-    if(f.handle() == nullptr) return FileStatus::OpenError;
+namespace {
+    // Adapts the callback interface to a lending sink, so that blocks are still decrypted
+    // straight into the buffer handed to the callback
+    class CallbackSink {
+    public:
+        static const bool LENDS = true;
 
-    {
-        uint16_t byteOrderIndicator = 0x7470;
-        uint8_t* byteOrderIndicatorLens = reinterpret_cast<uint8_t*>(&byteOrderIndicator);
-        fprintf(f.handle(), "wuffcry%c%c", byteOrderIndicatorLens[0], byteOrderIndicatorLens[1]);
+        explicit CallbackSink(std::function<void(const SodiumMessageBuffer& msg)>& handler):
+            _handler(handler), _buf(WuffCryptFile::BLOCK_SIZE) {}
+
+        uint8_t* borrow(size_t len) {
+            (void)len;
+            return _buf.data();
+        }
+
+        bool commit(size_t len) {
+            _buf.setSize(len);
+            _handler(_buf);
+            return true;
+        }
+
+    private:
+        std::function<void(const SodiumMessageBuffer& msg)>& _handler;
+        SodiumMessageBuffer _buf;
+    };
+
+    class CallbackSource {
+    public:
+        explicit CallbackSource(std::function<void(uint8_t* outBuf, size_t& outBufWritten, size_t blockSize)>& feeder): _feeder(feeder) {}
+
+        ssize_t read(uint8_t* buf, size_t len) {
+            size_t written = 0;
+            _feeder(buf, written, len);
+            return static_cast<ssize_t>(written);
+        }
+
+    private:
+        std::function<void(uint8_t* outBuf, size_t& outBufWritten, size_t blockSize)>& _feeder;
+    };
+}
+
+WuffCryptFile::FileStatus WuffCryptFile::read(std::function<void(const SodiumMessageBuffer& msg)> blockHandler, const SecureString& password,
+                                              const Options& options) {
+    CallbackSink sink(blockHandler);
+    return decryptTo(sink, password, options);
+}
+
+WuffCryptFile::FileStatus WuffCryptFile::decodeHeader(const uint8_t* buf, size_t len, Header& out) {
+    // Check the file type and determine byte order
+    const size_t magicLength = 9;
+    if(len < magicLength) {
+        return FileStatus::InvalidFileType;
     }
 
-    Encrypter enc(password, WORK_FACTOR);
+    if(memcmp(buf, "wuffcrypt", magicLength) == 0) {
+        out.byteOrder = byteorder::ByteOrder::LittleEndian;
+    }
+    else if(memcmp(buf, "wuffcrytp", magicLength) == 0) {
+        out.byteOrder = byteorder::ByteOrder::BigEndian;
+    }
+    else {
+        return FileStatus::InvalidFileType;
+    }
+
+    if(len < HEADER_SIZE) {
+        return FileStatus::CorruptHeader;
+    }
 
+    out.version = buf[9];
+    out.workFactor = buf[10];
+    memcpy(out.nonce, buf + 11, sizeof(out.nonce));
+
+    if(out.version > PARITY_VERSION) {
+        return FileStatus::WrongVersion;
+    }
+
+    // A hostile header must not make the KDF take more memory than it ever needs, and nothing
+    // has ever been written with more than WORK_FACTOR
+    if(out.workFactor > WORK_FACTOR) {
+        return FileStatus::CorruptHeader;
+    }
+
+    return FileStatus::OK;
+}
+
+void WuffCryptFile::encodeHeader(const Encrypter& enc, uint8_t* out, uint8_t version) {
+    // The last two bytes of the magic spell "pt" on little-endian hosts, and "tp" on big-endian
+    // ones.  Format 0 mixed the block counter into the nonce in host order; format 1 always
+    // uses little endian, but keeps the magic as it was.
+    uint16_t byteOrderIndicator = 0x7470;
+    memcpy(out, "wuffcry", 7);
+    memcpy(out + 7, &byteOrderIndicator, sizeof(byteOrderIndicator));
+
+    out[9] = version;
+    out[10] = WORK_FACTOR;
+    memcpy(out + 11, enc.noncePrefix(), 16);
+    memset(out + 27, 0, encrypt_NONCEPREFIXBYTES - 16);
+}
+
+WuffCryptFile::BlockWriter::BlockWriter(const std::string& path, const SecureString& password, const Options& options, PlaintextDigest& digest):
+        _fd((path == "-")? dup(STDOUT_FILENO) : open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)),
+        _drop((options.cache != fileio::CacheMode::Keep)? _fd : -1, true),
+        _enc(password, WORK_FACTOR), _options(options), _digest(digest), _headerWritten(false), _pipe(false), _offset(0),
+        _encBuf(BLOCK_SIZE), _heldLen(0), _n(0), _status(FileStatus::OK) {
+    if(_fd < 0) {
+        _status = FileStatus::OpenError;
+        return;
+    }
+
+    encodeHeader(_enc, _header, options.sparse? SPARSE_VERSION : VERSION);
+    _digest.reset();
+}
+
+WuffCryptFile::BlockWriter::~BlockWriter() {
+    if(_fd >= 0) close(_fd);
+}
+
+void WuffCryptFile::BlockWriter::write(struct iovec* iov, int count) {
+    struct iovec all[4];
+    int nAll = 0;
+    size_t total = 0;
+
+    if(!_headerWritten) {
+        all[nAll].iov_base = _header;
+        all[nAll].iov_len = sizeof(_header);
+        nAll += 1;
+        _headerWritten = true;
+    }
+
+    for(int i = 0; i < count; i += 1) {
+        all[nAll] = iov[i];
+        nAll += 1;
+    }
+
+    for(int i = 0; i < nAll; i += 1) {
+        total += all[i].iov_len;
+    }
+
+    ThrottledIO throttled(Throttle::Direction::Write, total);
+    StageTimer timer(Stats::Stage::Write);
+    if(_status == FileStatus::OK && !fileio::writevAll(_fd, all, nAll)) {
+        _status = FileStatus::WriteError;
+    }
+
+    _offset += total;
+    _drop.advanceTo(_offset);
+}
+
+void WuffCryptFile::BlockWriter::skipZero() {
+    // Make sure the header is out, then leave a hole where the block would have gone
+    write(nullptr, 0);
+    if(_status != FileStatus::OK) return;
+
+    if(!_pipe && lseek(_fd, static_cast<off_t>(ENCRYPTED_BLOCK_SIZE), SEEK_CUR) >= 0) {
+        _offset += ENCRYPTED_BLOCK_SIZE;
+    }
+    else {
+        // Nothing reads the bytes where a zero block would be, so anything will do
+        _pipe = true;
+        memset(_encBuf.data(), 0, ENCRYPTED_BLOCK_SIZE);
+
+        struct iovec iov;
+        iov.iov_base = _encBuf.data();
+        iov.iov_len = ENCRYPTED_BLOCK_SIZE;
+        write(&iov, 1);
+    }
+
+    _tags.insert(_tags.end(), merkle::TAG_BYTES, 0);
+    _trailer.addZero(_n);
+    _trailer.plaintextLength += BLOCK_SIZE;
+    _n += 1;
+
+    if(_options.digest || _options.storeDigest) {
+        _digest.add(zeroLeaf());
+    }
+}
+
+void WuffCryptFile::BlockWriter::add(const uint8_t* block, size_t len) {
+    // Only full blocks are left out, so that the file still ends with a real block
+    if(_options.sparse && len == BLOCK_SIZE) {
+        bool zero = false;
+        {
+            StageTimer timer(Stats::Stage::Crypto);
+            zero = fileio::allZero(block, len);
+        }
+
+        if(zero) {
+            skipZero();
+            return;
+        }
+    }
+
+    const size_t encryptedLen = len + crypto_secretbox_xsalsa20poly1305_MACBYTES;
     {
-        uint8_t version = VERSION;
-        uint8_t workFactor = WORK_FACTOR;
+        ThrottledCPU cpu;
+        StageTimer timer(Stats::Stage::Crypto);
+        WUFF_PROBE2(block__encrypt__start, _n, len);
+        _enc.encrypt(block, len, _encBuf.data(), blockNonce(_enc.noncePrefix(), _n, len));
+        WUFF_PROBE2(block__encrypt__done, _n, len);
+    }
 
-        // Write the header parameters
-        fwrite(&version, sizeof(version), 1, f.handle());
-        fwrite(&workFactor, sizeof(workFactor), 1, f.handle());
-        fwrite(enc.noncePrefix(), sizeof(uint8_t), encrypt_NONCEPREFIXBYTES, f.handle());
+    // Only the last block is short; it waits to go out with the trailer
+    if(len < BLOCK_SIZE) {
+        _heldLen = encryptedLen;
+    }
+    else {
+        struct iovec iov;
+        iov.iov_base = _encBuf.data();
+        iov.iov_len = encryptedLen;
+        write(&iov, 1);
+        WUFF_PROBE2(block__write, _n, len);
     }
 
-    SodiumMessageBuffer buf(BLOCK_SIZE);
-    SodiumEncryptedBuffer encBuf(BLOCK_SIZE);
-    uint32_t n = 0;
+    _tags.insert(_tags.end(), _encBuf.data(), _encBuf.data() + merkle::TAG_BYTES);
+    _trailer.plaintextLength += len;
+    _n += 1;
 
-    // Get data from the blockFeeder, encrypt it, and write it out until the blockFeeder provides
-    // a partial block
-    while(true) {
-        size_t bufLen = 0;
+    if(_options.digest || _options.storeDigest) {
+        StageTimer timer(Stats::Stage::Crypto);
+        if(len < BLOCK_SIZE) {
+            memcpy(_trailer.digestChain, _digest.chain(), PlaintextDigest::BYTES);
+        }
+
+        uint8_t leaf[PlaintextDigest::BYTES];
+        PlaintextDigest::leaf(block, len, leaf);
+        _digest.add(leaf);
+    }
+}
+
+WuffCryptFile::FileStatus WuffCryptFile::BlockWriter::finish() {
+    if(_options.digest || _options.storeDigest) {
+        _digest.finish(_trailer.plaintextLength);
+    }
 
-        blockFeeder(buf.data(), bufLen, BLOCK_SIZE);
-        buf.setSize(bufLen);
+    if(_options.storeDigest) {
+        _trailer.hasDigest = true;
+        memcpy(_trailer.digest, _digest.value(), PlaintextDigest::BYTES);
+    }
+
+    std::vector<uint8_t> end;
+    merkle::build(_tags, end);
+    _trailer.hasMerkleRoot = true;
+    memcpy(_trailer.merkleRoot, &end[end.size() - merkle::NODE_BYTES], merkle::NODE_BYTES);
+
+    sealTrailer(_enc, _trailer, end);
 
-        enc.encrypt(buf, encBuf, n);
-        fwrite(encBuf.data(), sizeof(uint8_t), encBuf.size(), f.handle());
+    struct iovec iov[2];
+    iov[0].iov_base = _encBuf.data();
+    iov[0].iov_len = _heldLen;
+    iov[1].iov_base = end.data();
+    iov[1].iov_len = end.size();
+    write(iov, 2);
+    WUFF_PROBE2(block__write, _n - 1, _heldLen - crypto_secretbox_xsalsa20poly1305_MACBYTES);
 
-        if(bufLen < BLOCK_SIZE) break;
+    _drop.finish();
+    if(_status != FileStatus::OK) {
+        return _status;
+    }
 
-        n += 1;
+    if(close(_fd) != 0) {
+        _fd = -1;
+        return FileStatus::WriteError;
     }
 
+    _fd = -1;
     return FileStatus::OK;
 }
+
+WuffCryptFile::FileStatus WuffCryptFile::write(std::function<void(uint8_t* outBuf, size_t& outBufWritten, size_t blockSize)> blockFeeder, const SecureString& password,
+                                               const Options& options) {
+    CallbackSource source(blockFeeder);
+    return encryptFrom(source, password, options);
+}
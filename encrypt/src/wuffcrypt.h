@@ -0,0 +1,111 @@
+// wuffcrypt.h - Part of WuffCrypt
+// Copyright 2014 Andrew Aldridge <i80and@foxquill.com>
+
+// The C interface to libwuffcrypt, for embedding WuffCrypt in other programs without going
+// through the command line, and so without passing a password through argv.  Everything here
+// reads and writes the same files as the wuffcrypt tool.
+//
+// Objects are opaque and created by the library.  None of them may be used from two threads at
+// once, but a key may be shared by any number of streams.  Nothing here aborts or throws on bad
+// input; misuse, such as calling update after final, returns WUFFCRYPT_MISUSE.
+
+#ifndef WUFFCRYPT_H
+#define WUFFCRYPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Raised only when something here changes incompatibly
+#define WUFFCRYPT_API_VERSION 1
+
+#define WUFFCRYPT_DIGEST_BYTES 32
+
+// Values are fixed; new ones are only ever added at the end
+typedef enum {
+    WUFFCRYPT_OK = 0,
+    WUFFCRYPT_INVALID_FILE_TYPE = 1,
+    WUFFCRYPT_CORRUPT_HEADER = 2,
+    WUFFCRYPT_VERIFICATION_FAILED = 3,
+    WUFFCRYPT_WRONG_VERSION = 4,
+    WUFFCRYPT_TRUNCATED = 5,
+    WUFFCRYPT_BUFFER_TOO_SMALL = 6,
+    WUFFCRYPT_MISUSE = 7,
+    WUFFCRYPT_NO_MEMORY = 8
+} wuffcrypt_status;
+
+// Flags for encrypting and decrypting
+enum {
+    // Compute the plaintext digest; see wuffcrypt_encrypt_digest()
+    WUFFCRYPT_DIGEST = 1,
+
+    // Encrypting only: store the digest in the file as well, so that decrypting with
+    // WUFFCRYPT_DIGEST checks it
+    WUFFCRYPT_STORE_DIGEST = 2
+};
+
+// Call once, before anything else.  0 on success.
+int wuffcrypt_init(void);
+
+unsigned wuffcrypt_api_version(void);
+const char* wuffcrypt_version(void);
+const char* wuffcrypt_status_string(wuffcrypt_status status);
+
+// A password, and the keys stretched out of it.  The password is copied into locked memory, and
+// may be wiped as soon as this returns.  Stretching a key costs 128 MiB and a good fraction of a
+// second, and happens once per key, when it is first needed, so reuse keys where possible.  A key
+// must outlive the streams made with it.
+typedef struct wuffcrypt_key wuffcrypt_key;
+
+wuffcrypt_key* wuffcrypt_key_new(const char* password, size_t len);
+void wuffcrypt_key_free(wuffcrypt_key* key);
+
+// Encrypting, a piece at a time.  Each call to update may write up to
+// wuffcrypt_encrypt_update_size() bytes, and final up to wuffcrypt_encrypt_final_size(); the
+// call fails with WUFFCRYPT_BUFFER_TOO_SMALL, having done nothing, if out_len is less.
+typedef struct wuffcrypt_encrypt_stream wuffcrypt_encrypt_stream;
+
+wuffcrypt_encrypt_stream* wuffcrypt_encrypt_new(wuffcrypt_key* key, int flags);
+size_t wuffcrypt_encrypt_update_size(const wuffcrypt_encrypt_stream* stream, size_t len);
+wuffcrypt_status wuffcrypt_encrypt_update(wuffcrypt_encrypt_stream* stream, const uint8_t* in, size_t len,
+                                          uint8_t* out, size_t out_len, size_t* written);
+size_t wuffcrypt_encrypt_final_size(const wuffcrypt_encrypt_stream* stream);
+wuffcrypt_status wuffcrypt_encrypt_final(wuffcrypt_encrypt_stream* stream, uint8_t* out, size_t out_len, size_t* written);
+
+// With WUFFCRYPT_DIGEST or WUFFCRYPT_STORE_DIGEST, after final
+wuffcrypt_status wuffcrypt_encrypt_digest(const wuffcrypt_encrypt_stream* stream, uint8_t* out);
+void wuffcrypt_encrypt_free(wuffcrypt_encrypt_stream* stream);
+
+// Decrypting, a piece at a time, with the same rules for buffer sizes.  Output is released as
+// each block authenticates, but the file as a whole is only checked by final: until it returns
+// WUFFCRYPT_OK, treat the output as untrusted.
+typedef struct wuffcrypt_decrypt_stream wuffcrypt_decrypt_stream;
+
+wuffcrypt_decrypt_stream* wuffcrypt_decrypt_new(wuffcrypt_key* key, int flags);
+size_t wuffcrypt_decrypt_update_size(const wuffcrypt_decrypt_stream* stream, size_t len);
+wuffcrypt_status wuffcrypt_decrypt_update(wuffcrypt_decrypt_stream* stream, const uint8_t* in, size_t len,
+                                          uint8_t* out, size_t out_len, size_t* written);
+size_t wuffcrypt_decrypt_final_size(const wuffcrypt_decrypt_stream* stream);
+wuffcrypt_status wuffcrypt_decrypt_final(wuffcrypt_decrypt_stream* stream, uint8_t* out, size_t out_len, size_t* written);
+
+// With WUFFCRYPT_DIGEST, after final
+wuffcrypt_status wuffcrypt_decrypt_digest(const wuffcrypt_decrypt_stream* stream, uint8_t* out);
+void wuffcrypt_decrypt_free(wuffcrypt_decrypt_stream* stream);
+
+// Whole buffers at once.  Encrypting len bytes writes exactly wuffcrypt_encrypted_size(len,
+// flags) bytes; decrypting len bytes writes fewer than len.  A buffer that fails to decrypt
+// leaves out wiped.
+uint64_t wuffcrypt_encrypted_size(uint64_t len, int flags);
+wuffcrypt_status wuffcrypt_encrypt_buffer(wuffcrypt_key* key, int flags, const uint8_t* in, size_t len,
+                                          uint8_t* out, size_t out_len, size_t* written);
+wuffcrypt_status wuffcrypt_decrypt_buffer(wuffcrypt_key* key, const uint8_t* in, size_t len,
+                                          uint8_t* out, size_t out_len, size_t* written);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
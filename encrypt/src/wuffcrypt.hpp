@@ -4,17 +4,90 @@
 #pragma once
 
 #include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
 #include <stdint.h>
+#include <stdio.h>
+#include <vector>
 #include <sodium.h>
+#include "blockio.hpp"
+#include "digest.hpp"
+#include "fileio.hpp"
+#include "merkle.hpp"
 #include "paddedbuffer.hpp"
+#include "probes.hpp"
+#include "secretbox.hpp"
 #include "securestring.hpp"
+#include "stats.hpp"
+#include "throttle.hpp"
+#include "util.hpp"
 
+// Throws std::bad_alloc if scrypt cannot get the memory it needs
 void kdf(const std::string& password, int workFactor, uint8_t* outBuf, size_t bufLen);
 
 typedef PaddedBuffer<crypto_secretbox_xsalsa20poly1305_ZEROBYTES,0> SodiumMessageBuffer;
 typedef PaddedBuffer<crypto_secretbox_xsalsa20poly1305_BOXZEROBYTES,crypto_secretbox_xsalsa20poly1305_BOXZEROBYTES> SodiumEncryptedBuffer;
 
+// A key stretched out of a password.  Running the KDF costs a large amount of memory and time,
+// so anything handling more than one file should derive the key once and share it.
+class DerivedKey {
+public:
+    DerivedKey(const SecureString& password, int workFactor): _key(crypto_secretbox_xsalsa20poly1305_KEYBYTES), _workFactor(workFactor) {
+        kdf(std::string(password.c_str(), password.size()), workFactor, _key.data(), _key.size());
+    }
+
+    DerivedKey(const DerivedKey& other) = delete;
+
+    const uint8_t* data() const {
+        return _key.data();
+    }
+
+    int workFactor() const {
+        return _workFactor;
+    }
+
+private:
+    SecureString _key;
+    int _workFactor;
+};
+
+// Derives keys on demand, once per work factor, for runs that open many existing files
+class KeyCache {
+public:
+    explicit KeyCache(const SecureString& password): _password(password) {}
+    KeyCache(const KeyCache& other) = delete;
+
+    // Thread-safe.  The returned key lives as long as the cache.  Throws std::bad_alloc, and
+    // caches nothing, if the key cannot be derived.
+    const DerivedKey& get(int workFactor);
+
+    // The same, but null if the key cannot be derived, for callers that report failure rather
+    // than throw: worker tasks, and anything reading a work factor from a file
+    const DerivedKey* tryGet(int workFactor);
+
+private:
+    const SecureString& _password;
+    std::mutex _lock;
+    std::map<int, std::unique_ptr<DerivedKey>> _keys;
+};
+
 #define encrypt_NONCEPREFIXBYTES (crypto_secretbox_xsalsa20poly1305_NONCEBYTES-sizeof(uint32_t))
+
+// The complete nonce for one block
+struct Nonce {
+    uint8_t bytes[crypto_secretbox_xsalsa20poly1305_NONCEBYTES];
+
+    // The format 0 nonce: the prefix followed by the block counter in host order
+    static Nonce counter(const uint8_t* prefix, uint32_t n) {
+        Nonce nonce;
+        memcpy(nonce.bytes, prefix, encrypt_NONCEPREFIXBYTES);
+        memcpy(nonce.bytes + encrypt_NONCEPREFIXBYTES, &n, sizeof(n));
+        return nonce;
+    }
+};
+
 class Encrypter {
 public:
     Encrypter(const SecureString& password, int workFactor): _key(crypto_secretbox_xsalsa20poly1305_KEYBYTES) {
@@ -22,16 +95,39 @@ public:
         kdf(password.c_str(), workFactor, _key.data(), _key.size());
     }
 
-    void encrypt(const SodiumMessageBuffer& msg, SodiumEncryptedBuffer& ctext, uint32_t n) {
-        uint8_t nonce[crypto_secretbox_xsalsa20poly1305_NONCEBYTES];
-        memcpy(nonce, _nonce, sizeof(_nonce));
-
-        *reinterpret_cast<uint32_t*>((nonce + sizeof(_nonce))) = n;
+    // A fresh nonce prefix, unless one is given to pick up an interrupted file where it left off
+    explicit Encrypter(const DerivedKey& key, const uint8_t* noncePrefix = nullptr): _key(crypto_secretbox_xsalsa20poly1305_KEYBYTES) {
+        if(noncePrefix != nullptr) {
+            memcpy(_nonce, noncePrefix, sizeof(_nonce));
+        }
+        else {
+            randombytes_buf(_nonce, sizeof(_nonce));
+        }
+        memcpy(_key.data(), key.data(), _key.size());
+    }
 
-        crypto_secretbox_xsalsa20poly1305(ctext.rawData(), msg.rawData(), msg.rawSize(), nonce, _key.data());
+    // Safe to call from several threads at once; each block has its own nonce
+    void encrypt(const SodiumMessageBuffer& msg, SodiumEncryptedBuffer& ctext, const Nonce& nonce) const {
+        crypto_secretbox_xsalsa20poly1305(ctext.rawData(), msg.rawData(), msg.rawSize(), nonce.bytes, _key.data());
         ctext.setSize(msg.size() + ctext.padding());
     }
 
+    void encrypt(const SodiumMessageBuffer& msg, SodiumEncryptedBuffer& ctext, uint32_t n) const {
+        encrypt(msg, ctext, Nonce::counter(_nonce, n));
+    }
+
+    // Encrypt len bytes from anywhere in memory, without the zero padding the buffers above
+    // carry.  ctext receives the MAC followed by the ciphertext, len + MACBYTES in all.
+    void encrypt(const uint8_t* msg, size_t len, uint8_t* ctext, const Nonce& nonce) const {
+        secretbox::seal(ctext + crypto_secretbox_xsalsa20poly1305_MACBYTES, ctext, msg, len, nonce.bytes, _key.data());
+    }
+
+    // Encrypt len bytes where they lie, putting the MAC elsewhere, so that the two can be
+    // gathered straight into the file with pwritev()
+    void encryptInPlace(uint8_t* block, size_t len, uint8_t* mac, const Nonce& nonce) const {
+        secretbox::seal(block, mac, block, len, nonce.bytes, _key.data());
+    }
+
     const uint8_t* noncePrefix() const {
         return _nonce;
     }
@@ -48,12 +144,29 @@ public:
         kdf(password.c_str(), workFactor, _key.data(), _key.size());
     }
 
-    int decrypt(const SodiumEncryptedBuffer& ctext, SodiumMessageBuffer& msg, uint32_t n) {
-        uint8_t nonce[crypto_secretbox_xsalsa20poly1305_NONCEBYTES];
-        memcpy(nonce, _nonce, sizeof(_nonce));
-        *reinterpret_cast<uint32_t*>(nonce + sizeof(_nonce)) = n;
+    Decrypter(const DerivedKey& key, const uint8_t* nonce): _key(crypto_secretbox_xsalsa20poly1305_KEYBYTES) {
+        memcpy(_nonce, nonce, sizeof(_nonce));
+        memcpy(_key.data(), key.data(), _key.size());
+    }
+
+    // Check a block's authenticator without decrypting it.  ctext is the MAC followed by the
+    // ciphertext, as laid out in the file.  Only the Poly1305 key is generated from the stream
+    // cipher, so this is much cheaper than decrypting.
+    int authenticate(const uint8_t* ctext, size_t len, const Nonce& nonce) const {
+        if(len < crypto_secretbox_xsalsa20poly1305_MACBYTES) {
+            return 1;
+        }
+
+        const size_t macLen = crypto_secretbox_xsalsa20poly1305_MACBYTES;
+        return secretbox::authenticate(ctext + macLen, ctext, len - macLen, nonce.bytes, _key.data());
+    }
+
+    int authenticate(const uint8_t* ctext, size_t len, uint32_t n) const {
+        return authenticate(ctext, len, Nonce::counter(_nonce, n));
+    }
 
-        int status = crypto_secretbox_xsalsa20poly1305_open(msg.rawData(), ctext.rawData(), ctext.rawSize(), nonce, _key.data());
+    int decrypt(const SodiumEncryptedBuffer& ctext, SodiumMessageBuffer& msg, const Nonce& nonce) const {
+        int status = crypto_secretbox_xsalsa20poly1305_open(msg.rawData(), ctext.rawData(), ctext.rawSize(), nonce.bytes, _key.data());
         if(status != 0) {
             // The message verification failed; the ciphertext has been tampered with
             msg.setSize(0);
@@ -64,6 +177,25 @@ public:
         return 0;
     }
 
+    int decrypt(const SodiumEncryptedBuffer& ctext, SodiumMessageBuffer& msg, uint32_t n) const {
+        return decrypt(ctext, msg, Nonce::counter(_nonce, n));
+    }
+
+    // Decrypt a MAC followed by ciphertext, len bytes in all, into len - MACBYTES bytes anywhere
+    // in memory.  Nothing is written to msg unless the MAC is correct.
+    int decrypt(const uint8_t* ctext, size_t len, uint8_t* msg, const Nonce& nonce) const {
+        const size_t macLen = crypto_secretbox_xsalsa20poly1305_MACBYTES;
+        if(len < macLen) {
+            return 1;
+        }
+
+        return secretbox::open(msg, ctext + macLen, ctext, len - macLen, nonce.bytes, _key.data());
+    }
+
+    const uint8_t* noncePrefix() const {
+        return _nonce;
+    }
+
 private:
     SecureString _key;
     uint8_t _nonce[encrypt_NONCEPREFIXBYTES];
@@ -71,24 +203,435 @@ private:
 
 class WuffCryptFile {
 public:
-    static const uint8_t VERSION = 0;
+    // The format written by write().  Older formats can still be read: format 1 is format 2
+    // without a Merkle index, and format 0 has neither trailer nor index.
+    static const uint8_t VERSION = 2;
+
+    // Format 3 is format 2 with some blocks of zeros left out, as holes, and listed in the
+    // trailer.  It is only written when Options::sparse asks for it.
+    static const uint8_t SPARSE_VERSION = 3;
+
+    // Format 4 adds Reed-Solomon parity over the stored blocks, between the Merkle index and the
+    // trailer, and may also have holes.  Only written when Options::parityShards asks for it.
+    static const uint8_t PARITY_VERSION = 4;
     static const uint8_t WORK_FACTOR = 17;
     static const size_t BLOCK_SIZE = 1024*1024;
 
+    // Each encrypted block has an additional handful of bytes alongside it
+    static const size_t ENCRYPTED_BLOCK_SIZE = BLOCK_SIZE + crypto_secretbox_xsalsa20poly1305_BOXZEROBYTES;
+    static_assert(BLOCK_SIZE + crypto_secretbox_xsalsa20poly1305_ZEROBYTES <= SecureArena::BLOCK_SLOT_SIZE,
+                  "Block buffers must fit in the secure arena");
+
+    // Magic, version, work factor, and nonce prefix
+    static const size_t HEADER_SIZE = 9 + 1 + 1 + encrypt_NONCEPREFIXBYTES;
+
+    // Format 1 and 2 files end with an encrypted trailer, followed by a plaintext footer: the
+    // length of the plaintext, the size of the trailer, and a magic number.  Format 2 stores the
+    // Merkle index of the block tags between the last block and the trailer.
+    static const size_t FOOTER_SIZE = 8 + 4 + 4;
+
     enum class FileStatus {
         OK,
         OpenError,
         InvalidFileType,
         CorruptHeader,
         VerificationFailed,
-        WrongVersion
+        WrongVersion,
+        ReadError,
+        WriteError,
+        Truncated,
+        NoMemory
+    };
+
+    // The parameters stored at the start of every file
+    struct Header {
+        byteorder::ByteOrder byteOrder;
+        uint8_t version;
+        uint8_t workFactor;
+
+        // Format 1 and later only use the first 16 bytes as a nonce prefix; see blockNonce()
+        uint8_t nonce[encrypt_NONCEPREFIXBYTES];
+
+        // Because the nonce used will vary with system endianness, we have to adapt ourselves
+        // to whatever platform created the file
+        uint32_t counter(uint64_t n) const {
+            uint32_t n32 = static_cast<uint32_t>(n);
+            return (byteOrder == byteorder::ByteOrder::LittleEndian)? byteorder::fromLittleEndian(n32) : byteorder::fromBigEndian(n32);
+        }
+    };
+
+    // Where a file sits in a set of volumes that together hold one plaintext, each a complete
+    // file of its own; see FileEncryptJob::startVolume()
+    struct Volume {
+        Volume(): index(0), count(0), offset(0), totalLength(0), setId() {}
+
+        uint32_t index;
+        uint32_t count;
+
+        // Where this volume's plaintext starts in the whole, and how long the whole is
+        uint64_t offset;
+        uint64_t totalLength;
+
+        // Chosen at random for each set, so that volumes of different sets cannot be mixed up
+        uint8_t setId[16];
+    };
+
+    // The authenticated contents of a format 1 or 2 trailer
+    struct Trailer {
+        Trailer(): plaintextLength(0), hasDigest(false), digest(), digestChain(), hasMerkleRoot(false), merkleRoot(),
+                   dataShards(0), parityShards(0), hasVolume(false) {}
+
+        uint64_t plaintextLength;
+
+        // The plaintext digest, and its chain value before the final (partial) block
+        bool hasDigest;
+        uint8_t digest[PlaintextDigest::BYTES];
+        uint8_t digestChain[PlaintextDigest::BYTES];
+
+        // The root of the Merkle tree over the block tags.  Set in every format 2 file.
+        bool hasMerkleRoot;
+        uint8_t merkleRoot[merkle::NODE_BYTES];
+
+        // Format 3: runs of full blocks that are all zeros, as (first block, count) pairs in
+        // order.  Nothing is stored for them; their tags count as all zeros in the Merkle tree.
+        std::vector<std::pair<uint64_t, uint64_t>> zeroRuns;
+
+        // Format 4: each run of dataShards blocks, a stripe, has parityShards parity blocks; see
+        // parity.hpp.  A block's shard is its MAC and ciphertext, as stored, padded with zeros to
+        // ENCRYPTED_BLOCK_SIZE; blocks of zeros and those past the end of the file count as all
+        // zeros.  No parity if parityShards is zero.
+        uint8_t dataShards;
+        uint8_t parityShards;
+
+        // Set in each file of a set of volumes.  Older readers skip it, and see an ordinary file.
+        bool hasVolume;
+        Volume volume;
+
+        bool isZero(uint64_t n) const;
+
+        // Add block n to zeroRuns.  Blocks must be added in increasing order.
+        void addZero(uint64_t n);
+    };
+
+    // Optional extras for read() and write()
+    struct Options {
+        Options(): digest(false), storeDigest(false), sparse(false), resume(false), append(false), dataShards(0), parityShards(0), cache(fileio::CacheMode::Keep) {}
+
+        // Compute a PlaintextDigest of everything read or written
+        bool digest;
+
+        // write() only: also record the digest, authenticated, in the trailer
+        bool storeDigest;
+
+        // write() only: skip over blocks of zeros instead of encrypting them, leaving holes in
+        // the output that decrypting recreates.  Which blocks are zero is then visible to anyone
+        // holding the file.
+        bool sparse;
+
+        // FileEncryptJob only: keep every block of an existing output that still authenticates
+        // under the same key and nonce prefix, and encrypt only the rest.  Ignored, and the
+        // output started over, unless the checkpoint left beside it, out + ".resume", shows the
+        // input to be the same file, unmodified since the output was started.
+        bool resume;
+
+        // FileEncryptJob only: extend an existing archive of an earlier, shorter version of the
+        // input, re-encrypting only its final block and whatever has been added since.  The
+        // archive's final block must still match the input, and its format and stored digest are
+        // kept.  Ignores resume.
+        bool append;
+
+        // FileEncryptJob only: add this many parity blocks for every dataShards blocks, so that
+        // up to parityShards damaged blocks in each run can be rebuilt when decrypting
+        uint8_t dataShards;
+        uint8_t parityShards;
+
+        // Whether file data may stay in the page cache.  Only the parallel jobs can read with
+        // O_DIRECT; elsewhere, Direct drops the cache behind the cursor just like Drop.
+        fileio::CacheMode cache;
     };
 
-    explicit WuffCryptFile(const std::string& path): _path(path) {}
+    explicit WuffCryptFile(const std::string& path): _path(path), _rebuilt(0) {}
+
+    // Decrypt the file into a sink, or encrypt a source into it; see blockio.hpp.  The sink sees
+    // each block as soon as it is authenticated, before the whole file has been checked.
+    template <typename Sink>
+    FileStatus decryptTo(Sink& sink, const SecureString& password, const Options& options = Options());
+    template <typename Sink>
+    FileStatus decryptTo(Sink& sink, KeyCache& keys, const Options& options = Options());
+    template <typename Source>
+    FileStatus encryptFrom(Source& source, const SecureString& password, const Options& options = Options());
+
+    // The same, through callbacks
+    FileStatus read(std::function<void(const SodiumMessageBuffer& msg)> blockHandler, const SecureString& password,
+                    const Options& options = Options());
+    FileStatus write(std::function<void(uint8_t* outBuf, size_t& outBufWritten, size_t blockSize)> blockFeeder, const SecureString& password,
+                     const Options& options = Options());
+
+    // The digest computed by the last read() or write() with Options::digest set
+    const PlaintextDigest& digest() const {
+        return _digest;
+    }
+
+    // How many damaged blocks the last read() rebuilt from parity
+    uint64_t rebuiltBlocks() const {
+        return _rebuilt;
+    }
+
+    // Fill out with the HEADER_SIZE byte file header for the given encrypter
+    static void encodeHeader(const Encrypter& enc, uint8_t* out, uint8_t version = VERSION);
+
+    // Parse the first len bytes of a file
+    static FileStatus decodeHeader(const uint8_t* buf, size_t len, Header& out);
+
+    // Format 1 nonces hold the block's index and length, so that a block rewritten with different
+    // contents never reuses a nonce.  The trailer's nonce holds the plaintext length with the top
+    // bit set, which no block's can.
+    static Nonce blockNonce(const uint8_t* prefix, uint64_t n, size_t len);
+    static Nonce trailerNonce(const uint8_t* prefix, uint64_t plaintextLength);
+
+    // Encrypt a trailer and append it, followed by the footer, to out
+    static void sealTrailer(const Encrypter& enc, const Trailer& trailer, std::vector<uint8_t>& out);
+
+    // How many bytes sealTrailer() appends for a trailer, footer included
+    static size_t sealedTrailerSize(const Trailer& trailer);
+
+    // Find, authenticate, and parse the trailer at the end of a format 1 or 2 file, and check
+    // that it sits where the plaintext length says it should
+    static FileStatus openTrailer(int fd, uint64_t fileSize, const Decrypter& dec, Trailer& out);
 
-    FileStatus read(std::function<void(const SodiumMessageBuffer& msg)> blockHandler, const SecureString& password) const;
-    FileStatus write(std::function<void(uint8_t* outBuf, size_t& outBufWritten, size_t blockSize)> blockFeeder, const SecureString& password);
+    // The same, for a file of fileSize bytes in memory whose last len bytes are at tail
+    static FileStatus openTrailer(const uint8_t* tail, size_t len, uint64_t fileSize, const Decrypter& dec, Trailer& out);
+
+    // Rebuild block n of a file with parity, as stored, into out, from the other blocks of its
+    // stripe and their parity.  Every block in the stripe that fails to authenticate is treated
+    // as lost.  OK only if block n then authenticates.
+    static FileStatus rebuildBlock(int fd, const Trailer& trailer, const Decrypter& dec, uint64_t n, uint8_t* out);
+
+    // The PlaintextDigest leaf of a full block of zeros, computed once
+    static const uint8_t* zeroLeaf();
+
+    // The number of blocks produced from plaintextSize bytes of input.  The last block is always
+    // partial, and may be empty.
+    static uint64_t blockCount(uint64_t plaintextSize) {
+        return plaintextSize / BLOCK_SIZE + 1;
+    }
+
+    // The plaintext length of block n
+    static size_t blockLength(uint64_t plaintextSize, uint64_t n) {
+        return (n + 1 < blockCount(plaintextSize))? BLOCK_SIZE : static_cast<size_t>(plaintextSize % BLOCK_SIZE);
+    }
+
+    static uint64_t blockOffset(uint64_t n) {
+        return HEADER_SIZE + n * ENCRYPTED_BLOCK_SIZE;
+    }
+
+    // The offset just past the last block, where the Merkle index begins
+    static uint64_t dataEnd(uint64_t plaintextSize) {
+        return HEADER_SIZE + plaintextSize + blockCount(plaintextSize) * (ENCRYPTED_BLOCK_SIZE - BLOCK_SIZE);
+    }
+
+    static uint64_t stripeCount(const Trailer& trailer) {
+        return (trailer.parityShards == 0)? 0 : (blockCount(trailer.plaintextLength) + trailer.dataShards - 1) / trailer.dataShards;
+    }
+
+    // The length of every shard in a stripe: a whole encrypted block, unless the stripe holds
+    // nothing but the final, partial block, so that small files stay small
+    static size_t shardSize(const Trailer& trailer, uint64_t stripe) {
+        return blockLength(trailer.plaintextLength, stripe * trailer.dataShards) + crypto_secretbox_xsalsa20poly1305_MACBYTES;
+    }
+
+    // The offset of parity block i of a stripe, after the Merkle index.  Only the last stripe
+    // can have short shards.
+    static uint64_t parityOffset(const Trailer& trailer, uint64_t stripe, unsigned i) {
+        const uint64_t start = dataEnd(trailer.plaintextLength) + merkle::indexSize(blockCount(trailer.plaintextLength));
+        return start + stripe * trailer.parityShards * ENCRYPTED_BLOCK_SIZE + i * shardSize(trailer, stripe);
+    }
+
+    // The offset of the trailer: after the data and, if there are any, the Merkle index and parity
+    static uint64_t trailerOffset(const Trailer& trailer) {
+        const uint64_t indexSize = trailer.hasMerkleRoot? merkle::indexSize(blockCount(trailer.plaintextLength)) : 0;
+        const uint64_t stripes = stripeCount(trailer);
+        const uint64_t paritySize = (stripes == 0)? 0 : parityOffset(trailer, stripes - 1, trailer.parityShards) - dataEnd(trailer.plaintextLength) - indexSize;
+        return dataEnd(trailer.plaintextLength) + indexSize + paritySize;
+    }
 
 private:
+    // Check a footer, and read the plaintext length and trailer size from it
+    static FileStatus readFooter(const uint8_t* footer, uint64_t fileSize, uint64_t& plaintextLength, size_t& trailerLen);
+
+    // Authenticate and parse a trailer found at offset
+    static FileStatus unsealTrailer(const Decrypter& dec, const SodiumEncryptedBuffer& ctext, uint64_t plaintextLength,
+                                    uint64_t offset, Trailer& out);
+
+    // The parts of encryptFrom() that do not depend on the source: one block at a time, in order
+    class BlockWriter {
+    public:
+        BlockWriter(const std::string& path, const SecureString& password, const Options& options, PlaintextDigest& digest);
+        BlockWriter(const BlockWriter& other) = delete;
+        ~BlockWriter();
+
+        FileStatus status() const { return _status; }
+
+        void add(const uint8_t* block, size_t len);
+
+        // Write out the Merkle index and trailer
+        FileStatus finish();
+
+    private:
+        // Write the header, if it has not gone out yet, then the given buffers, in one call
+        void write(struct iovec* iov, int count);
+
+        // Options::sparse: record a full block of zeros, and seek past where it would go
+        void skipZero();
+
+        // Plain write()s rather than stdio, so that the header goes out with the first block
+        // and the last block with the trailer.  Not pwrite(), as the output may be a pipe.
+        int _fd;
+        fileio::DropBehind _drop;
+        Encrypter _enc;
+        const Options& _options;
+        PlaintextDigest& _digest;
+        uint8_t _header[HEADER_SIZE];
+        bool _headerWritten;
+
+        // Set once seeking fails, after which skipped blocks are filled in instead
+        bool _pipe;
+        uint64_t _offset;
+
+        // The final, partial block is held back until finish()
+        SodiumEncryptedBuffer _encBuf;
+        size_t _heldLen;
+
+        std::vector<uint8_t> _tags;
+        Trailer _trailer;
+        uint64_t _n;
+        FileStatus _status;
+    };
+
+    // The parts of decryptTo() that do not depend on the sink
+    class BlockReader {
+    public:
+        BlockReader(const std::string& path, KeyCache& keys, const Options& options, PlaintextDigest& digest,
+                    uint64_t& rebuilt);
+        BlockReader(const BlockReader& other) = delete;
+        ~BlockReader();
+
+        FileStatus status() const { return _status; }
+
+        // Read the next block's ciphertext, and say how long its plaintext is
+        FileStatus next(size_t& len, bool& last);
+
+        // Whether the block from next() is a run of zeros that was never stored.  If so, call
+        // skipZero() instead of open().
+        bool zero() const { return _zero; }
+        void skipZero();
+
+        // Authenticate and decrypt the block from next() into out
+        FileStatus open(uint8_t* out);
+
+        // Check what can only be checked once every block has been seen
+        FileStatus finish();
+
+    private:
+        FILE* _f;
+        fileio::DropBehind _drop;
+        Header _header;
+        std::unique_ptr<Decrypter> _dec;
+        Trailer _trailer;
+        const Options& _options;
+        PlaintextDigest& _digest;
+        uint64_t& _rebuilt;
+        SodiumEncryptedBuffer _buf;
+        std::vector<uint8_t> _tags;
+        uint64_t _n;
+        uint64_t _nBlocks;
+        uint64_t _total;
+        bool _zero;
+        FileStatus _status;
+    };
+
     const std::string _path;
+    PlaintextDigest _digest;
+    uint64_t _rebuilt;
 };
+
+template <typename Sink>
+WuffCryptFile::FileStatus WuffCryptFile::decryptTo(Sink& sink, const SecureString& password, const Options& options) {
+    KeyCache keys(password);
+    return decryptTo(sink, keys, options);
+}
+
+template <typename Sink>
+WuffCryptFile::FileStatus WuffCryptFile::decryptTo(Sink& sink, KeyCache& keys, const Options& options) {
+    _rebuilt = 0;
+    BlockReader reader(_path, keys, options, _digest, _rebuilt);
+    if(reader.status() != FileStatus::OK) {
+        return reader.status();
+    }
+
+    SodiumMessageBuffer scratch(BLOCK_SIZE);
+    bool last = false;
+    for(uint64_t n = 0; !last; n += 1) {
+        BlockTimer timer;
+        size_t len = 0;
+        FileStatus status = reader.next(len, last);
+        if(status != FileStatus::OK) return status;
+
+        if(reader.zero()) {
+            reader.skipZero();
+
+            ThrottledIO throttled(Throttle::Direction::Write, blockio::holes<Sink>::value? 0 : len);
+            StageTimer writing(Stats::Stage::Write);
+            if(!blockio::putZeros(sink, scratch.data(), len)) return FileStatus::WriteError;
+            WUFF_PROBE2(block__write, n, len);
+            timer.done(len);
+            continue;
+        }
+
+        uint8_t* out = blockio::blockSpace(sink, scratch.data(), len);
+        if(out == nullptr) return FileStatus::WriteError;
+
+        status = reader.open(out);
+        if(status != FileStatus::OK) return status;
+
+        {
+            ThrottledIO throttled(Throttle::Direction::Write, len);
+            StageTimer writing(Stats::Stage::Write);
+            if(!blockio::putBlock(sink, out, len)) return FileStatus::WriteError;
+            WUFF_PROBE2(block__write, n, len);
+        }
+
+        timer.done(len);
+    }
+
+    return reader.finish();
+}
+
+template <typename Source>
+WuffCryptFile::FileStatus WuffCryptFile::encryptFrom(Source& source, const SecureString& password, const Options& options) {
+    BlockWriter writer(_path, password, options, _digest);
+    if(writer.status() != FileStatus::OK) {
+        return writer.status();
+    }
+
+    // Encrypt blocks until the source runs short
+    SodiumMessageBuffer scratch(BLOCK_SIZE);
+    for(uint64_t n = 0; ; n += 1) {
+        BlockTimer timer;
+        size_t len = 0;
+        const uint8_t* block = nullptr;
+        {
+            ThrottledIO throttled(Throttle::Direction::Read, BLOCK_SIZE);
+            StageTimer reading(Stats::Stage::Read);
+            block = blockio::nextBlock(source, scratch.data(), BLOCK_SIZE, len);
+        }
+        if(block == nullptr) return FileStatus::ReadError;
+        WUFF_PROBE2(block__read, n, len);
+
+        writer.add(block, len);
+        timer.done(len);
+        if(len < BLOCK_SIZE) break;
+    }
+
+    return writer.finish();
+}
@@ -0,0 +1,128 @@
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <sodium.h>
+#include "util.hpp"
+#include "async.hpp"
+
+namespace {
+    const size_t BLOCK_SIZE = WuffCryptFile::BLOCK_SIZE;
+    typedef WuffCryptFile::FileStatus FileStatus;
+
+    struct Run {
+        std::vector<uint8_t> plain;
+        std::vector<uint8_t> ctext;
+        std::vector<uint8_t> decrypted;
+        FileStatus status;
+        bool finished;
+        PlaintextDigest stored;
+        PlaintextDigest checked;
+    };
+
+    // Queue the whole of in, in pieces of size piece, and then the end
+    template <typename Stream>
+    void feed(Stream& stream, const std::vector<uint8_t>& in, size_t piece, std::vector<uint8_t>& out, Run& run, PlaintextDigest& digest) {
+        auto collect = [&out, &run](const typename Stream::Result& result) {
+            out.insert(out.end(), result.out, result.out + result.len);
+            if(result.status != FileStatus::OK) run.status = result.status;
+        };
+
+        for(size_t i = 0; i < in.size(); i += piece) {
+            stream.update(in.data() + i, std::min(piece, in.size() - i), collect);
+        }
+
+        stream.final([&out, &run, &digest](const typename Stream::Result& result) {
+            out.insert(out.end(), result.out, result.out + result.len);
+            if(result.status != FileStatus::OK) run.status = result.status;
+            if(result.digest != nullptr) digest = *result.digest;
+            run.finished = true;
+        });
+    }
+}
+
+int main(void) {
+    verify(sodium_init() >= 0);
+
+    char password[] = "correct horse";
+    SecureString pw(password);
+    KeyCache keys(pw);
+    WorkStealingPool pool(3);
+
+    // The KDF runs on a worker
+    {
+        std::atomic<const DerivedKey*> derived(nullptr);
+        DeriveKeyJob::start(pool, keys, WuffCryptFile::WORK_FACTOR, [&derived](const DerivedKey* key) { derived = key; });
+        pool.wait();
+        verify(derived.load() == &keys.get(WuffCryptFile::WORK_FACTOR));
+    }
+
+    // Many streams at once, each in order, sharing three threads
+    const size_t sizes[] = {0, 1, 1000, BLOCK_SIZE, BLOCK_SIZE + 3, 2 * BLOCK_SIZE + 1};
+    const size_t pieces[] = {1, 777, 65536, BLOCK_SIZE + 1};
+    std::vector<Run> runs(48);
+    for(size_t i = 0; i < runs.size(); i += 1) {
+        Run& run = runs[i];
+        run.plain.resize(sizes[i % 6]);
+        randombytes_buf(run.plain.data(), run.plain.size());
+        run.status = FileStatus::OK;
+        run.finished = false;
+    }
+
+    WuffCryptFile::Options options;
+    options.storeDigest = true;
+    {
+        std::vector<std::unique_ptr<AsyncEncryptStream>> streams;
+        for(size_t i = 0; i < runs.size(); i += 1) {
+            streams.push_back(std::unique_ptr<AsyncEncryptStream>(new AsyncEncryptStream(pool, keys, options)));
+            feed(*streams.back(), runs[i].plain, pieces[(i / 6) % 4], runs[i].ctext, runs[i], runs[i].stored);
+        }
+
+        // Streams may go away with their work still queued
+        streams.clear();
+        pool.wait();
+    }
+
+    for(Run& run : runs) {
+        verify(run.finished);
+        verify(run.status == FileStatus::OK);
+        verify(run.ctext.size() == StreamEncrypter::encryptedSize(run.plain.size(), options));
+        verify(run.stored.finished());
+        run.finished = false;
+    }
+
+    {
+        WuffCryptFile::Options digesting;
+        digesting.digest = true;
+        std::vector<std::unique_ptr<AsyncDecryptStream>> streams;
+        for(size_t i = 0; i < runs.size(); i += 1) {
+            streams.push_back(std::unique_ptr<AsyncDecryptStream>(new AsyncDecryptStream(pool, keys, digesting)));
+            feed(*streams.back(), runs[i].ctext, pieces[i % 4], runs[i].decrypted, runs[i], runs[i].checked);
+        }
+        pool.wait();
+
+        for(size_t i = 0; i < runs.size(); i += 1) {
+            verify(runs[i].finished);
+            verify(runs[i].status == FileStatus::OK);
+            verify(runs[i].decrypted == runs[i].plain);
+            verify(runs[i].checked.hex() == runs[i].stored.hex());
+        }
+    }
+
+    // Damage fails the stream, however it was cut up
+    {
+        Run& run = runs[4];
+        run.ctext[WuffCryptFile::blockOffset(1) + 9] ^= 1;
+        run.decrypted.clear();
+        run.finished = false;
+
+        AsyncDecryptStream stream(pool, keys);
+        feed(stream, run.ctext, 4096, run.decrypted, run, run.checked);
+        pool.wait();
+        verify(run.finished);
+        verify(run.status == FileStatus::VerificationFailed);
+    }
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <string.h>
+#include <atomic>
+#include <exception>
+#include <type_traits>
+#include <vector>
+#include <sodium.h>
+#include "util.hpp"
+#include "awaitable.hpp"
+
+#if !defined(__cpp_impl_coroutine)
+#error "test_awaitable must be built as C++20"
+#endif
+
+// Decrypted output must not be left on the heap once freed
+static_assert(std::is_same<decltype(awaitable::Output::data)::allocator_type, awaitable::WipingAllocator<uint8_t>>::value, "");
+
+namespace {
+    typedef WuffCryptFile::FileStatus FileStatus;
+
+    // Just enough of a coroutine type to start one and let it run to the end on its own
+    struct Detached {
+        struct promise_type {
+            Detached get_return_object() { return Detached(); }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    struct Outcome {
+        std::atomic<bool> finished{false};
+        const DerivedKey* key = nullptr;
+        std::vector<uint8_t> ctext;
+        std::vector<uint8_t> plain;
+        FileStatus encrypted = FileStatus::OK;
+        FileStatus decrypted = FileStatus::OK;
+        bool hasDigest = false;
+        PlaintextDigest stored;
+        PlaintextDigest checked;
+    };
+
+    // Encrypt in, in two pieces, then decrypt the result in one
+    Detached roundTrip(WorkStealingPool& pool, KeyCache& keys, const std::vector<uint8_t>& in, Outcome& outcome) {
+        const DerivedKey& key = co_await awaitable::deriveKey(pool, keys);
+        outcome.key = &key;
+
+        WuffCryptFile::Options storing;
+        storing.storeDigest = true;
+        AsyncEncryptStream enc(pool, keys, storing);
+
+        const size_t half = in.size() / 2;
+        awaitable::Output a = co_await awaitable::update(enc, in.data(), half);
+        awaitable::Output b = co_await awaitable::update(enc, in.data() + half, in.size() - half);
+        awaitable::Output c = co_await awaitable::final(enc);
+        for(const awaitable::Output* out : {&a, &b, &c}) {
+            if(out->status != FileStatus::OK) outcome.encrypted = out->status;
+            outcome.ctext.insert(outcome.ctext.end(), out->data.begin(), out->data.end());
+        }
+        if(c.hasDigest) outcome.stored = c.digest;
+
+        WuffCryptFile::Options digesting;
+        digesting.digest = true;
+        AsyncDecryptStream dec(pool, keys, digesting);
+
+        awaitable::Output d = co_await awaitable::update(dec, outcome.ctext.data(), outcome.ctext.size());
+        awaitable::Output e = co_await awaitable::final(dec);
+        for(const awaitable::Output* out : {&d, &e}) {
+            if(out->status != FileStatus::OK) outcome.decrypted = out->status;
+            outcome.plain.insert(outcome.plain.end(), out->data.begin(), out->data.end());
+        }
+        outcome.hasDigest = e.hasDigest;
+        if(e.hasDigest) outcome.checked = e.digest;
+
+        outcome.finished = true;
+    }
+}
+
+int main(void) {
+    verify(sodium_init() >= 0);
+
+    char password[] = "correct horse";
+    SecureString pw(password);
+    KeyCache keys(pw);
+    WorkStealingPool pool(3);
+
+    // Across a block boundary, so that both updates produce output
+    std::vector<uint8_t> in(WuffCryptFile::BLOCK_SIZE + 1000);
+    randombytes_buf(in.data(), in.size());
+
+    Outcome outcome;
+    roundTrip(pool, keys, in, outcome);
+    pool.wait();
+
+    verify(outcome.finished);
+    verify(outcome.key == &keys.get(WuffCryptFile::WORK_FACTOR));
+    verify(outcome.encrypted == FileStatus::OK);
+    WuffCryptFile::Options storing;
+    storing.storeDigest = true;
+    verify(outcome.ctext.size() == StreamEncrypter::encryptedSize(in.size(), storing));
+    verify(outcome.decrypted == FileStatus::OK);
+    verify(outcome.plain == in);
+    verify(outcome.hasDigest);
+    verify(outcome.checked.hex() == outcome.stored.hex());
+
+    return 0;
+}
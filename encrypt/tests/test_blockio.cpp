@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "util.hpp"
+#include "blockio.hpp"
+
+namespace {
+    struct PlainSink {
+        bool write(const uint8_t* buf, size_t len) {
+            out.insert(out.end(), buf, buf + len);
+            return true;
+        }
+
+        std::vector<uint8_t> out;
+    };
+}
+
+int main(void) {
+    verify(blockio::lends<blockio::MemorySource>::value);
+    verify(blockio::lends<blockio::SpanSink>::value);
+    verify(!blockio::lends<blockio::FileSource>::value);
+    verify(!blockio::lends<PlainSink>::value);
+    verify(blockio::holes<blockio::FileSink>::value);
+    verify(!blockio::holes<PlainSink>::value);
+
+    uint8_t data[100];
+    for(size_t i = 0; i < sizeof(data); i += 1) {
+        data[i] = static_cast<uint8_t>(i);
+    }
+
+    // Lending sources hand out their own memory, and run short at the end
+    {
+        blockio::MemorySource source(data, sizeof(data));
+        uint8_t scratch[64];
+        size_t got = 0;
+
+        verify(blockio::nextBlock(source, scratch, 64, got) == data);
+        verify(got == 64);
+        verify(blockio::nextBlock(source, scratch, 64, got) == data + 64);
+        verify(got == 36);
+        blockio::nextBlock(source, scratch, 64, got);
+        verify(got == 0);
+    }
+
+    // Others read into the scratch buffer
+    {
+        int fds[2];
+        verify(pipe(fds) == 0);
+        verify(write(fds[1], data, sizeof(data)) == static_cast<ssize_t>(sizeof(data)));
+        close(fds[1]);
+
+        blockio::FdSource source(fds[0]);
+        uint8_t scratch[64];
+        size_t got = 0;
+
+        verify(blockio::nextBlock(source, scratch, 64, got) == scratch);
+        verify(got == 64 && memcmp(scratch, data, 64) == 0);
+        blockio::nextBlock(source, scratch, 64, got);
+        verify(got == 36 && memcmp(scratch, data + 64, 36) == 0);
+        close(fds[0]);
+    }
+
+    // Mapped files
+    {
+        char path[] = "/tmp/test_blockio.XXXXXX";
+        int fd = mkstemp(path);
+        verify(fd >= 0);
+        verify(write(fd, data, sizeof(data)) == static_cast<ssize_t>(sizeof(data)));
+        close(fd);
+
+        blockio::MappedSource source(path);
+        verify(source.ok());
+        size_t got = 0;
+        const uint8_t* block = source.lend(1000, got);
+        verify(got == sizeof(data) && memcmp(block, data, got) == 0);
+        unlink(path);
+
+        blockio::MappedSource missing("/nonexistent/test_blockio");
+        verify(!missing.ok());
+        verify(missing.lend(10, got) == nullptr);
+    }
+
+    // Sinks either lend space or are written to
+    {
+        uint8_t scratch[64];
+        uint8_t span[80];
+        blockio::SpanSink sink(span, sizeof(span));
+
+        uint8_t* space = blockio::blockSpace(sink, scratch, 64);
+        verify(space == span);
+        memcpy(space, data, 64);
+        verify(blockio::putBlock(sink, space, 64));
+        verify(sink.size() == 64);
+
+        // No room for another full block
+        verify(blockio::blockSpace(sink, scratch, 64) == nullptr);
+
+        std::vector<uint8_t> vec;
+        blockio::MemorySink memory(vec);
+        space = blockio::blockSpace(memory, scratch, 10);
+        memcpy(space, data, 10);
+        verify(blockio::putBlock(memory, space, 10));
+        verify(vec.size() == 10 && memcmp(vec.data(), data, 10) == 0);
+
+        PlainSink plain;
+        space = blockio::blockSpace(plain, scratch, 10);
+        verify(space == scratch);
+        memcpy(space, data, 10);
+        verify(blockio::putBlock(plain, space, 10));
+        verify(plain.out.size() == 10);
+
+        // Zeros are written out where the sink cannot leave a hole
+        verify(blockio::putZeros(plain, scratch, 5));
+        verify(plain.out.size() == 15 && plain.out[14] == 0);
+    }
+
+    // A file sink seeks over zeros, and still ends up the right length if they come last
+    {
+        FILE* f = tmpfile();
+        verify(f != nullptr);
+        blockio::FileSink sink(f);
+        uint8_t scratch[64];
+
+        verify(blockio::putBlock(sink, data, 10));
+        verify(blockio::putZeros(sink, scratch, 5000));
+        verify(blockio::putBlock(sink, data, 10));
+        verify(blockio::putZeros(sink, scratch, 3000));
+        verify(sink.finish());
+
+        std::vector<uint8_t> back(9000);
+        rewind(f);
+        verify(fread(back.data(), 1, back.size(), f) == 8020);
+        verify(memcmp(back.data() + 5010, data, 10) == 0);
+        for(size_t i = 10; i < 5010; i += 1) verify(back[i] == 0);
+        fclose(f);
+    }
+
+    // A resumed file sink keeps what matches, and fixes up and trims the rest
+    {
+        FILE* f = tmpfile();
+        verify(f != nullptr);
+        uint8_t stale[40];
+        memcpy(stale, data, sizeof(stale));
+        stale[25] ^= 1;
+        verify(fwrite(stale, 1, sizeof(stale), f) == sizeof(stale));
+        rewind(f);
+
+        blockio::FileSink sink(f, false, true);
+        verify(sink.write(data, 10));
+        verify(sink.write(data + 10, 10));
+        verify(sink.write(data + 20, 10));
+        verify(sink.finish());
+        verify(sink.kept() == 20);
+
+        uint8_t back[40];
+        rewind(f);
+        verify(fread(back, 1, sizeof(back), f) == 30);
+        verify(memcmp(back, data, 30) == 0);
+        fclose(f);
+    }
+
+    return 0;
+}
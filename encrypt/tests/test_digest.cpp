@@ -0,0 +1,76 @@
+#include <string.h>
+#include <sodium.h>
+#include "util.hpp"
+#include "digest.hpp"
+
+int main(void) {
+    verify(sodium_init() >= 0);
+
+    uint8_t block[1000];
+    for(size_t i = 0; i < sizeof(block); i += 1) {
+        block[i] = static_cast<uint8_t>(i);
+    }
+
+    uint8_t leaves[3][PlaintextDigest::BYTES];
+    for(int i = 0; i < 3; i += 1) {
+        PlaintextDigest::leaf(block, sizeof(block) - i, leaves[i]);
+    }
+
+    {
+        PlaintextDigest a;
+        PlaintextDigest b;
+        verify(!a.finished());
+
+        for(int i = 0; i < 3; i += 1) {
+            a.add(leaves[i]);
+            b.add(leaves[i]);
+        }
+
+        a.finish(2997);
+        b.finish(2997);
+        verify(a.finished());
+        verify(a.blocks() == 3);
+        verify(memcmp(a.value(), b.value(), PlaintextDigest::BYTES) == 0);
+        verify(a.hex().size() == 2 * PlaintextDigest::BYTES);
+
+        // The length is part of the digest
+        b.reset();
+        for(int i = 0; i < 3; i += 1) {
+            b.add(leaves[i]);
+        }
+        b.finish(2998);
+        verify(memcmp(a.value(), b.value(), PlaintextDigest::BYTES) != 0);
+    }
+
+    {
+        // Order matters
+        PlaintextDigest a;
+        PlaintextDigest b;
+        a.add(leaves[0]);
+        a.add(leaves[1]);
+        b.add(leaves[1]);
+        b.add(leaves[0]);
+        a.finish(10);
+        b.finish(10);
+        verify(memcmp(a.value(), b.value(), PlaintextDigest::BYTES) != 0);
+    }
+
+    {
+        // A digest can be resumed from a saved chain value
+        PlaintextDigest a;
+        a.add(leaves[0]);
+        a.add(leaves[1]);
+
+        PlaintextDigest b;
+        b.reset(a.chain(), a.blocks());
+
+        a.add(leaves[2]);
+        b.add(leaves[2]);
+        a.finish(2997);
+        b.finish(2997);
+        verify(b.blocks() == 3);
+        verify(memcmp(a.value(), b.value(), PlaintextDigest::BYTES) == 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "util.hpp"
+#include "fileio.hpp"
+
+int main(void) {
+    char path[] = "/tmp/wuffcrypt-test-fileio-XXXXXX";
+    int fd = mkstemp(path);
+    verify(fd >= 0);
+
+    // Deliberately not a multiple of the alignment
+    std::vector<uint8_t> data(3 * fileio::DIRECT_ALIGNMENT + 123);
+    for(size_t i = 0; i < data.size(); i += 1) {
+        data[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    verify(fileio::alignUp(0) == 0);
+    verify(fileio::alignUp(1) == fileio::DIRECT_ALIGNMENT);
+    verify(fileio::alignUp(fileio::DIRECT_ALIGNMENT) == fileio::DIRECT_ALIGNMENT);
+
+    // Written data survives being flushed and dropped from the cache
+    {
+        fileio::DropBehind drop(fd, true);
+        const size_t half = data.size() / 2;
+        verify(fileio::pwriteAll(fd, data.data(), half, 0));
+        drop.advanceTo(half);
+        verify(fileio::pwriteAll(fd, data.data() + half, data.size() - half, half));
+        drop.advanceTo(data.size());
+    }
+    close(fd);
+
+    {
+        bool direct = false;
+        int in = fileio::openDirect(path, direct);
+        verify(in >= 0);
+
+        // An aligned read of the whole file stops at its end
+        void* aligned = nullptr;
+        verify(posix_memalign(&aligned, fileio::DIRECT_ALIGNMENT, fileio::alignUp(data.size())) == 0);
+        ssize_t n = fileio::preadDirect(in, static_cast<uint8_t*>(aligned), fileio::alignUp(data.size()), 0);
+        verify(n == static_cast<ssize_t>(data.size()));
+        verify(memcmp(aligned, data.data(), data.size()) == 0);
+
+        // A misaligned buffer still works, by way of the cache
+        std::vector<uint8_t> out(data.size() + 1);
+        n = fileio::preadDirect(in, out.data() + 1, data.size() - 5, 5);
+        verify(n == static_cast<ssize_t>(data.size() - 5));
+        verify(memcmp(out.data() + 1, data.data() + 5, data.size() - 5) == 0);
+
+        fileio::DropBehind drop(in, false);
+        drop.advanceTo(data.size());
+        drop.finish();
+
+        free(aligned);
+        close(in);
+    }
+
+    // Vectored writes land back to back, and use up their iovecs
+    {
+        int out = open(path, O_RDWR | O_TRUNC);
+        verify(out >= 0);
+        uint64_t size = 0;
+        if(fileio::preallocate(out, 100)) {
+            verify(fileio::regularFileSize(out, size) && size == 100);
+        }
+
+        uint8_t a[3] = {1, 2, 3};
+        uint8_t b[1] = {4};
+        struct iovec iov[3];
+        iov[0].iov_base = a;
+        iov[0].iov_len = sizeof(a);
+        iov[1].iov_base = b;
+        iov[1].iov_len = 0;
+        iov[2].iov_base = b;
+        iov[2].iov_len = sizeof(b);
+        verify(fileio::pwritevAll(out, iov, 3, 10));
+
+        iov[0].iov_base = b;
+        iov[0].iov_len = sizeof(b);
+        verify(lseek(out, 0, SEEK_SET) == 0);
+        verify(fileio::writevAll(out, iov, 1));
+
+        uint8_t back[14];
+        verify(fileio::preadAll(out, back, sizeof(back), 0) == sizeof(back));
+        verify(back[0] == 4 && back[10] == 1 && back[11] == 2 && back[12] == 3 && back[13] == 4);
+        close(out);
+    }
+
+    // Zero checks find a single set byte anywhere, at any alignment
+    {
+        std::vector<uint8_t> zeros(1000);
+        verify(fileio::allZero(zeros.data(), 0));
+        for(size_t start = 0; start < 3; start += 1) {
+            verify(fileio::allZero(zeros.data() + start, zeros.size() - start));
+            for(size_t i = start; i < zeros.size(); i += 97) {
+                zeros[i] = 0x80;
+                verify(!fileio::allZero(zeros.data() + start, zeros.size() - start));
+                zeros[i] = 0;
+            }
+        }
+    }
+
+    // Holes, where the filesystem reports them, never cover written data
+    {
+        const size_t chunk = 1024 * 1024;
+        int out = open(path, O_RDWR | O_TRUNC);
+        verify(out >= 0);
+        verify(ftruncate(out, 4 * chunk) == 0);
+        verify(fileio::pwriteAll(out, data.data(), data.size(), 2 * chunk));
+
+        std::vector<std::pair<uint64_t, uint64_t>> holes;
+        fileio::findHoles(out, 4 * chunk, holes);
+        uint64_t end = 0;
+        for(const auto& hole : holes) {
+            verify(hole.first >= end && hole.second > 0 && hole.first + hole.second <= 4 * chunk);
+            verify(hole.first + hole.second <= 2 * chunk || hole.first >= 2 * chunk + data.size());
+            end = hole.first + hole.second;
+        }
+        close(out);
+    }
+
+    // Negative descriptors are ignored
+    {
+        fileio::DropBehind drop(-1, true);
+        drop.advanceTo(100);
+    }
+
+    unlink(path);
+    return 0;
+}
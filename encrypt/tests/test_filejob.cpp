@@ -0,0 +1,232 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <sodium.h>
+#include "util.hpp"
+#include "blockio.hpp"
+#include "filejob.hpp"
+#include "threadpool.hpp"
+#include "wuffcrypt.hpp"
+
+namespace {
+    typedef WuffCryptFile::FileStatus FileStatus;
+
+    void writeFile(const std::string& path, const std::vector<uint8_t>& data) {
+        FILE* f = fopen(path.c_str(), "wb");
+        verify(f != nullptr);
+        verify(data.empty() || fwrite(data.data(), 1, data.size(), f) == data.size());
+        verify(fclose(f) == 0);
+    }
+
+    bool exists(const std::string& path) {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0;
+    }
+
+    // Decrypt path and compare it with what was encrypted
+    bool decryptsTo(const std::string& path, KeyCache& keys, const std::vector<uint8_t>& plain) {
+        std::vector<uint8_t> out(plain.size() + 1);
+        blockio::SpanSink sink(out.data(), out.size());
+        if(WuffCryptFile(path).decryptTo(sink, keys) != FileStatus::OK) return false;
+        return sink.size() == plain.size() && memcmp(out.data(), plain.data(), plain.size()) == 0;
+    }
+
+    // Encrypt with Options::resume, or Options::append.  With a limit, writes past it fail, as
+    // though the run had been cut short there.
+    FileEncryptJob::Result encrypt(WorkStealingPool& pool, const DerivedKey& key, const std::string& in, const std::string& out,
+                                   rlim_t limit = RLIM_INFINITY, bool append = false) {
+        struct rlimit old;
+        verify(getrlimit(RLIMIT_FSIZE, &old) == 0);
+        struct rlimit capped = old;
+        capped.rlim_cur = limit;
+        verify(setrlimit(RLIMIT_FSIZE, &capped) == 0);
+
+        WuffCryptFile::Options options;
+        options.resume = !append;
+        options.append = append;
+        FileEncryptJob::Result outcome;
+        outcome.status = FileStatus::OpenError;
+        FileEncryptJob::start(pool, key, in, out, options, [&outcome](const FileEncryptJob::Result& result) { outcome = result; });
+        pool.wait();
+
+        verify(setrlimit(RLIMIT_FSIZE, &old) == 0);
+        return outcome;
+    }
+
+    std::vector<uint8_t> noncePrefix(const std::string& path) {
+        std::vector<uint8_t> header(WuffCryptFile::HEADER_SIZE);
+        FILE* f = fopen(path.c_str(), "rb");
+        verify(f != nullptr);
+        verify(fread(header.data(), 1, header.size(), f) == header.size());
+        verify(fclose(f) == 0);
+
+        WuffCryptFile::Header decoded;
+        verify(WuffCryptFile::decodeHeader(header.data(), header.size(), decoded) == FileStatus::OK);
+        return std::vector<uint8_t>(decoded.nonce, decoded.nonce + sizeof(decoded.nonce));
+    }
+}
+
+int main(void) {
+    verify(sodium_init() >= 0);
+
+    // Writes past the file size limit fail with EFBIG rather than killing the process
+    signal(SIGXFSZ, SIG_IGN);
+
+    char password[] = "correct horse";
+    SecureString pw(password);
+    KeyCache keys(pw);
+    const DerivedKey& key = keys.get(WuffCryptFile::WORK_FACTOR);
+
+    char root[] = "/tmp/wuffcrypt-test-filejob-XXXXXX";
+    verify(mkdtemp(root) != nullptr);
+    const std::string dir = root;
+    const std::string in = dir + "/in";
+    const std::string out = dir + "/in.wuff";
+    const std::string checkpoint = out + ".resume";
+
+    std::vector<uint8_t> plain(5 * WuffCryptFile::BLOCK_SIZE + 123);
+    randombytes_buf(plain.data(), plain.size());
+    writeFile(in, plain);
+
+    WorkStealingPool pool(3);
+
+    // A run cut short in block 2 leaves its checkpoint behind, and resuming keeps the two whole
+    // blocks before it
+    const rlim_t cut = 3 * WuffCryptFile::BLOCK_SIZE;
+    verify(encrypt(pool, key, in, out, cut).status == FileStatus::WriteError);
+    verify(exists(checkpoint));
+    const std::vector<uint8_t> prefix = noncePrefix(out);
+
+    FileEncryptJob::Result result = encrypt(pool, key, in, out);
+    verify(result.status == FileStatus::OK);
+    verify(result.keptBlocks == 2);
+    verify(noncePrefix(out) == prefix);
+    verify(!exists(checkpoint));
+    verify(decryptsTo(out, keys, plain));
+
+    // Nothing is left to resume from a complete output
+    result = encrypt(pool, key, in, out);
+    verify(result.status == FileStatus::OK);
+    verify(result.keptBlocks == 0);
+    verify(decryptsTo(out, keys, plain));
+
+    // An input changed in place, to the same size and with its mtime set back before the
+    // output's, is still caught, and the output started over under a new nonce prefix
+    verify(unlink(out.c_str()) == 0);
+    verify(encrypt(pool, key, in, out, cut).status == FileStatus::WriteError);
+    const std::vector<uint8_t> interrupted = noncePrefix(out);
+
+    std::vector<uint8_t> changed = plain;
+    changed[WuffCryptFile::BLOCK_SIZE + 7] ^= 1;
+    writeFile(in, changed);
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = 1000000000;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    verify(utimensat(AT_FDCWD, in.c_str(), times, 0) == 0);
+
+    result = encrypt(pool, key, in, out);
+    verify(result.status == FileStatus::OK);
+    verify(result.keptBlocks == 0);
+    verify(noncePrefix(out) != interrupted);
+    verify(!exists(checkpoint));
+    verify(decryptsTo(out, keys, changed));
+
+    // So is a checkpoint that does not authenticate
+    verify(unlink(out.c_str()) == 0);
+    verify(encrypt(pool, key, in, out, cut).status == FileStatus::WriteError);
+    {
+        FILE* f = fopen(checkpoint.c_str(), "r+b");
+        verify(f != nullptr);
+        verify(fseek(f, 40, SEEK_SET) == 0);
+        const int c = fgetc(f);
+        verify(c != EOF);
+        verify(fseek(f, 40, SEEK_SET) == 0);
+        verify(fputc(c ^ 1, f) != EOF);
+        verify(fclose(f) == 0);
+    }
+    result = encrypt(pool, key, in, out);
+    verify(result.status == FileStatus::OK);
+    verify(result.keptBlocks == 0);
+    verify(decryptsTo(out, keys, changed));
+
+    // A single block is not worth a checkpoint
+    const std::string small = dir + "/small";
+    const std::string smallOut = small + ".wuff";
+    writeFile(small, std::vector<uint8_t>(1000, 7));
+    verify(encrypt(pool, key, small, smallOut, 100).status == FileStatus::WriteError);
+    verify(!exists(smallOut + ".resume"));
+
+    // An append cut short has already overwritten the archive's old end, so the archive does not
+    // decrypt until the next append puts it back and carries on
+    const std::string log = dir + "/log";
+    const std::string logOut = log + ".wuff";
+    const std::string rollback = logOut + ".append";
+    std::vector<uint8_t> grown(7 * WuffCryptFile::BLOCK_SIZE + 99);
+    randombytes_buf(grown.data(), grown.size());
+    const std::vector<uint8_t> start(grown.begin(), grown.begin() + 3 * WuffCryptFile::BLOCK_SIZE + 500);
+    writeFile(log, start);
+    verify(encrypt(pool, key, log, logOut, RLIM_INFINITY, true).status == FileStatus::OK);
+    verify(!exists(rollback));
+
+    writeFile(log, grown);
+    verify(encrypt(pool, key, log, logOut, 5 * WuffCryptFile::BLOCK_SIZE, true).status == FileStatus::WriteError);
+    verify(exists(rollback));
+    verify(!decryptsTo(logOut, keys, start));
+    verify(!decryptsTo(logOut, keys, grown));
+
+    verify(encrypt(pool, key, log, logOut, RLIM_INFINITY, true).status == FileStatus::OK);
+    verify(!exists(rollback));
+    verify(decryptsTo(logOut, keys, grown));
+
+    // An append refused outright leaves the archive as it was
+    writeFile(log, start);
+    verify(encrypt(pool, key, log, logOut, RLIM_INFINITY, true).status == FileStatus::VerificationFailed);
+    verify(!exists(rollback));
+    verify(decryptsTo(logOut, keys, grown));
+
+    // What was saved is only put back onto the archive it came from: encrypting afresh makes
+    // it moot
+    grown.resize(grown.size() + 5000);
+    writeFile(log, grown);
+    verify(encrypt(pool, key, log, logOut, 6 * WuffCryptFile::BLOCK_SIZE, true).status == FileStatus::WriteError);
+    verify(exists(rollback));
+    verify(encrypt(pool, key, log, logOut).status == FileStatus::OK);
+    verify(!exists(rollback));
+    verify(decryptsTo(logOut, keys, grown));
+
+    // A header asking for more work than WORK_FACTOR is refused, not handed to the KDF
+    const std::string hostile = dir + "/hostile.wuff";
+    {
+        std::vector<uint8_t> header(WuffCryptFile::HEADER_SIZE);
+        FILE* f = fopen(out.c_str(), "rb");
+        verify(f != nullptr);
+        verify(fread(header.data(), 1, header.size(), f) == header.size());
+        verify(fclose(f) == 0);
+        header[10] = 0x28;
+        writeFile(hostile, header);
+    }
+    FileVerifyJob::Result verified;
+    verified.status = FileStatus::OK;
+    FileVerifyJob::start(pool, keys, hostile, WuffCryptFile::Options(),
+                         [&verified](const FileVerifyJob::Result& r) { verified = r; });
+    pool.wait();
+    verify(verified.status == FileStatus::CorruptHeader);
+
+    unlink(hostile.c_str());
+    unlink(log.c_str());
+    unlink(logOut.c_str());
+    unlink(in.c_str());
+    unlink(out.c_str());
+    unlink(small.c_str());
+    unlink(smallOut.c_str());
+    verify(rmdir(root) == 0);
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <string.h>
+#include <sodium.h>
+#include <vector>
+#include "util.hpp"
+#include "merkle.hpp"
+
+int main(void) {
+    verify(sodium_init() >= 0);
+
+    // Shape
+    verify(merkle::levels(1) == 1);
+    verify(merkle::levels(2) == 2);
+    verify(merkle::levels(5) == 4);
+    verify(merkle::levelSize(5, 1) == 3);
+    verify(merkle::levelSize(5, 2) == 2);
+    verify(merkle::indexSize(1) == merkle::NODE_BYTES);
+    verify(merkle::indexSize(5) == (5 + 3 + 2 + 1) * merkle::NODE_BYTES);
+    verify(merkle::nodeOffset(5, 2, 1) == (5 + 3 + 1) * merkle::NODE_BYTES);
+
+    // Three leaves: the last is promoted past the first level
+    {
+        std::vector<uint8_t> tags(3 * merkle::TAG_BYTES);
+        for(size_t i = 0; i < tags.size(); i += 1) {
+            tags[i] = static_cast<uint8_t>(i);
+        }
+
+        uint8_t leaves[3][merkle::NODE_BYTES];
+        for(int i = 0; i < 3; i += 1) {
+            merkle::leaf(&tags[i * merkle::TAG_BYTES], leaves[i]);
+        }
+
+        uint8_t left[merkle::NODE_BYTES];
+        uint8_t root[merkle::NODE_BYTES];
+        merkle::parent(leaves[0], leaves[1], left);
+        merkle::parent(left, leaves[2], root);
+
+        std::vector<uint8_t> index;
+        merkle::build(tags, index);
+        verify(index.size() == merkle::indexSize(3));
+        verify(memcmp(&index[index.size() - merkle::NODE_BYTES], root, merkle::NODE_BYTES) == 0);
+        verify(memcmp(&index[merkle::nodeOffset(3, 1, 1)], leaves[2], merkle::NODE_BYTES) == 0);
+
+        // The same index can be completed from its leaves alone
+        std::vector<uint8_t> fromLeaves(merkle::indexSize(3));
+        memcpy(fromLeaves.data(), leaves, sizeof(leaves));
+        merkle::complete(fromLeaves, 3);
+        verify(fromLeaves == index);
+    }
+
+    // Climbing from any run of leaves reaches the root, reading only a few nodes
+    for(uint64_t n = 1; n <= 19; n += 1) {
+        std::vector<uint8_t> tags(n * merkle::TAG_BYTES);
+        randombytes_buf(tags.data(), tags.size());
+
+        std::vector<uint8_t> index;
+        merkle::build(tags, index);
+        const uint8_t* root = &index[index.size() - merkle::NODE_BYTES];
+
+        for(uint64_t first = 0; first < n; first += 1) {
+            for(uint64_t last = first; last < n; last += 1) {
+                std::vector<uint8_t> run(index.begin() + first * merkle::NODE_BYTES,
+                                         index.begin() + (last + 1) * merkle::NODE_BYTES);
+
+                int reads = 0;
+                auto reader = [&](unsigned level, uint64_t i, uint8_t* out) {
+                    verify(i < merkle::levelSize(n, level));
+                    memcpy(out, &index[merkle::nodeOffset(n, level, i)], merkle::NODE_BYTES);
+                    reads += 1;
+                    return true;
+                };
+
+                uint8_t climbed[merkle::NODE_BYTES];
+                verify(merkle::climb(n, first, run, reader, climbed));
+                verify(memcmp(climbed, root, merkle::NODE_BYTES) == 0);
+                verify(reads <= 2 * static_cast<int>(merkle::levels(n)));
+
+                // A changed leaf changes the root
+                run[0] ^= 1;
+                verify(merkle::climb(n, first, run, reader, climbed));
+                verify(memcmp(climbed, root, merkle::NODE_BYTES) != 0);
+            }
+        }
+    }
+
+    return 0;
+}
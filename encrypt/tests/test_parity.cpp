@@ -0,0 +1,90 @@
+#include <string.h>
+#include <sodium.h>
+#include <vector>
+#include "util.hpp"
+#include "parity.hpp"
+
+int main(void) {
+    verify(sodium_init() >= 0);
+
+    // Field arithmetic
+    verify(parity::mul(0, 7) == 0);
+    verify(parity::mul(1, 7) == 7);
+    verify(parity::mul(2, 0x80) == 0x1d);
+    for(unsigned a = 1; a < 256; a += 1) {
+        verify(parity::mul(static_cast<uint8_t>(a), parity::inverse(static_cast<uint8_t>(a))) == 1);
+    }
+
+    // The vector kernels agree with byte-at-a-time multiplication, at any length and alignment
+    {
+        std::vector<uint8_t> src(300);
+        randombytes_buf(src.data(), src.size());
+        for(unsigned c : {0u, 1u, 2u, 0x53u, 0xffu}) {
+            for(size_t start = 0; start < 3; start += 1) {
+                for(size_t len : {0, 1, 15, 16, 17, 31, 32, 33, 64, 100, 297}) {
+                    std::vector<uint8_t> dst(src.size(), 0x5a);
+                    parity::mulAdd(dst.data() + start, src.data() + start, static_cast<uint8_t>(c), len);
+                    for(size_t i = 0; i < dst.size(); i += 1) {
+                        const bool inside = i >= start && i < start + len;
+                        const uint8_t expected = inside? 0x5a ^ parity::mul(static_cast<uint8_t>(c), src[i]) : 0x5a;
+                        verify(dst[i] == expected);
+                    }
+                }
+            }
+        }
+    }
+
+    // Any k of the k + m shards bring back the rest
+    {
+        const unsigned k = 5;
+        const unsigned m = 3;
+        const size_t len = 1000;
+        std::vector<std::vector<uint8_t>> shards(k + m, std::vector<uint8_t>(len));
+        const uint8_t* data[k];
+        uint8_t* parityShards[m];
+        for(unsigned j = 0; j < k; j += 1) {
+            randombytes_buf(shards[j].data(), len);
+            data[j] = shards[j].data();
+        }
+        for(unsigned i = 0; i < m; i += 1) {
+            parityShards[i] = shards[k + i].data();
+        }
+        parity::encode(k, m, data, parityShards, len);
+
+        // Every choice of k survivors out of the eight
+        for(unsigned mask = 0; mask < (1u << (k + m)); mask += 1) {
+            if(__builtin_popcount(mask) != static_cast<int>(k)) continue;
+
+            std::vector<unsigned> present;
+            std::vector<const uint8_t*> survivors;
+            std::vector<unsigned> lost;
+            for(unsigned s = 0; s < k + m; s += 1) {
+                if(mask & (1u << s)) {
+                    present.push_back(s);
+                    survivors.push_back(shards[s].data());
+                }
+                else if(s < k) {
+                    lost.push_back(s);
+                }
+            }
+
+            std::vector<std::vector<uint8_t>> rebuilt(lost.size(), std::vector<uint8_t>(len));
+            std::vector<uint8_t*> out;
+            for(auto& shard : rebuilt) out.push_back(shard.data());
+
+            verify(parity::reconstruct(k, present, survivors.data(), lost, out.data(), len));
+            for(size_t l = 0; l < lost.size(); l += 1) {
+                verify(rebuilt[l] == shards[lost[l]]);
+            }
+        }
+
+        // The same shard twice is not k shards
+        std::vector<unsigned> present = {0, 0, 1, 2, 3};
+        std::vector<const uint8_t*> survivors(k, shards[0].data());
+        std::vector<unsigned> lost = {4};
+        uint8_t* out[1] = {shards[k].data()};
+        verify(!parity::reconstruct(k, present, survivors.data(), lost, out, len));
+    }
+
+    return 0;
+}
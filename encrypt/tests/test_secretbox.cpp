@@ -0,0 +1,90 @@
+#include <string.h>
+#include <sodium.h>
+#include <vector>
+#include "util.hpp"
+#include "secretbox.hpp"
+
+namespace {
+    // Seal, open and authenticate len bytes at offset start, against libsodium
+    void check(size_t start, size_t len) {
+        uint8_t key[secretbox::KEY_BYTES];
+        uint8_t nonce[secretbox::NONCE_BYTES];
+        randombytes_buf(key, sizeof(key));
+        randombytes_buf(nonce, sizeof(nonce));
+
+        // A byte to spare, so that not even an empty message has a null data()
+        std::vector<uint8_t> msg(start + len + 1);
+        randombytes_buf(msg.data(), msg.size());
+
+        std::vector<uint8_t> expected(start + len + 1);
+        uint8_t expectedMac[secretbox::MAC_BYTES];
+        verify(crypto_secretbox_detached(expected.data() + start, expectedMac, msg.data() + start, len, nonce, key) == 0);
+
+        std::vector<uint8_t> ctext(start + len + 1);
+        uint8_t mac[secretbox::MAC_BYTES];
+        secretbox::seal(ctext.data() + start, mac, msg.data() + start, len, nonce, key);
+        verify(memcmp(mac, expectedMac, sizeof(mac)) == 0);
+        verify(memcmp(ctext.data() + start, expected.data() + start, len) == 0);
+
+        // In place
+        std::vector<uint8_t> inPlace(msg);
+        secretbox::seal(inPlace.data() + start, mac, inPlace.data() + start, len, nonce, key);
+        verify(memcmp(mac, expectedMac, sizeof(mac)) == 0);
+        verify(memcmp(inPlace.data() + start, expected.data() + start, len) == 0);
+
+        verify(secretbox::authenticate(ctext.data() + start, mac, len, nonce, key) == 0);
+
+        std::vector<uint8_t> plain(start + len + 1);
+        verify(secretbox::open(plain.data() + start, ctext.data() + start, mac, len, nonce, key) == 0);
+        verify(memcmp(plain.data() + start, msg.data() + start, len) == 0);
+        verify(secretbox::open(inPlace.data() + start, inPlace.data() + start, mac, len, nonce, key) == 0);
+        verify(memcmp(inPlace.data() + start, msg.data() + start, len) == 0);
+
+        // Any damage is caught, and leaves the output alone
+        const size_t positions[] = {0, len / 2, len - 1};
+        for(size_t at : positions) {
+            if(len == 0) break;
+
+            ctext[start + at] ^= 0x40;
+            std::vector<uint8_t> untouched(start + len + 1, 0x5a);
+            verify(secretbox::authenticate(ctext.data() + start, mac, len, nonce, key) != 0);
+            verify(secretbox::open(untouched.data() + start, ctext.data() + start, mac, len, nonce, key) != 0);
+            verify(untouched == std::vector<uint8_t>(start + len + 1, 0x5a));
+            ctext[start + at] ^= 0x40;
+        }
+
+        mac[3] ^= 1;
+        verify(secretbox::authenticate(ctext.data() + start, mac, len, nonce, key) != 0);
+        verify(secretbox::open(plain.data() + start, ctext.data() + start, mac, len, nonce, key) != 0);
+    }
+}
+
+int main(void) {
+    verify(sodium_init() >= 0);
+
+    // There is always the fallback, and the default is the best there is
+    const std::vector<const char*> kernels = secretbox::kernels();
+    verify(!kernels.empty());
+    verify(strcmp(kernels.back(), "none") == 0);
+    verify(strcmp(secretbox::kernel(), kernels.front()) == 0);
+    verify(!secretbox::useKernel("mmx"));
+
+    // Every kernel this processor has gives libsodium's output, at lengths either side of each
+    // kernel's step, the chunk size and the cut-over from libsodium
+    const size_t lens[] = {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 1023, 1024, 1025, 1055, 1056, 1057,
+                           1567, 2080, 4095, 4096, 4097, 4128, 4129, 8224, 9000, 65536 + 7, 1024 * 1024};
+    for(const char* name : kernels) {
+        verify(secretbox::useKernel(name));
+        verify(strcmp(secretbox::kernel(), name) == 0);
+        for(size_t start = 0; start < 3; start += 1) {
+            for(size_t len : lens) {
+                check(start, len);
+            }
+        }
+        for(size_t len = 1024; len < 1024 + 300; len += 1) {
+            check(0, len);
+        }
+    }
+
+    return 0;
+}
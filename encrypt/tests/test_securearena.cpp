@@ -0,0 +1,163 @@
+#include <string.h>
+#include <sodium.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <vector>
+#include "util.hpp"
+#include "securearena.hpp"
+#include "paddedbuffer.hpp"
+
+int main(void) {
+    verify(sodium_init() >= 0);
+
+    {
+        SecureArena arena(100, 3);
+        verify(arena.slots() == 3);
+        verify(arena.slotSize() >= 100);
+
+        verify(arena.acquire(arena.slotSize() + 1) == nullptr);
+
+        uint8_t* a = arena.acquire(100);
+        uint8_t* b = arena.acquire(100);
+        uint8_t* c = arena.acquire(1);
+        verify(a != nullptr && b != nullptr && c != nullptr);
+        verify(a != b && b != c && a != c);
+        verify(arena.owns(a) && arena.owns(c));
+        verify(arena.acquire(1) == nullptr);
+
+        // Released buffers are wiped, and handed out again
+        memset(b, 0xAA, 100);
+        arena.release(b);
+        uint8_t* d = arena.acquire(100);
+        verify(d == b);
+        for(size_t i = 0; i < arena.slotSize(); i += 1) {
+            verify(d[i] == 0);
+        }
+
+        uint8_t heap[1];
+        verify(!arena.owns(heap));
+
+        arena.release(a);
+        arena.release(c);
+        arena.release(d);
+    }
+
+    // Many threads churning through a few slots never share one
+    {
+        SecureArena arena(64, 4);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < 8; t += 1) {
+            threads.emplace_back([&arena, t]() {
+                for(int i = 0; i < 20000; i += 1) {
+                    uint8_t* buf = arena.acquire(64);
+                    if(buf == nullptr) continue;
+
+                    memset(buf, t + 1, 64);
+                    for(int j = 0; j < 64; j += 1) {
+                        verify(buf[j] == t + 1);
+                    }
+                    arena.release(buf);
+                }
+            });
+        }
+
+        for(std::thread& thread : threads) {
+            thread.join();
+        }
+
+        std::vector<uint8_t*> all;
+        for(int i = 0; i < 4; i += 1) {
+            all.push_back(arena.acquire(64));
+            verify(all.back() != nullptr);
+        }
+        verify(arena.acquire(64) == nullptr);
+
+        for(uint8_t* buf : all) {
+            arena.release(buf);
+        }
+    }
+
+    // Waiting for a slot blocks until another thread releases one
+    {
+        SecureArena arena(64, 2);
+        uint8_t* a = arena.acquire(64);
+        uint8_t* b = arena.acquire(64);
+        verify(arena.peakInUse() == 2);
+        verify(arena.acquireWait(arena.slotSize() + 1) == nullptr);
+
+        std::atomic<bool> released(false);
+        std::thread releaser([&arena, &released, a]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            released = true;
+            arena.release(a);
+        });
+
+        uint8_t* c = arena.acquireWait(64);
+        verify(released);
+        verify(c == a);
+        releaser.join();
+
+        // Many more threads than slots all get their turn
+        arena.release(b);
+        arena.release(c);
+        std::vector<std::thread> threads;
+        std::atomic<int> done(0);
+        for(int t = 0; t < 8; t += 1) {
+            threads.emplace_back([&arena, &done]() {
+                for(int i = 0; i < 1000; i += 1) {
+                    uint8_t* buf = arena.acquireWait(64);
+                    verify(buf != nullptr);
+                    arena.release(buf);
+                }
+                done += 1;
+            });
+        }
+
+        for(std::thread& thread : threads) {
+            thread.join();
+        }
+        verify(done == 8);
+        verify(arena.peakInUse() == 2);
+    }
+
+    // A region that cannot be mapped is reported, rather than ending the process
+    {
+        const size_t slotSize = static_cast<size_t>(1) << 40;
+        const size_t slots = 1 << 20;
+
+        bool threw = false;
+        try {
+            SecureArena arena(slotSize, slots);
+        }
+        catch(const std::bad_alloc&) {
+            threw = true;
+        }
+        verify(threw);
+
+        SecureArena empty(slotSize, slots, std::nothrow);
+        verify(empty.slots() == 0);
+        verify(empty.acquire(1) == nullptr);
+        verify(empty.acquireWait(1) == nullptr);
+
+        uint8_t heap[1];
+        verify(!empty.owns(heap));
+    }
+
+    // Block buffers come from the shared arena when they fit, and the heap when they do not
+    {
+        SecureArena::reserveBlocks(2);
+        PaddedBuffer<16, 0> a(1024);
+        PaddedBuffer<16, 0> b(1024);
+        PaddedBuffer<16, 0> c(1024);
+        verify(SecureArena::blocks().owns(a.rawData()));
+        verify(SecureArena::blocks().owns(b.rawData()));
+        verify(!SecureArena::blocks().owns(c.rawData()));
+
+        PaddedBuffer<16, 0> huge(SecureArena::BLOCK_SLOT_SIZE * 2);
+        verify(!SecureArena::blocks().owns(huge.rawData()));
+    }
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "util.hpp"
+#include "stats.hpp"
+
+int main(void) {
+    {
+        // Without an active instance the timers record nothing, and do not crash
+        verify(Stats::active() == nullptr);
+        StageTimer timer(Stats::Stage::Crypto);
+        BlockTimer block;
+        block.done(100);
+    }
+
+    {
+        Stats stats;
+        Stats::activate(&stats);
+
+        std::vector<std::thread> threads;
+        for(int i = 0; i < 4; i += 1) {
+            threads.emplace_back([]() {
+                for(int j = 0; j < 25; j += 1) {
+                    BlockTimer block;
+                    StageTimer timer(Stats::Stage::Read);
+                    block.done(1000);
+                }
+            });
+        }
+
+        for(std::thread& thread : threads) {
+            thread.join();
+        }
+
+        Stats::activate(nullptr);
+
+        char out[1024] = {0};
+        FILE* f = fmemopen(out, sizeof(out) - 1, "w");
+        verify(f != nullptr);
+        stats.write(f, "test", 4);
+        fclose(f);
+
+        verify(strncmp(out, "{\"operation\": \"test\", \"threads\": 4,", 35) == 0);
+        verify(strstr(out, "\"bytes\": 100000,") != nullptr);
+        verify(strstr(out, "\"blocks\": 100,") != nullptr);
+        verify(out[strlen(out) - 2] == '}' && out[strlen(out) - 1] == '\n');
+    }
+
+    return 0;
+}
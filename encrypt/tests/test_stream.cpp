@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include <sodium.h>
+#include "util.hpp"
+#include "blockio.hpp"
+#include "filejob.hpp"
+#include "stream.hpp"
+#include "threadpool.hpp"
+#include "wuffcrypt.h"
+#include "wuffcrypt.hpp"
+
+namespace {
+    const size_t BLOCK_SIZE = WuffCryptFile::BLOCK_SIZE;
+    typedef WuffCryptFile::FileStatus FileStatus;
+
+    // Feed a stream pieces of the given sizes in turn
+    std::vector<uint8_t> encryptInPieces(const DerivedKey& key, const std::vector<uint8_t>& plain, const std::vector<size_t>& pieces,
+                                         const WuffCryptFile::Options& options = WuffCryptFile::Options()) {
+        StreamEncrypter stream(key, options);
+        std::vector<uint8_t> out;
+        for(size_t i = 0, p = 0; i < plain.size(); p += 1) {
+            const size_t len = std::min(pieces[p % pieces.size()], plain.size() - i);
+            std::vector<uint8_t> buf(stream.updateSize(len));
+            verify(stream.update(plain.data() + i, len, buf.data()) == buf.size());
+            out.insert(out.end(), buf.begin(), buf.end());
+            i += len;
+        }
+
+        std::vector<uint8_t> buf(stream.finalSize());
+        verify(stream.final(buf.data()) == buf.size());
+        out.insert(out.end(), buf.begin(), buf.end());
+        return out;
+    }
+
+    FileStatus decryptInPieces(KeyCache& keys, const std::vector<uint8_t>& ctext, const std::vector<size_t>& pieces, std::vector<uint8_t>& plain,
+                               const WuffCryptFile::Options& options = WuffCryptFile::Options(), PlaintextDigest* digest = nullptr,
+                               WorkStealingPool* pool = nullptr) {
+        StreamDecrypter stream(keys, options);
+        stream.setPool(pool);
+        plain.clear();
+        for(size_t i = 0, p = 0; i < ctext.size(); p += 1) {
+            const size_t len = std::min(pieces[p % pieces.size()], ctext.size() - i);
+            std::vector<uint8_t> buf(stream.updateSize(len));
+            size_t written = 0;
+            FileStatus status = stream.update(ctext.data() + i, len, buf.data(), written);
+            if(status != FileStatus::OK) return status;
+
+            verify(written <= buf.size());
+            plain.insert(plain.end(), buf.begin(), buf.begin() + written);
+            i += len;
+        }
+
+        std::vector<uint8_t> buf(stream.finalSize());
+        size_t written = 0;
+        FileStatus status = stream.final(buf.data(), written);
+        verify(written <= buf.size());
+        plain.insert(plain.end(), buf.begin(), buf.begin() + written);
+        if(digest != nullptr) *digest = stream.digest();
+        return status;
+    }
+
+    void writeFile(const char* path, const std::vector<uint8_t>& data) {
+        FILE* f = fopen(path, "wb");
+        verify(f != nullptr);
+        verify(data.empty() || fwrite(data.data(), 1, data.size(), f) == data.size());
+        verify(fclose(f) == 0);
+    }
+
+    std::vector<uint8_t> readFile(const char* path) {
+        FILE* f = fopen(path, "rb");
+        verify(f != nullptr);
+        std::vector<uint8_t> data;
+        uint8_t buf[65536];
+        size_t got = 0;
+        while((got = fread(buf, 1, sizeof(buf), f)) > 0) {
+            data.insert(data.end(), buf, buf + got);
+        }
+        fclose(f);
+        return data;
+    }
+}
+
+int main(void) {
+    verify(wuffcrypt_init() == 0);
+    verify(wuffcrypt_api_version() == WUFFCRYPT_API_VERSION);
+
+    char password[] = "correct horse";
+    SecureString pw(password);
+    KeyCache keys(pw);
+    const DerivedKey& key = keys.get(WuffCryptFile::WORK_FACTOR);
+
+    char path[] = "/tmp/wuffcrypt-test-stream-XXXXXX";
+    int fd = mkstemp(path);
+    verify(fd >= 0);
+    close(fd);
+
+    // Streams write what files hold, and read it back, however the input is cut up
+    for(size_t size : {static_cast<size_t>(0), static_cast<size_t>(1), BLOCK_SIZE - 1, BLOCK_SIZE, BLOCK_SIZE + 1, 3 * BLOCK_SIZE + 5}) {
+        std::vector<uint8_t> plain(size);
+        randombytes_buf(plain.data(), plain.size());
+
+        std::vector<uint8_t> ctext = encryptInPieces(key, plain, {1, 4096, BLOCK_SIZE + 7, 3});
+        verify(ctext.size() == StreamEncrypter::encryptedSize(size));
+        verify(ctext.size() == wuffcrypt_encrypted_size(size, 0));
+
+        writeFile(path, ctext);
+        std::vector<uint8_t> fromFile(size + 1);
+        blockio::SpanSink sink(fromFile.data(), fromFile.size());
+        verify(WuffCryptFile(path).decryptTo(sink, keys) == FileStatus::OK);
+        verify(sink.size() == size);
+        verify(std::equal(plain.begin(), plain.end(), fromFile.begin()));
+
+        std::vector<uint8_t> decrypted;
+        verify(decryptInPieces(keys, ctext, {5, 2 * BLOCK_SIZE + 1, 100}, decrypted) == FileStatus::OK);
+        verify(decrypted == plain);
+        verify(decryptInPieces(keys, ctext, {ctext.size() + 1}, decrypted) == FileStatus::OK);
+        verify(decrypted == plain);
+    }
+
+    // Files with holes and a stored digest, written the usual way
+    {
+        std::vector<uint8_t> plain(5 * BLOCK_SIZE + 10);
+        randombytes_buf(plain.data(), plain.size());
+        memset(plain.data(), 0, BLOCK_SIZE);
+        memset(plain.data() + 2 * BLOCK_SIZE, 0, 2 * BLOCK_SIZE);
+
+        WuffCryptFile::Options options;
+        options.sparse = true;
+        options.storeDigest = true;
+        options.digest = true;
+        WuffCryptFile file(path);
+        blockio::MemorySource source(plain.data(), plain.size());
+        verify(file.encryptFrom(source, pw, options) == FileStatus::OK);
+
+        std::vector<uint8_t> ctext = readFile(path);
+        std::vector<uint8_t> decrypted;
+        PlaintextDigest digest;
+        WuffCryptFile::Options digesting;
+        digesting.digest = true;
+        verify(decryptInPieces(keys, ctext, {BLOCK_SIZE / 3}, decrypted, digesting, &digest) == FileStatus::OK);
+        verify(decrypted == plain);
+        verify(digest.hex() == file.digest().hex());
+
+        // A stored block replaced with zeros is not a hole
+        std::vector<uint8_t> zeroed = ctext;
+        memset(&zeroed[WuffCryptFile::blockOffset(1)], 0, WuffCryptFile::ENCRYPTED_BLOCK_SIZE);
+        verify(decryptInPieces(keys, zeroed, {BLOCK_SIZE}, decrypted) == FileStatus::VerificationFailed);
+
+        // Decrypted across a pool, a run of blocks at a time, the holes and digest come out the same
+        WorkStealingPool pool(3);
+        for(size_t piece : {ctext.size(), 3 * WuffCryptFile::ENCRYPTED_BLOCK_SIZE + 1, BLOCK_SIZE / 3}) {
+            verify(decryptInPieces(keys, ctext, {piece}, decrypted, digesting, &digest, &pool) == FileStatus::OK);
+            verify(decrypted == plain);
+            verify(digest.hex() == file.digest().hex());
+            verify(decryptInPieces(keys, zeroed, {piece}, decrypted, digesting, nullptr, &pool) == FileStatus::VerificationFailed);
+        }
+
+        // A damaged block in the middle of a run stops it there
+        std::vector<uint8_t> damaged = ctext;
+        damaged[WuffCryptFile::blockOffset(4) + 7] ^= 1;
+        verify(decryptInPieces(keys, damaged, {ctext.size()}, decrypted, digesting, nullptr, &pool) == FileStatus::VerificationFailed);
+    }
+
+    // Damage anywhere is caught
+    {
+        std::vector<uint8_t> plain(3 * BLOCK_SIZE + 5);
+        randombytes_buf(plain.data(), plain.size());
+        const std::vector<uint8_t> ctext = encryptInPieces(key, plain, {BLOCK_SIZE});
+        std::vector<uint8_t> decrypted;
+
+        for(size_t offset : {WuffCryptFile::blockOffset(1) + 100, WuffCryptFile::blockOffset(3) + 2, ctext.size() - 20}) {
+            std::vector<uint8_t> damaged = ctext;
+            damaged[offset] ^= 1;
+            verify(decryptInPieces(keys, damaged, {4096}, decrypted) != FileStatus::OK);
+        }
+
+        std::vector<uint8_t> truncated(ctext.begin(), ctext.end() - 1);
+        verify(decryptInPieces(keys, truncated, {4096}, decrypted) != FileStatus::OK);
+
+        std::vector<uint8_t> missing(ctext.begin(), ctext.begin() + WuffCryptFile::blockOffset(1));
+        missing.insert(missing.end(), ctext.begin() + WuffCryptFile::blockOffset(2), ctext.end());
+        verify(decryptInPieces(keys, missing, {4096}, decrypted) != FileStatus::OK);
+
+        std::vector<uint8_t> header(ctext.begin(), ctext.begin() + 20);
+        verify(decryptInPieces(keys, header, {4096}, decrypted) == FileStatus::Truncated);
+        verify(decryptInPieces(keys, plain, {4096}, decrypted) == FileStatus::InvalidFileType);
+    }
+
+    // What follows a damaged block is not held on to: the stream fails as soon as there is more
+    // of it than the final block, Merkle index and trailer could take
+    {
+        std::vector<uint8_t> plain(12 * BLOCK_SIZE + 5);
+        randombytes_buf(plain.data(), plain.size());
+        std::vector<uint8_t> damaged = encryptInPieces(key, plain, {BLOCK_SIZE});
+        damaged[WuffCryptFile::blockOffset(1) + 100] ^= 1;
+
+        StreamDecrypter stream(keys);
+        std::vector<uint8_t> buf(BLOCK_SIZE);
+        FileStatus status = FileStatus::OK;
+        size_t i = 0;
+        while(status == FileStatus::OK && i < damaged.size()) {
+            const size_t len = std::min(static_cast<size_t>(65536), damaged.size() - i);
+            size_t written = 0;
+            status = stream.update(damaged.data() + i, len, buf.data(), written);
+            i += len;
+        }
+        verify(status == FileStatus::VerificationFailed);
+        verify(i < WuffCryptFile::blockOffset(4));
+    }
+
+    // Format 4 parity is read past, however long it is, and does not count as damage
+    {
+        std::vector<uint8_t> plain(7 * BLOCK_SIZE + 10);
+        randombytes_buf(plain.data(), plain.size());
+        char plainPath[] = "/tmp/wuffcrypt-test-stream-plain-XXXXXX";
+        fd = mkstemp(plainPath);
+        verify(fd >= 0);
+        close(fd);
+        writeFile(plainPath, plain);
+
+        WuffCryptFile::Options options;
+        options.dataShards = 2;
+        options.parityShards = 3;
+        WorkStealingPool pool(3);
+        FileStatus status = FileStatus::WriteError;
+        FileEncryptJob::start(pool, key, plainPath, path, options, [&status](const FileEncryptJob::Result& result) { status = result.status; });
+        pool.wait();
+        verify(status == FileStatus::OK);
+        unlink(plainPath);
+
+        std::vector<uint8_t> ctext = readFile(path);
+        WuffCryptFile::Header header;
+        verify(WuffCryptFile::decodeHeader(ctext.data(), ctext.size(), header) == FileStatus::OK);
+        verify(header.version == WuffCryptFile::PARITY_VERSION);
+        verify(ctext.size() > 2 * plain.size());
+
+        std::vector<uint8_t> decrypted;
+        for(size_t piece : {static_cast<size_t>(4096), BLOCK_SIZE + 3, ctext.size()}) {
+            verify(decryptInPieces(keys, ctext, {piece}, decrypted) == FileStatus::OK);
+            verify(decrypted == plain);
+            verify(decryptInPieces(keys, ctext, {piece}, decrypted, WuffCryptFile::Options(), nullptr, &pool) == FileStatus::OK);
+            verify(decrypted == plain);
+        }
+
+        // Damage to the trailer is still caught, with the parity in front of it dropped
+        std::vector<uint8_t> damaged = ctext;
+        damaged[damaged.size() - 30] ^= 1;
+        verify(decryptInPieces(keys, damaged, {4096}, decrypted) == FileStatus::VerificationFailed);
+    }
+
+    // The C interface
+    {
+        wuffcrypt_key* ckey = wuffcrypt_key_new("correct horse", 13);
+        verify(ckey != nullptr);
+
+        std::vector<uint8_t> plain(2 * BLOCK_SIZE + 77);
+        randombytes_buf(plain.data(), plain.size());
+
+        const int flags = WUFFCRYPT_DIGEST | WUFFCRYPT_STORE_DIGEST;
+        std::vector<uint8_t> ctext(wuffcrypt_encrypted_size(plain.size(), flags));
+        size_t written = 0;
+        verify(wuffcrypt_encrypt_buffer(ckey, flags, plain.data(), plain.size(), ctext.data(), ctext.size() - 1, &written) == WUFFCRYPT_BUFFER_TOO_SMALL);
+        verify(wuffcrypt_encrypt_buffer(ckey, flags, plain.data(), plain.size(), ctext.data(), ctext.size(), &written) == WUFFCRYPT_OK);
+        verify(written == ctext.size());
+
+        // Readable by the rest of WuffCrypt
+        std::vector<uint8_t> decrypted;
+        verify(decryptInPieces(keys, ctext, {12345}, decrypted) == FileStatus::OK);
+        verify(decrypted == plain);
+
+        std::vector<uint8_t> out(ctext.size());
+        verify(wuffcrypt_decrypt_buffer(ckey, ctext.data(), ctext.size(), out.data(), out.size(), &written) == WUFFCRYPT_OK);
+        verify(written == plain.size());
+        verify(memcmp(out.data(), plain.data(), plain.size()) == 0);
+
+        // Streams, with the digest checked against the one stored
+        wuffcrypt_encrypt_stream* enc = wuffcrypt_encrypt_new(ckey, flags);
+        verify(enc != nullptr);
+        std::vector<uint8_t> streamed;
+        for(size_t i = 0; i < plain.size(); i += 1000) {
+            const size_t len = std::min(static_cast<size_t>(1000), plain.size() - i);
+            std::vector<uint8_t> buf(wuffcrypt_encrypt_update_size(enc, len));
+            verify(wuffcrypt_encrypt_update(enc, plain.data() + i, len, buf.data(), buf.size(), &written) == WUFFCRYPT_OK);
+            streamed.insert(streamed.end(), buf.begin(), buf.begin() + written);
+        }
+        std::vector<uint8_t> buf(wuffcrypt_encrypt_final_size(enc));
+        verify(wuffcrypt_encrypt_final(enc, buf.data(), buf.size(), &written) == WUFFCRYPT_OK);
+        streamed.insert(streamed.end(), buf.begin(), buf.begin() + written);
+        verify(wuffcrypt_encrypt_final(enc, buf.data(), buf.size(), &written) == WUFFCRYPT_MISUSE);
+        verify(wuffcrypt_encrypt_update(enc, plain.data(), 1, buf.data(), buf.size(), &written) == WUFFCRYPT_MISUSE);
+
+        uint8_t encDigest[WUFFCRYPT_DIGEST_BYTES];
+        uint8_t decDigest[WUFFCRYPT_DIGEST_BYTES];
+        verify(wuffcrypt_encrypt_digest(enc, encDigest) == WUFFCRYPT_OK);
+        wuffcrypt_encrypt_free(enc);
+
+        wuffcrypt_decrypt_stream* dec = wuffcrypt_decrypt_new(ckey, WUFFCRYPT_DIGEST);
+        verify(dec != nullptr);
+        verify(wuffcrypt_decrypt_digest(dec, decDigest) == WUFFCRYPT_MISUSE);
+        decrypted.clear();
+        for(size_t i = 0; i < streamed.size(); i += 300000) {
+            const size_t len = std::min(static_cast<size_t>(300000), streamed.size() - i);
+            std::vector<uint8_t> piece(wuffcrypt_decrypt_update_size(dec, len));
+            verify(wuffcrypt_decrypt_update(dec, streamed.data() + i, len, piece.data(), piece.size(), &written) == WUFFCRYPT_OK);
+            decrypted.insert(decrypted.end(), piece.begin(), piece.begin() + written);
+        }
+        buf.assign(wuffcrypt_decrypt_final_size(dec), 0);
+        verify(wuffcrypt_decrypt_final(dec, buf.data(), buf.size(), &written) == WUFFCRYPT_OK);
+        decrypted.insert(decrypted.end(), buf.begin(), buf.begin() + written);
+        verify(decrypted == plain);
+        verify(wuffcrypt_decrypt_digest(dec, decDigest) == WUFFCRYPT_OK);
+        verify(memcmp(encDigest, decDigest, sizeof(encDigest)) == 0);
+        wuffcrypt_decrypt_free(dec);
+
+        // The wrong password leaves nothing behind
+        wuffcrypt_key* wrong = wuffcrypt_key_new("battery staple", 14);
+        verify(wrong != nullptr);
+        verify(wuffcrypt_decrypt_buffer(wrong, ctext.data(), ctext.size(), out.data(), out.size(), &written) == WUFFCRYPT_VERIFICATION_FAILED);
+        verify(written == 0);
+        verify(std::all_of(out.begin(), out.end(), [](uint8_t b) { return b == 0; }));
+        verify(strcmp(wuffcrypt_status_string(WUFFCRYPT_VERIFICATION_FAILED), "verification failed") == 0);
+
+        wuffcrypt_key_free(wrong);
+        wuffcrypt_key_free(ckey);
+    }
+
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "util.hpp"
+#include "threadpool.hpp"
+
+int main(void) {
+    {
+        WorkStealingPool pool(4);
+        verify(pool.size() == 4);
+
+        std::atomic<int> count(0);
+        for(int i = 0; i < 1000; i += 1) {
+            pool.submit([&count]() { count += 1; });
+        }
+
+        pool.wait();
+        verify(count == 1000);
+    }
+
+    {
+        // Tasks that fan out into further tasks are all waited on
+        WorkStealingPool pool(3);
+        std::atomic<int> count(0);
+
+        for(int i = 0; i < 10; i += 1) {
+            pool.submit([&pool, &count]() {
+                for(int j = 0; j < 100; j += 1) {
+                    pool.submit([&count]() { count += 1; });
+                }
+            });
+        }
+
+        pool.wait();
+        verify(count == 1000);
+
+        // The pool is reusable after a wait
+        pool.submit([&count]() { count += 1; });
+        pool.wait();
+        verify(count == 1001);
+    }
+
+    {
+        WorkStealingPool pool(0);
+        verify(pool.size() == 1);
+    }
+
+    {
+        // Each strand runs its tasks one at a time and in order, while strands run side by side
+        WorkStealingPool pool(4);
+        std::vector<std::shared_ptr<Strand>> strands;
+        std::vector<std::vector<int>> seen(50);
+        std::atomic<int> inside(0);
+        std::atomic<bool> overlapped(false);
+        for(size_t s = 0; s < seen.size(); s += 1) {
+            strands.push_back(std::make_shared<Strand>(pool));
+        }
+
+        for(int i = 0; i < 200; i += 1) {
+            for(size_t s = 0; s < seen.size(); s += 1) {
+                std::vector<int>& mine = seen[s];
+                Strand& strand = *strands[s];
+                strand.post([&mine, &strand, i]() {
+                    mine.push_back(i);
+
+                    // Tasks posted from inside a task still wait their turn
+                    if(i == 0) strand.post([&mine]() { mine.push_back(-1); });
+                });
+            }
+        }
+
+        // A single strand never runs two tasks at once
+        for(int i = 0; i < 1000; i += 1) {
+            strands[0]->post([&inside, &overlapped]() {
+                if(++inside > 1) overlapped = true;
+                inside -= 1;
+            });
+        }
+
+        pool.wait();
+        verify(!overlapped);
+        // The task posted from inside lands wherever the main thread had got to by then, but
+        // always after the task that posted it
+        for(const auto& mine : seen) {
+            verify(mine.size() == 201);
+            int next = 0;
+            bool reposted = false;
+            for(int value : mine) {
+                if(value == -1) {
+                    verify(!reposted && next > 0);
+                    reposted = true;
+                    continue;
+                }
+                verify(value == next);
+                next += 1;
+            }
+            verify(reposted);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,198 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include "util.hpp"
+#include "throttle.hpp"
+
+namespace {
+    const uint64_t MiB = 1024 * 1024;
+
+    double secondsSince(uint64_t start) {
+        return (Stats::now() - start) / 1e9;
+    }
+
+    void sleepMs(int ms) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    }
+
+    void writeFile(const char* path, const char* text) {
+        FILE* f = fopen(path, "w");
+        verify(f != nullptr);
+        fputs(text, f);
+        fclose(f);
+    }
+}
+
+int main(void) {
+    {
+        // Without an active instance the scopes do nothing, and do not crash
+        verify(Throttle::active() == nullptr);
+        ThrottledIO io(Throttle::Direction::Read, 100);
+        ThrottledCPU cpu;
+    }
+
+    {
+        uint64_t read = 1;
+        uint64_t write = 1;
+        verify(Throttle::parseRate("10M", read, write));
+        verify(read == 10 * MiB && write == 10 * MiB);
+        verify(Throttle::parseRate("512k:0", read, write));
+        verify(read == 512 * 1024 && write == 0);
+        verify(Throttle::parseRate("0:2G", read, write));
+        verify(read == 0 && write == 2048 * MiB);
+
+        const char* bad[] = {"", "M", "10X", "1:2:3", ":5", "5:", "-1", "1M "};
+        for(const char* arg : bad) {
+            verify(!Throttle::parseRate(arg, read, write));
+        }
+        verify(read == 0 && write == 2048 * MiB);
+    }
+
+    {
+        Throttle::Limits limits;
+        verify(Throttle::parseControl("# nightly\n\n  rate 20M:5M\ncpu 25\n", limits));
+        verify(limits.readRate == 20 * MiB && limits.writeRate == 5 * MiB && limits.cpuPercent == 25);
+
+        // Only what is mentioned changes
+        verify(Throttle::parseControl("cpu 100", limits));
+        verify(limits.readRate == 20 * MiB && limits.cpuPercent == 100);
+
+        const char* bad[] = {"cpu 0", "cpu 101", "cpu", "rate 1M 2M", "speed 1M", "rate 1M\ncpu x"};
+        for(const char* text : bad) {
+            verify(!Throttle::parseControl(text, limits));
+        }
+        verify(limits.readRate == 20 * MiB && limits.writeRate == 5 * MiB && limits.cpuPercent == 100);
+    }
+
+    {
+        // A burst goes straight through, and what is overdrawn is slept off
+        Throttle::Limits limits;
+        limits.writeRate = 8 * MiB;
+        Throttle throttle(limits);
+        Throttle::activate(&throttle);
+
+        uint64_t start = Stats::now();
+        { ThrottledIO io(Throttle::Direction::Write, 2 * MiB); }
+        { ThrottledIO io(Throttle::Direction::Read, 64 * MiB); }
+        verify(secondsSince(start) < 0.2);
+
+        { ThrottledIO io(Throttle::Direction::Write, 4 * MiB); }
+        const double waited = secondsSince(start);
+        verify(waited > 0.4 && waited < 2);
+
+        // New limits take effect at once
+        throttle.setLimits(Throttle::Limits());
+        start = Stats::now();
+        { ThrottledIO io(Throttle::Direction::Write, 64 * MiB); }
+        verify(secondsSince(start) < 0.2);
+
+        Throttle::activate(nullptr);
+    }
+
+    {
+        // Reads slow down while the source is slower than it has been, but not past a floor,
+        // and pick up again once it recovers
+        Throttle::Limits limits;
+        limits.readRate = 160 * MiB;
+        Throttle throttle(limits);
+
+        for(int i = 0; i < 8; i += 1) {
+            throttle.observeRead(MiB, 1000000);
+        }
+        verify(throttle.readRate() == 160 * MiB);
+
+        // Small reads say nothing
+        sleepMs(260);
+        throttle.observeRead(4096, 1000000000);
+        verify(throttle.readRate() == 160 * MiB);
+
+        throttle.observeRead(MiB, 20000000);
+        verify(throttle.readRate() == 120 * MiB);
+
+        // At most once an interval
+        throttle.observeRead(MiB, 20000000);
+        verify(throttle.readRate() == 120 * MiB);
+
+        sleepMs(260);
+        throttle.observeRead(MiB, 20000000);
+        verify(throttle.readRate() == 90 * MiB);
+
+        for(int i = 0; i < 64; i += 1) {
+            throttle.observeRead(MiB, 1000000);
+        }
+        sleepMs(260);
+        throttle.observeRead(MiB, 1000000);
+        verify(throttle.readRate() == 100 * MiB);
+
+        // The floor is a sixteenth of the limit
+        limits.readRate = 16 * MiB;
+        throttle.setLimits(limits);
+        throttle.observeRead(MiB, 1000000);
+        for(int i = 0; i < 12; i += 1) {
+            sleepMs(260);
+            throttle.observeRead(MiB, 1000000000);
+        }
+        verify(throttle.readRate() == MiB);
+    }
+
+    {
+        // Crypto sleeps for as long again as it ran, at half a thread
+        Throttle::Limits limits;
+        limits.cpuPercent = 50;
+        Throttle throttle(limits);
+        Throttle::activate(&throttle);
+
+        const uint64_t start = Stats::now();
+        {
+            ThrottledCPU cpu;
+            while(secondsSince(start) < 0.03) {}
+        }
+        verify(secondsSince(start) > 0.055);
+
+        Throttle::activate(nullptr);
+    }
+
+    {
+        // The control file is read at once, then again on SIGHUP or when it changes
+        char path[] = "/tmp/wuffcrypt-test-throttle-XXXXXX";
+        int fd = mkstemp(path);
+        verify(fd >= 0);
+        close(fd);
+
+        Throttle throttle{Throttle::Limits()};
+        verify(!throttle.watch("/nonexistent/throttle"));
+
+        writeFile(path, "rate 1M:2M\ncpu 50\n");
+        verify(throttle.watch(path));
+        verify(throttle.limits().readRate == MiB && throttle.limits().writeRate == 2 * MiB);
+        verify(throttle.limits().cpuPercent == 50);
+
+        // A bad file leaves the limits alone
+        writeFile(path, "rate fast\n");
+        verify(raise(SIGHUP) == 0);
+        throttle.admit(Throttle::Direction::Read, 0);
+        verify(throttle.limits().readRate == MiB && throttle.limits().cpuPercent == 50);
+
+        writeFile(path, "rate 3M\n");
+        verify(raise(SIGHUP) == 0);
+        throttle.admit(Throttle::Direction::Read, 0);
+        verify(throttle.limits().readRate == 3 * MiB && throttle.limits().writeRate == 3 * MiB);
+        verify(throttle.readRate() == 3 * MiB);
+
+        // Without a signal, the change is seen within a second
+        writeFile(path, "cpu 10\n");
+        throttle.admit(Throttle::Direction::Write, 0);
+        verify(throttle.limits().cpuPercent == 50);
+        sleepMs(1100);
+        throttle.admit(Throttle::Direction::Write, 0);
+        verify(throttle.limits().cpuPercent == 10);
+
+        unlink(path);
+    }
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <sodium.h>
+#include "util.hpp"
+#include "blockio.hpp"
+#include "threadpool.hpp"
+#include "tree.hpp"
+#include "wuffcrypt.hpp"
+
+namespace {
+    void writeFile(const std::string& path, const std::vector<uint8_t>& data) {
+        FILE* f = fopen(path.c_str(), "wb");
+        verify(f != nullptr);
+        verify(data.empty() || fwrite(data.data(), 1, data.size(), f) == data.size());
+        verify(fclose(f) == 0);
+    }
+
+    bool exists(const std::string& path) {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0;
+    }
+
+    // Decrypt path and compare it with what was encrypted
+    bool decryptsTo(const std::string& path, KeyCache& keys, const std::vector<uint8_t>& plain) {
+        std::vector<uint8_t> out(plain.size() + 1);
+        blockio::SpanSink sink(out.data(), out.size());
+        if(WuffCryptFile(path).decryptTo(sink, keys) != WuffCryptFile::FileStatus::OK) return false;
+        return sink.size() == plain.size() && memcmp(out.data(), plain.data(), plain.size()) == 0;
+    }
+}
+
+int main(void) {
+    verify(sodium_init() >= 0);
+
+    char password[] = "correct horse";
+    SecureString pw(password);
+    KeyCache keys(pw);
+    const DerivedKey& key = keys.get(WuffCryptFile::WORK_FACTOR);
+
+    char root[] = "/tmp/wuffcrypt-test-tree-XXXXXX";
+    verify(mkdtemp(root) != nullptr);
+    const std::string src = root;
+    verify(mkdir((src + "/sub").c_str(), 0700) == 0);
+
+    std::vector<uint8_t> a(1000);
+    std::vector<uint8_t> b(WuffCryptFile::BLOCK_SIZE + 3);
+    randombytes_buf(a.data(), a.size());
+    randombytes_buf(b.data(), b.size());
+    writeFile(src + "/a", a);
+    writeFile(src + "/sub/b", b);
+
+    WorkStealingPool pool(2);
+
+    // The destination inside the source is not walked into, however often the tree is encrypted
+    const std::string dst = src + "/out";
+    for(int run = 0; run < 2; run += 1) {
+        TreeEncrypter tree(pool, key, WuffCryptFile::Options());
+        verify(tree.run(src, dst));
+        verify(tree.files() == 2);
+        verify(tree.failures() == 0);
+        verify(!exists(dst + "/out"));
+        verify(decryptsTo(dst + "/a.wuff", keys, a));
+        verify(decryptsTo(dst + "/sub/b.wuff", keys, b));
+    }
+
+    // Nor is it inside a subdirectory, or given another name for the same directory; the first
+    // output is now part of the source, like any other files
+    {
+        TreeEncrypter tree(pool, key, WuffCryptFile::Options());
+        verify(tree.run(src, src + "/sub/../sub/out"));
+        verify(tree.files() == 4);
+        verify(!exists(src + "/sub/out/sub/out"));
+        verify(decryptsTo(src + "/sub/out/sub/b.wuff", keys, b));
+    }
+
+    // Into itself is refused outright
+    {
+        TreeEncrypter tree(pool, key, WuffCryptFile::Options());
+        verify(!tree.run(src, src + "/."));
+        verify(tree.files() == 0);
+        verify(!exists(src + "/a.wuff"));
+    }
+
+    const std::string cleanup = "rm -rf " + src;
+    verify(system(cleanup.c_str()) == 0);
+    return 0;
+}